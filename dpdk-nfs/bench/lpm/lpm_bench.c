@@ -0,0 +1,222 @@
+// Compares the DIR-24-8 and DXR lpm backends on the same routing table:
+// table build time, lookup footprint and lookup throughput for uniformly
+// random addresses and for addresses drawn from the table's own prefixes
+// (closer to real traffic, which mostly hits routed space).
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/unverified/lpm-table.h"
+
+#define SYNTHETIC_RULES 900000
+#define SYNTHETIC_LONG_RULES 200
+#define LOOKUPS (1 << 24)
+
+struct rule {
+  uint32_t prefix;
+  uint8_t prefixlen;
+  uint16_t value;
+};
+
+struct rib {
+  struct rule *rules;
+  size_t count;
+  size_t capacity;
+};
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)(rng_state >> 16);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void rib_push(struct rib *rib, uint32_t prefix, uint8_t prefixlen,
+                     uint16_t value) {
+  if (rib->count == rib->capacity) {
+    rib->capacity = rib->capacity ? rib->capacity * 2 : 1024;
+    rib->rules = realloc(rib->rules, rib->capacity * sizeof(struct rule));
+    if (rib->rules == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+
+  uint32_t mask = prefixlen == 0 ? 0 : 0xFFFFFFFF << (32 - prefixlen);
+  rib->rules[rib->count].prefix = prefix & mask;
+  rib->rules[rib->count].prefixlen = prefixlen;
+  rib->rules[rib->count].value = value;
+  rib->count++;
+}
+
+// One rule per line: "a.b.c.d/len [next hop]". Missing next hops are derived
+// from the prefix so that neighbouring routes rarely collapse.
+static void rib_load(struct rib *rib, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned a, b, c, d, len, hop;
+    int n = sscanf(line, "%u.%u.%u.%u/%u %u", &a, &b, &c, &d, &len, &hop);
+    if (n < 5 || a > 255 || b > 255 || c > 255 || d > 255 || len > 32) {
+      continue;
+    }
+
+    uint32_t prefix = (a << 24) | (b << 16) | (c << 8) | d;
+    if (n < 6) {
+      hop = (prefix >> 8) * 2654435761u;
+    }
+    rib_push(rib, prefix, (uint8_t)len, (uint16_t)(hop % 1024));
+  }
+
+  fclose(f);
+}
+
+// Rough shape of a full BGP table: mostly /24s, /16-/23 next, a handful of
+// short and of longer-than-/24 prefixes (kept below DIR-24-8's 256 long
+// groups so both backends hold the same table).
+static void rib_synthesize(struct rib *rib) {
+  for (size_t i = 0; i < SYNTHETIC_RULES; i++) {
+    uint32_t r = rng() % 100;
+    uint8_t len;
+
+    if (i < SYNTHETIC_LONG_RULES) {
+      len = 25 + rng() % 8;
+    } else if (r < 60) {
+      len = 24;
+    } else if (r < 91) {
+      len = 16 + rng() % 8;
+    } else {
+      len = 8 + rng() % 8;
+    }
+
+    rib_push(rib, rng(), len, (uint16_t)(rng() % 1024));
+  }
+}
+
+static int cmp_prefixlen(const void *a, const void *b) {
+  const struct rule *ra = a;
+  const struct rule *rb = b;
+  return (int)ra->prefixlen - (int)rb->prefixlen;
+}
+
+static uint32_t *gen_random_addrs(void) {
+  uint32_t *addrs = malloc(LOOKUPS * sizeof(uint32_t));
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    addrs[i] = rng();
+  }
+  return addrs;
+}
+
+static uint32_t *gen_rib_addrs(struct rib *rib) {
+  uint32_t *addrs = malloc(LOOKUPS * sizeof(uint32_t));
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    struct rule *r = &rib->rules[rng() % rib->count];
+    uint32_t host_mask = r->prefixlen == 32 ? 0 : 0xFFFFFFFF >> r->prefixlen;
+    addrs[i] = r->prefix | (rng() & host_mask);
+  }
+  return addrs;
+}
+
+static double bench_lookups(struct lpm_table *lpm, uint32_t *addrs,
+                            uint64_t *checksum) {
+  uint64_t sum = 0;
+  double start = now_seconds();
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    sum += lpm_table_lookup_elem(lpm, addrs[i]);
+  }
+  double elapsed = now_seconds() - start;
+  *checksum = sum;
+  return LOOKUPS / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+  struct rib rib = { 0 };
+
+  if (argc > 1) {
+    rib_load(&rib, argv[1]);
+  } else {
+    rib_synthesize(&rib);
+  }
+
+  if (rib.count == 0) {
+    fprintf(stderr, "No rules loaded\n");
+    return 1;
+  }
+
+  // DIR-24-8 expects ascending prefix lengths
+  qsort(rib.rules, rib.count, sizeof(struct rule), cmp_prefixlen);
+
+  uint32_t *random_addrs = gen_random_addrs();
+  uint32_t *rib_addrs = gen_rib_addrs(&rib);
+
+  const char *names[] = { "dir-24-8", "dxr" };
+  enum lpm_backend backends[] = { LPM_BACKEND_DIR_24_8, LPM_BACKEND_DXR };
+  struct lpm_table *tables[2];
+
+  printf("%zu rules, %d lookups per run\n\n", rib.count, LOOKUPS);
+  printf("%-10s %10s %10s %12s %14s %14s\n", "backend", "build (s)",
+         "rejected", "lookup MB", "random Mlps", "rib Mlps");
+
+  for (int b = 0; b < 2; b++) {
+    if (!lpm_table_allocate(backends[b], &tables[b])) {
+      fprintf(stderr, "Unable to allocate %s\n", names[b]);
+      return 1;
+    }
+
+    size_t rejected = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < rib.count; i++) {
+      struct rule *r = &rib.rules[i];
+      if (!lpm_table_update_elem(tables[b], r->prefix, r->prefixlen,
+                                 r->value)) {
+        rejected++;
+      }
+    }
+    double build = now_seconds() - start;
+
+    double footprint = lpm_table_lookup_footprint(tables[b]) / 1048576.0;
+
+    uint64_t sum_random, sum_rib;
+    double random_mlps = bench_lookups(tables[b], random_addrs, &sum_random);
+    double rib_mlps = bench_lookups(tables[b], rib_addrs, &sum_rib);
+
+    printf("%-10s %10.2f %10zu %12.2f %14.1f %14.1f\n", names[b], build,
+           rejected, footprint, random_mlps, rib_mlps);
+  }
+
+  // DIR-24-8 rejects rules once its 256 long groups are used up and only
+  // supports ascending insertion, so disagreements are expected there.
+  size_t mismatches = 0;
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    if (lpm_table_lookup_elem(tables[0], rib_addrs[i]) !=
+        lpm_table_lookup_elem(tables[1], rib_addrs[i])) {
+      mismatches++;
+    }
+  }
+  printf("\n%zu/%d rib lookups differ between backends\n", mismatches,
+         LOOKUPS);
+
+  lpm_table_free(tables[0]);
+  lpm_table_free(tables[1]);
+  free(random_addrs);
+  free(rib_addrs);
+  free(rib.rules);
+  return 0;
+}
@@ -9,12 +9,17 @@
 #include "nf-util.h"
 #include "nf.h"
 
+const uint32_t DEFAULT_EXPIRATION_TIME = 100000000;  // 100s, as in the Makefile
+
 #define PARSE_ERROR(format, ...)                                               \
   nf_config_usage();                                                           \
   fprintf(stderr, format, ##__VA_ARGS__);                                      \
   exit(EXIT_FAILURE);
 
 void nf_config_init(int argc, char **argv) {
+  // Set the default values
+  config.expiration_time = DEFAULT_EXPIRATION_TIME;
+
   uint16_t nb_devices = rte_eth_dev_count_avail();
 
   struct option long_options[] = { { "lan", required_argument, NULL, 'l' },
@@ -22,10 +27,11 @@ void nf_config_init(int argc, char **argv) {
                                    { "extip", required_argument, NULL, 'i' },
                                    { "max-flows", required_argument, NULL,
                                      'f' },
+                                   { "expire", required_argument, NULL, 't' },
                                    { NULL, 0, NULL, 0 } };
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "l:w:i:f:", long_options, NULL)) !=
+  while ((opt = getopt_long(argc, argv, "l:w:i:f:t:", long_options, NULL)) !=
          EOF) {
     unsigned device;
     switch (opt) {
@@ -56,6 +62,14 @@ void nf_config_init(int argc, char **argv) {
         }
         break;
 
+      case 't':
+        config.expiration_time =
+            nf_util_parse_int(optarg, "exp-time", 10, '\0');
+        if (config.expiration_time == 0) {
+          PARSE_ERROR("Expiration time must be strictly positive.\n");
+        }
+        break;
+
       default:
         PARSE_ERROR("Unknown option.\n");
         break;
@@ -72,7 +86,10 @@ void nf_config_usage(void) {
           "\t--lan <device>: set device to be the main LAN device.\n"
           "\t--wan <device>: set device to be the external one.\n"
           "\t--extip <ip>: external IP address.\n"
-          "\t--max-flows <n>: flow table capacity.\n");
+          "\t--max-flows <n>: flow table capacity.\n"
+          "\t--expire <time>: flow expiration time (us),"
+          " default: %" PRIu32 ".\n",
+          DEFAULT_EXPIRATION_TIME);
 }
 
 void nf_config_print(void) {
@@ -86,6 +103,7 @@ void nf_config_print(void) {
   free(ext_ip_str);
 
   NF_INFO("Max flows: %" PRIu32, config.max_flows);
+  NF_INFO("Expiration time: %" PRIu32 "us", config.expiration_time);
 
   NF_INFO("\n--- --- ------ ---\n");
 }
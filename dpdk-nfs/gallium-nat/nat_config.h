@@ -16,4 +16,7 @@ struct nf_config {
 
   // Size of the flow table
   uint32_t max_flows;
+
+  // Expiration time of idle flows in microseconds
+  uint32_t expiration_time;
 };
@@ -6,53 +6,84 @@
 
 #include <rte_byteorder.h>
 
+#include "lib/verified/double-chain.h"
+#include "lib/verified/expirator.h"
 #include "lib/verified/map.h"
 #include "lib/verified/vector.h"
 
+#ifndef KLEE_VERIFICATION
+#include "lib/unverified/expirator.h"
+#endif // KLEE_VERIFICATION
+
 #include "state.h"
 
-bool allocate_flow(struct State *state, struct Flow *flow,
-                   uint16_t *external_port) {
-  struct Counter *counter = 0;
-  vector_borrow(state->port_counter, 0, (void **)&counter);
+// At most one flow is allocated per packet, so expiring up to two per packet
+// always catches up with the backlog while keeping the per-packet cost
+// bounded.
+#define EXPIRE_FLOWS_PER_PACKET 2
 
-  if (counter->value >= state->max_flows) {
-    vector_return(state->port_counter, 0, counter);
+// The external port is the index of the flow, shared by the dchain, the
+// vector and the map: each direction is a single lookup.
+bool allocate_flow(struct State *state, struct Flow *flow, vigor_time_t time,
+                   uint16_t *external_port) {
+  int index;
+  if (dchain_allocate_new_index(state->ports, &index, time) == 0) {
     return false;
   }
 
-  int current_counter = counter->value;
-  counter->value++;
-  vector_return(state->port_counter, 0, counter);
-
   struct Flow *key = 0;
-  vector_borrow(state->flows, current_counter, (void **)&key);
+  vector_borrow(state->flows, index, (void **)&key);
   memcpy((void *)key, (void *)flow, sizeof(struct Flow));
-  map_put(state->table, key, current_counter);
-  vector_return(state->flows, current_counter, key);
+  map_put(state->table, key, index);
+  vector_return(state->flows, index, key);
 
-  *external_port = rte_be_to_cpu_16(current_counter);
+  *external_port = rte_cpu_to_be_16(index);
 
   return true;
 }
 
-bool internal_get(struct State *state, struct Flow *flow,
+bool internal_get(struct State *state, struct Flow *flow, vigor_time_t time,
                   uint16_t *external_port) {
   int index;
   if (map_get(state->table, flow, &index) == 0) {
     return false;
   }
 
-  *external_port = index;
+  dchain_rejuvenate_index(state->ports, index, time);
+
+  *external_port = rte_cpu_to_be_16(index);
   return true;
 }
 
+// Does not rejuvenate the flow: the caller first checks that the packet
+// comes from the flow's remote end, spoofed packets must not keep it alive.
 bool external_get(struct State *state, uint16_t external_port,
                   struct Flow *out_flow) {
+  int index = rte_be_to_cpu_16(external_port);
+  if (index >= state->max_flows ||
+      dchain_is_index_allocated(state->ports, index) == 0) {
+    return false;
+  }
+
   struct Flow *key = 0;
-  vector_borrow(state->flows, external_port, (void **)&key);
+  vector_borrow(state->flows, index, (void **)&key);
   memcpy((void *)out_flow, (void *)key, sizeof(struct Flow));
-  vector_return(state->flows, external_port, key);
+  vector_return(state->flows, index, key);
 
   return true;
 }
+
+void external_rejuvenate(struct State *state, uint16_t external_port,
+                         vigor_time_t time) {
+  dchain_rejuvenate_index(state->ports, rte_be_to_cpu_16(external_port), time);
+}
+
+void expire_flows(struct State *state, vigor_time_t last_time) {
+#ifdef KLEE_VERIFICATION
+  // Same behavior as far as a single packet is concerned
+  expire_items_single_map(state->ports, state->flows, state->table, last_time);
+#else  // KLEE_VERIFICATION
+  expire_items_single_map_bounded(state->ports, state->flows, state->table,
+                                  last_time, EXPIRE_FLOWS_PER_PACKET);
+#endif // KLEE_VERIFICATION
+}
@@ -8,10 +8,15 @@
 
 #include "lib/verified/vigor-time.h"
 
-bool allocate_flow(struct State *manager, struct Flow *flow,
+bool allocate_flow(struct State *manager, struct Flow *flow, vigor_time_t time,
                    uint16_t *external_port);
-bool internal_get(struct State *manager, struct Flow *flow,
+bool internal_get(struct State *manager, struct Flow *flow, vigor_time_t time,
                   uint16_t *external_port);
 bool external_get(struct State *manager, uint16_t external_port,
                   struct Flow *out_flow);
+void external_rejuvenate(struct State *manager, uint16_t external_port,
+                         vigor_time_t time);
+
+// Frees the ports of the flows idle since before last_time.
+void expire_flows(struct State *manager, vigor_time_t last_time);
 #endif
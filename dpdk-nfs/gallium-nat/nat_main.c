@@ -32,8 +32,12 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
     return device;
   }
 
+  expire_flows(state, now - (vigor_time_t)config.expiration_time * 1000);
+
   NF_DEBUG("Forwarding an IPv4 packet on device %" PRIu16, device);
   uint16_t dst_device;
+  uint32_t old_addr, new_addr;
+  uint16_t old_port, new_port;
 
   if (device == config.wan_device) {
     NF_DEBUG("WAN packet");
@@ -49,8 +53,15 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
         return device;
       }
 
-      ipv4_header->dst_addr = internal_flow.src_addr;
-      tcpudp_header->dst_port = internal_flow.src_port;
+      external_rejuvenate(state, tcpudp_header->dst_port, now);
+
+      old_addr = ipv4_header->dst_addr;
+      old_port = tcpudp_header->dst_port;
+      new_addr = internal_flow.src_addr;
+      new_port = internal_flow.src_port;
+
+      ipv4_header->dst_addr = new_addr;
+      tcpudp_header->dst_port = new_port;
       dst_device = config.lan_device;
     } else {
       NF_DEBUG("Unknown flow, dropping");
@@ -67,10 +78,10 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
 
     uint16_t external_port;
 
-    if (!internal_get(state, &flow, &external_port)) {
+    if (!internal_get(state, &flow, now, &external_port)) {
       NF_DEBUG("New flow");
 
-      if (!allocate_flow(state, &flow, &external_port)) {
+      if (!allocate_flow(state, &flow, now, &external_port)) {
         NF_DEBUG("No space for the flow, dropping");
         return device;
       }
@@ -78,12 +89,21 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
 
     NF_DEBUG("Forwarding from ext port: %d", rte_be_to_cpu_16(external_port));
 
-    ipv4_header->src_addr = config.external_addr;
-    tcpudp_header->src_port = external_port;
+    old_addr = ipv4_header->src_addr;
+    old_port = tcpudp_header->src_port;
+    new_addr = config.external_addr;
+    new_port = external_port;
+
+    ipv4_header->src_addr = new_addr;
+    tcpudp_header->src_port = new_port;
     dst_device = config.wan_device;
   }
 
-  nf_set_rte_ipv4_udptcp_checksum(ipv4_header, tcpudp_header, buffer);
+  if (!nf_offload_rte_ipv4_udptcp_checksum(dst_device, mbuf, ipv4_header,
+                                           tcpudp_header)) {
+    nf_update_rte_ipv4_udptcp_checksum(ipv4_header, tcpudp_header, old_addr,
+                                       new_addr, old_port, new_port, buffer);
+  }
 
   return dst_device;
 }
@@ -5,6 +5,7 @@
 #include "lib/verified/boilerplate-util.h"
 
 #ifdef KLEE_VERIFICATION
+#include "lib/models/verified/double-chain-control.h"
 #include "lib/models/verified/map-control.h"
 #include "lib/models/verified/vector-control.h"
 #endif // KLEE_VERIFICATION
@@ -33,9 +34,8 @@ struct State *alloc_state(int max_flows, uint32_t ext_ip) {
     return NULL;
   }
 
-  ret->port_counter = NULL;
-  if (vector_allocate(sizeof(struct Counter), 1, counter_allocate,
-                      &(ret->port_counter)) == 0) {
+  ret->ports = NULL;
+  if (dchain_allocate(max_flows, &(ret->ports)) == 0) {
     return NULL;
   }
 
@@ -49,11 +49,6 @@ struct State *alloc_state(int max_flows, uint32_t ext_ip) {
   vector_set_layout(ret->flows, flow_descrs,
                     sizeof(flow_descrs) / sizeof(flow_descrs[0]), flow_nests,
                     sizeof(flow_nests) / sizeof(flow_nests[0]), "Flow");
-  vector_set_layout(
-      ret->port_counter, counter_descrs,
-      sizeof(counter_descrs) / sizeof(counter_descrs[0]), counter_nests,
-      sizeof(counter_nests) / sizeof(counter_nests[0]), "Counter");
-  vector_set_entry_condition(ret->port_counter, counter_invariant, ret);
 #endif // KLEE_VERIFICATION
 
   allocated_nf_state = ret;
@@ -63,7 +58,7 @@ struct State *alloc_state(int max_flows, uint32_t ext_ip) {
 #ifdef KLEE_VERIFICATION
 void nf_loop_iteration_border(unsigned lcore_id, vigor_time_t time) {
   loop_iteration_border(&allocated_nf_state->table, &allocated_nf_state->flows,
-                        &allocated_nf_state->port_counter,
+                        &allocated_nf_state->ports,
                         allocated_nf_state->max_flows,
                         allocated_nf_state->ext_ip, lcore_id, time);
 }
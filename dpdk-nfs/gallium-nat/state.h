@@ -3,12 +3,11 @@
 
 #include "loop.h"
 #include "flow.h"
-#include "counter.h"
 
 struct State {
   struct Map *table;
   struct Vector *flows;
-  struct Vector *port_counter;
+  struct DoubleChain *ports;
   int max_flows;
   uint32_t ext_ip;
 };
@@ -34,24 +34,28 @@ bool consume_until_separator(FILE *file, char *buffer, int max) {
   return false;
 }
 
-void fill_table_from_file(struct State *state, struct nf_config *config) {
-  if (config->table_fname[0] == '\0') {
-    // No static config
-    return;
-  }
-
+struct PortTable *port_table_from_file(struct nf_config *config) {
   FILE *file = fopen(config->table_fname, "r");
   if (file == NULL) {
-    rte_exit(EXIT_FAILURE, "Error opening the static config file: %s",
-             config->table_fname);
+    NF_INFO("Error opening the static config file: %s", config->table_fname);
+    return NULL;
+  }
+
+  struct PortTable *table =
+      (struct PortTable *)calloc(1, sizeof(struct PortTable));
+  if (table == NULL) {
+    fclose(file);
+    return NULL;
   }
 
   uint32_t n_entries = 0;
 
   while (!feof(file)) {
     if (n_entries >= config->capacity) {
-      rte_exit(EXIT_FAILURE, "Too many static rules, max: %d",
-               config->capacity);
+      NF_INFO("Too many static rules, max: %d", config->capacity);
+      free(table);
+      table = NULL;
+      goto finally;
     }
 
     char dst_port[PORT_STR_MAX_SIZE];
@@ -73,41 +77,52 @@ void fill_table_from_file(struct State *state, struct nf_config *config) {
       goto finally;
     }
 
-    struct Entry *entry = 0;
-    struct Backend *backend = 0;
-
-    vector_borrow(state->entries, n_entries, (void **)&entry);
-    vector_borrow(state->values, n_entries, (void **)&backend);
+    uint16_t port;
+    struct PortBackend backend = { .valid = 1 };
 
-    if (!nf_parse_port(dst_port, &entry->port)) {
+    if (!nf_parse_port(dst_port, &port)) {
       NF_INFO("Invalid destination port: %s, skip", dst_port);
       continue;
     }
 
-    if (!nf_parse_ipv4addr(backend_ip, &backend->ip)) {
+    if (!nf_parse_ipv4addr(backend_ip, &backend.ip)) {
       NF_INFO("Invalid backend IP: %s, skip", backend_ip);
       continue;
     }
 
-    if (!nf_parse_port(backend_port, &backend->port)) {
+    if (!nf_parse_port(backend_port, &backend.port)) {
       NF_INFO("Invalid backend port: %s, skip", backend_port);
       continue;
     }
 
-    map_put(state->table, entry, n_entries);
-
-    vector_return(state->entries, n_entries, entry);
-    vector_return(state->values, n_entries, backend);
-
+    table->backends[port] = backend;
     n_entries++;
 
     NF_DEBUG("Added proxy entry: %u => %u.%u.%u.%u:%u",
-             rte_be_to_cpu_16(entry->port), (backend->ip >> 0) & 0xff,
-             (backend->ip >> 8) & 0xff, (backend->ip >> 16) & 0xff,
-             (backend->ip >> 24) & 0xff, rte_be_to_cpu_16(backend->port));
+             rte_be_to_cpu_16(port), (backend.ip >> 0) & 0xff,
+             (backend.ip >> 8) & 0xff, (backend.ip >> 16) & 0xff,
+             (backend.ip >> 24) & 0xff, rte_be_to_cpu_16(backend.port));
   }
 
 finally:
   fclose(file);
+  return table;
+}
+
+void fill_table_from_file(struct State *state, struct nf_config *config) {
+  if (config->table_fname[0] == '\0') {
+    // No static config
+    return;
+  }
+
+  struct PortTable *table = port_table_from_file(config);
+  if (table == NULL) {
+    rte_exit(EXIT_FAILURE, "Error loading the static config file: %s",
+             config->table_fname);
+  }
+
+  free(state->port_table);
+  state->port_table = table;
+  state->port_table_seen = table;
 }
-#endif
\ No newline at end of file
+#endif
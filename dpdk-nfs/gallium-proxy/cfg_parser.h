@@ -3,4 +3,9 @@
 #include "proxy_config.h"
 #include "state.h"
 
-void fill_table_from_file(struct State *state, struct nf_config *config);
\ No newline at end of file
+void fill_table_from_file(struct State *state, struct nf_config *config);
+
+#ifndef KLEE_VERIFICATION
+// Parses the static config into a fresh table, NULL if it cannot be loaded.
+struct PortTable *port_table_from_file(struct nf_config *config);
+#endif // KLEE_VERIFICATION
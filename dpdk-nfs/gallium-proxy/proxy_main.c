@@ -5,9 +5,55 @@
 #include "proxy_config.h"
 #include "state.h"
 
+#ifndef KLEE_VERIFICATION
+#include <signal.h>
+#include <stdlib.h>
+
+#include <rte_alarm.h>
+#endif // KLEE_VERIFICATION
+
 struct nf_config config;
 struct State *state;
 
+#ifndef KLEE_VERIFICATION
+// The static config is reloaded on SIGHUP, from the EAL alarm thread: it
+// builds a new table and swaps it in. The data path loads state->port_table
+// once per lookup and then reports the table it used in port_table_seen, so
+// once that reports the new table, no lookup can still be reading the old
+// one and it is freed. This assumes a single core runs the data path.
+#define PROXY_RELOAD_PERIOD_US 100000
+
+static volatile sig_atomic_t reload_requested = 0;
+static struct PortTable *retired_table = NULL;
+
+static void proxy_request_reload(int signum) { reload_requested = 1; }
+
+static void proxy_reload(void *unused) {
+  if (retired_table != NULL &&
+      __atomic_load_n(&state->port_table_seen, __ATOMIC_ACQUIRE) ==
+          state->port_table) {
+    free(retired_table);
+    retired_table = NULL;
+  }
+
+  // A reload requested while the previous table is still in use waits.
+  if (retired_table == NULL && reload_requested) {
+    reload_requested = 0;
+
+    struct PortTable *table = port_table_from_file(&config);
+    if (table == NULL) {
+      NF_INFO("Keeping the current proxy table.");
+    } else {
+      retired_table =
+          __atomic_exchange_n(&state->port_table, table, __ATOMIC_ACQ_REL);
+      NF_INFO("Reloaded the proxy table from %s.", config.table_fname);
+    }
+  }
+
+  rte_eal_alarm_set(PROXY_RELOAD_PERIOD_US, proxy_reload, NULL);
+}
+#endif // KLEE_VERIFICATION
+
 bool nf_init() {
   state = alloc_state(config.capacity);
 
@@ -17,9 +63,19 @@ bool nf_init() {
 
   fill_table_from_file(state, &config);
 
+#ifndef KLEE_VERIFICATION
+  if (config.table_fname[0] != '\0') {
+    signal(SIGHUP, proxy_request_reload);
+    if (rte_eal_alarm_set(PROXY_RELOAD_PERIOD_US, proxy_reload, NULL) != 0) {
+      return false;
+    }
+  }
+#endif // KLEE_VERIFICATION
+
   return true;
 }
 
+#ifdef KLEE_VERIFICATION
 int match_backend(uint16_t dst_port, uint32_t *new_dst_ip,
                   uint16_t *new_dst_port) {
   struct Entry entry = { .port = dst_port };
@@ -40,6 +96,27 @@ int match_backend(uint16_t dst_port, uint32_t *new_dst_ip,
 
   return 1;
 }
+#else  // KLEE_VERIFICATION
+int match_backend(uint16_t dst_port, uint32_t *new_dst_ip,
+                  uint16_t *new_dst_port) {
+  struct PortTable *table =
+      __atomic_load_n(&state->port_table, __ATOMIC_ACQUIRE);
+  struct PortBackend backend = table->backends[dst_port];
+
+  if (state->port_table_seen != table) {
+    __atomic_store_n(&state->port_table_seen, table, __ATOMIC_RELEASE);
+  }
+
+  if (!backend.valid) {
+    return 0;
+  }
+
+  *new_dst_ip = backend.ip;
+  *new_dst_port = backend.port;
+
+  return 1;
+}
+#endif // KLEE_VERIFICATION
 
 int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
                vigor_time_t now, struct rte_mbuf *mbuf) {
@@ -76,10 +153,17 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
     return device;
   }
 
+  uint32_t old_dst_addr = ipv4_header->dst_addr;
+
   ipv4_header->dst_addr = new_dst_addr;
   tcpudp_header->dst_port = new_dst_port;
 
-  nf_set_rte_ipv4_udptcp_checksum(ipv4_header, tcpudp_header, buffer);
+  if (!nf_offload_rte_ipv4_udptcp_checksum(config.lan_device, mbuf,
+                                           ipv4_header, tcpudp_header)) {
+    nf_update_rte_ipv4_udptcp_checksum(ipv4_header, tcpudp_header,
+                                       old_dst_addr, new_dst_addr, dst_port,
+                                       new_dst_port, buffer);
+  }
 
   NF_DEBUG(
       "[%u.%u.%u.%u:%u] %u => %u.%u.%u.%u:%u",
@@ -22,6 +22,7 @@ struct State *alloc_state(uint32_t capacity) {
     return NULL;
   }
 
+#ifdef KLEE_VERIFICATION
   ret->table = NULL;
   if (map_allocate(entry_eq, entry_hash, capacity, &(ret->table)) == 0) {
     return NULL;
@@ -39,7 +40,6 @@ struct State *alloc_state(uint32_t capacity) {
     return NULL;
   }
 
-#ifdef KLEE_VERIFICATION
   map_set_layout(ret->table, entry_descrs,
                  sizeof(entry_descrs) / sizeof(entry_descrs[0]), entry_nests,
                  sizeof(entry_nests) / sizeof(entry_nests[0]), "entry");
@@ -50,6 +50,12 @@ struct State *alloc_state(uint32_t capacity) {
       ret->values, backend_descrs,
       sizeof(backend_descrs) / sizeof(backend_descrs[0]), backend_nests,
       sizeof(backend_nests) / sizeof(backend_nests[0]), "backend");
+#else  // KLEE_VERIFICATION
+  ret->port_table = (struct PortTable *)calloc(1, sizeof(struct PortTable));
+  if (ret->port_table == NULL) {
+    return NULL;
+  }
+  ret->port_table_seen = ret->port_table;
 #endif // KLEE_VERIFICATION
 
   allocated_nf_state = ret;
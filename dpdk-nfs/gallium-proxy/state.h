@@ -5,10 +5,31 @@
 #include "backend.h"
 #include "entry.h"
 
+#ifndef KLEE_VERIFICATION
+// Backends directly indexed by destination port (network byte order), one
+// load per lookup. 64K records of 8 bytes, 512 KB.
+struct PortBackend {
+  uint32_t ip;
+  uint16_t port;
+  uint16_t valid;
+};
+
+struct PortTable {
+  struct PortBackend backends[UINT16_MAX + 1];
+};
+#endif // KLEE_VERIFICATION
+
 struct State {
+#ifdef KLEE_VERIFICATION
   struct Map *table;
   struct Vector *entries;
   struct Vector *values;
+#else  // KLEE_VERIFICATION
+  // Swapped as a whole on reload, see proxy_main.c
+  struct PortTable *port_table;
+  // Last table the data path finished a lookup in
+  struct PortTable *port_table_seen;
+#endif // KLEE_VERIFICATION
 };
 
 struct State *alloc_state(uint32_t capacity);
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <rte_byteorder.h>
 
 #include "lib/verified/expirator.h"
+#include "lib/unverified/token-bucket.h"
 
 #include "nf.h"
 #include "nf-log.h"
@@ -18,6 +19,7 @@
 
 struct nf_config config;
 struct State *state;
+struct TokenBucketConfig bucket_config;
 
 bool nf_init(void) {
   uint64_t link_capacity = config.link_capacity;
@@ -28,14 +30,23 @@ bool nf_init(void) {
 
   state =
       alloc_state(link_capacity, threshold, subnets_mask, capacity, dev_count);
+  if (state == NULL) {
+    return false;
+  }
+
+  if (!token_bucket_init(&bucket_config, state->threshold_rate,
+                         config.burst)) {
+    NF_INFO("HHH threshold rate null or burst too large for its buckets");
+    return false;
+  }
 
-  return state != NULL;
+  return true;
 }
 
+#ifdef KLEE_VERIFICATION
 int64_t expire_entries(vigor_time_t time) {
   assert(time >= 0);  // we don't support the past
-  vigor_time_t exp_time =
-      VIGOR_TIME_SECONDS_MULTIPLIER * config.burst / state->threshold_rate;
+  vigor_time_t exp_time = bucket_config.refill_time;
   uint64_t time_u = (uint64_t)time;
   // OK because time >= config.burst / threshold_rate >= 0
   vigor_time_t min_time = time_u - exp_time;
@@ -139,23 +150,8 @@ void update_buckets(uint32_t src, uint16_t size, vigor_time_t time) {
     assert(value->bucket_time <= time_u);
     uint64_t time_diff = time_u - value->bucket_time;
 
-    if (time_diff < (config.burst * VIGOR_TIME_SECONDS_MULTIPLIER) /
-                        state->threshold_rate) {
-      uint64_t added_tokens =
-          (time_diff * state->threshold_rate) / VIGOR_TIME_SECONDS_MULTIPLIER;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wtautological-compare"
-      vigor_note(0 <= time_diff * state->threshold_rate /
-                          VIGOR_TIME_SECONDS_MULTIPLIER);
-#pragma GCC diagnostic pop
-      assert(value->bucket_size <= config.burst);
-      value->bucket_size += added_tokens;
-      if (value->bucket_size > config.burst) {
-        value->bucket_size = config.burst;
-      }
-    } else {
-      value->bucket_size = config.burst;
-    }
+    value->bucket_size =
+        token_bucket_refill(&bucket_config, value->bucket_size, time_diff);
 
     value->bucket_time = time_u;
 
@@ -177,6 +173,67 @@ void update_buckets(uint32_t src, uint16_t size, vigor_time_t time) {
              (hh >> 24) & 0xff, hh_subnet_sz);
   }
 }
+#else  // KLEE_VERIFICATION
+void expire_entries(vigor_time_t time) {
+  assert(time >= 0);  // we don't support the past
+  vigor_time_t exp_time = bucket_config.refill_time;
+  uint64_t time_u = (uint64_t)time;
+  // OK because time >= config.burst / threshold_rate >= 0
+  vigor_time_t min_time = time_u - exp_time;
+  prefix_buckets_expire(state->buckets, min_time);
+}
+
+void update_buckets(uint32_t src, uint16_t size, vigor_time_t time) {
+  struct prefix_bucket *buckets[PREFIX_BUCKETS_MAX_LEVELS];
+
+  bool captured_hh = false;
+  uint32_t hh = 0;
+  uint8_t hh_subnet_sz = 0;
+
+  // All the prefix lengths of src in a single pass over one table
+  uint32_t allocated =
+      prefix_buckets_get(state->buckets, rte_be_to_cpu_32(src), time, buckets);
+
+  for (int subnet_i = 0; subnet_i < state->n_subnets; subnet_i++) {
+    struct prefix_bucket *bucket = buckets[subnet_i];
+
+    if (bucket == NULL) {
+      // Not much we can do...
+      NF_DEBUG("No more space in the HHH subnet match table");
+      continue;
+    }
+
+    if (allocated & (1u << subnet_i)) {
+      assert(config.burst >= size);
+      bucket->size = config.burst - size;
+      continue;
+    }
+
+    assert(0 <= time);
+    uint64_t time_u = (uint64_t)time;
+    assert(bucket->time <= time);
+    uint64_t time_diff = time_u - bucket->time;
+
+    bucket->size = token_bucket_refill(&bucket_config, bucket->size, time_diff);
+    bucket->time = time;
+
+    if (bucket->size > size) {
+      bucket->size -= size;
+    } else {
+      captured_hh = true;
+      hh = rte_cpu_to_be_32(bucket->prefix);
+      hh_subnet_sz = bucket->prefix_len;
+    }
+  }
+
+  if (captured_hh) {
+    NF_DEBUG("HH detected: %0u.%u.%u.%u => %u.%u.%u.%u/%d", (src >> 0) & 0xff,
+             (src >> 8) & 0xff, (src >> 16) & 0xff, (src >> 24) & 0xff,
+             (hh >> 0) & 0xff, (hh >> 8) & 0xff, (hh >> 16) & 0xff,
+             (hh >> 24) & 0xff, hh_subnet_sz);
+  }
+}
+#endif // KLEE_VERIFICATION
 
 int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
                vigor_time_t now, struct rte_mbuf *mbuf) {
@@ -48,6 +48,7 @@ struct State *alloc_state(uint64_t link_capacity, uint8_t threshold,
   uint64_t threshold_rate = (link_capacity / 8) * (threshold * 0.01);
   ret->threshold_rate = threshold_rate;
 
+#ifdef KLEE_VERIFICATION
   ret->subnet_indexers =
       (struct Map **)malloc(sizeof(struct Map *) * n_subnets);
   ret->allocators =
@@ -81,7 +82,6 @@ struct State *alloc_state(uint64_t link_capacity, uint8_t threshold,
       return NULL;
     }
 
-#ifdef KLEE_VERIFICATION
     map_set_layout(ret->subnet_indexers[i], ip_addr_descrs,
                    sizeof(ip_addr_descrs) / sizeof(ip_addr_descrs[0]),
                    ip_addr_nests,
@@ -97,8 +97,13 @@ struct State *alloc_state(uint64_t link_capacity, uint8_t threshold,
         ret->subnets[i], ip_addr_descrs,
         sizeof(ip_addr_descrs) / sizeof(ip_addr_descrs[0]), ip_addr_nests,
         sizeof(ip_addr_nests) / sizeof(ip_addr_nests[0]), "ip_addr");
-#endif  // KLEE_VERIFICATION
   }
+#else  // KLEE_VERIFICATION
+  ret->buckets = NULL;
+  if (prefix_buckets_allocate(subnets_mask, capacity, &(ret->buckets)) == 0) {
+    return NULL;
+  }
+#endif // KLEE_VERIFICATION
 
   ret->capacity = capacity;
   ret->dev_count = dev_count;
@@ -3,11 +3,21 @@
 
 #include "hhh_loop.h"
 
+#ifndef KLEE_VERIFICATION
+#include "lib/unverified/prefix-buckets.h"
+#endif // KLEE_VERIFICATION
+
 struct State {
+#ifdef KLEE_VERIFICATION
+  // One libvig map, dchain and vectors per prefix length
   struct Map **subnet_indexers;
   struct DoubleChain **allocators;
   struct Vector **subnet_buckets;
   struct Vector **subnets;
+#else  // KLEE_VERIFICATION
+  // All the prefix lengths in one table, see prefix-buckets.h
+  struct PrefixBuckets *buckets;
+#endif // KLEE_VERIFICATION
   uint64_t threshold_rate; // B/s
   int n_subnets;
   uint32_t capacity;
@@ -6,6 +6,12 @@
 
 #include <rte_ethdev.h>
 
+#ifdef NF_MULTICORE
+#include <rte_lcore.h>
+
+#include "nf.h"
+#endif  // NF_MULTICORE
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,8 +22,217 @@ struct LoadBalancer {
 
   vigor_time_t backend_expiration_time;
   struct State *state;
+
+#ifdef NF_MULTICORE
+  // Generation of the backend each flow is assigned to, alongside
+  // flow_id_to_backend_id.
+  uint32_t *flow_generations;
+  // Control core: bumped every time a backend index is allocated.
+  uint32_t *backend_generations;
+  uint32_t sweep_cursor;
+#endif  // NF_MULTICORE
 };
 
+#ifdef NF_MULTICORE
+// Every core has its own flow tables, but the backends are shared. Heartbeats
+// are all handled by LB_CONTROL_CORE (see nf_owner_core) on its own copy of
+// the backend tables, which are therefore only ever written by it. Whenever
+// the set of live backends changes, it publishes a read-only snapshot of
+// them. The data path of every core reads the current snapshot without any
+// synchronization, so heartbeats never stall it.
+//
+// Snapshots are reclaimed with epochs (quiescent-state based): a core records
+// the current epoch after every polling round, when it holds none, so reading
+// the snapshot for a packet costs a single load. Idle cores keep up too. A
+// snapshot replaced during epoch E can be freed once every core has recorded
+// E + 1 or later.
+//
+// Each backend index carries a generation, 0 when the index is free. A flow
+// remembers the generation of its backend, so a flow whose backend died (or
+// was replaced by another one at the same index) is detected with a single
+// compare and reassigned in place.
+struct LoadBalancedBackends {
+  uint32_t backend_capacity;
+  uint32_t *generations;
+  struct LoadBalancedBackend *backends;
+
+  uint64_t retired_epoch;
+  struct LoadBalancedBackends *next_retired;
+};
+
+struct lb_reader {
+  uint64_t epoch;
+} __rte_cache_aligned;
+
+static struct LoadBalancedBackends *published_backends;
+static struct LoadBalancedBackends *retired_backends;
+static uint64_t backends_epoch = 1;
+static struct lb_reader readers[RTE_MAX_LCORE];
+
+static inline struct LoadBalancedBackends *lb_read_backends(void) {
+  return __atomic_load_n(&published_backends, __ATOMIC_ACQUIRE);
+}
+
+void lb_quiescent(void) {
+  struct lb_reader *reader = &readers[nf_core()];
+  uint64_t epoch = __atomic_load_n(&backends_epoch, __ATOMIC_SEQ_CST);
+
+  // Only store when it changed, so that idle rounds do not fence
+  if (__atomic_load_n(&reader->epoch, __ATOMIC_RELAXED) != epoch) {
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void lb_reclaim_backends(void) {
+  uint64_t oldest = UINT64_MAX;
+  for (unsigned core = 0; core < nf_cores(); core++) {
+    uint64_t epoch = __atomic_load_n(&readers[core].epoch, __ATOMIC_SEQ_CST);
+    if (epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  struct LoadBalancedBackends **retired = &retired_backends;
+  while (*retired != NULL) {
+    if ((*retired)->retired_epoch <= oldest) {
+      struct LoadBalancedBackends *reclaimed = *retired;
+      *retired = reclaimed->next_retired;
+      free(reclaimed);
+    } else {
+      retired = &(*retired)->next_retired;
+    }
+  }
+}
+
+// Control core only.
+static void lb_publish_backends(struct LoadBalancer *balancer) {
+  uint32_t capacity = balancer->state->backend_capacity;
+  struct LoadBalancedBackends *snapshot = malloc(
+      sizeof(struct LoadBalancedBackends) +
+      capacity * (sizeof(uint32_t) + sizeof(struct LoadBalancedBackend)));
+  if (snapshot == NULL) {
+    // Keep serving the previous snapshot, the next change will retry.
+    return;
+  }
+
+  snapshot->backend_capacity = capacity;
+  snapshot->backends = (struct LoadBalancedBackend *)(snapshot + 1);
+  snapshot->generations = (uint32_t *)(snapshot->backends + capacity);
+
+  for (uint32_t i = 0; i < capacity; i++) {
+    struct LoadBalancedBackend *vec_backend;
+    vector_borrow(balancer->state->backends, i, (void **)&vec_backend);
+    snapshot->backends[i] = *vec_backend;
+    vector_return(balancer->state->backends, i, (void *)vec_backend);
+
+    snapshot->generations[i] =
+        dchain_is_index_allocated(balancer->state->active_backends, i)
+            ? balancer->backend_generations[i]
+            : 0;
+  }
+
+  struct LoadBalancedBackends *old = __atomic_exchange_n(
+      &published_backends, snapshot, __ATOMIC_SEQ_CST);
+  uint64_t epoch = __atomic_add_fetch(&backends_epoch, 1, __ATOMIC_SEQ_CST);
+
+  if (old != NULL) {
+    old->retired_epoch = epoch;
+    old->next_retired = retired_backends;
+    retired_backends = old;
+  }
+
+  // We are not holding any snapshot ourselves.
+  __atomic_store_n(&readers[nf_core()].epoch, epoch, __ATOMIC_SEQ_CST);
+  lb_reclaim_backends();
+}
+
+// Same choice as cht_find_preferred_available_backend, over a snapshot.
+static int lb_find_preferred_backend(struct LoadBalancer *balancer,
+                                     struct LoadBalancedBackends *snapshot,
+                                     uint64_t hash, int *chosen_backend) {
+  uint32_t capacity = balancer->state->backend_capacity;
+  uint64_t start = hash % balancer->state->cht_height;
+
+  for (uint32_t i = 0; i < capacity; i++) {
+    int candidate_idx = (int)(start * capacity + i);
+
+    uint32_t *candidate;
+    vector_borrow(balancer->state->cht, candidate_idx, (void **)&candidate);
+    uint32_t backend_index = *candidate;
+    vector_return(balancer->state->cht, candidate_idx, candidate);
+
+    if (snapshot->generations[backend_index] != 0) {
+      *chosen_backend = backend_index;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Points the flow at its preferred live backend, returns the backend index
+// or -1 if there is none.
+static int lb_assign_flow(struct LoadBalancer *balancer,
+                          struct LoadBalancedBackends *snapshot,
+                          struct LoadBalancedFlow *flow, int flow_index) {
+  int backend_index;
+  if (!lb_find_preferred_backend(balancer, snapshot,
+                                 (uint64_t)LoadBalancedFlow_hash(flow),
+                                 &backend_index)) {
+    return -1;
+  }
+
+  uint32_t *vec_flow_id_to_backend_id;
+  vector_borrow(balancer->state->flow_id_to_backend_id, flow_index,
+                (void **)&vec_flow_id_to_backend_id);
+  *vec_flow_id_to_backend_id = backend_index;
+  vector_return(balancer->state->flow_id_to_backend_id, flow_index,
+                (void *)vec_flow_id_to_backend_id);
+
+  balancer->flow_generations[flow_index] = snapshot->generations[backend_index];
+  return backend_index;
+}
+
+#ifdef LB_FLOW_SWEEP
+// Checks LB_FLOW_SWEEP flow slots per call and reassigns the orphaned ones,
+// so that after a backend failure most flows are already moved when their
+// next packet arrives.
+static void lb_sweep_flows(struct LoadBalancer *balancer) {
+  struct LoadBalancedBackends *snapshot = lb_read_backends();
+  if (snapshot == NULL) {
+    return;
+  }
+
+  for (int n = 0; n < LB_FLOW_SWEEP; n++) {
+    int flow_index = balancer->sweep_cursor;
+    balancer->sweep_cursor =
+        (balancer->sweep_cursor + 1) % balancer->state->flow_capacity;
+
+    if (!dchain_is_index_allocated(balancer->state->flow_chain, flow_index)) {
+      continue;
+    }
+
+    uint32_t *vec_backend_index;
+    vector_borrow(balancer->state->flow_id_to_backend_id, flow_index,
+                  (void **)&vec_backend_index);
+    uint32_t backend_index = *vec_backend_index;
+    vector_return(balancer->state->flow_id_to_backend_id, flow_index,
+                  (void *)vec_backend_index);
+
+    if (snapshot->generations[backend_index] ==
+        balancer->flow_generations[flow_index]) {
+      continue;
+    }
+
+    struct LoadBalancedFlow *flow;
+    vector_borrow(balancer->state->flow_heap, flow_index, (void **)&flow);
+    lb_assign_flow(balancer, snapshot, flow, flow_index);
+    vector_return(balancer->state->flow_heap, flow_index, (void *)flow);
+  }
+}
+#endif  // LB_FLOW_SWEEP
+#endif  // NF_MULTICORE
+
 struct LoadBalancer *lb_allocate_balancer(uint32_t flow_capacity,
                                           uint32_t backend_capacity,
                                           uint32_t cht_height,
@@ -32,9 +247,78 @@ struct LoadBalancer *lb_allocate_balancer(uint32_t flow_capacity,
     return NULL;
   }
 
+#ifdef NF_MULTICORE
+  balancer->flow_generations = calloc(flow_capacity, sizeof(uint32_t));
+  balancer->backend_generations = calloc(backend_capacity, sizeof(uint32_t));
+  if (balancer->flow_generations == NULL ||
+      balancer->backend_generations == NULL) {
+    return NULL;
+  }
+
+  if (nf_core() == LB_CONTROL_CORE) {
+    lb_publish_backends(balancer);
+  }
+#endif  // NF_MULTICORE
+
   return balancer;
 }
 
+#ifdef NF_MULTICORE
+struct LoadBalancedBackend lb_get_backend(struct LoadBalancer *balancer,
+                                          struct LoadBalancedFlow *flow,
+                                          vigor_time_t now,
+                                          uint16_t wan_device) {
+  struct LoadBalancedBackends *snapshot = lb_read_backends();
+  struct LoadBalancedBackend backend;
+  backend.nic = wan_device;  // Drop
+
+  if (snapshot == NULL) {
+    return backend;
+  }
+
+  int flow_index;
+  int backend_index;
+  if (map_get(balancer->state->flow_to_flow_id, flow, &flow_index) != 0) {
+    uint32_t *vec_backend_index;
+    vector_borrow(balancer->state->flow_id_to_backend_id, flow_index,
+                  (void **)&vec_backend_index);
+    backend_index = *vec_backend_index;
+    vector_return(balancer->state->flow_id_to_backend_id, flow_index,
+                  (void *)vec_backend_index);
+
+    if (snapshot->generations[backend_index] !=
+        balancer->flow_generations[flow_index]) {
+      // Orphaned, keep the flow entry and just move it
+      backend_index = lb_assign_flow(balancer, snapshot, flow, flow_index);
+      if (backend_index < 0) {
+        return backend;
+      }
+    }
+
+    dchain_rejuvenate_index(balancer->state->flow_chain, flow_index, now);
+    return snapshot->backends[backend_index];
+  }
+
+  if (!lb_find_preferred_backend(balancer, snapshot,
+                                 (uint64_t)LoadBalancedFlow_hash(flow),
+                                 &backend_index)) {
+    return backend;
+  }
+
+  if (dchain_allocate_new_index(balancer->state->flow_chain, &flow_index,
+                                now) != 0) {
+    struct LoadBalancedFlow *vec_flow;
+    vector_borrow(balancer->state->flow_heap, flow_index, (void **)&vec_flow);
+    memcpy(vec_flow, flow, sizeof(struct LoadBalancedFlow));
+    lb_assign_flow(balancer, snapshot, vec_flow, flow_index);
+    map_put(balancer->state->flow_to_flow_id, vec_flow, flow_index);
+    vector_return(balancer->state->flow_heap, flow_index, vec_flow);
+  }  // Doesn't matter if we can't insert
+
+  return snapshot->backends[backend_index];
+}
+#else   // NF_MULTICORE
+
 struct LoadBalancedBackend lb_get_backend(struct LoadBalancer *balancer,
                                           struct LoadBalancedFlow *flow,
                                           vigor_time_t now,
@@ -111,6 +395,7 @@ struct LoadBalancedBackend lb_get_backend(struct LoadBalancer *balancer,
 
   return backend;
 }
+#endif  // NF_MULTICORE
 
 void lb_process_heartbit(struct LoadBalancer *balancer,
                          struct LoadBalancedFlow *flow,
@@ -135,6 +420,14 @@ void lb_process_heartbit(struct LoadBalancer *balancer,
       *ip = flow->src_ip;
       map_put(balancer->state->ip_to_backend_id, ip, backend_index);
       vector_return(balancer->state->backend_ips, backend_index, (void *)ip);
+
+#ifdef NF_MULTICORE
+      // Never 0, which marks free indexes
+      if (++balancer->backend_generations[backend_index] == 0) {
+        balancer->backend_generations[backend_index] = 1;
+      }
+      lb_publish_backends(balancer);
+#endif  // NF_MULTICORE
     }
     // Otherwise ignore this backend, we are full.
   } else {
@@ -156,16 +449,35 @@ void lb_expire_flows(struct LoadBalancer *balancer, vigor_time_t time) {
   expire_items_single_map(balancer->state->flow_chain,
                           balancer->state->flow_heap,
                           balancer->state->flow_to_flow_id, last_time);
+
+#if defined(NF_MULTICORE) && defined(LB_FLOW_SWEEP)
+  lb_sweep_flows(balancer);
+#endif  // NF_MULTICORE && LB_FLOW_SWEEP
 }
 
 void lb_expire_backends(struct LoadBalancer *balancer, vigor_time_t time) {
+#ifdef NF_MULTICORE
+  // Only the control core's backend tables are live
+  if (nf_core() != LB_CONTROL_CORE) {
+    return;
+  }
+#endif  // NF_MULTICORE
   assert(time >= 0);  // we don't support the past
   assert(sizeof(vigor_time_t) <= sizeof(uint64_t));
   uint64_t time_u = (uint64_t)time;  // OK because of the two asserts
   vigor_time_t vigor_time_expiration =
       (vigor_time_t)balancer->backend_expiration_time;
   vigor_time_t last_time = time_u - vigor_time_expiration * 1000;  // us to ns
+#ifdef NF_MULTICORE
+  if (expire_items_single_map(balancer->state->active_backends,
+                              balancer->state->backend_ips,
+                              balancer->state->ip_to_backend_id,
+                              last_time) > 0) {
+    lb_publish_backends(balancer);
+  }
+#else   // NF_MULTICORE
   expire_items_single_map(balancer->state->active_backends,
                           balancer->state->backend_ips,
                           balancer->state->ip_to_backend_id, last_time);
+#endif  // NF_MULTICORE
 }
@@ -11,6 +11,14 @@
 #include "lb_backend.h.gen.h"
 #include "ip_addr.h.gen.h"
 
+#ifdef NF_MULTICORE
+// The core that handles all heartbeats and owns the backend tables.
+#define LB_CONTROL_CORE 0
+
+// Called by each core whenever it holds no backend snapshot.
+void lb_quiescent(void);
+#endif  // NF_MULTICORE
+
 struct LoadBalancer;
 struct LoadBalancer *lb_allocate_balancer(uint32_t flow_capacity,
                                           uint32_t backend_capacity,
@@ -8,7 +8,18 @@
 
 struct nf_config config;
 
+#ifdef NF_MULTICORE
+unsigned nf_owner_core(uint16_t device, struct rte_mbuf *mbuf) {
+  return device == config.wan_device ? nf_core() : LB_CONTROL_CORE;
+}
+
+void nf_quiescent(void) { lb_quiescent(); }
+
+RTE_DEFINE_PER_LCORE(struct LoadBalancer *, balancer);
+#define balancer RTE_PER_LCORE(balancer)
+#else  // NF_MULTICORE
 struct LoadBalancer *balancer;
+#endif // NF_MULTICORE
 
 bool nf_init(void) {
   balancer = lb_allocate_balancer(
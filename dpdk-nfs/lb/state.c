@@ -8,7 +8,14 @@
 #include "lib/models/verified/vector-control.h"
 #include "lib/models/verified/lpm-dir-24-8-control.h"
 #endif//KLEE_VERIFICATION
+#ifdef NF_MULTICORE
+#include <rte_per_lcore.h>
+// Every core allocates its own state
+RTE_DEFINE_PER_LCORE(struct State*, allocated_nf_state) = NULL;
+#define allocated_nf_state RTE_PER_LCORE(allocated_nf_state)
+#else//NF_MULTICORE
 struct State* allocated_nf_state = NULL;
+#endif//NF_MULTICORE
 bool lb_backend_id_condition(void* value, int index, void* state) {
   struct ip_addr *v = value;
   return (0 <= index) AND
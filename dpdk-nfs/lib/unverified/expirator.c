@@ -12,3 +12,19 @@ int expire_items_single_map_iteratively(struct Vector *vector, struct Map *map,
     vector_return(vector, i, key);
   }
 }
+
+int expire_items_single_map_bounded(struct DoubleChain *chain,
+                                    struct Vector *vector, struct Map *map,
+                                    vigor_time_t time, int max_items) {
+  assert(max_items >= 0);
+  int count = 0;
+  int index = -1;
+  void *key;
+  while (count < max_items && dchain_expire_one_index(chain, &index, time)) {
+    vector_borrow(vector, index, (void **)&key);
+    map_erase(map, key, (void **)&key);
+    vector_return(vector, index, key);
+    ++count;
+  }
+  return count;
+}
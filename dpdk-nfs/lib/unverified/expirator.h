@@ -1,6 +1,7 @@
 #ifndef _UNVERIFIED_EXPIRATOR_H_INCLUDED_
 #define _UNVERIFIED_EXPIRATOR_H_INCLUDED_
 
+#include "../verified/double-chain.h"
 #include "../verified/map.h"
 #include "../verified/vector.h"
 
@@ -11,4 +12,12 @@
 int expire_items_single_map_iteratively(struct Vector *vector, struct Map *map,
                                         int start, int n_elems);
 
+// Same as expire_items_single_map, but expires at most max_items of the
+// oldest items older than time, so that the cost of a call is bounded. Items
+// left over are expired by the next calls.
+// @returns the number of expired items.
+int expire_items_single_map_bounded(struct DoubleChain *chain,
+                                    struct Vector *vector, struct Map *map,
+                                    vigor_time_t time, int max_items);
+
 #endif //_UNVERIFIED_EXPIRATOR_H_INCLUDED_
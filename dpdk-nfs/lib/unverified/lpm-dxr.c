@@ -0,0 +1,318 @@
+#include "lpm-dxr.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define lpm_DXR_RANGES_INIT 4096
+#define lpm_DXR_NODES_INIT 4096
+#define lpm_DXR_NO_NODE 0
+
+// A chunk with count == 0 stores its next hop (or INVALID) in base.
+struct dxr_chunk {
+  uint32_t base;
+  uint32_t count;
+};
+
+struct dxr_range {
+  uint16_t start;
+  uint16_t value;
+};
+
+// Control-plane binary trie; node 0 is the root, so 0 also means "no child".
+struct dxr_node {
+  uint32_t child[2];
+  uint16_t value;
+};
+
+struct lpm_dxr {
+  struct dxr_chunk *chunks;
+
+  struct dxr_range *ranges;
+  uint32_t ranges_used;
+  uint32_t ranges_wasted;
+  uint32_t ranges_capacity;
+
+  struct dxr_node *nodes;
+  uint32_t nodes_used;
+  uint32_t nodes_capacity;
+
+  // Scratch space used when rebuilding a single chunk.
+  struct dxr_range *scratch;
+  uint32_t scratch_count;
+};
+
+static uint32_t dxr_mask(uint8_t prefixlen) {
+  return prefixlen == 0 ? 0 : 0xFFFFFFFF << (32 - prefixlen);
+}
+
+static bool dxr_grow(void **array, uint32_t *capacity, uint32_t needed,
+                     size_t elem_size) {
+  if (needed <= *capacity) {
+    return true;
+  }
+
+  uint32_t new_capacity = *capacity;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+
+  void *grown = realloc(*array, new_capacity * elem_size);
+  if (grown == NULL) {
+    return false;
+  }
+
+  *array = grown;
+  *capacity = new_capacity;
+  return true;
+}
+
+static uint32_t dxr_new_node(struct lpm_dxr *_lpm) {
+  if (!dxr_grow((void **)&_lpm->nodes, &_lpm->nodes_capacity,
+                _lpm->nodes_used + 1, sizeof(struct dxr_node))) {
+    return lpm_DXR_NO_NODE;
+  }
+
+  uint32_t node = _lpm->nodes_used++;
+  _lpm->nodes[node].child[0] = lpm_DXR_NO_NODE;
+  _lpm->nodes[node].child[1] = lpm_DXR_NO_NODE;
+  _lpm->nodes[node].value = INVALID;
+  return node;
+}
+
+static void dxr_emit(struct lpm_dxr *_lpm, uint32_t start, uint16_t value) {
+  if (_lpm->scratch_count > 0 &&
+      _lpm->scratch[_lpm->scratch_count - 1].value == value) {
+    return;
+  }
+
+  _lpm->scratch[_lpm->scratch_count].start = (uint16_t)start;
+  _lpm->scratch[_lpm->scratch_count].value = value;
+  _lpm->scratch_count++;
+}
+
+// In-order walk of the subtree covering [start, start + 2^(32-depth)[ within
+// a chunk, emitting a range every time the matching rule changes.
+static void dxr_walk(struct lpm_dxr *_lpm, uint32_t node, uint8_t depth,
+                     uint32_t start, uint16_t inherited) {
+  struct dxr_node *n = &_lpm->nodes[node];
+
+  if (n->value != INVALID) {
+    inherited = n->value;
+  }
+
+  if (n->child[0] == lpm_DXR_NO_NODE && n->child[1] == lpm_DXR_NO_NODE) {
+    dxr_emit(_lpm, start, inherited);
+    return;
+  }
+
+  for (uint32_t bit = 0; bit < 2; bit++) {
+    uint32_t sub_start = start + (bit << (31 - depth));
+    uint32_t child = _lpm->nodes[node].child[bit];
+
+    if (child == lpm_DXR_NO_NODE) {
+      dxr_emit(_lpm, sub_start, inherited);
+    } else {
+      dxr_walk(_lpm, child, depth + 1, sub_start, inherited);
+    }
+  }
+}
+
+static void dxr_compact(struct lpm_dxr *_lpm) {
+  struct dxr_range *packed = (struct dxr_range *)malloc(
+      _lpm->ranges_capacity * sizeof(struct dxr_range));
+  if (packed == NULL) {
+    // Keep the fragmented layout, it is still correct.
+    return;
+  }
+
+  uint32_t used = 0;
+  for (uint32_t c = 0; c < lpm_DXR_CHUNKS; c++) {
+    struct dxr_chunk *chunk = &_lpm->chunks[c];
+    if (chunk->count == 0) {
+      continue;
+    }
+
+    memcpy(&packed[used], &_lpm->ranges[chunk->base],
+           chunk->count * sizeof(struct dxr_range));
+    chunk->base = used;
+    used += chunk->count;
+  }
+
+  free(_lpm->ranges);
+  _lpm->ranges = packed;
+  _lpm->ranges_used = used;
+  _lpm->ranges_wasted = 0;
+}
+
+static bool dxr_rebuild_chunk(struct lpm_dxr *_lpm, uint32_t c) {
+  uint32_t node = 0;
+  uint16_t inherited = _lpm->nodes[0].value;
+
+  for (uint8_t depth = 0; depth < lpm_DXR_CHUNK_BITS; depth++) {
+    uint32_t bit = (c >> (lpm_DXR_CHUNK_BITS - 1 - depth)) & 1;
+    node = _lpm->nodes[node].child[bit];
+
+    if (node == lpm_DXR_NO_NODE) {
+      break;
+    }
+
+    if (_lpm->nodes[node].value != INVALID) {
+      inherited = _lpm->nodes[node].value;
+    }
+  }
+
+  _lpm->scratch_count = 0;
+  if (node != lpm_DXR_NO_NODE) {
+    dxr_walk(_lpm, node, lpm_DXR_CHUNK_BITS, 0, inherited);
+  } else {
+    dxr_emit(_lpm, 0, inherited);
+  }
+
+  struct dxr_chunk *chunk = &_lpm->chunks[c];
+  uint32_t new_count = _lpm->scratch_count;
+
+  if (new_count == 1) {
+    _lpm->ranges_wasted += chunk->count;
+    chunk->base = _lpm->scratch[0].value;
+    chunk->count = 0;
+    return true;
+  }
+
+  if (new_count > chunk->count) {
+    if (!dxr_grow((void **)&_lpm->ranges, &_lpm->ranges_capacity,
+                  _lpm->ranges_used + new_count, sizeof(struct dxr_range))) {
+      return false;
+    }
+
+    _lpm->ranges_wasted += chunk->count;
+    chunk->base = _lpm->ranges_used;
+    _lpm->ranges_used += new_count;
+  } else {
+    _lpm->ranges_wasted += chunk->count - new_count;
+  }
+
+  memcpy(&_lpm->ranges[chunk->base], _lpm->scratch,
+         new_count * sizeof(struct dxr_range));
+  chunk->count = new_count;
+  return true;
+}
+
+int lpm_dxr_allocate(struct lpm_dxr **lpm_out) {
+  struct lpm_dxr *_lpm = (struct lpm_dxr *)calloc(1, sizeof(struct lpm_dxr));
+  if (_lpm == NULL) {
+    return 0;
+  }
+
+  _lpm->chunks =
+      (struct dxr_chunk *)malloc(lpm_DXR_CHUNKS * sizeof(struct dxr_chunk));
+  _lpm->ranges = (struct dxr_range *)malloc(lpm_DXR_RANGES_INIT *
+                                            sizeof(struct dxr_range));
+  _lpm->nodes =
+      (struct dxr_node *)malloc(lpm_DXR_NODES_INIT * sizeof(struct dxr_node));
+  _lpm->scratch =
+      (struct dxr_range *)malloc(lpm_DXR_CHUNKS * sizeof(struct dxr_range));
+
+  if (_lpm->chunks == NULL || _lpm->ranges == NULL || _lpm->nodes == NULL ||
+      _lpm->scratch == NULL) {
+    lpm_dxr_free(_lpm);
+    return 0;
+  }
+
+  for (uint32_t c = 0; c < lpm_DXR_CHUNKS; c++) {
+    _lpm->chunks[c].base = INVALID;
+    _lpm->chunks[c].count = 0;
+  }
+
+  _lpm->ranges_capacity = lpm_DXR_RANGES_INIT;
+  _lpm->nodes_capacity = lpm_DXR_NODES_INIT;
+
+  // root
+  dxr_new_node(_lpm);
+
+  *lpm_out = _lpm;
+  return 1;
+}
+
+void lpm_dxr_free(struct lpm_dxr *_lpm) {
+  free(_lpm->chunks);
+  free(_lpm->ranges);
+  free(_lpm->nodes);
+  free(_lpm->scratch);
+  free(_lpm);
+}
+
+int lpm_dxr_update_elem(struct lpm_dxr *_lpm, uint32_t prefix,
+                        uint8_t prefixlen, uint16_t value) {
+  if (prefixlen > lpm_PLEN_MAX || value > MAX_NEXT_HOP_VALUE) {
+    return 0;
+  }
+
+  uint32_t masked_ip = prefix & dxr_mask(prefixlen);
+  uint32_t node = 0;
+
+  for (uint8_t depth = 0; depth < prefixlen; depth++) {
+    uint32_t bit = (masked_ip >> (31 - depth)) & 1;
+    uint32_t child = _lpm->nodes[node].child[bit];
+
+    if (child == lpm_DXR_NO_NODE) {
+      child = dxr_new_node(_lpm);
+      if (child == lpm_DXR_NO_NODE) {
+        return 0;
+      }
+      _lpm->nodes[node].child[bit] = child;
+    }
+
+    node = child;
+  }
+
+  _lpm->nodes[node].value = value;
+
+  uint32_t first_chunk = masked_ip >> lpm_DXR_CHUNK_BITS;
+  uint32_t n_chunks = prefixlen >= lpm_DXR_CHUNK_BITS
+                          ? 1
+                          : 1u << (lpm_DXR_CHUNK_BITS - prefixlen);
+
+  for (uint32_t c = first_chunk; c < first_chunk + n_chunks; c++) {
+    if (!dxr_rebuild_chunk(_lpm, c)) {
+      return 0;
+    }
+  }
+
+  if (_lpm->ranges_wasted > lpm_DXR_RANGES_INIT &&
+      _lpm->ranges_wasted > _lpm->ranges_used / 2) {
+    dxr_compact(_lpm);
+  }
+
+  return 1;
+}
+
+int lpm_dxr_lookup_elem(struct lpm_dxr *_lpm, uint32_t prefix) {
+  struct dxr_chunk chunk = _lpm->chunks[prefix >> lpm_DXR_CHUNK_BITS];
+
+  if (chunk.count == 0) {
+    return chunk.base;
+  }
+
+  uint16_t low = (uint16_t)(prefix & 0xFFFF);
+  struct dxr_range *ranges = &_lpm->ranges[chunk.base];
+
+  // The first range of a chunk always starts at 0, so ranges[lo] is a match.
+  uint32_t lo = 0;
+  uint32_t hi = chunk.count;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (ranges[mid].start <= low) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return ranges[lo].value;
+}
+
+size_t lpm_dxr_lookup_footprint(struct lpm_dxr *_lpm) {
+  return lpm_DXR_CHUNKS * sizeof(struct dxr_chunk) +
+         (_lpm->ranges_used - _lpm->ranges_wasted) * sizeof(struct dxr_range);
+}
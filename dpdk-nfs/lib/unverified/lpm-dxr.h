@@ -0,0 +1,40 @@
+#ifndef _LPM_DXR_H_INCLUDED_
+#define _LPM_DXR_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib/verified/lpm-dir-24-8.h"
+
+// DXR-style range table (D16R), an alternative to the DIR-24-8 lpm.
+// Zec et al., "DXR: towards a billion routing lookups per second in
+// software", SIGCOMM CCR 2012.
+//
+// The 16 MSB of the address index a direct table of 2^16 chunks. A chunk
+// either holds a single next hop for its whole /16, or points to a sorted
+// array of ranges (16-bit start, next hop) that is binary-searched with the
+// 16 LSB. A full Internet table fits in a few MB instead of the 32 MB
+// lpm_24 array, so most lookups hit L2/LLC.
+//
+// Contrary to DIR-24-8, rules may be inserted in any order: a binary trie of
+// the rules is kept on the side and the affected chunks are rebuilt from it
+// on every update. Updates are therefore slower, lookups are not.
+//
+// Same contract as lpm_*: values must be <= MAX_NEXT_HOP_VALUE, lookups
+// return INVALID when no rule matches.
+
+#define lpm_DXR_CHUNK_BITS 16
+#define lpm_DXR_CHUNKS (1 << lpm_DXR_CHUNK_BITS)
+
+struct lpm_dxr;
+
+int lpm_dxr_allocate(struct lpm_dxr **lpm_out);
+void lpm_dxr_free(struct lpm_dxr *_lpm);
+int lpm_dxr_update_elem(struct lpm_dxr *_lpm, uint32_t prefix,
+                        uint8_t prefixlen, uint16_t value);
+int lpm_dxr_lookup_elem(struct lpm_dxr *_lpm, uint32_t prefix);
+
+// Bytes touched by lookups (direct table + live ranges), excluding the trie.
+size_t lpm_dxr_lookup_footprint(struct lpm_dxr *_lpm);
+
+#endif //_LPM_DXR_H_INCLUDED_
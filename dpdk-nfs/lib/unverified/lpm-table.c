@@ -0,0 +1,88 @@
+#include "lpm-table.h"
+
+#include <stdlib.h>
+
+#include "lib/verified/lpm-dir-24-8.h"
+#include "lpm-dxr.h"
+
+struct lpm_table {
+  enum lpm_backend backend;
+  union {
+    struct lpm *dir_24_8;
+    struct lpm_dxr *dxr;
+  } impl;
+};
+
+int lpm_table_allocate(enum lpm_backend backend, struct lpm_table **lpm_out) {
+  struct lpm_table *_lpm = (struct lpm_table *)malloc(sizeof(struct lpm_table));
+  if (_lpm == NULL) {
+    return 0;
+  }
+
+  _lpm->backend = backend;
+
+  int allocated = 0;
+  switch (backend) {
+    case LPM_BACKEND_DIR_24_8:
+      allocated = lpm_allocate(&_lpm->impl.dir_24_8);
+      break;
+    case LPM_BACKEND_DXR:
+      allocated = lpm_dxr_allocate(&_lpm->impl.dxr);
+      break;
+  }
+
+  if (!allocated) {
+    free(_lpm);
+    return 0;
+  }
+
+  *lpm_out = _lpm;
+  return 1;
+}
+
+void lpm_table_free(struct lpm_table *_lpm) {
+  switch (_lpm->backend) {
+    case LPM_BACKEND_DIR_24_8:
+      lpm_free(_lpm->impl.dir_24_8);
+      break;
+    case LPM_BACKEND_DXR:
+      lpm_dxr_free(_lpm->impl.dxr);
+      break;
+  }
+
+  free(_lpm);
+}
+
+int lpm_table_update_elem(struct lpm_table *_lpm, uint32_t prefix,
+                          uint8_t prefixlen, uint16_t value) {
+  switch (_lpm->backend) {
+    case LPM_BACKEND_DIR_24_8:
+      return lpm_update_elem(_lpm->impl.dir_24_8, prefix, prefixlen, value);
+    case LPM_BACKEND_DXR:
+      return lpm_dxr_update_elem(_lpm->impl.dxr, prefix, prefixlen, value);
+  }
+
+  return 0;
+}
+
+int lpm_table_lookup_elem(struct lpm_table *_lpm, uint32_t prefix) {
+  switch (_lpm->backend) {
+    case LPM_BACKEND_DIR_24_8:
+      return lpm_lookup_elem(_lpm->impl.dir_24_8, prefix);
+    case LPM_BACKEND_DXR:
+      return lpm_dxr_lookup_elem(_lpm->impl.dxr, prefix);
+  }
+
+  return INVALID;
+}
+
+size_t lpm_table_lookup_footprint(struct lpm_table *_lpm) {
+  switch (_lpm->backend) {
+    case LPM_BACKEND_DIR_24_8:
+      return (lpm_24_MAX_ENTRIES + lpm_LONG_MAX_ENTRIES) * sizeof(uint16_t);
+    case LPM_BACKEND_DXR:
+      return lpm_dxr_lookup_footprint(_lpm->impl.dxr);
+  }
+
+  return 0;
+}
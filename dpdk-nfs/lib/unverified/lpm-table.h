@@ -0,0 +1,27 @@
+#ifndef _LPM_TABLE_H_INCLUDED_
+#define _LPM_TABLE_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime choice between the verified DIR-24-8 lpm (32 MB, one or two memory
+// accesses per lookup) and the compressed DXR range table (a few MB, binary
+// search within a /16). Both honour the lpm_* contract.
+
+enum lpm_backend {
+  LPM_BACKEND_DIR_24_8,
+  LPM_BACKEND_DXR,
+};
+
+struct lpm_table;
+
+int lpm_table_allocate(enum lpm_backend backend, struct lpm_table **lpm_out);
+void lpm_table_free(struct lpm_table *_lpm);
+int lpm_table_update_elem(struct lpm_table *_lpm, uint32_t prefix,
+                          uint8_t prefixlen, uint16_t value);
+int lpm_table_lookup_elem(struct lpm_table *_lpm, uint32_t prefix);
+
+// Bytes of table memory touched by lookups.
+size_t lpm_table_lookup_footprint(struct lpm_table *_lpm);
+
+#endif //_LPM_TABLE_H_INCLUDED_
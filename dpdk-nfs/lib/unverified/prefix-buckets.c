@@ -0,0 +1,128 @@
+#include "prefix-buckets.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Slots probed from the home slot of a key, a couple of cache lines.
+#define PREFIX_BUCKETS_PROBES 8
+
+struct PrefixBuckets {
+  struct prefix_bucket *slots;
+  uint32_t slots_mask;
+  vigor_time_t cutoff;
+
+  int n_levels;
+  uint8_t lens[PREFIX_BUCKETS_MAX_LEVELS];
+  uint32_t masks[PREFIX_BUCKETS_MAX_LEVELS];
+};
+
+static inline bool prefix_bucket_live(struct PrefixBuckets *table,
+                                      struct prefix_bucket *bucket) {
+  return bucket->prefix_len != 0 && bucket->time >= table->cutoff;
+}
+
+// MurmurHash3 finalizer over (prefix length, prefix).
+static inline uint32_t prefix_buckets_home(struct PrefixBuckets *table,
+                                           uint32_t prefix, uint8_t len) {
+  uint64_t hash = ((uint64_t)len << 32) | prefix;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return (uint32_t)hash & table->slots_mask;
+}
+
+int prefix_buckets_allocate(uint32_t prefixes_mask, uint32_t capacity,
+                            struct PrefixBuckets **table_out) {
+  struct PrefixBuckets *table =
+      (struct PrefixBuckets *)malloc(sizeof(struct PrefixBuckets));
+  if (table == NULL) {
+    return 0;
+  }
+
+  table->n_levels = 0;
+  for (int len = 1; len <= 32; len++, prefixes_mask >>= 1) {
+    if (prefixes_mask & 1) {
+      table->lens[table->n_levels] = len;
+      table->masks[table->n_levels] = 0xFFFFFFFF << (32 - len);
+      table->n_levels++;
+    }
+  }
+
+  // Keep the load under one half, probing stays short.
+  uint64_t wanted = 2 * (uint64_t)capacity * table->n_levels;
+  uint64_t slots = PREFIX_BUCKETS_PROBES;
+  while (slots < wanted) {
+    slots *= 2;
+  }
+  if (slots > (1ull << 31)) {
+    free(table);
+    return 0;
+  }
+
+  table->slots =
+      (struct prefix_bucket *)calloc(slots, sizeof(struct prefix_bucket));
+  if (table->slots == NULL) {
+    free(table);
+    return 0;
+  }
+
+  table->slots_mask = (uint32_t)(slots - 1);
+  table->cutoff = 0;
+
+  *table_out = table;
+  return 1;
+}
+
+uint32_t prefix_buckets_get(struct PrefixBuckets *table, uint32_t addr,
+                            vigor_time_t now,
+                            struct prefix_bucket **buckets_out) {
+  uint32_t prefixes[PREFIX_BUCKETS_MAX_LEVELS];
+  uint32_t homes[PREFIX_BUCKETS_MAX_LEVELS];
+
+  for (int level = 0; level < table->n_levels; level++) {
+    prefixes[level] = addr & table->masks[level];
+    homes[level] =
+        prefix_buckets_home(table, prefixes[level], table->lens[level]);
+    __builtin_prefetch(&table->slots[homes[level]], 1);
+  }
+
+  uint32_t allocated = 0;
+
+  for (int level = 0; level < table->n_levels; level++) {
+    struct prefix_bucket *found = NULL;
+    struct prefix_bucket *free_slot = NULL;
+
+    for (uint32_t probe = 0; probe < PREFIX_BUCKETS_PROBES; probe++) {
+      struct prefix_bucket *slot =
+          &table->slots[(homes[level] + probe) & table->slots_mask];
+
+      if (!prefix_bucket_live(table, slot)) {
+        if (free_slot == NULL) {
+          free_slot = slot;
+        }
+      } else if (slot->prefix == prefixes[level] &&
+                 slot->prefix_len == table->lens[level]) {
+        found = slot;
+        break;
+      }
+    }
+
+    if (found == NULL && free_slot != NULL) {
+      free_slot->prefix = prefixes[level];
+      free_slot->prefix_len = table->lens[level];
+      free_slot->time = now;
+      allocated |= 1u << level;
+      found = free_slot;
+    }
+
+    buckets_out[level] = found;
+  }
+
+  return allocated;
+}
+
+void prefix_buckets_expire(struct PrefixBuckets *table, vigor_time_t time) {
+  table->cutoff = time;
+}
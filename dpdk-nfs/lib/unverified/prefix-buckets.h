@@ -0,0 +1,46 @@
+#ifndef _PREFIX_BUCKETS_H_INCLUDED_
+#define _PREFIX_BUCKETS_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "lib/verified/vigor-time.h"
+
+// Token buckets for every enabled prefix length of an IPv4 address, kept in
+// a single open-addressing table keyed by (prefix length, masked address).
+// All the levels of an address are hashed and prefetched before any of them
+// is probed, so the memory accesses of the levels overlap instead of being
+// serialized as with one map per prefix length.
+//
+// Like the flat sketch, there is no dchain: each bucket carries the time it
+// was last touched, prefix_buckets_expire only records the expiration cutoff,
+// and buckets older than it read as free.
+
+#define PREFIX_BUCKETS_MAX_LEVELS 32
+
+struct prefix_bucket {
+  vigor_time_t time; // last touched
+  uint64_t size;
+  uint32_t prefix; // host byte order
+  uint8_t prefix_len;
+};
+
+struct PrefixBuckets;
+
+// Bit i of prefixes_mask enables prefix length i + 1. Each enabled level gets
+// room for about capacity buckets.
+int prefix_buckets_allocate(uint32_t prefixes_mask, uint32_t capacity,
+                            struct PrefixBuckets **table_out);
+
+// Finds the bucket of every enabled prefix of addr (host byte order), in
+// increasing prefix length order. Buckets not found are allocated with their
+// time set to now and their size left to the caller; buckets_out[level] is
+// NULL when there was no room left for it.
+// @returns the bitmap of the levels whose bucket was just allocated.
+uint32_t prefix_buckets_get(struct PrefixBuckets *table, uint32_t addr,
+                            vigor_time_t now,
+                            struct prefix_bucket **buckets_out);
+
+// Buckets last touched before time are considered free from now on.
+void prefix_buckets_expire(struct PrefixBuckets *table, vigor_time_t time);
+
+#endif //_PREFIX_BUCKETS_H_INCLUDED_
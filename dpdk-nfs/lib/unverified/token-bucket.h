@@ -0,0 +1,63 @@
+#ifndef _TOKEN_BUCKET_H_INCLUDED_
+#define _TOKEN_BUCKET_H_INCLUDED_
+
+#include <stdint.h>
+
+#include "lib/verified/boilerplate-util.h"
+#include "lib/verified/vigor-time.h"
+
+// Token bucket refill shared by the policer and HHH. Everything depending on
+// the configured rate is computed once by token_bucket_init, so a refill is a
+// compare, a multiply and a division by the compile-time constant
+// VIGOR_TIME_SECONDS_MULTIPLIER, which compilers lower to a multiply by its
+// reciprocal and a shift. No per-packet division by the runtime rate remains.
+//
+// With M = VIGOR_TIME_SECONDS_MULTIPLIER, refills compute exactly
+//   elapsed < burst * M / rate ? min(size + elapsed * rate / M, burst) : burst
+// Configs where burst * M does not fit in 64 bits are refused (the formula
+// used to wrap silently there). Otherwise nothing overflows:
+//   elapsed < floor(burst * M / rate) implies elapsed * rate < burst * M,
+//   so elapsed * rate fits and added tokens < burst;
+//   size <= burst, so size + added < 2 * burst < 2^64.
+
+struct TokenBucketConfig {
+  uint64_t rate;  // tokens/s
+  uint64_t burst; // tokens
+  // Time for an empty bucket to fill up, i.e. burst * M / rate
+  uint64_t refill_time;
+};
+
+// @returns 0 if rate is 0 or burst * VIGOR_TIME_SECONDS_MULTIPLIER overflows.
+static inline int token_bucket_init(struct TokenBucketConfig *config,
+                                    uint64_t rate, uint64_t burst) {
+  if (rate == 0 || burst > UINT64_MAX / VIGOR_TIME_SECONDS_MULTIPLIER) {
+    return 0;
+  }
+
+  config->rate = rate;
+  config->burst = burst;
+  config->refill_time = burst * VIGOR_TIME_SECONDS_MULTIPLIER / rate;
+  return 1;
+}
+
+// @returns the size of a bucket holding bucket_size <= burst tokens once it is
+// refilled for elapsed nanoseconds.
+static inline uint64_t
+token_bucket_refill(const struct TokenBucketConfig *config,
+                    uint64_t bucket_size, uint64_t elapsed) {
+  if (elapsed >= config->refill_time) {
+    return config->burst;
+  }
+
+  uint64_t added_tokens =
+      elapsed * config->rate / VIGOR_TIME_SECONDS_MULTIPLIER;
+  vigor_note(added_tokens < config->burst);
+
+  bucket_size += added_tokens;
+  if (bucket_size > config->burst) {
+    bucket_size = config->burst;
+  }
+  return bucket_size;
+}
+
+#endif //_TOKEN_BUCKET_H_INCLUDED_
@@ -6,8 +6,17 @@
 
 #include "packet-io.h"
 
+#ifdef NF_MULTICORE
+// Each core reads its own packet
+#include <rte_per_lcore.h>
+RTE_DEFINE_PER_LCORE(size_t, global_total_length);
+RTE_DEFINE_PER_LCORE(size_t, global_read_length) = 0;
+#define global_total_length RTE_PER_LCORE(global_total_length)
+#define global_read_length RTE_PER_LCORE(global_read_length)
+#else  // NF_MULTICORE
 size_t global_total_length;
 size_t global_read_length = 0;
+#endif // NF_MULTICORE
 
 /*@
   fixpoint bool missing_chunks(list<pair<int8_t*, int> > missing_chunks, int8_t*
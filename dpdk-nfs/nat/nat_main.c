@@ -1,5 +1,9 @@
 #include <stdlib.h>
 
+#ifdef NF_MULTICORE
+#include <rte_flow.h>
+#endif // NF_MULTICORE
+
 #include "nf.h"
 #include "flow.h.gen.h"
 #include "nat_flowmanager.h"
@@ -9,6 +13,124 @@
 
 struct nf_config config;
 
+#ifdef NF_MULTICORE
+// Each core owns the external ports [start_port + core * slice,
+// start_port + (core + 1) * slice[ and the flows allocated on them. New flows
+// are allocated by whichever core RSS picks; their return traffic is steered
+// back to the owning core by the NIC when it can match on destination port
+// ranges, and otherwise redirected in software by nf_owner_core.
+RTE_DEFINE_PER_LCORE(struct FlowManager *, flow_manager);
+#define flow_manager RTE_PER_LCORE(flow_manager)
+
+static uint32_t port_slice;
+
+// Power of 2, so that the flow tables can be allocated and slices are
+// prefixes for the NIC.
+static uint32_t nat_port_slice(void) {
+  uint32_t slice = 1;
+  while (slice * 2 <= config.max_flows / nf_cores()) {
+    slice *= 2;
+  }
+  return slice;
+}
+
+static bool nat_steer_proto(unsigned core, enum rte_flow_item_type type,
+                            size_t offset) {
+  // Ports are compared as stored in the packet, like flow_manager does
+  uint16_t spec_port = config.start_port + core * port_slice;
+  uint16_t mask_port = (uint16_t) ~(port_slice - 1);
+
+  struct rte_tcp_hdr spec_l4 = { 0 };
+  struct rte_tcp_hdr mask_l4 = { 0 };
+  *(uint16_t *)((uint8_t *)&spec_l4 + offset) = spec_port;
+  *(uint16_t *)((uint8_t *)&mask_l4 + offset) = mask_port;
+
+  struct rte_flow_attr attr = { .ingress = 1 };
+  struct rte_flow_item pattern[] = {
+    { .type = RTE_FLOW_ITEM_TYPE_ETH },
+    { .type = RTE_FLOW_ITEM_TYPE_IPV4 },
+    { .type = type, .spec = &spec_l4, .mask = &mask_l4 },
+    { .type = RTE_FLOW_ITEM_TYPE_END },
+  };
+  struct rte_flow_action_queue queue = { .index = core };
+  struct rte_flow_action actions[] = {
+    { .type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &queue },
+    { .type = RTE_FLOW_ACTION_TYPE_END },
+  };
+
+  struct rte_flow_error error;
+  return rte_flow_create(config.wan_device, &attr, pattern, actions, &error) !=
+         NULL;
+}
+
+static void nat_steer_return_traffic(void) {
+  if (config.start_port % port_slice != 0) {
+    NF_INFO("Starting port not aligned on the per-core port range, "
+            "redirecting return traffic in software");
+    return;
+  }
+
+  for (unsigned core = 0; core < nf_cores(); core++) {
+    if (!nat_steer_proto(core, RTE_FLOW_ITEM_TYPE_TCP,
+                         offsetof(struct rte_tcp_hdr, dst_port)) ||
+        !nat_steer_proto(core, RTE_FLOW_ITEM_TYPE_UDP,
+                         offsetof(struct rte_udp_hdr, dst_port))) {
+      struct rte_flow_error error;
+      rte_flow_flush(config.wan_device, &error);
+      NF_INFO("Device %" PRIu16 " cannot steer return traffic, "
+              "redirecting it in software",
+              config.wan_device);
+      return;
+    }
+  }
+}
+
+unsigned nf_owner_core(uint16_t device, struct rte_mbuf *mbuf) {
+  if (device != config.wan_device) {
+    return nf_core();
+  }
+
+  struct rte_ether_hdr *ether_header =
+      rte_pktmbuf_mtod(mbuf, struct rte_ether_hdr *);
+  struct rte_ipv4_hdr *ipv4_header = (struct rte_ipv4_hdr *)(ether_header + 1);
+  size_t ipv4_length = (ipv4_header->version_ihl & 0x0f) * WORD_SIZE;
+
+  if (mbuf->data_len < sizeof(struct rte_ether_hdr) +
+                           sizeof(struct rte_ipv4_hdr) +
+                           sizeof(struct tcpudp_hdr) ||
+      !nf_has_rte_ipv4_header(ether_header) ||
+      !nf_has_tcpudp_header(ipv4_header) ||
+      mbuf->data_len < sizeof(struct rte_ether_hdr) + ipv4_length +
+                           sizeof(struct tcpudp_hdr)) {
+    // Dropped by whichever core looks at it
+    return nf_core();
+  }
+
+  struct tcpudp_hdr *tcpudp_header =
+      (struct tcpudp_hdr *)((uint8_t *)ipv4_header + ipv4_length);
+  uint16_t index = tcpudp_header->dst_port - config.start_port;
+  unsigned owner = index / port_slice;
+
+  return owner < nf_cores() ? owner : nf_core();
+}
+
+// The flow manager is partitioned, no core ever holds shared state.
+void nf_quiescent(void) {}
+
+bool nf_init(void) {
+  port_slice = nat_port_slice();
+
+  flow_manager = flow_manager_allocate(
+      config.start_port + nf_core() * port_slice, config.external_addr,
+      config.wan_device, config.expiration_time, port_slice);
+
+  if (flow_manager != NULL && nf_core() == 0) {
+    nat_steer_return_traffic();
+  }
+
+  return flow_manager != NULL;
+}
+#else  // NF_MULTICORE
 struct FlowManager *flow_manager;
 
 bool nf_init(void) {
@@ -18,6 +140,7 @@ bool nf_init(void) {
 
   return flow_manager != NULL;
 }
+#endif // NF_MULTICORE
 
 int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
                vigor_time_t now, struct rte_mbuf *mbuf) {
@@ -43,6 +166,8 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
   NF_DEBUG("Forwarding an IPv4 packet on device %" PRIu16, device);
 
   uint16_t dst_device;
+  uint32_t old_addr, new_addr;
+  uint16_t old_port, new_port;
   if (device == config.wan_device) {
     NF_DEBUG("Device %" PRIu16 " is external", device);
 
@@ -59,8 +184,13 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
         return device;
       }
 
-      rte_ipv4_header->dst_addr = internal_flow.src_ip;
-      tcpudp_header->dst_port = internal_flow.src_port;
+      old_addr = rte_ipv4_header->dst_addr;
+      old_port = tcpudp_header->dst_port;
+      new_addr = internal_flow.src_ip;
+      new_port = internal_flow.src_port;
+
+      rte_ipv4_header->dst_addr = new_addr;
+      tcpudp_header->dst_port = new_port;
       dst_device = internal_flow.internal_device;
     } else {
       NF_DEBUG("Unknown flow, dropping");
@@ -93,12 +223,22 @@ int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
 
     NF_DEBUG("Forwarding from ext port:%d", external_port);
 
-    rte_ipv4_header->src_addr = config.external_addr;
-    tcpudp_header->src_port = external_port;
+    old_addr = rte_ipv4_header->src_addr;
+    old_port = tcpudp_header->src_port;
+    new_addr = config.external_addr;
+    new_port = external_port;
+
+    rte_ipv4_header->src_addr = new_addr;
+    tcpudp_header->src_port = new_port;
     dst_device = config.wan_device;
   }
 
-  nf_set_rte_ipv4_udptcp_checksum(rte_ipv4_header, tcpudp_header, buffer);
+  if (!nf_offload_rte_ipv4_udptcp_checksum(dst_device, mbuf, rte_ipv4_header,
+                                           tcpudp_header)) {
+    nf_update_rte_ipv4_udptcp_checksum(rte_ipv4_header, tcpudp_header,
+                                       old_addr, new_addr, old_port, new_port,
+                                       buffer);
+  }
 
   concretize_devices(&dst_device, rte_eth_dev_count_avail());
 
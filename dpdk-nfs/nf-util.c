@@ -16,8 +16,13 @@
 #include <klee/klee.h>
 #endif
 
+#ifdef NF_MULTICORE
+RTE_DEFINE_PER_LCORE(void *[MAX_N_CHUNKS], chunks_borrowed);
+RTE_DEFINE_PER_LCORE(size_t, chunks_borrowed_num) = 0;
+#else  // NF_MULTICORE
 void *chunks_borrowed[MAX_N_CHUNKS];
 size_t chunks_borrowed_num = 0;
+#endif // NF_MULTICORE
 
 void nf_log_pkt(struct rte_ether_hdr *rte_ether_header,
                 struct rte_ipv4_hdr *rte_ipv4_header,
@@ -117,6 +122,93 @@ void nf_set_rte_ipv4_udptcp_checksum(struct rte_ipv4_hdr *ip_header,
 }
 #endif // KLEE_VERIFICATION
 
+#ifdef KLEE_VERIFICATION
+// Traced as a full recomputation, the result is the same.
+void nf_update_rte_ipv4_udptcp_checksum(struct rte_ipv4_hdr *ip_header,
+                                        void *l4_header, uint32_t old_addr,
+                                        uint32_t new_addr, uint16_t old_port,
+                                        uint16_t new_port, void *packet) {
+  nf_set_rte_ipv4_udptcp_checksum(ip_header, l4_header, packet);
+}
+#else  // KLEE_VERIFICATION
+void nf_update_rte_ipv4_udptcp_checksum(struct rte_ipv4_hdr *ip_header,
+                                        void *l4_header, uint32_t old_addr,
+                                        uint32_t new_addr, uint16_t old_port,
+                                        uint16_t new_port, void *packet) {
+  ip_header->hdr_checksum =
+      nf_checksum_update_32(ip_header->hdr_checksum, old_addr, new_addr);
+
+  // The addresses are part of the L4 pseudo-header
+  if (ip_header->next_proto_id == IPPROTO_TCP) {
+    struct rte_tcp_hdr *tcp_header = (struct rte_tcp_hdr *)l4_header;
+    uint16_t cksum =
+        nf_checksum_update_32(tcp_header->cksum, old_addr, new_addr);
+    tcp_header->cksum = nf_checksum_update_16(cksum, old_port, new_port);
+  } else if (ip_header->next_proto_id == IPPROTO_UDP) {
+    struct rte_udp_hdr *udp_header = (struct rte_udp_hdr *)l4_header;
+
+    // A zero UDP checksum means none was computed
+    if (udp_header->dgram_cksum == 0) {
+      return;
+    }
+
+    uint16_t cksum =
+        nf_checksum_update_32(udp_header->dgram_cksum, old_addr, new_addr);
+    cksum = nf_checksum_update_16(cksum, old_port, new_port);
+    udp_header->dgram_cksum = cksum == 0 ? 0xffff : cksum;
+  }
+}
+#endif // KLEE_VERIFICATION
+
+#if defined(NF_CHECKSUM_OFFLOAD) && !defined(KLEE_VERIFICATION)
+#define NF_CHECKSUM_OFFLOADS                                                   \
+  (DEV_TX_OFFLOAD_IPV4_CKSUM | DEV_TX_OFFLOAD_TCP_CKSUM |                      \
+   DEV_TX_OFFLOAD_UDP_CKSUM)
+
+static bool checksum_offload[RTE_MAX_ETHPORTS];
+
+void nf_checksum_offload_configure(uint16_t device, struct rte_eth_conf *conf) {
+  struct rte_eth_dev_info dev_info;
+  rte_eth_dev_info_get(device, &dev_info);
+
+  checksum_offload[device] =
+      (dev_info.tx_offload_capa & NF_CHECKSUM_OFFLOADS) == NF_CHECKSUM_OFFLOADS;
+
+  if (checksum_offload[device]) {
+    conf->txmode.offloads |= NF_CHECKSUM_OFFLOADS;
+  } else {
+    NF_INFO("Device %" PRIu16 " has no checksum offload, using software",
+            device);
+  }
+}
+
+bool nf_offload_rte_ipv4_udptcp_checksum(uint16_t device, struct rte_mbuf *mbuf,
+                                         struct rte_ipv4_hdr *ip_header,
+                                         void *l4_header) {
+  if (!checksum_offload[device]) {
+    return false;
+  }
+
+  mbuf->l2_len = (uint8_t *)ip_header - rte_pktmbuf_mtod(mbuf, uint8_t *);
+  mbuf->l3_len = (ip_header->version_ihl & 0x0f) * WORD_SIZE;
+  mbuf->ol_flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+  ip_header->hdr_checksum = 0;
+
+  // The NIC expects the L4 checksum to be seeded with the pseudo-header one
+  if (ip_header->next_proto_id == IPPROTO_TCP) {
+    struct rte_tcp_hdr *tcp_header = (struct rte_tcp_hdr *)l4_header;
+    mbuf->ol_flags |= PKT_TX_TCP_CKSUM;
+    tcp_header->cksum = rte_ipv4_phdr_cksum(ip_header, mbuf->ol_flags);
+  } else if (ip_header->next_proto_id == IPPROTO_UDP) {
+    struct rte_udp_hdr *udp_header = (struct rte_udp_hdr *)l4_header;
+    mbuf->ol_flags |= PKT_TX_UDP_CKSUM;
+    udp_header->dgram_cksum = rte_ipv4_phdr_cksum(ip_header, mbuf->ol_flags);
+  }
+
+  return true;
+}
+#endif // NF_CHECKSUM_OFFLOAD && !KLEE_VERIFICATION
+
 uintmax_t nf_util_parse_int(const char *str, const char *name, int base,
                             char next) {
   char *temp;
@@ -100,6 +100,62 @@ bool nf_has_udp_header(struct rte_ipv4_hdr *header);
 void nf_set_rte_ipv4_udptcp_checksum(struct rte_ipv4_hdr *ip_header,
                                      void *l4_header, void *packet);
 
+// Incremental checksum update (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m').
+// Fields and checksums are both taken as stored in the packet, so no byte
+// swapping is needed.
+static inline uint16_t nf_checksum_fold(uint32_t sum) {
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+static inline uint16_t nf_checksum_update_16(uint16_t checksum,
+                                             uint16_t old_value,
+                                             uint16_t new_value) {
+  uint32_t sum = (uint16_t)~checksum;
+  sum += (uint16_t)~old_value;
+  sum += new_value;
+  return (uint16_t)~nf_checksum_fold(sum);
+}
+
+static inline uint16_t nf_checksum_update_32(uint16_t checksum,
+                                             uint32_t old_value,
+                                             uint32_t new_value) {
+  uint32_t sum = (uint16_t)~checksum;
+  sum += (uint16_t)~(old_value >> 16) + (uint16_t)~(old_value & 0xffff);
+  sum += (new_value >> 16) + (new_value & 0xffff);
+  return (uint16_t)~nf_checksum_fold(sum);
+}
+
+// Patches the IPv4 and TCP/UDP checksums after one address and one port of
+// the packet were rewritten from old_* to new_*, instead of recomputing them
+// over the whole payload like nf_set_rte_ipv4_udptcp_checksum.
+void nf_update_rte_ipv4_udptcp_checksum(struct rte_ipv4_hdr *ip_header,
+                                        void *l4_header, uint32_t old_addr,
+                                        uint32_t new_addr, uint16_t old_port,
+                                        uint16_t new_port, void *packet);
+
+// With -DNF_CHECKSUM_OFFLOAD, devices advertising IPv4 and TCP/UDP checksum
+// offload get it enabled at configuration time, and
+// nf_offload_rte_ipv4_udptcp_checksum hands the checksums of packets sent
+// through them to the NIC. It returns false when the device cannot offload,
+// in which case the checksums must be updated in software.
+#if defined(NF_CHECKSUM_OFFLOAD) && !defined(KLEE_VERIFICATION)
+void nf_checksum_offload_configure(uint16_t device, struct rte_eth_conf *conf);
+bool nf_offload_rte_ipv4_udptcp_checksum(uint16_t device, struct rte_mbuf *mbuf,
+                                         struct rte_ipv4_hdr *ip_header,
+                                         void *l4_header);
+#else  // NF_CHECKSUM_OFFLOAD && !KLEE_VERIFICATION
+static inline void nf_checksum_offload_configure(uint16_t device,
+                                                 struct rte_eth_conf *conf) {}
+static inline bool
+nf_offload_rte_ipv4_udptcp_checksum(uint16_t device, struct rte_mbuf *mbuf,
+                                    struct rte_ipv4_hdr *ip_header,
+                                    void *l4_header) {
+  return false;
+}
+#endif // NF_CHECKSUM_OFFLOAD && !KLEE_VERIFICATION
+
 uintmax_t nf_util_parse_int(const char *str, const char *name, int base,
                             char next);
 
@@ -108,8 +164,16 @@ char *nf_mac_to_str(struct rte_ether_addr *addr);
 char *nf_rte_ipv4_to_str(uint32_t addr);
 
 #define MAX_N_CHUNKS 100
+#ifdef NF_MULTICORE
+// Every core borrows chunks from the packet it is processing
+RTE_DECLARE_PER_LCORE(void *[MAX_N_CHUNKS], chunks_borrowed);
+RTE_DECLARE_PER_LCORE(size_t, chunks_borrowed_num);
+#define chunks_borrowed RTE_PER_LCORE(chunks_borrowed)
+#define chunks_borrowed_num RTE_PER_LCORE(chunks_borrowed_num)
+#else  // NF_MULTICORE
 extern void *chunks_borrowed[];
 extern size_t chunks_borrowed_num;
+#endif // NF_MULTICORE
 
 static inline void *nf_borrow_next_chunk(uint8_t **p, size_t length) {
   assert(chunks_borrowed_num < MAX_N_CHUNKS);
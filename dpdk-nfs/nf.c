@@ -10,6 +10,10 @@
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
 
+#ifdef NF_MULTICORE
+#include <rte_ring.h>
+#endif // NF_MULTICORE
+
 #include "lib/verified/boilerplate-util.h"
 #include "lib/verified/packet-io.h"
 #include "nf-log.h"
@@ -76,6 +80,19 @@ static const uint16_t TX_QUEUE_SIZE = 1024;
 // Buffer count for mempools
 static const unsigned MEMPOOL_BUFFER_COUNT = 2048;
 
+#ifdef NF_MULTICORE
+// Unverified multi-core mode, see nf.h
+#define NF_MULTICORE_BURST 32
+#define NF_REDIRECT_RING_SIZE 1024
+#define NF_MBUF_CACHE_SIZE 256
+
+static struct rte_ring *redirect_rings[RTE_MAX_LCORE];
+
+unsigned nf_core(void) { return rte_lcore_index(rte_lcore_id()); }
+
+unsigned nf_cores(void) { return rte_lcore_count(); }
+#endif // NF_MULTICORE
+
 // Send the given packet to all devices except the packet's own
 void flood(struct rte_mbuf *packet, uint16_t nb_devices) {
   rte_mbuf_refcnt_set(packet, nb_devices - 1);
@@ -94,6 +111,67 @@ void flood(struct rte_mbuf *packet, uint16_t nb_devices) {
   }
 }
 
+#if VIGOR_BATCH_SIZE != 1 || defined(NF_MULTICORE)
+// Unverified batched TX: packets are queued per output device while a burst
+// is processed, and each device is flushed once at the end of the burst.
+// Every queued entry owns one reference to its mbuf, so a flood queues the
+// same mbuf on several devices instead of transmitting it once per device.
+#define TX_BUFFER_SIZE 32
+
+struct tx_buffer {
+  uint16_t count;
+  struct rte_mbuf *mbufs[TX_BUFFER_SIZE];
+};
+
+static void tx_buffer_flush(struct tx_buffer *buffer, uint16_t device,
+                            uint16_t queue) {
+  if (buffer->count == 0) {
+    return;
+  }
+
+  uint16_t sent_count =
+      rte_eth_tx_burst(device, queue, buffer->mbufs, buffer->count);
+  // should not happen, but drop the reference held by every entry the device
+  // did not take; the mbuf itself goes away with its last reference
+  for (uint16_t n = sent_count; n < buffer->count; n++) {
+    rte_pktmbuf_free(buffer->mbufs[n]);
+  }
+  buffer->count = 0;
+}
+
+static inline void tx_buffer_push(struct tx_buffer *buffer, uint16_t device,
+                                  uint16_t queue, struct rte_mbuf *mbuf) {
+  if (buffer->count == TX_BUFFER_SIZE) {
+    tx_buffer_flush(buffer, device, queue);
+  }
+  buffer->mbufs[buffer->count++] = mbuf;
+}
+
+static void tx_buffers_flush(struct tx_buffer *buffers, uint16_t nb_devices,
+                             uint16_t queue) {
+  for (uint16_t device = 0; device < nb_devices; device++) {
+    tx_buffer_flush(&buffers[device], device, queue);
+  }
+}
+
+// Queue the given packet on all devices except the packet's own
+static void tx_buffers_flood(struct tx_buffer *buffers, uint16_t nb_devices,
+                             uint16_t queue, struct rte_mbuf *mbuf) {
+  if (nb_devices < 2) {
+    rte_pktmbuf_free(mbuf);
+    return;
+  }
+
+  // all references are taken before the first one can be transmitted
+  rte_mbuf_refcnt_set(mbuf, nb_devices - 1);
+  for (uint16_t device = 0; device < nb_devices; device++) {
+    if (device != mbuf->port) {
+      tx_buffer_push(&buffers[device], device, queue, mbuf);
+    }
+  }
+}
+#endif // VIGOR_BATCH_SIZE != 1 || NF_MULTICORE
+
 // Initializes the given device using the given memory pool
 static int nf_init_device(uint16_t device, struct rte_mempool *mbuf_pool) {
   int retval;
@@ -102,6 +180,35 @@ static int nf_init_device(uint16_t device, struct rte_mempool *mbuf_pool) {
   struct rte_eth_conf device_conf = { 0 };
   // device_conf.rxmode.hw_strip_crc = 1;
 
+  nf_checksum_offload_configure(device, &device_conf);
+
+#ifdef NF_MULTICORE
+  // One RX/TX queue pair per core, RX spread by RSS
+  const uint16_t num_queues = rte_lcore_count();
+  device_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+  device_conf.rx_adv_conf.rss_conf.rss_hf =
+      ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP;
+
+  retval = rte_eth_dev_configure(device, num_queues, num_queues, &device_conf);
+  if (retval != 0) {
+    return retval;
+  }
+
+  for (uint16_t queue = 0; queue < num_queues; queue++) {
+    retval = rte_eth_tx_queue_setup(device, queue, TX_QUEUE_SIZE,
+                                    rte_eth_dev_socket_id(device), NULL);
+    if (retval != 0) {
+      return retval;
+    }
+
+    retval = rte_eth_rx_queue_setup(device, queue, RX_QUEUE_SIZE,
+                                    rte_eth_dev_socket_id(device), NULL,
+                                    mbuf_pool);
+    if (retval != 0) {
+      return retval;
+    }
+  }
+#else  // NF_MULTICORE
   // Configure the device (1, 1 == number of RX/TX queues)
   retval = rte_eth_dev_configure(device, 1, 1, &device_conf);
   if (retval != 0) {
@@ -121,6 +228,7 @@ static int nf_init_device(uint16_t device, struct rte_mempool *mbuf_pool) {
   if (retval != 0) {
     return retval;
   }
+#endif // NF_MULTICORE
 
   // Start the device
   retval = rte_eth_dev_start(device);
@@ -137,6 +245,74 @@ static int nf_init_device(uint16_t device, struct rte_mempool *mbuf_pool) {
   return 0;
 }
 
+#ifdef NF_MULTICORE
+static void multicore_process(struct rte_mbuf *mbuf, uint16_t queue,
+                              uint16_t nb_devices,
+                              struct tx_buffer *tx_buffers) {
+  uint16_t device = mbuf->port;
+  uint8_t *data = rte_pktmbuf_mtod(mbuf, uint8_t *);
+  packet_state_total_length(data, &(mbuf->pkt_len));
+
+  uint16_t dst_device =
+      nf_process(device, &data, mbuf->pkt_len, current_time(), mbuf);
+  nf_return_all_chunks(data);
+
+  if (dst_device == device) {
+    rte_pktmbuf_free(mbuf);
+  } else if (dst_device == FLOOD_FRAME) {
+    tx_buffers_flood(tx_buffers, nb_devices, queue, mbuf);
+  } else {
+    tx_buffer_push(&tx_buffers[dst_device], dst_device, queue, mbuf);
+  }
+}
+
+// Every core polls its own queue on all devices, plus the ring where other
+// cores redirect the packets that belong to its share of the state.
+static int multicore_worker_main(void *unused) {
+  if (!nf_init()) {
+    rte_exit(EXIT_FAILURE, "Error initializing NF");
+  }
+
+  const uint16_t queue = nf_core();
+  const uint16_t nb_devices = rte_eth_dev_count_avail();
+  struct rte_mbuf *mbufs[NF_MULTICORE_BURST];
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
+  NF_INFO("Core %u forwarding packets on queue %" PRIu16 ".", rte_lcore_id(),
+          queue);
+
+  while (1) {
+    for (uint16_t device = 0; device < nb_devices; device++) {
+      uint16_t rx_count =
+          rte_eth_rx_burst(device, queue, mbufs, NF_MULTICORE_BURST);
+
+      for (uint16_t n = 0; n < rx_count; n++) {
+        unsigned owner = nf_owner_core(device, mbufs[n]);
+
+        if (owner == queue) {
+          multicore_process(mbufs[n], queue, nb_devices, tx_buffers);
+        } else if (rte_ring_enqueue(redirect_rings[owner], mbufs[n]) != 0) {
+          rte_pktmbuf_free(mbufs[n]);
+        }
+      }
+
+      tx_buffers_flush(tx_buffers, nb_devices, queue);
+    }
+
+    unsigned redirected = rte_ring_dequeue_burst(
+        redirect_rings[queue], (void **)mbufs, NF_MULTICORE_BURST, NULL);
+    for (unsigned n = 0; n < redirected; n++) {
+      multicore_process(mbufs[n], queue, nb_devices, tx_buffers);
+    }
+    tx_buffers_flush(tx_buffers, nb_devices, queue);
+
+    nf_quiescent();
+  }
+
+  return 0;
+}
+#endif // NF_MULTICORE
+
 // Main worker method (for now used on a single thread...)
 static void worker_main(void) {
   if (!nf_init()) {
@@ -178,13 +354,10 @@ static void worker_main(void) {
 
 #else // if VIGOR_BATCH_SIZE != 1
 
-  if (rte_eth_dev_count_avail() != 2) {
-    printf("We assume there will be exactly 2 devices for our simple batching "
-           "implementation.");
-    exit(1);
-  }
   NF_INFO("Running with batches, this code is unverified!");
 
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
   while (1) {
     unsigned VIGOR_DEVICES_COUNT = rte_eth_dev_count_avail();
     for (uint16_t VIGOR_DEVICE = 0; VIGOR_DEVICE < VIGOR_DEVICES_COUNT;
@@ -193,8 +366,6 @@ static void worker_main(void) {
       uint16_t rx_count =
           rte_eth_rx_burst(VIGOR_DEVICE, 0, mbufs, VIGOR_BATCH_SIZE);
 
-      struct rte_mbuf *mbufs_to_send[VIGOR_BATCH_SIZE];
-      uint16_t tx_count = 0;
       for (uint16_t n = 0; n < rx_count; n++) {
         uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
         packet_state_total_length(data, &(mbufs[n]->pkt_len));
@@ -205,20 +376,14 @@ static void worker_main(void) {
 
         if (dst_device == VIGOR_DEVICE) {
           rte_pktmbuf_free(mbufs[n]);
-        } else { // includes flood when 2 devices, which is equivalent to just
-                 // a
-                 // send
-          mbufs_to_send[tx_count] = mbufs[n];
-          tx_count++;
+        } else if (dst_device == FLOOD_FRAME) {
+          tx_buffers_flood(tx_buffers, VIGOR_DEVICES_COUNT, 0, mbufs[n]);
+        } else {
+          tx_buffer_push(&tx_buffers[dst_device], dst_device, 0, mbufs[n]);
         }
       }
 
-      uint16_t sent_count =
-          rte_eth_tx_burst(1 - VIGOR_DEVICE, 0, mbufs_to_send, tx_count);
-      for (uint16_t n = sent_count; n < tx_count; n++) {
-        rte_pktmbuf_free(mbufs[n]); // should not happen, but we're in the
-                                    // unverified case anyway
-      }
+      tx_buffers_flush(tx_buffers, VIGOR_DEVICES_COUNT, 0);
     }
   }
 #endif
@@ -240,6 +405,16 @@ int main(int argc, char **argv) {
 
   // Create a memory pool
   unsigned nb_devices = rte_eth_dev_count_avail();
+#ifdef NF_MULTICORE
+  struct rte_mempool *mbuf_pool = rte_pktmbuf_pool_create(
+      "MEMPOOL",                                             // name
+      MEMPOOL_BUFFER_COUNT * nb_devices * rte_lcore_count(), // #elements
+      NF_MBUF_CACHE_SIZE,        // cache size (per-core)
+      0,                         // application private area size
+      RTE_MBUF_DEFAULT_BUF_SIZE, // data buffer size
+      rte_socket_id()            // socket ID
+  );
+#else  // NF_MULTICORE
   struct rte_mempool *mbuf_pool = rte_pktmbuf_pool_create(
       "MEMPOOL",                         // name
       MEMPOOL_BUFFER_COUNT * nb_devices, // #elements
@@ -248,6 +423,7 @@ int main(int argc, char **argv) {
       RTE_MBUF_DEFAULT_BUF_SIZE, // data buffer size
       rte_socket_id()            // socket ID
   );
+#endif // NF_MULTICORE
   if (mbuf_pool == NULL) {
     rte_exit(EXIT_FAILURE, "Cannot create pool: %s\n", rte_strerror(rte_errno));
   }
@@ -262,8 +438,30 @@ int main(int argc, char **argv) {
     }
   }
 
+#ifdef NF_MULTICORE
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    char ring_name[RTE_RING_NAMESIZE];
+    unsigned core = rte_lcore_index(lcore_id);
+    snprintf(ring_name, sizeof(ring_name), "REDIRECT_%u", core);
+
+    // Any core may redirect to this one, only this one dequeues
+    redirect_rings[core] =
+        rte_ring_create(ring_name, NF_REDIRECT_RING_SIZE,
+                        rte_lcore_to_socket_id(lcore_id), RING_F_SC_DEQ);
+    if (redirect_rings[core] == NULL) {
+      rte_exit(EXIT_FAILURE, "Cannot create ring: %s\n",
+               rte_strerror(rte_errno));
+    }
+  }
+
+  // Run on every core, including this one
+  rte_eal_mp_remote_launch(multicore_worker_main, NULL, CALL_MASTER);
+  rte_eal_mp_wait_lcore();
+#else  // NF_MULTICORE
   // Run!
   worker_main();
+#endif // NF_MULTICORE
 
   return 0;
 }
@@ -18,6 +18,20 @@ void nf_config_init(int argc, char **argv);
 void nf_config_usage(void);
 void nf_config_print(void);
 
+#ifdef NF_MULTICORE
+// Unverified multi-core mode: every core runs nf_init, then processes its own
+// RX queue of every device (spread by RSS). nf_owner_core is called on each
+// received packet first; packets owned by another core are handed over to it
+// through a ring, so an NF can partition its state among the cores without
+// sharing any of it. NFs built with it must implement nf_owner_core, and
+// nf_quiescent, called by each core after every polling round, when it holds
+// no packet (even if it received none).
+unsigned nf_core(void);
+unsigned nf_cores(void);
+unsigned nf_owner_core(uint16_t device, struct rte_mbuf *mbuf);
+void nf_quiescent(void);
+#endif // NF_MULTICORE
+
 #ifdef KLEE_VERIFICATION
 void nf_loop_iteration_border(unsigned lcore_id, vigor_time_t time);
 #endif
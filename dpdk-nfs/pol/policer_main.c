@@ -14,15 +14,17 @@
 #include "lib/verified/map.h"
 #include "lib/verified/vector.h"
 #include "lib/verified/expirator.h"
+#include "lib/unverified/token-bucket.h"
 
 struct nf_config config;
 
 struct State *dynamic_ft;
 
+struct TokenBucketConfig bucket_config;
+vigor_time_t exp_time;
+
 int policer_expire_entries(vigor_time_t time) {
   assert(time >= 0); // we don't support the past
-  vigor_time_t exp_time =
-      VIGOR_TIME_SECONDS_MULTIPLIER * (config.burst / config.rate);
   uint64_t time_u = (uint64_t)time;
   // OK because time >= config.burst / config.rate >= 0
   vigor_time_t min_time = time_u - exp_time;
@@ -46,22 +48,8 @@ bool policer_check_tb(uint32_t dst, uint16_t size, vigor_time_t time) {
     assert(value->bucket_time >= 0);
     assert(value->bucket_time <= time_u);
     uint64_t time_diff = time_u - value->bucket_time;
-    if (time_diff <
-        config.burst * VIGOR_TIME_SECONDS_MULTIPLIER / config.rate) {
-      uint64_t added_tokens =
-          time_diff * config.rate / VIGOR_TIME_SECONDS_MULTIPLIER;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wtautological-compare"
-      vigor_note(0 <= time_diff * config.rate / VIGOR_TIME_SECONDS_MULTIPLIER);
-#pragma GCC diagnostic pop
-      assert(value->bucket_size <= config.burst);
-      value->bucket_size += added_tokens;
-      if (value->bucket_size > config.burst) {
-        value->bucket_size = config.burst;
-      }
-    } else {
-      value->bucket_size = config.burst;
-    }
+    value->bucket_size =
+        token_bucket_refill(&bucket_config, value->bucket_size, time_diff);
     value->bucket_time = time_u;
 
     bool fwd = false;
@@ -103,6 +91,12 @@ bool policer_check_tb(uint32_t dst, uint16_t size, vigor_time_t time) {
 }
 
 bool nf_init(void) {
+  if (!token_bucket_init(&bucket_config, config.rate, config.burst)) {
+    NF_INFO("Policer burst too large for its token buckets");
+    return false;
+  }
+  exp_time = VIGOR_TIME_SECONDS_MULTIPLIER * (config.burst / config.rate);
+
   unsigned capacity = config.dyn_capacity;
   dynamic_ft = alloc_state(capacity, rte_eth_dev_count_avail());
   return dynamic_ft != NULL;
@@ -65,6 +65,12 @@ function test_policer {
   sudo ip netns delete wan
 }
 
+TOKEN_BUCKET_TEST=$(mktemp)
+cc -O2 -I"$SCRIPT_DIR/.." -o "$TOKEN_BUCKET_TEST" \
+   "$SCRIPT_DIR/token-bucket-test.c"
+"$TOKEN_BUCKET_TEST"
+rm -f "$TOKEN_BUCKET_TEST"
+
 make clean
 make ADDITIONAL_FLAGS="-DSTOP_ON_RX_0 -g"
 
@@ -0,0 +1,103 @@
+// Randomized differential test of token_bucket_refill against the refill
+// the policer and HHH used to compute inline. Run by test.sh, or on its own:
+//   cc -O2 -I.. -o token-bucket-test token-bucket-test.c
+//   ./token-bucket-test [cases]
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib/unverified/token-bucket.h"
+
+#define DEFAULT_CASES 20000000ul
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+// xorshift64*, fixed seed so that failures are reproducible
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+// Uniform over [0, bound]
+static uint64_t rng_below(uint64_t bound) {
+  return bound == UINT64_MAX ? rng_next() : rng_next() % (bound + 1);
+}
+
+// Spread over every magnitude up to max, not only the largest ones
+static uint64_t rng_magnitude(uint64_t max) {
+  unsigned bits = 1 + rng_below(63);
+  uint64_t value = bits == 64 ? rng_next() : rng_next() & ((1ull << bits) - 1);
+  return value > max ? value % (max + 1) : value;
+}
+
+// The refill as policer_check_tb and HHH's update_buckets computed it
+static uint64_t old_refill(uint64_t rate, uint64_t burst, uint64_t size,
+                           uint64_t elapsed) {
+  if (elapsed < burst * VIGOR_TIME_SECONDS_MULTIPLIER / rate) {
+    uint64_t added_tokens = elapsed * rate / VIGOR_TIME_SECONDS_MULTIPLIER;
+    size += added_tokens;
+    if (size > burst) {
+      size = burst;
+    }
+  } else {
+    size = burst;
+  }
+  return size;
+}
+
+int main(int argc, char **argv) {
+  uint64_t cases = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_CASES;
+  uint64_t max_burst = UINT64_MAX / VIGOR_TIME_SECONDS_MULTIPLIER;
+
+  for (uint64_t n = 0; n < cases; n++) {
+    struct TokenBucketConfig config;
+    uint64_t rate = 1 + rng_magnitude(UINT64_MAX - 1);
+    uint64_t burst = rng_magnitude(max_burst);
+
+    if (!token_bucket_init(&config, rate, burst)) {
+      fprintf(stderr, "Refused rate %" PRIu64 " burst %" PRIu64 "\n", rate,
+              burst);
+      return 1;
+    }
+
+    uint64_t size = rng_below(burst);
+    // mostly up to the refill time, and right at it, where both branches meet
+    uint64_t elapsed;
+    switch (rng_below(3)) {
+    case 0:
+      elapsed = rng_magnitude(UINT64_MAX);
+      break;
+    case 1:
+      elapsed = rng_below(config.refill_time);
+      break;
+    default:
+      elapsed = config.refill_time - rng_below(config.refill_time > 0);
+      break;
+    }
+
+    uint64_t expected = old_refill(rate, burst, size, elapsed);
+    uint64_t actual = token_bucket_refill(&config, size, elapsed);
+
+    if (actual != expected || actual > burst) {
+      fprintf(stderr,
+              "Mismatch: rate %" PRIu64 " burst %" PRIu64 " size %" PRIu64
+              " elapsed %" PRIu64 ": expected %" PRIu64 ", got %" PRIu64 "\n",
+              rate, burst, size, elapsed, expected, actual);
+      return 1;
+    }
+  }
+
+  // burst * M overflowing and null rates are refused
+  struct TokenBucketConfig config;
+  if (token_bucket_init(&config, 1, max_burst + 1) ||
+      token_bucket_init(&config, 0, 1)) {
+    fprintf(stderr, "Accepted a config the refill cannot handle\n");
+    return 1;
+  }
+
+  printf("%" PRIu64 " token bucket refills match.\n", cases);
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #include <rte_byteorder.h>
@@ -37,6 +38,7 @@ void expire_entries(vigor_time_t time) {
                           last_time);
 }
 
+#ifdef KLEE_VERIFICATION
 int allocate(uint32_t src, uint16_t target_port, vigor_time_t time) {
   int index = -1;
   int port_index = -1;
@@ -142,6 +144,98 @@ int detect_port_scanning(uint32_t src, uint16_t target_port,
 
   return false;
 }
+#else  // KLEE_VERIFICATION
+static inline uint16_t *port_set(int index) {
+  return &state->port_sets[(size_t)index * (state->max_ports + 1)];
+}
+
+// Position of port in the sorted set, or where it should be inserted.
+static inline uint16_t port_set_position(uint16_t *set, uint16_t port) {
+  uint16_t *ports = set + 1;
+  uint16_t lo = 0;
+  uint16_t hi = set[0];
+
+  while (lo < hi) {
+    uint16_t mid = lo + (hi - lo) / 2;
+    if (ports[mid] < port) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+int allocate(uint32_t src, uint16_t target_port, vigor_time_t time) {
+  int index = -1;
+
+  int allocated = dchain_allocate_new_index(state->allocator, &index, time);
+
+  if (!allocated) {
+    // Nothing we can do...
+    NF_DEBUG("No more space in the Port Scanner Detector source table");
+    return false;
+  }
+
+  NF_DEBUG("Allocating %3u.%3u.%3u.%3u", (src >> 0) & 0xff, (src >> 8) & 0xff,
+           (src >> 16) & 0xff, (src >> 24) & 0xff);
+
+  uint32_t *src_key = NULL;
+  vector_borrow(state->srcs_key, index, (void **)&src_key);
+  *src_key = src;
+  map_put(state->srcs, src_key, index);
+  vector_return(state->srcs_key, index, src_key);
+
+  // Whatever the previous source left is simply overwritten.
+  uint16_t *set = port_set(index);
+  set[0] = 1;
+  set[1] = target_port;
+
+  return true;
+}
+
+// Return true if a port scanning is detected.
+int detect_port_scanning(uint32_t src, uint16_t target_port,
+                         vigor_time_t time) {
+  int index = -1;
+  int present = map_get(state->srcs, &src, &index);
+
+  if (!present) {
+    bool allocated = allocate(src, target_port, time);
+
+    if (!allocated) {
+      // Nothing we can do, the table is full...
+      NF_DEBUG("No more space");
+    }
+
+    return false;
+  }
+
+  dchain_rejuvenate_index(state->allocator, index, time);
+
+  uint16_t *set = port_set(index);
+  uint16_t count = set[0];
+  uint16_t position = port_set_position(set, target_port);
+
+  if (position < count && set[1 + position] == target_port) {
+    return false;
+  }
+
+  if (count >= state->max_ports) {
+    NF_DEBUG("Dropping   %3u.%3u.%3u.%3u", (src >> 0) & 0xff, (src >> 8) & 0xff,
+             (src >> 16) & 0xff, (src >> 24) & 0xff);
+    return true;
+  }
+
+  memmove(&set[2 + position], &set[1 + position],
+          (count - position) * sizeof(uint16_t));
+  set[1 + position] = target_port;
+  set[0] = count + 1;
+
+  return false;
+}
+#endif // KLEE_VERIFICATION
 
 int nf_process(uint16_t device, uint8_t **buffer, uint16_t packet_length,
                vigor_time_t now, struct rte_mbuf *mbuf) {
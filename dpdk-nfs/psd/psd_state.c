@@ -41,17 +41,20 @@ struct State *alloc_state(uint32_t capacity, uint64_t max_ports,
     return NULL;
   }
 
+#ifdef KLEE_VERIFICATION
   ret->touched_ports_counter = NULL;
   if (vector_allocate(sizeof(struct counter), capacity, counter_allocate,
                       &(ret->touched_ports_counter)) == 0) {
     return NULL;
   }
+#endif  // KLEE_VERIFICATION
 
   ret->allocator = NULL;
   if (dchain_allocate(capacity, &(ret->allocator)) == 0) {
     return NULL;
   }
 
+#ifdef KLEE_VERIFICATION
   if (map_allocate(touched_port_eq, touched_port_hash, capacity * max_ports,
                    &(ret->ports)) == 0) {
     return NULL;
@@ -62,7 +65,6 @@ struct State *alloc_state(uint32_t capacity, uint64_t max_ports,
     return NULL;
   }
 
-#ifdef KLEE_VERIFICATION
   map_set_layout(ret->srcs, ip_addr_descrs,
                  sizeof(ip_addr_descrs) / sizeof(ip_addr_descrs[0]),
                  ip_addr_nests,
@@ -88,6 +90,17 @@ struct State *alloc_state(uint32_t capacity, uint64_t max_ports,
       touched_port_nests,
       sizeof(touched_port_nests) / sizeof(touched_port_nests[0]),
       "TouchedPort");
+#else   // KLEE_VERIFICATION
+  // The count of a set is stored as one of its uint16_t
+  if (max_ports > UINT16_MAX) {
+    return NULL;
+  }
+
+  ret->port_sets = (uint16_t *)calloc((size_t)capacity * (max_ports + 1),
+                                      sizeof(uint16_t));
+  if (ret->port_sets == NULL) {
+    return NULL;
+  }
 #endif  // KLEE_VERIFICATION
 
   ret->capacity = capacity;
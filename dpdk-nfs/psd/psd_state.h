@@ -6,11 +6,17 @@
 struct State {
   struct Map *srcs;
   struct Vector *srcs_key;
-  struct Vector *touched_ports_counter;
   struct DoubleChain *allocator;
 
+#ifdef KLEE_VERIFICATION
+  struct Vector *touched_ports_counter;
   struct Map *ports;
   struct Vector *ports_key;
+#else  // KLEE_VERIFICATION
+  // Touched ports of the source at index i: port_sets[i * (max_ports + 1)]
+  // holds their count, followed by the ports themselves in ascending order.
+  uint16_t *port_sets;
+#endif // KLEE_VERIFICATION
 
   uint32_t capacity;
   uint32_t max_ports;
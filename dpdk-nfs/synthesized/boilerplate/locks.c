@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <netinet/in.h>
 
@@ -16,10 +17,14 @@
 #include <rte_eal.h>
 #include <rte_errno.h>
 #include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
 #include <rte_lcore.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_tcp.h>
 #include <rte_atomic.h>
+#include <rte_rwlock.h>
 
 /**********************************************
  *
@@ -30,6 +35,216 @@
 RTE_DEFINE_PER_LCORE(bool, write_attempt);
 RTE_DEFINE_PER_LCORE(bool, write_state);
 
+#ifdef LOCKS_PER_OBJECT
+// Instead of the global nf_lock, every libvig object carries its own
+// reader/writer lock. Objects are numbered in allocation order, which is the
+// canonical locking order: locks are always waited upon in increasing id
+// order, so two cores never wait on each other.
+//
+// A packet first runs taking read locks lazily, as objects are touched. A lock
+// that comes out of order is only tried; if that fails, everything held is
+// released and the whole set is taken again in order, and the packet is rerun.
+// Writes are suppressed in these runs: like with the global lock, they are
+// recorded and the packet is rerun in write state. Nothing was written yet, so
+// dropping the locks or rerunning is harmless.
+//
+// A run in write state must be all-or-nothing, since its writes (index
+// allocations, counters) cannot be repeated. It write locks, upfront and in
+// order, every object up to the highest one the previous runs touched, and
+// then extends that prefix of the canonical order as it touches objects past
+// it. Every lock it waits on is thus in order: it never drops its locks, never
+// suppresses a write and is never rerun. Vector cells, written through the
+// borrowed pointer, are covered too, as the NF only writes them in write state.
+// Writers only block the cores touching the objects of that prefix.
+#define OBJECT_LOCKS_MAX 64
+
+struct object_lock {
+  rte_rwlock_t lock;
+} __rte_cache_aligned;
+
+static struct object_lock object_locks[OBJECT_LOCKS_MAX];
+static rte_atomic32_t object_locks_count = RTE_ATOMIC32_INIT(0);
+
+// Bit i of each mask stands for the object with id i
+struct object_locks_held {
+  uint64_t locked;        // currently held by this lcore
+  uint64_t write_locked;  // currently held in write mode
+  uint64_t needed;        // touched during the last runs
+  bool restart;           // locks were dropped during the run
+};
+
+RTE_DEFINE_PER_LCORE(struct object_locks_held, object_locks_held);
+
+static int object_lock_register(unsigned *id_out) {
+  int id = rte_atomic32_add_return(&object_locks_count, 1) - 1;
+  if (id >= OBJECT_LOCKS_MAX) {
+    return 0;
+  }
+
+  rte_rwlock_init(&object_locks[id].lock);
+  *id_out = (unsigned)id;
+  return 1;
+}
+
+// Read locks, in order
+static void object_locks_acquire(struct object_locks_held *held,
+                                 uint64_t locks) {
+  for (uint64_t pending = locks; pending != 0; pending &= pending - 1) {
+    unsigned id = __builtin_ctzll(pending);
+    rte_rwlock_read_lock(&object_locks[id].lock);
+  }
+
+  held->locked = locks;
+  held->write_locked = 0;
+}
+
+// Write state only: write locks every object up to id, in order, on top of
+// the prefix already held
+static void object_locks_write_prefix(struct object_locks_held *held,
+                                      unsigned id) {
+  // bits 0 to id, 2 << 63 wraps to 0
+  uint64_t prefix = (2ull << id) - 1;
+
+  for (uint64_t pending = prefix & ~held->locked; pending != 0;
+       pending &= pending - 1) {
+    unsigned pending_id = __builtin_ctzll(pending);
+    rte_rwlock_write_lock(&object_locks[pending_id].lock);
+  }
+
+  held->locked |= prefix;
+  held->write_locked |= prefix;
+}
+
+static void object_locks_release(struct object_locks_held *held) {
+  for (uint64_t pending = held->locked; pending != 0;
+       pending &= pending - 1) {
+    unsigned id = __builtin_ctzll(pending);
+    if (held->write_locked & (1ull << id)) {
+      rte_rwlock_write_unlock(&object_locks[id].lock);
+    } else {
+      rte_rwlock_read_unlock(&object_locks[id].lock);
+    }
+  }
+
+  held->locked = 0;
+  held->write_locked = 0;
+}
+
+static inline void object_lock_read(unsigned id) {
+  struct object_locks_held *held = &RTE_PER_LCORE(object_locks_held);
+  uint64_t bit = 1ull << id;
+
+  if (held->locked & bit) {
+    return;
+  }
+
+  held->needed |= bit;
+
+  // unheld objects come after the prefix held in write state
+  if (RTE_PER_LCORE(write_state)) {
+    object_locks_write_prefix(held, id);
+    return;
+  }
+
+  // in canonical order, it is safe to wait
+  if ((held->locked >> id) == 0) {
+    rte_rwlock_read_lock(&object_locks[id].lock);
+    held->locked |= bit;
+    return;
+  }
+
+  if (rte_rwlock_read_trylock(&object_locks[id].lock) == 0) {
+    held->locked |= bit;
+    return;
+  }
+
+  // Waiting here could deadlock with a writer going in canonical order. What
+  // was read so far may change once the locks are dropped, hence the rerun.
+  uint64_t locks = held->locked | bit;
+  object_locks_release(held);
+  object_locks_acquire(held, locks);
+  held->restart = true;
+}
+
+// Writes are only allowed in write state, where the object is write locked
+static inline bool object_lock_write(unsigned id) {
+  object_lock_read(id);
+  return RTE_PER_LCORE(write_state);
+}
+
+#define NF_OBJECT_READ(object) object_lock_read((object)->lock_id)
+#define NF_OBJECT_MAY_WRITE(object) object_lock_write((object)->lock_id)
+#else
+// Set whenever the packet writes or attempts to, whatever the write state,
+// including through the cells it borrows from vectors (see below)
+RTE_DEFINE_PER_LCORE(bool, write_needed);
+
+static inline bool nf_lock_may_write(void) {
+  RTE_PER_LCORE(write_needed) = true;
+  return RTE_PER_LCORE(write_state);
+}
+
+// The NF writes vector cells through the borrowed pointer, and only checks the
+// write state to do so. In write state, borrowed cells are copied and compared
+// once returned, so that write_needed covers these writes too.
+#define VECTOR_WRITE_CHECKS 8
+#define VECTOR_WRITE_CHECK_SIZE 64
+
+struct vector_write_check {
+  void *cell;
+  int size;
+  char copy[VECTOR_WRITE_CHECK_SIZE];
+};
+
+struct vector_write_checks {
+  unsigned count;
+  struct vector_write_check checks[VECTOR_WRITE_CHECKS];
+};
+
+RTE_DEFINE_PER_LCORE(struct vector_write_checks, vector_write_checks);
+
+static inline void vector_write_check_borrow(void *cell, int size) {
+  if (!RTE_PER_LCORE(write_state) || RTE_PER_LCORE(write_needed)) {
+    return;
+  }
+
+  struct vector_write_checks *checks = &RTE_PER_LCORE(vector_write_checks);
+
+  // cannot tell, assume it is written
+  if (checks->count == VECTOR_WRITE_CHECKS ||
+      size > VECTOR_WRITE_CHECK_SIZE) {
+    RTE_PER_LCORE(write_needed) = true;
+    return;
+  }
+
+  struct vector_write_check *check = &checks->checks[checks->count++];
+  check->cell = cell;
+  check->size = size;
+  memcpy(check->copy, cell, size);
+}
+
+static inline void vector_write_check_return(void *cell) {
+  struct vector_write_checks *checks = &RTE_PER_LCORE(vector_write_checks);
+
+  for (unsigned i = checks->count; i-- > 0;) {
+    struct vector_write_check *check = &checks->checks[i];
+    if (check->cell != cell) {
+      continue;
+    }
+
+    if (memcmp(check->copy, cell, check->size) != 0) {
+      RTE_PER_LCORE(write_needed) = true;
+    }
+
+    *check = checks->checks[--checks->count];
+    return;
+  }
+}
+
+#define NF_OBJECT_READ(object)
+#define NF_OBJECT_MAY_WRITE(object) nf_lock_may_write()
+#endif // LOCKS_PER_OBJECT
+
 struct tcpudp_hdr {
   uint16_t src_port;
   uint16_t dst_port;
@@ -194,6 +409,9 @@ struct MapLocks {
   unsigned size;
   map_keys_equality *keys_eq;
   map_key_hash *khash;
+#ifdef LOCKS_PER_OBJECT
+  unsigned lock_id;
+#endif
 };
 
 int map_locks_allocate(map_keys_equality *keq, map_key_hash *khash,
@@ -260,12 +478,18 @@ int map_locks_allocate(map_keys_equality *keq, map_key_hash *khash,
   (*map_locks_out)->size = 0;
   (*map_locks_out)->keys_eq = keq;
   (*map_locks_out)->khash = khash;
+#ifdef LOCKS_PER_OBJECT
+  if (!object_lock_register(&(*map_locks_out)->lock_id)) {
+    return 0;
+  }
+#endif
   map_impl_init((*map_locks_out)->busybits, keq, (*map_locks_out)->keyps,
                 (*map_locks_out)->khs, (*map_locks_out)->chns,
                 (*map_locks_out)->vals, capacity);
   return 1;
 }
 int map_locks_get(struct MapLocks *map, void *key, int *value_out) {
+  NF_OBJECT_READ(map);
   map_key_hash *khash = map->khash;
   unsigned hash = khash(key);
   return map_impl_get(map->busybits, map->keyps, map->khs, map->chns, map->vals,
@@ -273,9 +497,8 @@ int map_locks_get(struct MapLocks *map, void *key, int *value_out) {
 }
 void map_locks_put(struct MapLocks *map, void *key, int value) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
-  if (!*write_state_ptr) {
+  if (!NF_OBJECT_MAY_WRITE(map)) {
     *write_attempt_ptr = true;
     return;
   }
@@ -288,9 +511,8 @@ void map_locks_put(struct MapLocks *map, void *key, int value) {
 }
 void map_locks_erase(struct MapLocks *map, void *key, void **trash) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
-  if (!*write_state_ptr) {
+  if (!NF_OBJECT_MAY_WRITE(map)) {
     *write_attempt_ptr = true;
     return;
   }
@@ -301,7 +523,10 @@ void map_locks_erase(struct MapLocks *map, void *key, void **trash) {
                  map->keys_eq, hash, map->capacity, trash);
   --map->size;
 }
-unsigned map_locks_size(struct MapLocks *map) { return map->size; }
+unsigned map_locks_size(struct MapLocks *map) {
+  NF_OBJECT_READ(map);
+  return map->size;
+}
 
 struct VectorLocks;
 
@@ -311,6 +536,9 @@ struct VectorLocks {
   char *data;
   int elem_size;
   unsigned capacity;
+#ifdef LOCKS_PER_OBJECT
+  unsigned lock_id;
+#endif
 };
 
 int vector_locks_allocate(int elem_size, unsigned capacity,
@@ -331,6 +559,11 @@ int vector_locks_allocate(int elem_size, unsigned capacity,
   (*vector_out)->data = data_alloc;
   (*vector_out)->elem_size = elem_size;
   (*vector_out)->capacity = capacity;
+#ifdef LOCKS_PER_OBJECT
+  if (!object_lock_register(&(*vector_out)->lock_id)) {
+    return 0;
+  }
+#endif
   for (unsigned i = 0; i < capacity; ++i) {
     init_elem((*vector_out)->data + elem_size * (int)i);
   }
@@ -338,9 +571,18 @@ int vector_locks_allocate(int elem_size, unsigned capacity,
 }
 void vector_locks_borrow(struct VectorLocks *vector, int index,
                          void **val_out) {
+  // write locked in write state, when the NF may write the cell
+  NF_OBJECT_READ(vector);
   *val_out = vector->data + index * vector->elem_size;
+#ifndef LOCKS_PER_OBJECT
+  vector_write_check_borrow(*val_out, vector->elem_size);
+#endif
+}
+void vector_locks_return(struct VectorLocks *vector, int index, void *value) {
+#ifndef LOCKS_PER_OBJECT
+  vector_write_check_return(value);
+#endif
 }
-void vector_locks_return(struct VectorLocks *vector, int index, void *value) {}
 
 struct dchain_locks_cell {
   int prev;
@@ -657,6 +899,9 @@ struct DoubleChainLocks {
   struct dchain_locks_cell *active_cells[RTE_MAX_LCORE];
   vigor_time_t *timestamps[RTE_MAX_LCORE];
   int range;
+#ifdef LOCKS_PER_OBJECT
+  unsigned lock_id;
+#endif
 };
 
 int dchain_locks_allocate(int index_range,
@@ -715,15 +960,20 @@ int dchain_locks_allocate(int index_range,
     dchain_locks_impl_init((*chain_out)->cells[lcore_id], index_range);
   }
 
+#ifdef LOCKS_PER_OBJECT
+  if (!object_lock_register(&(*chain_out)->lock_id)) {
+    return 0;
+  }
+#endif
+
   return 1;
 }
 
 int dchain_locks_allocate_new_index(struct DoubleChainLocks *chain,
                                     int *index_out, vigor_time_t time) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
-  if (!*write_state_ptr) {
+  if (!NF_OBJECT_MAY_WRITE(chain)) {
     *write_attempt_ptr = true;
     return 1;
   }
@@ -749,6 +999,7 @@ int dchain_locks_allocate_new_index(struct DoubleChainLocks *chain,
 
 int dchain_locks_rejuvenate_index(struct DoubleChainLocks *chain, int index,
                                   vigor_time_t time) {
+  NF_OBJECT_READ(chain);
   unsigned int lcore_id = rte_lcore_id();
   int ret = dchain_locks_impl_rejuvenate_index(chain->cells[lcore_id], index);
 
@@ -797,9 +1048,8 @@ int dchain_locks_update_timestamp(struct DoubleChainLocks *chain, int index,
 
 int dchain_locks_free_index(struct DoubleChainLocks *chain, int index) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
-  if (!*write_state_ptr) {
+  if (!NF_OBJECT_MAY_WRITE(chain)) {
     *write_attempt_ptr = true;
     return 1;
   }
@@ -820,8 +1070,8 @@ int dchain_locks_free_index(struct DoubleChainLocks *chain, int index) {
 int dchain_locks_expire_one_index(struct DoubleChainLocks *chain,
                                   int *index_out, vigor_time_t time) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
+  NF_OBJECT_READ(chain);
   unsigned int this_lcore_id = rte_lcore_id();
 
   int has_ind = dchain_locks_impl_get_oldest_index(
@@ -829,7 +1079,7 @@ int dchain_locks_expire_one_index(struct DoubleChainLocks *chain,
 
   if (has_ind && chain->timestamps[this_lcore_id][*index_out] > -1 &&
       chain->timestamps[this_lcore_id][*index_out] < time) {
-    if (!*write_state_ptr) {
+    if (!NF_OBJECT_MAY_WRITE(chain)) {
       *write_attempt_ptr = true;
       return 1;
     }
@@ -853,6 +1103,7 @@ int dchain_locks_expire_one_index(struct DoubleChainLocks *chain,
 }
 
 int dchain_locks_is_index_allocated(struct DoubleChainLocks *chain, int index) {
+  NF_OBJECT_READ(chain);
   return dchain_locks_impl_is_index_allocated(chain->cells[rte_lcore_id()],
                                               index);
 }
@@ -864,13 +1115,12 @@ int expire_items_single_map_locks(struct DoubleChainLocks *chain,
                                   struct VectorLocks *vector,
                                   struct MapLocks *map, vigor_time_t time) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
   int count = 0;
   int index = -1;
 
   while (dchain_locks_expire_one_index(chain, &index, time)) {
-    if (!*write_state_ptr) {
+    if (!NF_OBJECT_MAY_WRITE(map)) {
       *write_attempt_ptr = true;
       return 1;
     }
@@ -903,17 +1153,20 @@ static const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
   0xceee91e5, 0x1d4c6b18, 0x2a80e6df, 0x396f4d23,
 };
 
+// Each lcore expires buckets against its own cutoff, so that expiring does
+// not write shared memory on every packet.
 struct internal_data {
   unsigned hashes[SKETCH_HASHES];
-  int present[SKETCH_HASHES];
-  int buckets_indexes[SKETCH_HASHES];
+  vigor_time_t cutoff;
 } __attribute__((aligned(64)));
 
+struct sketch_bucket {
+  vigor_time_t touched;
+  uint32_t value;
+};
+
 struct SketchLocks {
-  struct MapLocks *clients;
-  struct VectorLocks *keys;
-  struct VectorLocks *buckets;
-  struct DoubleChainLocks *allocators[SKETCH_HASHES];
+  struct sketch_bucket *buckets;
 
   uint32_t capacity;
   uint16_t threshold;
@@ -921,229 +1174,163 @@ struct SketchLocks {
   map_key_hash *kh;
 
   struct internal_data internal[RTE_MAX_LCORE];
+#ifdef LOCKS_PER_OBJECT
+  unsigned lock_id;
+#endif
 };
 
-struct hash {
-  uint32_t value;
-};
-
-struct bucket {
-  uint32_t value;
-};
-
-unsigned find_next_power_of_2_bigger_than(uint32_t d) {
-  assert(d <= 0x80000000);
-  unsigned n = 1;
-
-  while (n < d) {
-    n *= 2;
-  }
-
-  return n;
-}
-
-bool hash_eq(void *a, void *b) {
-  struct hash *id1 = (struct hash *)a;
-  struct hash *id2 = (struct hash *)b;
-
-  return (id1->value == id2->value);
-}
-
-void hash_allocate(void *obj) {
-  struct hash *id = (struct hash *)obj;
-  id->value = 0;
+static inline struct sketch_bucket *sketch_locks_bucket(
+    struct SketchLocks *sketch, unsigned lcore_id, int row) {
+  return &sketch->buckets[sketch->capacity * row +
+                          sketch->internal[lcore_id].hashes[row]];
 }
 
-unsigned hash_hash(void *obj) {
-  struct hash *id = (struct hash *)obj;
-
-  unsigned hash = 0;
-  hash = __builtin_ia32_crc32si(hash, id->value);
-  return hash;
+static inline bool sketch_locks_bucket_live(struct SketchLocks *sketch,
+                                            unsigned lcore_id,
+                                            struct sketch_bucket *bucket) {
+  return bucket->touched > -1 &&
+         bucket->touched >= sketch->internal[lcore_id].cutoff;
 }
 
-void bucket_allocate(void *obj) { (uintptr_t) obj; }
-
 int sketch_locks_allocate(map_key_hash *kh, uint32_t capacity,
                           uint16_t threshold, struct SketchLocks **sketch_out) {
   assert(SKETCH_HASHES <= SKETCH_SALTS_BANK_SIZE);
 
   struct SketchLocks *sketch_alloc =
-      (struct SketchLocks *)rte_malloc(NULL, sizeof(struct SketchLocks), 0);
+      (struct SketchLocks *)rte_malloc(NULL, sizeof(struct SketchLocks), 64);
   if (sketch_alloc == NULL) {
     return 0;
   }
 
+  struct sketch_bucket *buckets_alloc = (struct sketch_bucket *)rte_malloc(
+      NULL, sizeof(struct sketch_bucket) * capacity * SKETCH_HASHES, 64);
+  if (buckets_alloc == NULL) {
+    rte_free(sketch_alloc);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < capacity * SKETCH_HASHES; i++) {
+    buckets_alloc[i].touched = -1;
+    buckets_alloc[i].value = 0;
+  }
+
   (*sketch_out) = sketch_alloc;
 
+  (*sketch_out)->buckets = buckets_alloc;
   (*sketch_out)->capacity = capacity;
   (*sketch_out)->threshold = threshold;
   (*sketch_out)->kh = kh;
 
-  unsigned total_sketch_capacity =
-      find_next_power_of_2_bigger_than(capacity * SKETCH_HASHES);
-
-  (*sketch_out)->clients = NULL;
-  if (map_locks_allocate(hash_eq, hash_hash, total_sketch_capacity,
-                         &((*sketch_out)->clients)) == 0) {
-    return 0;
+  for (int i = 0; i < RTE_MAX_LCORE; i++) {
+    (*sketch_out)->internal[i].cutoff = 0;
   }
 
-  (*sketch_out)->keys = NULL;
-  if (vector_locks_allocate(sizeof(struct hash), total_sketch_capacity,
-                            hash_allocate, &((*sketch_out)->keys)) == 0) {
+#ifdef LOCKS_PER_OBJECT
+  if (!object_lock_register(&(*sketch_out)->lock_id)) {
     return 0;
   }
+#endif
 
-  (*sketch_out)->buckets = NULL;
-  if (vector_locks_allocate(sizeof(struct bucket), total_sketch_capacity,
-                            bucket_allocate, &((*sketch_out)->buckets)) == 0) {
-    return 0;
-  }
+  return 1;
+}
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    (*sketch_out)->allocators[i] = NULL;
-    if (dchain_locks_allocate(capacity, &((*sketch_out)->allocators[i])) == 0) {
-      return 0;
-    }
-  }
+// Mixes the client key hash into 64 bits (MurmurHash3 finalizer), from which
+// every row index is derived: row i uses h1 + i * h2 (Kirsch-Mitzenmacher),
+// mapped onto [0, capacity[ with a multiply-shift instead of a modulo.
+static inline uint64_t sketch_hash64(unsigned key_hash) {
+  uint64_t hash =
+      (((uint64_t)SKETCH_SALTS[1]) << 32 | SKETCH_SALTS[0]) ^ key_hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
 
-  return 1;
+static inline unsigned sketch_row_index(uint64_t hash, int row,
+                                        uint32_t capacity) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  uint32_t row_hash = h1 + (uint32_t)row * h2;
+  return (unsigned)(((uint64_t)row_hash * capacity) >> 32);
 }
 
 void sketch_locks_compute_hashes(struct SketchLocks *sketch, void *key) {
   unsigned int lcore_id = rte_lcore_id();
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal[lcore_id].buckets_indexes[i] = -1;
-    sketch->internal[lcore_id].present[i] = 0;
-    sketch->internal[lcore_id].hashes[i] = 0;
+  uint64_t hash = sketch_hash64(sketch->kh(key));
 
-    sketch->internal[lcore_id].hashes[i] = __builtin_ia32_crc32si(
-        sketch->internal[lcore_id].hashes[i], SKETCH_SALTS[i]);
-    sketch->internal[lcore_id].hashes[i] = __builtin_ia32_crc32si(
-        sketch->internal[lcore_id].hashes[i], sketch->kh(key));
-    sketch->internal[lcore_id].hashes[i] %= sketch->capacity;
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    sketch->internal[lcore_id].hashes[i] =
+        sketch_row_index(hash, i, sketch->capacity);
   }
 }
 
 void sketch_locks_refresh(struct SketchLocks *sketch, vigor_time_t now) {
   unsigned int lcore_id = rte_lcore_id();
+  bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
+
+  if (!NF_OBJECT_MAY_WRITE(sketch)) {
+    *write_attempt_ptr = true;
+    return;
+  }
 
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    map_locks_get(sketch->clients, &sketch->internal[lcore_id].hashes[i],
-                  &sketch->internal[lcore_id].buckets_indexes[i]);
-    dchain_locks_rejuvenate_index(sketch->allocators[i],
-                                  sketch->internal[lcore_id].buckets_indexes[i],
-                                  now);
+    struct sketch_bucket *bucket = sketch_locks_bucket(sketch, lcore_id, i);
+
+    if (sketch_locks_bucket_live(sketch, lcore_id, bucket)) {
+      bucket->touched = now;
+    }
   }
 }
 
 int sketch_locks_fetch(struct SketchLocks *sketch) {
   unsigned int lcore_id = rte_lcore_id();
 
-  int bucket_min_set = false;
-  uint32_t *buckets_values[SKETCH_HASHES];
-  uint32_t bucket_min = 0;
+  NF_OBJECT_READ(sketch);
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal[lcore_id].present[i] =
-        map_locks_get(sketch->clients, &sketch->internal[lcore_id].hashes[i],
-                      &sketch->internal[lcore_id].buckets_indexes[i]);
-
-    if (!sketch->internal[lcore_id].present[i]) {
-      continue;
-    }
+  uint32_t bucket_min = UINT32_MAX;
 
-    int offseted =
-        sketch->internal[lcore_id].buckets_indexes[i] + sketch->capacity * i;
-    vector_locks_borrow(sketch->buckets, offseted, (void **)&buckets_values[i]);
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    struct sketch_bucket *bucket = sketch_locks_bucket(sketch, lcore_id, i);
+    uint32_t value =
+        sketch_locks_bucket_live(sketch, lcore_id, bucket) ? bucket->value : 0;
 
-    if (!bucket_min_set || bucket_min > *buckets_values[i]) {
-      bucket_min = *buckets_values[i];
-      bucket_min_set = true;
+    if (bucket_min > value) {
+      bucket_min = value;
     }
-
-    vector_locks_return(sketch->buckets, offseted, buckets_values[i]);
   }
 
-  return bucket_min_set && bucket_min > sketch->threshold;
+  return bucket_min > sketch->threshold;
 }
 
 int sketch_locks_touch_buckets(struct SketchLocks *sketch, vigor_time_t now) {
   unsigned int lcore_id = rte_lcore_id();
-
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
-  if (!*write_state_ptr) {
+  if (!NF_OBJECT_MAY_WRITE(sketch)) {
     *write_attempt_ptr = true;
     return false;
   }
 
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    int bucket_index = -1;
-    int present = map_locks_get(
-        sketch->clients, &sketch->internal[lcore_id].hashes[i], &bucket_index);
+    struct sketch_bucket *bucket = sketch_locks_bucket(sketch, lcore_id, i);
 
-    if (!present) {
-      int allocated_client = dchain_locks_allocate_new_index(
-          sketch->allocators[i], &bucket_index, now);
-
-      if (!allocated_client) {
-        // Sketch size limit reached.
-        return false;
-      }
-
-      int offseted = bucket_index + sketch->capacity * i;
-
-      uint32_t *saved_hash = 0;
-      uint32_t *saved_bucket = 0;
-
-      vector_locks_borrow(sketch->keys, offseted, (void **)&saved_hash);
-      vector_locks_borrow(sketch->buckets, offseted, (void **)&saved_bucket);
-
-      (*saved_hash) = sketch->internal[lcore_id].hashes[i];
-      (*saved_bucket) = 0;
-      map_locks_put(sketch->clients, saved_hash, bucket_index);
-
-      vector_locks_return(sketch->keys, offseted, saved_hash);
-      vector_locks_return(sketch->buckets, offseted, saved_bucket);
+    if (sketch_locks_bucket_live(sketch, lcore_id, bucket)) {
+      bucket->value++;
     } else {
-      dchain_locks_rejuvenate_index(sketch->allocators[i], bucket_index, now);
-      uint32_t *bucket;
-      int offseted = bucket_index + sketch->capacity * i;
-      vector_locks_borrow(sketch->buckets, offseted, (void **)&bucket);
-      (*bucket)++;
-      vector_locks_return(sketch->buckets, offseted, bucket);
+      bucket->value = 0;
     }
+
+    bucket->touched = now;
   }
 
   return true;
 }
 
 void sketch_locks_expire(struct SketchLocks *sketch, vigor_time_t time) {
-  bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
-
-  int offset = 0;
-  int index = -1;
-
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    offset = i * sketch->capacity;
-
-    while (dchain_locks_expire_one_index(sketch->allocators[i], &index, time)) {
-      if (!*write_state_ptr) {
-        *write_attempt_ptr = true;
-        return;
-      }
-
-      void *key;
-      vector_locks_borrow(sketch->keys, index + offset, &key);
-      map_locks_erase(sketch->clients, key, &key);
-      vector_locks_return(sketch->keys, index + offset, key);
-    }
-  }
+  sketch->internal[rte_lcore_id()].cutoff = time;
 }
 
 #define MAX_CHT_HEIGHT 40000
@@ -1261,9 +1448,8 @@ int expire_items_single_map_iteratively_locks(struct VectorLocks *vector,
                                               struct MapLocks *map, int start,
                                               int n_elems) {
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
-  bool *write_state_ptr = &RTE_PER_LCORE(write_state);
 
-  if (n_elems != 0 && !*write_state_ptr) {
+  if (n_elems != 0 && !NF_OBJECT_MAY_WRITE(map)) {
     *write_attempt_ptr = true;
     return 1;
   }
@@ -1573,22 +1759,56 @@ static const uint16_t TX_QUEUE_SIZE = 1024;
 // Buffer count for mempools
 static const unsigned MEMPOOL_BUFFER_COUNT = 2048;
 
-// Send the given packet to all devices except the packet's own
-void flood(struct rte_mbuf *packet, uint16_t nb_devices, uint16_t queue_id) {
+// Packets are queued per output device while a burst is processed, and each
+// device is flushed once at the end of the burst. Every queued entry owns one
+// reference to its mbuf, so a flood queues the same mbuf on several devices.
+#define TX_BUFFER_SIZE VIGOR_BATCH_SIZE
+
+struct tx_buffer {
+  uint16_t count;
+  struct rte_mbuf *mbufs[TX_BUFFER_SIZE];
+};
+
+static void tx_buffer_flush(struct tx_buffer *buffer, uint16_t device,
+                            uint16_t queue_id) {
+  if (buffer->count == 0) {
+    return;
+  }
+
+  uint16_t sent_count =
+      rte_eth_tx_burst(device, queue_id, buffer->mbufs, buffer->count);
+  // should not happen, but drop the reference held by every entry the device
+  // did not take; the mbuf itself goes away with its last reference
+  for (uint16_t n = sent_count; n < buffer->count; n++) {
+    rte_pktmbuf_free(buffer->mbufs[n]);
+  }
+  buffer->count = 0;
+}
+
+static inline void tx_buffer_push(struct tx_buffer *buffer, uint16_t device,
+                                  uint16_t queue_id, struct rte_mbuf *packet) {
+  if (buffer->count == TX_BUFFER_SIZE) {
+    tx_buffer_flush(buffer, device, queue_id);
+  }
+  buffer->mbufs[buffer->count++] = packet;
+}
+
+// Queue the given packet on all devices except the packet's own
+void flood(struct rte_mbuf *packet, uint16_t nb_devices,
+           struct tx_buffer *tx_buffers, uint16_t queue_id) {
+  if (nb_devices < 2) {
+    rte_pktmbuf_free(packet);
+    return;
+  }
+
+  // all references are taken before the first one can be transmitted
   rte_mbuf_refcnt_set(packet, nb_devices - 1);
-  int total_sent = 0;
   uint16_t skip_device = packet->port;
   for (uint16_t device = 0; device < nb_devices; device++) {
     if (device != skip_device) {
-      total_sent += rte_eth_tx_burst(device, queue_id, &packet, 1);
+      tx_buffer_push(&tx_buffers[device], device, queue_id, packet);
     }
   }
-  // should not happen, but in case we couldn't transmit, ensure the packet is
-  // freed
-  if (total_sent != nb_devices - 1) {
-    rte_mbuf_refcnt_set(packet, 1);
-    rte_pktmbuf_free(packet);
-  }
 }
 
 // Initializes the given device using the given memory pool
@@ -1648,6 +1868,157 @@ static int nf_init_device(uint16_t device, struct rte_mempool **mbuf_pools) {
   return 0;
 }
 
+#ifndef LOCKS_PER_OBJECT
+// Packets predicted to write take the write lock upfront, instead of running
+// once under the read token only to run again under the write lock. Packets
+// are classified by input device, IPv4 protocol, TCP SYN/FIN/RST flags and
+// whether their flow was recently seen by this core, and every class has a
+// 2-bit saturating counter trained with what packets actually did, libvig
+// and vector cell writes alike (see write_needed). A
+// mispredicted writer still falls back to the rerun; a mispredicted reader
+// only costs a needless write lock.
+#define WRITE_PREDICTOR_CLASSES 256
+#define WRITE_PREDICTOR_FLOWS 4096
+#define WRITE_PREDICTOR_REPORT_PERIOD (10 * 1000000000l) // ns
+
+struct write_predictor {
+  uint8_t counters[WRITE_PREDICTOR_CLASSES];
+  uint32_t flows[WRITE_PREDICTOR_FLOWS];
+  uint64_t hits;
+  uint64_t misses;
+} __rte_cache_aligned;
+
+static struct write_predictor write_predictors[RTE_MAX_LCORE];
+
+static unsigned write_predictor_class(struct write_predictor *predictor,
+                                      struct rte_mbuf *packet,
+                                      uint32_t *flow_out) {
+  uint8_t *data = rte_pktmbuf_mtod(packet, uint8_t *);
+  uint32_t key = packet->port;
+  uint32_t flow = 0;
+
+  struct rte_ether_hdr *ether_hdr = (struct rte_ether_hdr *)data;
+  size_t l3_offset = sizeof(struct rte_ether_hdr);
+
+  if (packet->pkt_len >= l3_offset + sizeof(struct rte_ipv4_hdr) &&
+      ether_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+    struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)(data + l3_offset);
+    size_t l4_offset = l3_offset + (ipv4_hdr->version_ihl & 0x0f) * 4;
+
+    key = key << 8 | ipv4_hdr->next_proto_id;
+    flow = __builtin_ia32_crc32si(flow, ipv4_hdr->src_addr);
+    flow = __builtin_ia32_crc32si(flow, ipv4_hdr->dst_addr);
+
+    if ((ipv4_hdr->next_proto_id == IPPROTO_TCP ||
+         ipv4_hdr->next_proto_id == IPPROTO_UDP) &&
+        packet->pkt_len >= l4_offset + sizeof(struct tcpudp_hdr)) {
+      struct tcpudp_hdr *tcpudp_hdr = (struct tcpudp_hdr *)(data + l4_offset);
+      flow = __builtin_ia32_crc32si(
+          flow, (uint32_t)tcpudp_hdr->src_port << 16 | tcpudp_hdr->dst_port);
+    }
+
+    if (ipv4_hdr->next_proto_id == IPPROTO_TCP &&
+        packet->pkt_len >= l4_offset + sizeof(struct rte_tcp_hdr)) {
+      struct rte_tcp_hdr *tcp_hdr = (struct rte_tcp_hdr *)(data + l4_offset);
+      key = key << 3 |
+            (tcp_hdr->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG |
+                                   RTE_TCP_RST_FLAG));
+    }
+  }
+
+  uint32_t *seen = &predictor->flows[flow % WRITE_PREDICTOR_FLOWS];
+  key = key << 1 | (*seen == flow);
+  *seen = flow;
+  *flow_out = flow;
+
+  return __builtin_ia32_crc32si(0, key) % WRITE_PREDICTOR_CLASSES;
+}
+
+static inline bool write_predictor_predict(struct write_predictor *predictor,
+                                           unsigned class) {
+  return predictor->counters[class] >= 2;
+}
+
+static inline void write_predictor_train(struct write_predictor *predictor,
+                                         unsigned class, bool predicted,
+                                         bool wrote) {
+  uint8_t *counter = &predictor->counters[class];
+
+  if (wrote && *counter < 3) {
+    (*counter)++;
+  } else if (!wrote && *counter > 0) {
+    (*counter)--;
+  }
+
+  if (predicted == wrote) {
+    predictor->hits++;
+  } else {
+    predictor->misses++;
+  }
+}
+
+void write_predictor_stats(uint64_t *hits, uint64_t *misses) {
+  *hits = 0;
+  *misses = 0;
+
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    *hits += write_predictors[lcore_id].hits;
+    *misses += write_predictors[lcore_id].misses;
+  }
+}
+
+static void write_predictor_report(void) {
+  uint64_t hits, misses;
+  write_predictor_stats(&hits, &misses);
+  printf("Write predictor: %" PRIu64 " hits, %" PRIu64 " misses\n", hits,
+         misses);
+}
+#endif // LOCKS_PER_OBJECT
+
+static inline void nf_send(struct rte_mbuf *packet, uint16_t dst_device,
+                           uint16_t nb_devices, struct tx_buffer *tx_buffers,
+                           uint16_t queue_id) {
+  if (dst_device == packet->port) {
+    rte_pktmbuf_free(packet);
+  } else if (dst_device == FLOOD_FRAME) {
+    flood(packet, nb_devices, tx_buffers, queue_id);
+  } else {
+    tx_buffer_push(&tx_buffers[dst_device], dst_device, queue_id, packet);
+  }
+}
+
+#ifndef LOCKS_PER_OBJECT
+// The read token is held across a burst instead of being taken per packet.
+// It is given back as soon as a writer waits for it, and at the latest after
+// READ_TOKEN_MAX_HOLD, so writers are not starved. Packets that want to write
+// are deferred to the end of the burst and processed together under a single
+// write lock; later packets of a deferred flow are deferred too, so a flow's
+// packets are still processed in order.
+#define READ_TOKEN_MAX_HOLD 10000 // ns
+
+struct deferred_packet {
+  struct rte_mbuf *mbuf;
+  uint32_t flow;
+  unsigned class;
+  bool predicted_write;
+};
+
+static inline bool flow_deferred(struct deferred_packet *deferred,
+                                 uint16_t nb_deferred, uint32_t flow) {
+  for (uint16_t i = 0; i < nb_deferred; i++) {
+    if (deferred[i].flow == flow) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline bool writer_waiting(nf_lock_t *nfl) {
+  return rte_atomic32_read(&nfl->write_token.atom) != 0;
+}
+#endif // LOCKS_PER_OBJECT
+
 static void worker_main(void) {
   const unsigned lcore_id = rte_lcore_id();
   const uint16_t queue_id = lcores_conf[lcore_id].queue_id;
@@ -1658,17 +2029,18 @@ static void worker_main(void) {
 
   bool *write_attempt_ptr = &RTE_PER_LCORE(write_attempt);
   bool *write_state_ptr = &RTE_PER_LCORE(write_state);
+#ifndef LOCKS_PER_OBJECT
+  bool *write_needed_ptr = &RTE_PER_LCORE(write_needed);
+  struct write_predictor *predictor = &write_predictors[lcore_id];
+  vigor_time_t last_report = current_time();
+#endif
 
   printf("Core %u forwarding packets.\n", rte_lcore_id());
 
-  if (rte_eth_dev_count_avail() != 2) {
-    printf(
-        "We assume there will be exactly 2 devices for our simple batching "
-        "implementation.");
-    exit(1);
-  }
   printf("Running with batches, this code is unverified!\n");
 
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
   while (1) {
     unsigned VIGOR_DEVICES_COUNT = rte_eth_dev_count_avail();
     for (uint16_t VIGOR_DEVICE = 0; VIGOR_DEVICE < VIGOR_DEVICES_COUNT;
@@ -1677,49 +2049,137 @@ static void worker_main(void) {
       uint16_t rx_count =
           rte_eth_rx_burst(VIGOR_DEVICE, queue_id, mbufs, VIGOR_BATCH_SIZE);
 
-      struct rte_mbuf *mbufs_to_send[VIGOR_BATCH_SIZE];
-      uint16_t tx_count = 0;
+#ifdef LOCKS_PER_OBJECT
       for (uint16_t n = 0; n < rx_count; n++) {
         uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
         vigor_time_t VIGOR_NOW = current_time();
 
-        *write_attempt_ptr = false;
+        struct object_locks_held *held = &RTE_PER_LCORE(object_locks_held);
+        held->needed = 0;
         *write_state_ptr = false;
 
-        nf_lock_block_writes(&nf_lock);
-        uint16_t dst_device =
-            nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
+        // the first run takes its locks as it goes, reruns take every lock
+        // the previous runs needed upfront, in order; the run in write state
+        // is the last one
+        uint16_t dst_device;
+        do {
+          *write_attempt_ptr = false;
+          held->restart = false;
+
+          if (!*write_state_ptr) {
+            object_locks_acquire(held, held->needed);
+          } else if (held->needed != 0) {
+            object_locks_write_prefix(held, 63 - __builtin_clzll(held->needed));
+          }
+
+          dst_device =
+              nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
+          object_locks_release(held);
+
+          if (*write_attempt_ptr) {
+            *write_state_ptr = true;
+          }
+        } while (*write_attempt_ptr || held->restart);
+
+        nf_send(mbufs[n], dst_device, VIGOR_DEVICES_COUNT, tx_buffers,
+                queue_id);
+      }
+#else
+      struct deferred_packet deferred[VIGOR_BATCH_SIZE];
+      uint16_t nb_deferred = 0;
+
+      bool read_token = false;
+      vigor_time_t read_token_since = 0;
+
+      for (uint16_t n = 0; n < rx_count; n++) {
+        uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
+        vigor_time_t VIGOR_NOW = current_time();
 
-        if (*write_attempt_ptr) {
-          *write_state_ptr = true;
+        // classified before nf_process gets to rewrite the headers
+        uint32_t flow;
+        unsigned class = write_predictor_class(predictor, mbufs[n], &flow);
+        bool predicted_write = write_predictor_predict(predictor, class);
+
+        if (!predicted_write && !flow_deferred(deferred, nb_deferred, flow)) {
+          if (read_token && (writer_waiting(&nf_lock) ||
+                             VIGOR_NOW - read_token_since >=
+                                 READ_TOKEN_MAX_HOLD)) {
+            nf_lock_allow_writes(&nf_lock);
+            read_token = false;
+          }
+
+          if (!read_token) {
+            nf_lock_block_writes(&nf_lock);
+            read_token = true;
+            read_token_since = VIGOR_NOW;
+          }
+
+          *write_attempt_ptr = false;
+          *write_needed_ptr = false;
+          *write_state_ptr = false;
 
-          nf_lock_write_lock(&nf_lock);
           uint16_t dst_device =
               nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
-          nf_lock_write_unlock(&nf_lock);
-        } else {
-          nf_lock_allow_writes(&nf_lock);
+
+          if (!*write_attempt_ptr) {
+            write_predictor_train(predictor, class, false, *write_needed_ptr);
+            nf_send(mbufs[n], dst_device, VIGOR_DEVICES_COUNT, tx_buffers,
+                    queue_id);
+            continue;
+          }
         }
 
-        if (dst_device == VIGOR_DEVICE) {
-          rte_pktmbuf_free(mbufs[n]);
-        } else if (dst_device == FLOOD_FRAME) {
-          flood(mbufs[n], VIGOR_DEVICES_COUNT, queue_id);
-        } else {  // includes flood when 2 devices, which is equivalent to just
-                  // a
-                  // send
-          mbufs_to_send[tx_count] = mbufs[n];
-          tx_count++;
+        deferred[nb_deferred].mbuf = mbufs[n];
+        deferred[nb_deferred].flow = flow;
+        deferred[nb_deferred].class = class;
+        deferred[nb_deferred].predicted_write = predicted_write;
+        nb_deferred++;
+      }
+
+      if (read_token) {
+        nf_lock_allow_writes(&nf_lock);
+      }
+
+      if (nb_deferred > 0) {
+        *write_state_ptr = true;
+        nf_lock_write_lock(&nf_lock);
+
+        for (uint16_t n = 0; n < nb_deferred; n++) {
+          struct rte_mbuf *mbuf = deferred[n].mbuf;
+          uint8_t *data = rte_pktmbuf_mtod(mbuf, uint8_t *);
+          vigor_time_t VIGOR_NOW = current_time();
+
+          *write_needed_ptr = false;
+          RTE_PER_LCORE(vector_write_checks).count = 0;
+
+          uint16_t dst_device =
+              nf_process(mbuf->port, data, mbuf->pkt_len, VIGOR_NOW);
+
+          write_predictor_train(predictor, deferred[n].class,
+                                deferred[n].predicted_write,
+                                *write_needed_ptr);
+          nf_send(mbuf, dst_device, VIGOR_DEVICES_COUNT, tx_buffers,
+                  queue_id);
         }
+
+        nf_lock_write_unlock(&nf_lock);
+      }
+#endif // LOCKS_PER_OBJECT
+
+      for (uint16_t device = 0; device < VIGOR_DEVICES_COUNT; device++) {
+        tx_buffer_flush(&tx_buffers[device], device, queue_id);
       }
+    }
 
-      uint16_t sent_count =
-          rte_eth_tx_burst(1 - VIGOR_DEVICE, queue_id, mbufs_to_send, tx_count);
-      for (uint16_t n = sent_count; n < tx_count; n++) {
-        rte_pktmbuf_free(mbufs[n]);  // should not happen, but we're in the
-                                     // unverified case anyway
+#ifndef LOCKS_PER_OBJECT
+    if (lcore_id == rte_get_master_lcore()) {
+      vigor_time_t now = current_time();
+      if (now - last_report >= WRITE_PREDICTOR_REPORT_PERIOD) {
+        write_predictor_report();
+        last_report = now;
       }
     }
+#endif // LOCKS_PER_OBJECT
   }
 }
 
@@ -0,0 +1,1666 @@
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <rte_byteorder.h>
+#include <rte_common.h>
+#include <rte_eal.h>
+#include <rte_errno.h>
+#include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_hash_crc.h>
+#include <rte_ip.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+/**********************************************
+ *
+ *                   LIBVIG
+ *
+ **********************************************/
+
+struct tcpudp_hdr {
+  uint16_t src_port;
+  uint16_t dst_port;
+} __attribute__((__packed__));
+
+#define AND &&
+#define vigor_time_t int64_t
+
+vigor_time_t current_time(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec * 1000000000ul + tp.tv_nsec;
+}
+
+typedef unsigned map_key_hash(void *k1);
+typedef bool map_keys_equality(void *k1, void *k2);
+
+struct Map {
+  int *busybits;
+  void **keyps;
+  unsigned *khs;
+  int *chns;
+  int *vals;
+  unsigned capacity;
+  unsigned size;
+  map_keys_equality *keys_eq;
+  map_key_hash *khash;
+};
+
+
+static unsigned loop(unsigned k, unsigned capacity) {
+  return k & (capacity - 1);
+}
+
+static int find_key(int* busybits, void** keyps,
+                                 unsigned* k_hashes, int* chns, void* keyp,
+                                 map_keys_equality* eq, unsigned key_hash,
+                                 unsigned capacity) {
+  unsigned start = loop(key_hash, capacity);
+  unsigned i = 0;
+  for (; i < capacity; ++i)  {
+    unsigned index = loop(start + i, capacity);
+    int bb = busybits[index];
+    unsigned kh = k_hashes[index];
+    int chn = chns[index];
+    void* kp = keyps[index];
+    if (bb != 0 && kh == key_hash) {
+      if (eq(kp, keyp)) {
+        return (int)index;
+      }
+    } else {
+      if (chn == 0) {
+        return -1;
+      }
+    }
+  }
+  
+  return -1;
+}
+
+static unsigned find_key_remove_chain(
+    int* busybits, void** keyps, unsigned* k_hashes, int* chns, void* keyp,
+    map_keys_equality* eq, unsigned key_hash, unsigned capacity,
+    void** keyp_out) {
+  unsigned i = 0;
+  unsigned start = loop(key_hash, capacity);
+  
+  for (; i < capacity; ++i) {
+    unsigned index = loop(start + i, capacity);
+    int bb = busybits[index];
+    unsigned kh = k_hashes[index];
+    int chn = chns[index];
+    void* kp = keyps[index];
+    if (bb != 0 && kh == key_hash) {
+      if (eq(kp, keyp)) {
+        busybits[index] = 0;
+        *keyp_out = keyps[index];
+        return index;
+      }
+    }
+	
+    chns[index] = chn - 1;
+  }
+
+  return -1;
+}
+
+static unsigned find_empty(int* busybits, int* chns,
+                                        unsigned start, unsigned capacity) {
+  unsigned i = 0;
+  for (; i < capacity; ++i) {
+    unsigned index = loop(start + i, capacity);
+    int bb = busybits[index];
+    if (0 == bb) {
+      return index;
+    }
+
+    int chn = chns[index];
+    chns[index] = chn + 1;
+  }
+  
+  return -1;
+}
+
+void map_impl_init(int* busybits, map_keys_equality* eq,
+                                void** keyps, unsigned* khs, int* chns,
+                                int* vals, unsigned capacity) {
+  (uintptr_t) eq;
+  (uintptr_t) keyps;
+  (uintptr_t) khs;
+  (uintptr_t) vals;
+
+  unsigned i = 0;
+  for (; i < capacity; ++i) {
+    busybits[i] = 0;
+    chns[i] = 0;
+  }
+}
+
+int map_impl_get(int* busybits, void** keyps, unsigned* k_hashes,
+                              int* chns, int* values, void* keyp,
+                              map_keys_equality* eq, unsigned hash, int* value,
+                              unsigned capacity) {
+  int index =
+      find_key(busybits, keyps, k_hashes, chns, keyp, eq, hash, capacity);
+  if (-1 == index) {
+    return 0;
+  }
+  
+  *value = values[index];
+  return 1;
+}
+
+void map_impl_put(int* busybits, void** keyps, unsigned* k_hashes,
+                               int* chns, int* values, void* keyp,
+                               unsigned hash, int value, unsigned capacity) {
+  unsigned start = loop(hash, capacity);
+  unsigned index = find_empty(busybits, chns, start, capacity);
+
+  busybits[index] = 1;
+  keyps[index] = keyp;
+  k_hashes[index] = hash;
+  values[index] = value;
+}
+
+void map_impl_erase(int* busybits, void** keyps,
+                                 unsigned* k_hashes, int* chns, void* keyp,
+                                 map_keys_equality* eq, unsigned hash,
+                                 unsigned capacity, void** keyp_out) {
+  find_key_remove_chain(busybits, keyps, k_hashes, chns, keyp, eq, hash,
+                        capacity, keyp_out);
+}
+
+unsigned map_impl_size(int* busybits, unsigned capacity) {
+  unsigned s = 0;
+  unsigned i = 0;
+  for (; i < capacity; ++i) {
+    if (busybits[i] != 0) {
+      ++s;
+    }
+  }
+  return s;
+}
+
+int map_allocate(map_keys_equality *keq, map_key_hash *khash, unsigned capacity,
+                 struct Map **map_out) {
+  struct Map *old_map_val = *map_out;
+  struct Map *map_alloc =
+      (struct Map *)rte_malloc(NULL, sizeof(struct Map), 64);
+  if (map_alloc == NULL)
+    return 0;
+  *map_out = (struct Map *)map_alloc;
+  int *bbs_alloc = (int *)rte_malloc(NULL, sizeof(int) * (int)capacity, 64);
+  if (bbs_alloc == NULL) {
+    rte_free(map_alloc);
+    *map_out = old_map_val;
+    return 0;
+  }
+  (*map_out)->busybits = bbs_alloc;
+  void **keyps_alloc =
+      (void **)rte_malloc(NULL, sizeof(void *) * (int)capacity, 64);
+  if (keyps_alloc == NULL) {
+    rte_free(bbs_alloc);
+    rte_free(map_alloc);
+    *map_out = old_map_val;
+    return 0;
+  }
+  (*map_out)->keyps = keyps_alloc;
+  unsigned *khs_alloc =
+      (unsigned *)rte_malloc(NULL, sizeof(unsigned) * (int)capacity, 64);
+  if (khs_alloc == NULL) {
+    rte_free(keyps_alloc);
+    rte_free(bbs_alloc);
+    rte_free(map_alloc);
+    *map_out = old_map_val;
+    return 0;
+  }
+  (*map_out)->khs = khs_alloc;
+  int *chns_alloc = (int *)rte_malloc(NULL, sizeof(int) * (int)capacity, 64);
+  if (chns_alloc == NULL) {
+    rte_free(khs_alloc);
+    rte_free(keyps_alloc);
+    rte_free(bbs_alloc);
+    rte_free(map_alloc);
+    *map_out = old_map_val;
+    return 0;
+  }
+  (*map_out)->chns = chns_alloc;
+  int *vals_alloc = (int *)rte_malloc(NULL, sizeof(int) * (int)capacity, 64);
+
+  if (vals_alloc == NULL) {
+    rte_free(chns_alloc);
+    rte_free(khs_alloc);
+    rte_free(keyps_alloc);
+    rte_free(bbs_alloc);
+    rte_free(map_alloc);
+    *map_out = old_map_val;
+    return 0;
+  }
+
+  (*map_out)->vals = vals_alloc;
+  (*map_out)->capacity = capacity;
+  (*map_out)->size = 0;
+  (*map_out)->keys_eq = keq;
+  (*map_out)->khash = khash;
+
+
+  map_impl_init((*map_out)->busybits, keq, (*map_out)->keyps, (*map_out)->khs,
+                (*map_out)->chns, (*map_out)->vals, capacity);
+  return 1;
+}
+
+int map_get(struct Map *map, void *key, int *value_out) {
+  map_key_hash *khash = map->khash;
+  unsigned hash = khash(key);
+  return map_impl_get(map->busybits, map->keyps, map->khs, map->chns, map->vals,
+                      key, map->keys_eq, hash, value_out, map->capacity);
+}
+
+void map_put(struct Map *map, void *key, int value) {
+  map_key_hash *khash = map->khash;
+  unsigned hash = khash(key);
+  map_impl_put(map->busybits, map->keyps, map->khs, map->chns, map->vals, key,
+               hash, value, map->capacity);
+  ++map->size;
+}
+
+void map_erase(struct Map *map, void *key, void **trash) {
+  map_key_hash *khash = map->khash;
+  unsigned hash = khash(key);
+  map_impl_erase(map->busybits, map->keyps, map->khs, map->chns, key,
+                 map->keys_eq, hash, map->capacity, trash);
+
+  --map->size;
+}
+
+unsigned map_size(struct Map *map) { return map->size; }
+
+// Makes sure the allocator structur fits into memory, and particularly into
+// 32 bit address space.
+#define IRANG_LIMIT (1048576)
+
+// kinda hacky, but makes the proof independent of vigor_time_t... sort of
+#define malloc_block_time malloc_block_llongs
+#define time_integer llong_integer
+#define times llongs
+
+#define DCHAIN_RESERVED (2)
+
+struct dchain_cell {
+  int prev;
+  int next;
+};
+
+struct DoubleChain {
+  struct dchain_cell *cells;
+  vigor_time_t *timestamps;
+};
+
+enum DCHAIN_ENUM {
+  ALLOC_LIST_HEAD = 0,
+  FREE_LIST_HEAD = 1,
+  INDEX_SHIFT = DCHAIN_RESERVED
+};
+
+void dchain_impl_init(struct dchain_cell *cells, int size) {
+  struct dchain_cell *al_head = cells + ALLOC_LIST_HEAD;
+  al_head->prev = 0;
+  al_head->next = 0;
+  int i = INDEX_SHIFT;
+
+  struct dchain_cell *fl_head = cells + FREE_LIST_HEAD;
+  fl_head->next = i;
+  fl_head->prev = fl_head->next;
+
+  while (i < (size + INDEX_SHIFT - 1)) {
+    struct dchain_cell *current = cells + i;
+    current->next = i + 1;
+    current->prev = current->next;
+
+    ++i;
+  }
+
+  struct dchain_cell *last = cells + i;
+  last->next = FREE_LIST_HEAD;
+  last->prev = last->next;
+}
+
+int dchain_impl_allocate_new_index(struct dchain_cell *cells, int *index) {
+  struct dchain_cell *fl_head = cells + FREE_LIST_HEAD;
+  struct dchain_cell *al_head = cells + ALLOC_LIST_HEAD;
+  int allocated = fl_head->next;
+  if (allocated == FREE_LIST_HEAD) {
+    return 0;
+  }
+
+  struct dchain_cell *allocp = cells + allocated;
+  // Extract the link from the "empty" chain.
+  fl_head->next = allocp->next;
+  fl_head->prev = fl_head->next;
+
+  // Add the link to the "new"-end "alloc" chain.
+  allocp->next = ALLOC_LIST_HEAD;
+  allocp->prev = al_head->prev;
+
+  struct dchain_cell *alloc_head_prevp = cells + al_head->prev;
+  alloc_head_prevp->next = allocated;
+  al_head->prev = allocated;
+
+  *index = allocated - INDEX_SHIFT;
+
+  return 1;
+}
+
+int dchain_impl_free_index(struct dchain_cell *cells, int index) {
+  int freed = index + INDEX_SHIFT;
+
+  struct dchain_cell *freedp = cells + freed;
+  int freed_prev = freedp->prev;
+  int freed_next = freedp->next;
+
+  // The index is already free.
+  if (freed_next == freed_prev) {
+    if (freed_prev != ALLOC_LIST_HEAD) {
+      return 0;
+    }
+  }
+
+  struct dchain_cell *fr_head = cells + FREE_LIST_HEAD;
+  struct dchain_cell *freed_prevp = cells + freed_prev;
+  freed_prevp->next = freed_next;
+
+  struct dchain_cell *freed_nextp = cells + freed_next;
+  freed_nextp->prev = freed_prev;
+
+  freedp->next = fr_head->next;
+  freedp->prev = freedp->next;
+
+  fr_head->next = freed;
+  fr_head->prev = fr_head->next;
+
+  return 1;
+}
+
+int dchain_impl_get_oldest_index(struct dchain_cell *cells, int *index) {
+  struct dchain_cell *al_head = cells + ALLOC_LIST_HEAD;
+
+  // No allocated indexes.
+  if (al_head->next == ALLOC_LIST_HEAD) {
+    return 0;
+  }
+
+  *index = al_head->next - INDEX_SHIFT;
+
+  return 1;
+}
+
+int dchain_impl_rejuvenate_index(struct dchain_cell *cells, int index) {
+  int lifted = index + INDEX_SHIFT;
+
+  struct dchain_cell *liftedp = cells + lifted;
+  int lifted_next = liftedp->next;
+  int lifted_prev = liftedp->prev;
+
+  if (lifted_next == lifted_prev) {
+    if (lifted_next != ALLOC_LIST_HEAD) {
+      return 0;
+    } else {
+      return 1;
+    }
+  }
+
+  struct dchain_cell *lifted_prevp = cells + lifted_prev;
+  lifted_prevp->next = lifted_next;
+
+  struct dchain_cell *lifted_nextp = cells + lifted_next;
+  lifted_nextp->prev = lifted_prev;
+
+  struct dchain_cell *al_head = cells + ALLOC_LIST_HEAD;
+  int al_head_prev = al_head->prev;
+
+  liftedp->next = ALLOC_LIST_HEAD;
+  liftedp->prev = al_head_prev;
+
+  struct dchain_cell *al_head_prevp = cells + al_head_prev;
+  al_head_prevp->next = lifted;
+
+  al_head->prev = lifted;
+  return 1;
+}
+
+int dchain_impl_is_index_allocated(struct dchain_cell *cells, int index) {
+  int lifted = index + INDEX_SHIFT;
+
+  struct dchain_cell *liftedp = cells + lifted;
+  int lifted_next = liftedp->next;
+  int lifted_prev = liftedp->prev;
+
+  int result;
+  if (lifted_next == lifted_prev) {
+    if (lifted_next != ALLOC_LIST_HEAD) {
+      return 0;
+    } else {
+      return 1;
+    }
+  } else {
+    return 1;
+  }
+}
+
+int dchain_allocate(int index_range, struct DoubleChain **chain_out) {
+
+  struct DoubleChain *old_chain_out = *chain_out;
+  struct DoubleChain *chain_alloc =
+      (struct DoubleChain *)rte_malloc(NULL, sizeof(struct DoubleChain), 64);
+  if (chain_alloc == NULL)
+    return 0;
+  *chain_out = (struct DoubleChain *)chain_alloc;
+
+  struct dchain_cell *cells_alloc = (struct dchain_cell *)rte_malloc(
+      NULL, sizeof(struct dchain_cell) * (index_range + DCHAIN_RESERVED), 64);
+  if (cells_alloc == NULL) {
+    rte_free(chain_alloc);
+    *chain_out = old_chain_out;
+    return 0;
+  }
+  (*chain_out)->cells = cells_alloc;
+
+  vigor_time_t *timestamps_alloc = (vigor_time_t *)rte_malloc(
+      NULL, sizeof(vigor_time_t) * (index_range), 64);
+  if (timestamps_alloc == NULL) {
+    rte_free((void *)cells_alloc);
+    rte_free(chain_alloc);
+    *chain_out = old_chain_out;
+    return 0;
+  }
+  (*chain_out)->timestamps = timestamps_alloc;
+
+
+  dchain_impl_init((*chain_out)->cells, index_range);
+
+  return 1;
+}
+
+int dchain_allocate_new_index(struct DoubleChain *chain, int *index_out,
+                              vigor_time_t time) {
+  int ret = dchain_impl_allocate_new_index(chain->cells, index_out);
+
+  if (ret) {
+    chain->timestamps[*index_out] = time;
+  }
+
+  return ret;
+}
+
+int dchain_rejuvenate_index(struct DoubleChain *chain, int index,
+                            vigor_time_t time) {
+  int ret = dchain_impl_rejuvenate_index(chain->cells, index);
+
+  if (ret) {
+    chain->timestamps[index] = time;
+  }
+
+  return ret;
+}
+
+int dchain_expire_one_index(struct DoubleChain *chain, int *index_out,
+                            vigor_time_t time) {
+  int has_ind = dchain_impl_get_oldest_index(chain->cells, index_out);
+
+  if (has_ind) {
+    if (chain->timestamps[*index_out] < time) {
+      int rez = dchain_impl_free_index(chain->cells, *index_out);
+      return rez;
+    }
+  }
+
+  return 0;
+}
+
+int dchain_is_index_allocated(struct DoubleChain *chain, int index) {
+  return dchain_impl_is_index_allocated(chain->cells, index);
+}
+
+int dchain_free_index(struct DoubleChain *chain, int index) {
+  return dchain_impl_free_index(chain->cells, index);
+}
+
+#define VECTOR_CAPACITY_UPPER_LIMIT 140000
+
+typedef void vector_init_elem(void *elem);
+
+struct Vector {
+  char *data;
+  int elem_size;
+  unsigned capacity;
+};
+
+int vector_allocate(int elem_size, unsigned capacity,
+                    vector_init_elem *init_elem, struct Vector **vector_out) {
+  struct Vector *old_vector_val = *vector_out;
+  struct Vector *vector_alloc =
+      (struct Vector *)rte_malloc(NULL, sizeof(struct Vector), 64);
+  if (vector_alloc == 0)
+    return 0;
+  *vector_out = (struct Vector *)vector_alloc;
+
+  char *data_alloc =
+      (char *)rte_malloc(NULL, (uint32_t)elem_size * capacity, 64);
+  if (data_alloc == 0) {
+    rte_free(vector_alloc);
+    *vector_out = old_vector_val;
+    return 0;
+  }
+  (*vector_out)->data = data_alloc;
+  (*vector_out)->elem_size = elem_size;
+  (*vector_out)->capacity = capacity;
+
+  for (unsigned i = 0; i < capacity; ++i) {
+    init_elem((*vector_out)->data + elem_size * (int)i);
+  }
+
+
+  return 1;
+}
+
+void vector_borrow(struct Vector *vector, int index, void **val_out) {
+  *val_out = vector->data + index * vector->elem_size;
+}
+
+void vector_return(struct Vector *vector, int index, void *value) {}
+
+int expire_items_single_map(struct DoubleChain *chain, struct Vector *vector,
+                            struct Map *map, vigor_time_t time) {
+  int count = 0;
+  int index = -1;
+
+  while (dchain_expire_one_index(chain, &index, time)) {
+    void *key;
+    vector_borrow(vector, index, &key);
+    map_erase(map, key, &key);
+    vector_return(vector, index, key);
+
+    ++count;
+  }
+
+  return count;
+}
+
+int expire_items_single_map_iteratively(struct Vector *vector, struct Map *map,
+                                        int start, int n_elems) {
+  assert(start >= 0);
+  assert(n_elems >= 0);
+  void *key;
+  for (int i = start; i < n_elems; i++) {
+    vector_borrow(vector, i, (void **)&key);
+    map_erase(map, key, (void **)&key);
+    vector_return(vector, i, key);
+  }
+}
+
+// Careful: SKETCH_HASHES needs to be <= SKETCH_SALTS_BANK_SIZE
+#define SKETCH_HASHES 5
+#define SKETCH_SALTS_BANK_SIZE 64
+
+// Count-min sketch laid out as SKETCH_HASHES rows of `capacity` counters,
+// directly indexed by the row hash. Buckets carry the time they were last
+// touched, so expiring only records the cutoff.
+//
+// Each core owns its sketch. When a client's flows are spread over several
+// cores by RSS, building with -DSKETCH_MERGE_STALENESS=<ns> makes sketch_fetch
+// also account for the other cores: every core keeps updating only its local
+// counters, and every SKETCH_MERGE_STALENESS ns a control thread sums all the
+// cores' counters and publishes, for each core, what the others hold. Counters
+// are written with relaxed atomic stores, since the merger reads them while
+// their core keeps counting.
+
+struct internal_data {
+  unsigned hashes[SKETCH_HASHES];
+};
+
+static const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
+  0x9b78350f, 0x9bcf144c, 0x8ab29a3e, 0x34d48bf5, 0x78e47449, 0xd6e4af1d,
+  0x32ed75e2, 0xb1eb5a08, 0x9cc7fbdf, 0x65b811ea, 0x41fd5ed9, 0x2e6a6782,
+  0x3549661d, 0xbb211240, 0x78daa2ae, 0x8ce2d11f, 0x52911493, 0xc2497bd5,
+  0x83c232dd, 0x3e413e9f, 0x8831d191, 0x6770ac67, 0xcd1c9141, 0xad35861a,
+  0xb79cd83d, 0xce3ec91f, 0x360942d1, 0x905000fa, 0x28bb469a, 0xdb239a17,
+  0x615cf3ae, 0xec9f7807, 0x271dcc3c, 0x47b98e44, 0x33ff4a71, 0x02a063f8,
+  0xb051ebf2, 0x6f938d98, 0x2279abc3, 0xd55b01db, 0xaa99e301, 0x95d0587c,
+  0xaee8684e, 0x24574971, 0x4b1e79a6, 0x4a646938, 0xa68d67f4, 0xb87839e6,
+  0x8e3d388b, 0xed2af964, 0x541b83e3, 0xcb7fc8da, 0xe1140f8c, 0xe9724fd6,
+  0x616a78fa, 0x610cd51c, 0x10f9173e, 0x8e180857, 0xa8f0b843, 0xd429a973,
+  0xceee91e5, 0x1d4c6b18, 0x2a80e6df, 0x396f4d23,
+};
+
+
+struct sketch_bucket {
+  vigor_time_t touched;
+  uint32_t value;
+};
+
+struct Sketch {
+  struct sketch_bucket *buckets;
+
+  uint32_t capacity;
+  uint16_t threshold;
+  vigor_time_t cutoff;
+
+  map_key_hash *kh;
+  struct internal_data internal;
+
+#ifdef SKETCH_MERGE_STALENESS
+  // Sum of the other cores' counters as of the last merge. The merger fills
+  // the spare array and swaps it in, so readers never see it being written.
+  uint32_t *others;
+  uint32_t *others_spare;
+#endif
+};
+
+#ifdef SKETCH_MERGE_STALENESS
+#define SKETCH_MAX_GROUPS 8
+
+// The n-th sketch allocated by each core (they all run the same nf_init)
+// is the same logical sketch.
+struct sketch_group {
+  struct Sketch *members[RTE_MAX_LCORE];
+};
+
+static struct sketch_group sketch_groups[SKETCH_MAX_GROUPS];
+RTE_DEFINE_PER_LCORE(unsigned, sketch_allocations);
+
+// Swapped out "others" arrays are reclaimed with epochs: a core records the
+// current epoch after every polling round, when it holds no array, and the
+// merger writes an array swapped out at epoch E again only once every core
+// owning a sketch has recorded E or later.
+struct sketch_reader {
+  uint64_t epoch;
+} __rte_cache_aligned;
+
+static struct sketch_reader sketch_readers[RTE_MAX_LCORE];
+static uint64_t sketch_epoch = 1;
+
+static inline void sketch_quiescent(void) {
+  struct sketch_reader *reader = &sketch_readers[rte_lcore_id()];
+  uint64_t epoch = __atomic_load_n(&sketch_epoch, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&reader->epoch, __ATOMIC_RELAXED) != epoch) {
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+  }
+}
+#endif
+
+static inline struct sketch_bucket *sketch_bucket(struct Sketch *sketch,
+                                                  int row) {
+  return &sketch->buckets[sketch->capacity * row +
+                          sketch->internal.hashes[row]];
+}
+
+static inline bool sketch_bucket_live(struct Sketch *sketch,
+                                      struct sketch_bucket *bucket) {
+  return bucket->touched > -1 && bucket->touched >= sketch->cutoff;
+}
+
+int sketch_allocate(map_key_hash *kh, uint32_t capacity, uint16_t threshold,
+                    struct Sketch **sketch_out) {
+  assert(SKETCH_HASHES <= SKETCH_SALTS_BANK_SIZE);
+
+  struct Sketch *sketch_alloc = (struct Sketch *)malloc(sizeof(struct Sketch));
+  if (sketch_alloc == NULL) {
+    return 0;
+  }
+
+  struct sketch_bucket *buckets_alloc = (struct sketch_bucket *)malloc(
+      sizeof(struct sketch_bucket) * capacity * SKETCH_HASHES);
+  if (buckets_alloc == NULL) {
+    free(sketch_alloc);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < capacity * SKETCH_HASHES; i++) {
+    buckets_alloc[i].touched = -1;
+    buckets_alloc[i].value = 0;
+  }
+
+  (*sketch_out) = sketch_alloc;
+
+  (*sketch_out)->buckets = buckets_alloc;
+  (*sketch_out)->capacity = capacity;
+  (*sketch_out)->threshold = threshold;
+  (*sketch_out)->cutoff = 0;
+  (*sketch_out)->kh = kh;
+
+#ifdef SKETCH_MERGE_STALENESS
+  unsigned group_id = RTE_PER_LCORE(sketch_allocations)++;
+  if (group_id >= SKETCH_MAX_GROUPS) {
+    rte_exit(EXIT_FAILURE, "Too many sketches to merge across cores");
+  }
+
+  (*sketch_out)->others =
+      (uint32_t *)calloc(capacity * SKETCH_HASHES, sizeof(uint32_t));
+  (*sketch_out)->others_spare =
+      (uint32_t *)calloc(capacity * SKETCH_HASHES, sizeof(uint32_t));
+  if ((*sketch_out)->others == NULL || (*sketch_out)->others_spare == NULL) {
+    return 0;
+  }
+
+  // the merger picks the sketch up once it is fully initialized
+  __atomic_store_n(&sketch_groups[group_id].members[rte_lcore_id()],
+                   *sketch_out, __ATOMIC_RELEASE);
+#endif
+
+  return 1;
+}
+
+// Mixes the client key hash into 64 bits (MurmurHash3 finalizer), from which
+// every row index is derived: row i uses h1 + i * h2 (Kirsch-Mitzenmacher),
+// mapped onto [0, capacity[ with a multiply-shift instead of a modulo.
+static inline uint64_t sketch_hash64(unsigned key_hash) {
+  uint64_t hash =
+      (((uint64_t)SKETCH_SALTS[1]) << 32 | SKETCH_SALTS[0]) ^ key_hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static inline unsigned sketch_row_index(uint64_t hash, int row,
+                                        uint32_t capacity) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  uint32_t row_hash = h1 + (uint32_t)row * h2;
+  return (unsigned)(((uint64_t)row_hash * capacity) >> 32);
+}
+
+void sketch_compute_hashes(struct Sketch *sketch, void *key) {
+  uint64_t hash = sketch_hash64(sketch->kh(key));
+
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    sketch->internal.hashes[i] = sketch_row_index(hash, i, sketch->capacity);
+  }
+}
+
+void sketch_refresh(struct Sketch *sketch, vigor_time_t now) {
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+
+    if (sketch_bucket_live(sketch, bucket)) {
+      __atomic_store_n(&bucket->touched, now, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+int sketch_fetch(struct Sketch *sketch) {
+  uint32_t bucket_min = UINT32_MAX;
+
+#ifdef SKETCH_MERGE_STALENESS
+  uint32_t *others = __atomic_load_n(&sketch->others, __ATOMIC_ACQUIRE);
+#endif
+
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+    uint32_t value = sketch_bucket_live(sketch, bucket) ? bucket->value : 0;
+
+#ifdef SKETCH_MERGE_STALENESS
+    value += others[bucket - sketch->buckets];
+#endif
+
+    if (bucket_min > value) {
+      bucket_min = value;
+    }
+  }
+
+  return bucket_min > sketch->threshold;
+}
+
+int sketch_touch_buckets(struct Sketch *sketch, vigor_time_t now) {
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+
+    uint32_t value = sketch_bucket_live(sketch, bucket) ? bucket->value + 1 : 0;
+
+    __atomic_store_n(&bucket->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->touched, now, __ATOMIC_RELAXED);
+  }
+
+  return true;
+}
+
+#ifdef SKETCH_MERGE_STALENESS
+// Reads every member's live counters exactly once per bucket, so that the
+// published "others" never include a core's own contribution. Members keep
+// counting meanwhile, the merge only needs to be about as fresh as its period.
+// The spare arrays must no longer be read by any core, see sketch_merger_main.
+static void sketch_merge(struct sketch_group *group) {
+  struct Sketch *members[RTE_MAX_LCORE];
+  uint32_t values[RTE_MAX_LCORE];
+  unsigned n_members = 0;
+
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    struct Sketch *member =
+        __atomic_load_n(&group->members[lcore_id], __ATOMIC_ACQUIRE);
+    if (member != NULL) {
+      members[n_members++] = member;
+    }
+  }
+
+  if (n_members == 0) {
+    return;
+  }
+
+  uint32_t size = members[0]->capacity * SKETCH_HASHES;
+  vigor_time_t cutoffs[RTE_MAX_LCORE];
+
+  for (unsigned m = 0; m < n_members; m++) {
+    cutoffs[m] = __atomic_load_n(&members[m]->cutoff, __ATOMIC_RELAXED);
+  }
+
+  for (uint32_t b = 0; b < size; b++) {
+    uint32_t total = 0;
+
+    for (unsigned m = 0; m < n_members; m++) {
+      struct sketch_bucket *bucket = &members[m]->buckets[b];
+      vigor_time_t touched =
+          __atomic_load_n(&bucket->touched, __ATOMIC_RELAXED);
+      bool live = touched > -1 && touched >= cutoffs[m];
+      values[m] = live ? __atomic_load_n(&bucket->value, __ATOMIC_RELAXED) : 0;
+      total += values[m];
+    }
+
+    for (unsigned m = 0; m < n_members; m++) {
+      members[m]->others_spare[b] = total - values[m];
+    }
+  }
+
+  for (unsigned m = 0; m < n_members; m++) {
+    uint32_t *published = members[m]->others;
+    __atomic_store_n(&members[m]->others, members[m]->others_spare,
+                     __ATOMIC_RELEASE);
+    members[m]->others_spare = published;
+  }
+}
+
+static void *sketch_merger_main(void *arg) {
+  struct timespec period = {
+    .tv_sec = SKETCH_MERGE_STALENESS / 1000000000l,
+    .tv_nsec = SKETCH_MERGE_STALENESS % 1000000000l,
+  };
+
+  // epoch at which the spare arrays were swapped out, none were yet
+  uint64_t retired_epoch = 0;
+
+  while (1) {
+    nanosleep(&period, NULL);
+
+    // cores still reading a spare array drop it by their next polling round
+    unsigned lcore_id;
+    RTE_LCORE_FOREACH(lcore_id) {
+      bool reader = false;
+      for (int group = 0; group < SKETCH_MAX_GROUPS; group++) {
+        reader |= __atomic_load_n(&sketch_groups[group].members[lcore_id],
+                                  __ATOMIC_ACQUIRE) != NULL;
+      }
+
+      while (reader && __atomic_load_n(&sketch_readers[lcore_id].epoch,
+                                       __ATOMIC_SEQ_CST) < retired_epoch) {
+        rte_pause();
+      }
+    }
+
+    for (int group = 0; group < SKETCH_MAX_GROUPS; group++) {
+      sketch_merge(&sketch_groups[group]);
+    }
+
+    retired_epoch = __atomic_add_fetch(&sketch_epoch, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+// The merge costs a pass over every core's counters, it runs on a control
+// thread instead of on some core's packet path.
+static void sketch_merger_start(void) {
+  pthread_t thread;
+  int retval = rte_ctrl_thread_create(&thread, "sketch-merger", NULL,
+                                      sketch_merger_main, NULL);
+  if (retval != 0) {
+    rte_exit(EXIT_FAILURE, "Cannot start the sketch merger: %d\n", retval);
+  }
+}
+#endif
+
+void sketch_expire(struct Sketch *sketch, vigor_time_t time) {
+  __atomic_store_n(&sketch->cutoff, time, __ATOMIC_RELAXED);
+}
+
+/**********************************************
+ *
+ *                  RTE-IP
+ *
+ **********************************************/
+
+uint32_t __raw_cksum(const void *buf, size_t len, uint32_t sum) {
+  /* workaround gcc strict-aliasing warning */
+  uintptr_t ptr = (uintptr_t)buf;
+  typedef uint16_t __attribute__((__may_alias__)) u16_p;
+  const u16_p *u16_buf = (const u16_p *)ptr;
+
+  while (len >= (sizeof(*u16_buf) * 4)) {
+    sum += u16_buf[0];
+    sum += u16_buf[1];
+    sum += u16_buf[2];
+    sum += u16_buf[3];
+    len -= sizeof(*u16_buf) * 4;
+    u16_buf += 4;
+  }
+  while (len >= sizeof(*u16_buf)) {
+    sum += *u16_buf;
+    len -= sizeof(*u16_buf);
+    u16_buf += 1;
+  }
+
+  /* if length is in odd bytes */
+  if (len == 1) {
+    uint16_t left = 0;
+    *(uint8_t *)&left = *(const uint8_t *)u16_buf;
+    sum += left;
+  }
+
+  return sum;
+}
+
+uint16_t __raw_cksum_reduce(uint32_t sum) {
+  sum = ((sum & 0xffff0000) >> 16) + (sum & 0xffff);
+  sum = ((sum & 0xffff0000) >> 16) + (sum & 0xffff);
+  return (uint16_t)sum;
+}
+
+uint16_t raw_cksum(const void *buf, size_t len) {
+  uint32_t sum;
+
+  sum = __raw_cksum(buf, len, 0);
+  return __raw_cksum_reduce(sum);
+}
+
+uint16_t ipv4_cksum(const struct rte_ipv4_hdr *ipv4_hdr) {
+  uint16_t cksum;
+  cksum = raw_cksum(ipv4_hdr, sizeof(struct rte_ipv4_hdr));
+  return (uint16_t)~cksum;
+}
+
+uint16_t ipv4_udptcp_cksum(const struct rte_ipv4_hdr *ipv4_hdr,
+                           const void *l4_hdr) {
+  uint32_t cksum;
+  uint32_t l3_len, l4_len;
+
+  l3_len = rte_be_to_cpu_16(ipv4_hdr->total_length);
+  if (l3_len < sizeof(struct rte_ipv4_hdr))
+    return 0;
+
+  l4_len = l3_len - sizeof(struct rte_ipv4_hdr);
+
+  cksum = raw_cksum(l4_hdr, l4_len);
+  cksum += ipv4_cksum(ipv4_hdr);
+
+  cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+  cksum = (~cksum) & 0xffff;
+  /*
+   * Per RFC 768:If the computed checksum is zero for UDP,
+   * it is transmitted as all ones
+   * (the equivalent in one's complement arithmetic).
+   */
+  if (cksum == 0 && ipv4_hdr->next_proto_id == IPPROTO_UDP)
+    cksum = 0xffff;
+
+  return (uint16_t)cksum;
+}
+
+/**********************************************
+ *
+ *                  ETHER
+ *
+ **********************************************/
+
+bool rte_ether_addr_eq(void* a, void* b) {
+  struct rte_ether_addr* id1 = (struct rte_ether_addr*)a;
+  struct rte_ether_addr* id2 = (struct rte_ether_addr*)b;
+  
+  return (id1->addr_bytes[0] == id2->addr_bytes[0])AND(id1->addr_bytes[1] ==
+                                                       id2->addr_bytes[1])
+      AND (id1->addr_bytes[2] == id2->addr_bytes[2])
+      AND (id1->addr_bytes[3] == id2->addr_bytes[3])
+      AND (id1->addr_bytes[4] == id2->addr_bytes[4])
+      AND (id1->addr_bytes[5] == id2->addr_bytes[5]);
+}
+
+void rte_ether_addr_allocate(void* obj) {
+
+  struct rte_ether_addr* id = (struct rte_ether_addr*)obj;
+
+  id->addr_bytes[0] = 0;
+  id->addr_bytes[1] = 0;
+  id->addr_bytes[2] = 0;
+  id->addr_bytes[3] = 0;
+  id->addr_bytes[4] = 0;
+  id->addr_bytes[5] = 0;
+}
+
+unsigned rte_ether_addr_hash(void* obj) {
+  struct rte_ether_addr* id = (struct rte_ether_addr*)obj;
+
+  uint8_t addr_bytes_0 = id->addr_bytes[0];
+  uint8_t addr_bytes_1 = id->addr_bytes[1];
+  uint8_t addr_bytes_2 = id->addr_bytes[2];
+  uint8_t addr_bytes_3 = id->addr_bytes[3];
+  uint8_t addr_bytes_4 = id->addr_bytes[4];
+  uint8_t addr_bytes_5 = id->addr_bytes[5];
+
+  unsigned hash = 0;
+  hash = __builtin_ia32_crc32si(hash, addr_bytes_0);
+  hash = __builtin_ia32_crc32si(hash, addr_bytes_1);
+  hash = __builtin_ia32_crc32si(hash, addr_bytes_2);
+  hash = __builtin_ia32_crc32si(hash, addr_bytes_3);
+  hash = __builtin_ia32_crc32si(hash, addr_bytes_4);
+  hash = __builtin_ia32_crc32si(hash, addr_bytes_5);
+  return hash;
+}
+
+
+/**********************************************
+ *
+ *                  NF-PIPELINE
+ *
+ **********************************************/
+
+#define MBUF_CACHE_SIZE 256
+#define MAX_NUM_DEVICES 32 // this is quite arbitrary...
+
+// Cores receiving from the devices, at the start of the pipeline
+#ifndef PIPELINE_RX_CORES
+#define PIPELINE_RX_CORES 1
+#endif
+
+// Cores transmitting to the devices, at the end of the pipeline
+#ifndef PIPELINE_TX_CORES
+#define PIPELINE_TX_CORES 1
+#endif
+
+#define PIPELINE_RING_SIZE 1024
+
+enum pipeline_stage { PIPELINE_RX, PIPELINE_WORKER, PIPELINE_TX };
+
+struct lcore_conf {
+  struct rte_mempool *mbuf_pool;
+  enum pipeline_stage stage;
+  uint16_t index; // within its stage, also the queue of RX and TX cores
+};
+
+struct lcore_conf lcores_conf[RTE_MAX_LCORE];
+
+// Cores between the RX and TX stages, each running the NF on its own state
+static unsigned nb_workers;
+
+// [worker] packets steered to it by the RX cores
+static struct rte_ring *worker_rings[RTE_MAX_LCORE];
+// [worker] packets it processed, for the TX core serving it
+static struct rte_ring *tx_rings[RTE_MAX_LCORE];
+
+/**********************************************
+ *
+ *                  NF-UTIL
+ *
+ **********************************************/
+
+// rte_ether
+struct rte_ether_addr;
+struct rte_ether_hdr;
+
+#define IP_MIN_SIZE_WORDS 5
+#define WORD_SIZE 4
+
+// this is doing nothing here, just making compilation easier
+RTE_DEFINE_PER_LCORE(bool, write_attempt);
+RTE_DEFINE_PER_LCORE(bool, write_state);
+
+uint32_t spread_data_among_cores(uint32_t capacity) {
+  // only the workers hold state
+  capacity /= nb_workers;
+
+  // find power of 2
+  for (int pow = 0; pow < 32; pow++) {
+    if ((1 << pow) >= capacity) {
+      return 1 << pow;
+    }
+  }
+
+  // we should not be here
+  rte_exit(EXIT_FAILURE, "Error spreading data among cores");
+  return 0; // silence warning
+}
+
+/**********************************************
+ *
+ *                  STEERING
+ *
+ **********************************************/
+
+// Used when no RSS key makes the NIC send all packets touching the same state
+// to the same core. The RX cores steer them in software instead, hashing on
+// the fields the state of each device is keyed by, as found by
+// rss-config-from-lvas --steering and synthesized into steering_conf.
+
+#define STEERING_MAX_FIELDS 4
+
+enum steering_field {
+  STEERING_IPV4_SRC,
+  STEERING_IPV4_DST,
+  STEERING_PORT_SRC,
+  STEERING_PORT_DST,
+};
+
+struct steering_conf {
+  bool stateful; // stateless devices are spread round robin
+  // writes state other devices reach without its key, so every worker keeps
+  // a copy of that state and gets a copy of the device's packets
+  bool broadcast;
+  uint8_t n_fields;
+  enum steering_field fields[STEERING_MAX_FIELDS];
+};
+
+struct steering_conf steering_conf[MAX_NUM_DEVICES];
+
+// Set by the RX cores in hash.usr, the workers drop the copies of broadcast
+// packets once their state is updated, and forward the originals
+#define STEERING_ORIGINAL 0
+#define STEERING_COPY 1
+
+RTE_DEFINE_PER_LCORE(unsigned, steering_next);
+
+// A flow and its reply swap sources and destinations, so a key holding both
+// is hashed in an order that does not depend on the direction. Devices keyed
+// by the mirrored fields then agree on the worker, as checked by
+// rss-config-from-lvas.
+static inline uint32_t steering_hash_pair(uint32_t hash, bool use_src,
+                                          uint32_t src, bool use_dst,
+                                          uint32_t dst) {
+  if (use_src && use_dst) {
+    hash = rte_hash_crc_4byte(RTE_MIN(src, dst), hash);
+    return rte_hash_crc_4byte(RTE_MAX(src, dst), hash);
+  }
+
+  if (use_src) {
+    return rte_hash_crc_4byte(src, hash);
+  }
+
+  if (use_dst) {
+    return rte_hash_crc_4byte(dst, hash);
+  }
+
+  return hash;
+}
+
+// @returns the worker holding the state the packet may touch
+static inline uint16_t steering_worker(struct rte_mbuf *packet) {
+  struct steering_conf *conf = &steering_conf[packet->port];
+
+  if (!conf->stateful) {
+    return RTE_PER_LCORE(steering_next)++ % nb_workers;
+  }
+
+  uint8_t *data = rte_pktmbuf_mtod(packet, uint8_t *);
+  struct rte_ether_hdr *ether_hdr = (struct rte_ether_hdr *)data;
+  size_t ipv4_offset = sizeof(struct rte_ether_hdr);
+
+  // packets without the fields all go to the first worker
+  if (conf->n_fields == 0 ||
+      packet->data_len < ipv4_offset + sizeof(struct rte_ipv4_hdr) ||
+      ether_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+    return 0;
+  }
+
+  struct rte_ipv4_hdr *ipv4_hdr =
+      (struct rte_ipv4_hdr *)(data + ipv4_offset);
+  size_t l4_offset =
+      ipv4_offset + (ipv4_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * WORD_SIZE;
+  struct tcpudp_hdr *tcpudp_hdr = (struct tcpudp_hdr *)(data + l4_offset);
+  bool has_ports =
+      (ipv4_hdr->next_proto_id == IPPROTO_TCP ||
+       ipv4_hdr->next_proto_id == IPPROTO_UDP) &&
+      packet->data_len >= l4_offset + sizeof(struct tcpudp_hdr);
+
+  bool used[STEERING_MAX_FIELDS] = { false };
+  for (uint8_t f = 0; f < conf->n_fields; f++) {
+    used[conf->fields[f]] = true;
+  }
+
+  uint32_t hash =
+      steering_hash_pair(0, used[STEERING_IPV4_SRC], ipv4_hdr->src_addr,
+                         used[STEERING_IPV4_DST], ipv4_hdr->dst_addr);
+
+  if (used[STEERING_PORT_SRC] || used[STEERING_PORT_DST]) {
+    if (!has_ports) {
+      return 0;
+    }
+    hash = steering_hash_pair(hash, used[STEERING_PORT_SRC],
+                              tcpudp_hdr->src_port, used[STEERING_PORT_DST],
+                              tcpudp_hdr->dst_port);
+  }
+
+  // scale the hash instead of taking it modulo, the worker count is arbitrary
+  return ((uint64_t)hash * nb_workers) >> 32;
+}
+
+/**********************************************
+ *
+ *                  NF
+ *
+ **********************************************/
+
+bool nf_init(void);
+int nf_process(uint16_t device, uint8_t *buffer, uint16_t packet_length,
+               vigor_time_t now);
+
+#define FLOOD_FRAME ((uint16_t)-1)
+
+// Unverified support for batching, useful for performance comparisons
+#define VIGOR_BATCH_SIZE 32
+
+// Do the opposite: we want batching!
+static const uint16_t RX_QUEUE_SIZE = 1024;
+static const uint16_t TX_QUEUE_SIZE = 1024;
+
+// Buffer count for mempools
+static const unsigned MEMPOOL_BUFFER_COUNT = 2048;
+
+// Packets are queued per output device while a burst is processed, and each
+// device is flushed once at the end of the burst. Every queued entry owns one
+// reference to its mbuf, so a flood queues the same mbuf on several devices.
+#define TX_BUFFER_SIZE VIGOR_BATCH_SIZE
+
+struct tx_buffer {
+  uint16_t count;
+  struct rte_mbuf *mbufs[TX_BUFFER_SIZE];
+};
+
+static void tx_buffer_flush(struct tx_buffer *buffer, uint16_t device,
+                            uint16_t queue_id) {
+  if (buffer->count == 0) {
+    return;
+  }
+
+  uint16_t sent_count =
+      rte_eth_tx_burst(device, queue_id, buffer->mbufs, buffer->count);
+  // should not happen, but drop the reference held by every entry the device
+  // did not take; the mbuf itself goes away with its last reference
+  for (uint16_t n = sent_count; n < buffer->count; n++) {
+    rte_pktmbuf_free(buffer->mbufs[n]);
+  }
+  buffer->count = 0;
+}
+
+static inline void tx_buffer_push(struct tx_buffer *buffer, uint16_t device,
+                                  uint16_t queue_id, struct rte_mbuf *packet) {
+  if (buffer->count == TX_BUFFER_SIZE) {
+    tx_buffer_flush(buffer, device, queue_id);
+  }
+  buffer->mbufs[buffer->count++] = packet;
+}
+
+// Queue the given packet on all devices except the packet's own
+void flood(struct rte_mbuf *packet, uint16_t nb_devices,
+           struct tx_buffer *tx_buffers, uint16_t queue_id) {
+  if (nb_devices < 2) {
+    rte_pktmbuf_free(packet);
+    return;
+  }
+
+  // all references are taken before the first one can be transmitted
+  rte_mbuf_refcnt_set(packet, nb_devices - 1);
+  uint16_t skip_device = packet->port;
+  for (uint16_t device = 0; device < nb_devices; device++) {
+    if (device != skip_device) {
+      tx_buffer_push(&tx_buffers[device], device, queue_id, packet);
+    }
+  }
+}
+
+// Initializes the given device using the given memory pools
+static int nf_init_device(uint16_t device, struct rte_mempool **mbuf_pools) {
+  int retval;
+
+  // device_conf passed to rte_eth_dev_configure cannot be NULL
+  struct rte_eth_conf device_conf = { 0 };
+  // device_conf.rxmode.hw_strip_crc = 1;
+  if (PIPELINE_RX_CORES > 1) {
+    // any spreading will do, the RX cores steer the packets themselves
+    struct rte_eth_dev_info dev_info;
+    rte_eth_dev_info_get(device, &dev_info);
+
+    device_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+    device_conf.rx_adv_conf.rss_conf.rss_hf =
+        ETH_RSS_IP & dev_info.flow_type_rss_offloads;
+  } else {
+    device_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+  }
+
+  retval = rte_eth_dev_configure(device, PIPELINE_RX_CORES, PIPELINE_TX_CORES,
+                                 &device_conf);
+  if (retval != 0) {
+    return retval;
+  }
+
+  // Allocate and set up TX queues
+  for (int txq = 0; txq < PIPELINE_TX_CORES; txq++) {
+    retval = rte_eth_tx_queue_setup(device, txq, TX_QUEUE_SIZE,
+                                    rte_eth_dev_socket_id(device), NULL);
+    if (retval != 0) {
+      return retval;
+    }
+  }
+
+  // Allocate and set up RX queues
+  for (int rxq = 0; rxq < PIPELINE_RX_CORES; rxq++) {
+    retval = rte_eth_rx_queue_setup(device, rxq, RX_QUEUE_SIZE,
+                                    rte_eth_dev_socket_id(device), NULL,
+                                    mbuf_pools[rxq]);
+    if (retval != 0) {
+      return retval;
+    }
+  }
+
+  // Start the device
+  retval = rte_eth_dev_start(device);
+  if (retval != 0) {
+    return retval;
+  }
+
+  // Enable RX in promiscuous mode, just in case
+  rte_eth_promiscuous_enable(device);
+  if (rte_eth_promiscuous_get(device) != 1) {
+    return retval;
+  }
+
+  return 0;
+}
+
+static void rx_main(uint16_t queue_id, struct rte_mempool *mbuf_pool) {
+  printf("Core %u receiving packets.\n", rte_lcore_id());
+
+  // [worker] packets of the burst
+  struct rte_mbuf *batches[RTE_MAX_LCORE][VIGOR_BATCH_SIZE];
+  uint16_t counts[RTE_MAX_LCORE] = { 0 };
+
+  while (1) {
+    uint16_t nb_devices = rte_eth_dev_count_avail();
+
+    for (uint16_t device = 0; device < nb_devices; device++) {
+      struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
+      uint16_t rx_count =
+          rte_eth_rx_burst(device, queue_id, mbufs, VIGOR_BATCH_SIZE);
+
+      for (uint16_t n = 0; n < rx_count; n++) {
+        struct rte_mbuf *packet = mbufs[n];
+        uint16_t worker = steering_worker(packet);
+
+        packet->hash.usr = STEERING_ORIGINAL;
+        batches[worker][counts[worker]++] = packet;
+
+        if (!steering_conf[device].broadcast) {
+          continue;
+        }
+
+        // deep copies, the workers may rewrite the packet while processing it
+        for (uint16_t other = 0; other < nb_workers; other++) {
+          if (other == worker) {
+            continue;
+          }
+
+          struct rte_mbuf *copy =
+              rte_pktmbuf_copy(packet, mbuf_pool, 0, UINT32_MAX);
+          // like a packet dropped on a full ring, that worker misses it
+          if (copy == NULL) {
+            continue;
+          }
+
+          copy->hash.usr = STEERING_COPY;
+          batches[other][counts[other]++] = copy;
+        }
+      }
+
+      for (uint16_t worker = 0; worker < nb_workers; worker++) {
+        if (counts[worker] == 0) {
+          continue;
+        }
+
+        unsigned sent = rte_ring_enqueue_burst(
+            worker_rings[worker], (void **)batches[worker], counts[worker],
+            NULL);
+        for (unsigned n = sent; n < counts[worker]; n++) {
+          rte_pktmbuf_free(batches[worker][n]);
+        }
+        counts[worker] = 0;
+      }
+    }
+  }
+}
+
+static void worker_main(uint16_t worker) {
+  if (!nf_init()) {
+    rte_exit(EXIT_FAILURE, "Error initializing NF");
+  }
+
+  printf("Core %u forwarding packets.\n", rte_lcore_id());
+
+  printf("Running with batches, this code is unverified!\n");
+
+  while (1) {
+    struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
+    unsigned rx_count = rte_ring_sc_dequeue_burst(
+        worker_rings[worker], (void **)mbufs, VIGOR_BATCH_SIZE, NULL);
+
+    struct rte_mbuf *processed[VIGOR_BATCH_SIZE];
+    unsigned processed_count = 0;
+
+    for (unsigned n = 0; n < rx_count; n++) {
+      bool copy = mbufs[n]->hash.usr == STEERING_COPY;
+      uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
+      vigor_time_t VIGOR_NOW = current_time();
+      uint16_t dst_device =
+          nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
+
+      if (copy || dst_device == mbufs[n]->port) {
+        rte_pktmbuf_free(mbufs[n]);
+      } else {
+        // the TX core only needs the packet and where it goes
+        mbufs[n]->hash.usr = dst_device;
+        processed[processed_count++] = mbufs[n];
+      }
+    }
+
+    if (processed_count > 0) {
+      unsigned sent = rte_ring_sp_enqueue_burst(
+          tx_rings[worker], (void **)processed, processed_count, NULL);
+      for (unsigned n = sent; n < processed_count; n++) {
+        rte_pktmbuf_free(processed[n]);
+      }
+    }
+
+#ifdef SKETCH_MERGE_STALENESS
+    sketch_quiescent();
+#endif
+  }
+}
+
+static void tx_main(uint16_t queue_id) {
+  printf("Core %u transmitting packets.\n", rte_lcore_id());
+
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
+  while (1) {
+    uint16_t nb_devices = rte_eth_dev_count_avail();
+
+    // the workers are dealt round robin among the TX cores
+    for (unsigned worker = queue_id; worker < nb_workers;
+         worker += PIPELINE_TX_CORES) {
+      struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
+      unsigned count = rte_ring_sc_dequeue_burst(
+          tx_rings[worker], (void **)mbufs, VIGOR_BATCH_SIZE, NULL);
+
+      for (unsigned n = 0; n < count; n++) {
+        uint16_t dst_device = mbufs[n]->hash.usr;
+        if (dst_device == FLOOD_FRAME) {
+          flood(mbufs[n], nb_devices, tx_buffers, queue_id);
+        } else {
+          tx_buffer_push(&tx_buffers[dst_device], dst_device, queue_id,
+                         mbufs[n]);
+        }
+      }
+    }
+
+    for (uint16_t device = 0; device < nb_devices; device++) {
+      tx_buffer_flush(&tx_buffers[device], device, queue_id);
+    }
+  }
+}
+
+static void lcore_main(void) {
+  struct lcore_conf *conf = &lcores_conf[rte_lcore_id()];
+
+  switch (conf->stage) {
+  case PIPELINE_RX:
+    rx_main(conf->index, conf->mbuf_pool);
+    break;
+  case PIPELINE_WORKER:
+    worker_main(conf->index);
+    break;
+  case PIPELINE_TX:
+    tx_main(conf->index);
+    break;
+  }
+}
+
+// Entry point
+int main(int argc, char **argv) {
+  // Initialize the DPDK Environment Abstraction Layer (EAL)
+  int ret = rte_eal_init(argc, argv);
+  if (ret < 0) {
+    rte_exit(EXIT_FAILURE, "Error with EAL initialization, ret=%d\n", ret);
+  }
+  argc -= ret;
+  argv += ret;
+
+  unsigned nb_devices = rte_eth_dev_count_avail();
+
+  unsigned lcores = rte_lcore_count();
+  if (lcores < PIPELINE_RX_CORES + PIPELINE_TX_CORES + 1) {
+    rte_exit(EXIT_FAILURE, "Need at least %u cores for the pipeline\n",
+             PIPELINE_RX_CORES + PIPELINE_TX_CORES + 1);
+  }
+  nb_workers = lcores - PIPELINE_RX_CORES - PIPELINE_TX_CORES;
+
+  // the first cores receive, the last ones transmit
+  unsigned lcore_id;
+  unsigned lcore_idx = 0;
+  RTE_LCORE_FOREACH(lcore_id) {
+    if (lcore_idx < PIPELINE_RX_CORES) {
+      lcores_conf[lcore_id].stage = PIPELINE_RX;
+      lcores_conf[lcore_id].index = lcore_idx;
+    } else if (lcore_idx < PIPELINE_RX_CORES + nb_workers) {
+      lcores_conf[lcore_id].stage = PIPELINE_WORKER;
+      lcores_conf[lcore_id].index = lcore_idx - PIPELINE_RX_CORES;
+    } else {
+      lcores_conf[lcore_id].stage = PIPELINE_TX;
+      lcores_conf[lcore_id].index =
+          lcore_idx - PIPELINE_RX_CORES - nb_workers;
+    }
+
+    lcore_idx++;
+  }
+
+  // Create a memory pool per RX core, with room for what the rings hold
+  char MBUF_POOL_NAME[20];
+  struct rte_mempool *mbuf_pools[PIPELINE_RX_CORES];
+
+  for (unsigned rx = 0; rx < PIPELINE_RX_CORES; rx++) {
+    sprintf(MBUF_POOL_NAME, "MEMORY_POOL_%u", rx);
+
+    mbuf_pools[rx] = rte_pktmbuf_pool_create(
+        MBUF_POOL_NAME, // name
+        MEMPOOL_BUFFER_COUNT * nb_devices +
+            2 * PIPELINE_RING_SIZE * nb_workers, // #elements
+        MBUF_CACHE_SIZE,                         // cache size (per-lcore)
+        0,                          // application private area size
+        RTE_MBUF_DEFAULT_BUF_SIZE,  // data buffer size
+        rte_socket_id()             // socket ID
+    );
+
+    if (mbuf_pools[rx] == NULL) {
+      rte_exit(EXIT_FAILURE, "Cannot create mbuf pool: %s\n",
+               rte_strerror(rte_errno));
+    }
+  }
+
+  // the RX cores also copy the packets of broadcast devices into their pool
+  RTE_LCORE_FOREACH(lcore_id) {
+    if (lcores_conf[lcore_id].stage == PIPELINE_RX) {
+      lcores_conf[lcore_id].mbuf_pool =
+          mbuf_pools[lcores_conf[lcore_id].index];
+    }
+  }
+
+  // Create the rings between the stages
+  char ring_name[32];
+  for (unsigned worker = 0; worker < nb_workers; worker++) {
+    sprintf(ring_name, "WORKER_RING_%u", worker);
+    worker_rings[worker] = rte_ring_create(
+        ring_name, PIPELINE_RING_SIZE, rte_socket_id(),
+        RING_F_SC_DEQ | (PIPELINE_RX_CORES == 1 ? RING_F_SP_ENQ : 0));
+
+    sprintf(ring_name, "TX_RING_%u", worker);
+    tx_rings[worker] = rte_ring_create(ring_name, PIPELINE_RING_SIZE,
+                                       rte_socket_id(),
+                                       RING_F_SP_ENQ | RING_F_SC_DEQ);
+
+    if (worker_rings[worker] == NULL || tx_rings[worker] == NULL) {
+      rte_exit(EXIT_FAILURE, "Cannot create pipeline rings: %s\n",
+               rte_strerror(rte_errno));
+    }
+  }
+
+  // Initialize all devices
+  for (uint16_t device = 0; device < nb_devices; device++) {
+    ret = nf_init_device(device, mbuf_pools);
+    if (ret == 0) {
+      printf("Initialized device %" PRIu16 ".\n", device);
+    } else {
+      rte_exit(EXIT_FAILURE, "Cannot init device %" PRIu16 ": %d", device, ret);
+    }
+  }
+
+#ifdef SKETCH_MERGE_STALENESS
+  sketch_merger_start();
+#endif
+
+  RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+    rte_eal_remote_launch((lcore_function_t *)lcore_main, NULL, lcore_id);
+  }
+
+  lcore_main();
+
+  return 0;
+}
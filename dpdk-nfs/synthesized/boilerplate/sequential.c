@@ -607,10 +607,12 @@ int expire_items_single_map_iteratively(struct Vector *vector, struct Map *map,
 #define SKETCH_HASHES 5
 #define SKETCH_SALTS_BANK_SIZE 64
 
+// Count-min sketch laid out as SKETCH_HASHES rows of `capacity` counters,
+// directly indexed by the row hash. Buckets carry the time they were last
+// touched, so expiring only records the cutoff.
+
 struct internal_data {
   unsigned hashes[SKETCH_HASHES];
-  int present[SKETCH_HASHES];
-  int buckets_indexes[SKETCH_HASHES];
 };
 
 static const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
@@ -628,66 +630,33 @@ static const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
 };
 
 
+struct sketch_bucket {
+  vigor_time_t touched;
+  uint32_t value;
+};
+
 struct Sketch {
-  struct Map *clients;
-  struct Vector *keys;
-  struct Vector *buckets;
-  struct DoubleChain *allocators[SKETCH_HASHES];
+  struct sketch_bucket *buckets;
 
   uint32_t capacity;
   uint16_t threshold;
+  vigor_time_t cutoff;
 
   map_key_hash *kh;
   struct internal_data internal;
 };
 
-struct hash {
-  uint32_t value;
-};
-
-struct bucket {
-  uint32_t value;
-};
-
-struct sketch_data {
-  unsigned hashes[SKETCH_HASHES];
-  int present[SKETCH_HASHES];
-  int buckets_indexes[SKETCH_HASHES];
-};
-
-unsigned find_next_power_of_2_bigger_than(uint32_t d) {
-  assert(d <= 0x80000000);
-  unsigned n = 1;
-
-  while (n < d) {
-    n *= 2;
-  }
-
-  return n;
+static inline struct sketch_bucket *sketch_bucket(struct Sketch *sketch,
+                                                  int row) {
+  return &sketch->buckets[sketch->capacity * row +
+                          sketch->internal.hashes[row]];
 }
 
-bool hash_eq(void *a, void *b) {
-  struct hash *id1 = (struct hash *)a;
-  struct hash *id2 = (struct hash *)b;
-
-  return (id1->value == id2->value);
-}
-
-void hash_allocate(void *obj) {
-  struct hash *id = (struct hash *)obj;
-  id->value = 0;
-}
-
-unsigned hash_hash(void *obj) {
-  struct hash *id = (struct hash *)obj;
-
-  unsigned hash = 0;
-  hash = __builtin_ia32_crc32si(hash, id->value);
-  return hash;
+static inline bool sketch_bucket_live(struct Sketch *sketch,
+                                      struct sketch_bucket *bucket) {
+  return bucket->touched > -1 && bucket->touched >= sketch->cutoff;
 }
 
-void bucket_allocate(void *obj) { (uintptr_t) obj; }
-
 int sketch_allocate(map_key_hash *kh, uint32_t capacity, uint16_t threshold,
                     struct Sketch **sketch_out) {
   assert(SKETCH_HASHES <= SKETCH_SALTS_BANK_SIZE);
@@ -697,150 +666,102 @@ int sketch_allocate(map_key_hash *kh, uint32_t capacity, uint16_t threshold,
     return 0;
   }
 
-  (*sketch_out) = sketch_alloc;
-
-  (*sketch_out)->capacity = capacity;
-  (*sketch_out)->threshold = threshold;
-  (*sketch_out)->kh = kh;
-
-  unsigned total_sketch_capacity =
-      find_next_power_of_2_bigger_than(capacity * SKETCH_HASHES);
-
-  (*sketch_out)->clients = NULL;
-  if (map_allocate(hash_eq, hash_hash, total_sketch_capacity,
-                   &((*sketch_out)->clients)) == 0) {
+  struct sketch_bucket *buckets_alloc = (struct sketch_bucket *)malloc(
+      sizeof(struct sketch_bucket) * capacity * SKETCH_HASHES);
+  if (buckets_alloc == NULL) {
+    free(sketch_alloc);
     return 0;
   }
 
-  (*sketch_out)->keys = NULL;
-  if (vector_allocate(sizeof(struct hash), total_sketch_capacity, hash_allocate,
-                      &((*sketch_out)->keys)) == 0) {
-    return 0;
+  for (uint32_t i = 0; i < capacity * SKETCH_HASHES; i++) {
+    buckets_alloc[i].touched = -1;
+    buckets_alloc[i].value = 0;
   }
 
-  (*sketch_out)->buckets = NULL;
-  if (vector_allocate(sizeof(struct bucket), total_sketch_capacity,
-                      bucket_allocate, &((*sketch_out)->buckets)) == 0) {
-    return 0;
-  }
+  (*sketch_out) = sketch_alloc;
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    (*sketch_out)->allocators[i] = NULL;
-    if (dchain_allocate(capacity, &((*sketch_out)->allocators[i])) == 0) {
-      return 0;
-    }
-  }
+  (*sketch_out)->buckets = buckets_alloc;
+  (*sketch_out)->capacity = capacity;
+  (*sketch_out)->threshold = threshold;
+  (*sketch_out)->cutoff = 0;
+  (*sketch_out)->kh = kh;
 
   return 1;
 }
 
+// Mixes the client key hash into 64 bits (MurmurHash3 finalizer), from which
+// every row index is derived: row i uses h1 + i * h2 (Kirsch-Mitzenmacher),
+// mapped onto [0, capacity[ with a multiply-shift instead of a modulo.
+static inline uint64_t sketch_hash64(unsigned key_hash) {
+  uint64_t hash =
+      (((uint64_t)SKETCH_SALTS[1]) << 32 | SKETCH_SALTS[0]) ^ key_hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static inline unsigned sketch_row_index(uint64_t hash, int row,
+                                        uint32_t capacity) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  uint32_t row_hash = h1 + (uint32_t)row * h2;
+  return (unsigned)(((uint64_t)row_hash * capacity) >> 32);
+}
+
 void sketch_compute_hashes(struct Sketch *sketch, void *key) {
+  uint64_t hash = sketch_hash64(sketch->kh(key));
+
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal.buckets_indexes[i] = -1;
-    sketch->internal.present[i] = 0;
-    sketch->internal.hashes[i] = 0;
-
-    sketch->internal.hashes[i] =
-        __builtin_ia32_crc32si(sketch->internal.hashes[i], SKETCH_SALTS[i]);
-    sketch->internal.hashes[i] =
-        __builtin_ia32_crc32si(sketch->internal.hashes[i], sketch->kh(key));
-    sketch->internal.hashes[i] %= sketch->capacity;
+    sketch->internal.hashes[i] = sketch_row_index(hash, i, sketch->capacity);
   }
 }
 
 void sketch_refresh(struct Sketch *sketch, vigor_time_t now) {
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    map_get(sketch->clients, &sketch->internal.hashes[i],
-            &sketch->internal.buckets_indexes[i]);
-    dchain_rejuvenate_index(sketch->allocators[i],
-                            sketch->internal.buckets_indexes[i], now);
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+
+    if (sketch_bucket_live(sketch, bucket)) {
+      bucket->touched = now;
+    }
   }
 }
 
 int sketch_fetch(struct Sketch *sketch) {
-  int bucket_min_set = false;
-  uint32_t *buckets_values[SKETCH_HASHES];
-  uint32_t bucket_min = 0;
+  uint32_t bucket_min = UINT32_MAX;
 
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal.present[i] =
-        map_get(sketch->clients, &sketch->internal.hashes[i],
-                &sketch->internal.buckets_indexes[i]);
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+    uint32_t value = sketch_bucket_live(sketch, bucket) ? bucket->value : 0;
 
-    if (!sketch->internal.present[i]) {
-      continue;
+    if (bucket_min > value) {
+      bucket_min = value;
     }
-
-    int offseted = sketch->internal.buckets_indexes[i] + sketch->capacity * i;
-    vector_borrow(sketch->buckets, offseted, (void **)&buckets_values[i]);
-
-    if (!bucket_min_set || bucket_min > *buckets_values[i]) {
-      bucket_min = *buckets_values[i];
-      bucket_min_set = true;
-    }
-
-    vector_return(sketch->buckets, offseted, buckets_values[i]);
   }
 
-  return bucket_min_set && bucket_min > sketch->threshold;
+  return bucket_min > sketch->threshold;
 }
 
 int sketch_touch_buckets(struct Sketch *sketch, vigor_time_t now) {
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    int bucket_index = -1;
-    int present =
-        map_get(sketch->clients, &sketch->internal.hashes[i], &bucket_index);
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
 
-    if (!present) {
-      int allocated_client =
-          dchain_allocate_new_index(sketch->allocators[i], &bucket_index, now);
-
-      if (!allocated_client) {
-        // Sketch size limit reached.
-        return false;
-      }
-
-      int offseted = bucket_index + sketch->capacity * i;
-
-      uint32_t *saved_hash = 0;
-      uint32_t *saved_bucket = 0;
-
-      vector_borrow(sketch->keys, offseted, (void **)&saved_hash);
-      vector_borrow(sketch->buckets, offseted, (void **)&saved_bucket);
-
-      (*saved_hash) = sketch->internal.hashes[i];
-      (*saved_bucket) = 0;
-      map_put(sketch->clients, saved_hash, bucket_index);
-
-      vector_return(sketch->keys, offseted, saved_hash);
-      vector_return(sketch->buckets, offseted, saved_bucket);
+    if (sketch_bucket_live(sketch, bucket)) {
+      bucket->value++;
     } else {
-      dchain_rejuvenate_index(sketch->allocators[i], bucket_index, now);
-      uint32_t *bucket;
-      int offseted = bucket_index + sketch->capacity * i;
-      vector_borrow(sketch->buckets, offseted, (void **)&bucket);
-      (*bucket)++;
-      vector_return(sketch->buckets, offseted, bucket);
+      bucket->value = 0;
     }
+
+    bucket->touched = now;
   }
 
   return true;
 }
 
 void sketch_expire(struct Sketch *sketch, vigor_time_t time) {
-  int offset = 0;
-  int index = -1;
-
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    offset = i * sketch->capacity;
-
-    while (dchain_expire_one_index(sketch->allocators[i], &index, time)) {
-      void *key;
-      vector_borrow(sketch->keys, index + offset, &key);
-      map_erase(sketch->clients, key, &key);
-      vector_return(sketch->keys, index + offset, key);
-    }
-  }
+  sketch->cutoff = time;
 }
 
 /**********************************************
@@ -1087,22 +1008,56 @@ static const uint16_t TX_QUEUE_SIZE = 256;
 // Buffer count for mempools
 static const unsigned MEMPOOL_BUFFER_COUNT = 512;
 
-// Send the given packet to all devices except the packet's own
-void flood(struct rte_mbuf *packet, uint16_t nb_devices) {
+// Packets are queued per output device while a burst is processed, and each
+// device is flushed once at the end of the burst. Every queued entry owns one
+// reference to its mbuf, so a flood queues the same mbuf on several devices.
+#define TX_BUFFER_SIZE VIGOR_BATCH_SIZE
+
+struct tx_buffer {
+  uint16_t count;
+  struct rte_mbuf *mbufs[TX_BUFFER_SIZE];
+};
+
+static void tx_buffer_flush(struct tx_buffer *buffer, uint16_t device,
+                            uint16_t queue_id) {
+  if (buffer->count == 0) {
+    return;
+  }
+
+  uint16_t sent_count =
+      rte_eth_tx_burst(device, queue_id, buffer->mbufs, buffer->count);
+  // should not happen, but drop the reference held by every entry the device
+  // did not take; the mbuf itself goes away with its last reference
+  for (uint16_t n = sent_count; n < buffer->count; n++) {
+    rte_pktmbuf_free(buffer->mbufs[n]);
+  }
+  buffer->count = 0;
+}
+
+static inline void tx_buffer_push(struct tx_buffer *buffer, uint16_t device,
+                                  uint16_t queue_id, struct rte_mbuf *packet) {
+  if (buffer->count == TX_BUFFER_SIZE) {
+    tx_buffer_flush(buffer, device, queue_id);
+  }
+  buffer->mbufs[buffer->count++] = packet;
+}
+
+// Queue the given packet on all devices except the packet's own
+void flood(struct rte_mbuf *packet, uint16_t nb_devices,
+           struct tx_buffer *tx_buffers, uint16_t queue_id) {
+  if (nb_devices < 2) {
+    rte_pktmbuf_free(packet);
+    return;
+  }
+
+  // all references are taken before the first one can be transmitted
   rte_mbuf_refcnt_set(packet, nb_devices - 1);
-  int total_sent = 0;
   uint16_t skip_device = packet->port;
   for (uint16_t device = 0; device < nb_devices; device++) {
     if (device != skip_device) {
-      total_sent += rte_eth_tx_burst(device, 0, &packet, 1);
+      tx_buffer_push(&tx_buffers[device], device, queue_id, packet);
     }
   }
-  // should not happen, but in case we couldn't transmit, ensure the packet is
-  // freed
-  if (total_sent != nb_devices - 1) {
-    rte_mbuf_refcnt_set(packet, 1);
-    rte_pktmbuf_free(packet);
-  }
 }
 
 // Initializes the given device using the given memory pool
@@ -1156,14 +1111,10 @@ static void worker_main(void) {
 
   printf("Core %u forwarding packets.\n", rte_lcore_id());
 
-  if (rte_eth_dev_count_avail() != 2) {
-    printf(
-        "We assume there will be exactly 2 devices for our simple batching "
-        "implementation.\n");
-    exit(1);
-  }
   printf("Running with batches, this code is unverified!\n");
 
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
   while (1) {
     unsigned VIGOR_DEVICES_COUNT = rte_eth_dev_count_avail();
     for (uint16_t VIGOR_DEVICE = 0; VIGOR_DEVICE < VIGOR_DEVICES_COUNT;
@@ -1172,8 +1123,6 @@ static void worker_main(void) {
       uint16_t rx_count =
           rte_eth_rx_burst(VIGOR_DEVICE, 0, mbufs, VIGOR_BATCH_SIZE);
 
-      struct rte_mbuf *mbufs_to_send[VIGOR_BATCH_SIZE];
-      uint16_t tx_count = 0;
       for (uint16_t n = 0; n < rx_count; n++) {
         uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
         vigor_time_t VIGOR_NOW = current_time();
@@ -1182,19 +1131,15 @@ static void worker_main(void) {
 
         if (dst_device == VIGOR_DEVICE) {
           rte_pktmbuf_free(mbufs[n]);
-        } else {  // includes flood when 2 devices, which is equivalent to just
-                  // a
-                  // send
-          mbufs_to_send[tx_count] = mbufs[n];
-          tx_count++;
+        } else if (dst_device == FLOOD_FRAME) {
+          flood(mbufs[n], VIGOR_DEVICES_COUNT, tx_buffers, 0);
+        } else {
+          tx_buffer_push(&tx_buffers[dst_device], dst_device, 0, mbufs[n]);
         }
       }
 
-      uint16_t sent_count =
-          rte_eth_tx_burst(1 - VIGOR_DEVICE, 0, mbufs_to_send, tx_count);
-      for (uint16_t n = sent_count; n < tx_count; n++) {
-        rte_pktmbuf_free(mbufs[n]);  // should not happen, but we're in the
-                                     // unverified case anyway
+      for (uint16_t device = 0; device < VIGOR_DEVICES_COUNT; device++) {
+        tx_buffer_flush(&tx_buffers[device], device, 0);
       }
     }
   }
@@ -16,9 +16,12 @@
 #include <rte_eal.h>
 #include <rte_errno.h>
 #include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
 #include <rte_lcore.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_ring.h>
 
 /**********************************************
  *
@@ -53,8 +56,44 @@ struct Map {
   unsigned size;
   map_keys_equality *keys_eq;
   map_key_hash *khash;
+#ifdef FLOW_MIGRATION
+  void **keys_of; // [value] key last put with it
+#endif
 };
 
+#ifdef FLOW_MIGRATION
+#define MIGRATION_MAX_OBJECTS 16
+
+struct DoubleChain;
+struct Vector;
+
+// The objects allocated by each core, in allocation order. Every core runs
+// the same nf_init, so the n-th dchain of each core is the same logical table.
+struct migration_objects {
+  struct Map *maps[MIGRATION_MAX_OBJECTS];
+  struct DoubleChain *dchains[MIGRATION_MAX_OBJECTS];
+  struct Vector *vectors[MIGRATION_MAX_OBJECTS];
+  unsigned nb_maps;
+  unsigned nb_dchains;
+  unsigned nb_vectors;
+};
+
+static struct migration_objects migration_objects[RTE_MAX_LCORE];
+
+// RETA bucket of the packet being processed, recorded by the dchains for the
+// indexes it allocates or rejuvenates.
+RTE_DEFINE_PER_LCORE(uint16_t, flow_bucket);
+
+#define MIGRATION_REGISTER(kind, object)                                       \
+  do {                                                                         \
+    struct migration_objects *objects = &migration_objects[rte_lcore_id()];    \
+    if (objects->nb_##kind == MIGRATION_MAX_OBJECTS) {                         \
+      rte_exit(EXIT_FAILURE, "Too many " #kind " to migrate flows");           \
+    }                                                                          \
+    objects->kind[objects->nb_##kind++] = (object);                            \
+  } while (0)
+#endif // FLOW_MIGRATION
+
 static unsigned loop(unsigned k, unsigned capacity) {
   return k & (capacity - 1);
 }
@@ -251,6 +290,15 @@ int map_allocate(map_keys_equality *keq, map_key_hash *khash, unsigned capacity,
   (*map_out)->keys_eq = keq;
   (*map_out)->khash = khash;
 
+#ifdef FLOW_MIGRATION
+  (*map_out)->keys_of =
+      (void **)rte_zmalloc(NULL, sizeof(void *) * capacity, 64);
+  if ((*map_out)->keys_of == NULL) {
+    return 0;
+  }
+  MIGRATION_REGISTER(maps, *map_out);
+#endif // FLOW_MIGRATION
+
   map_impl_init((*map_out)->busybits, keq, (*map_out)->keyps, (*map_out)->khs,
                 (*map_out)->chns, (*map_out)->vals, capacity);
   return 1;
@@ -269,6 +317,11 @@ void map_put(struct Map *map, void *key, int value) {
   map_impl_put(map->busybits, map->keyps, map->khs, map->chns, map->vals, key,
                hash, value, map->capacity);
   ++map->size;
+#ifdef FLOW_MIGRATION
+  if ((unsigned)value < map->capacity) {
+    map->keys_of[value] = key;
+  }
+#endif // FLOW_MIGRATION
 }
 
 void map_erase(struct Map *map, void *key, void **trash) {
@@ -301,6 +354,10 @@ struct dchain_cell {
 struct DoubleChain {
   struct dchain_cell *cells;
   vigor_time_t *timestamps;
+#ifdef FLOW_MIGRATION
+  int range;
+  uint16_t *buckets; // [index] RETA bucket, ETH_RSS_RETA_SIZE_512 if unknown
+#endif
 };
 
 enum DCHAIN_ENUM {
@@ -332,6 +389,61 @@ void dchain_impl_init(struct dchain_cell *cells, int size) {
   last->prev = last->next;
 }
 
+#ifdef FLOW_MIGRATION
+// Rotates the free list of a fresh chain to start at index first, so that
+// each core hands out a different part of the range first.
+static void dchain_impl_rotate_free_list(struct dchain_cell *cells, int size,
+                                         int first) {
+  if (first <= 0 || first >= size) {
+    return;
+  }
+
+  struct dchain_cell *fl_head = cells + FREE_LIST_HEAD;
+  struct dchain_cell *before_first = cells + first - 1 + INDEX_SHIFT;
+  struct dchain_cell *last = cells + size - 1 + INDEX_SHIFT;
+
+  last->next = INDEX_SHIFT;
+  last->prev = last->next;
+
+  before_first->next = FREE_LIST_HEAD;
+  before_first->prev = before_first->next;
+
+  fl_head->next = first + INDEX_SHIFT;
+  fl_head->prev = fl_head->next;
+}
+
+// Allocates the free indexes marked in reserve, in a single walk of the free
+// list, appending them to the allocated list.
+static void dchain_impl_reserve_indexes(struct dchain_cell *cells,
+                                        const uint64_t *reserve) {
+  struct dchain_cell *al_head = cells + ALLOC_LIST_HEAD;
+  int prev = FREE_LIST_HEAD;
+  int current = cells[FREE_LIST_HEAD].next;
+
+  while (current != FREE_LIST_HEAD) {
+    int next = cells[current].next;
+    int index = current - INDEX_SHIFT;
+
+    if (((reserve[index / 64] >> (index % 64)) & 1) == 0) {
+      prev = current;
+      current = next;
+      continue;
+    }
+
+    // free cells (and the free list head) have prev == next
+    cells[prev].next = next;
+    cells[prev].prev = next;
+
+    cells[current].next = ALLOC_LIST_HEAD;
+    cells[current].prev = al_head->prev;
+    cells[al_head->prev].next = current;
+    al_head->prev = current;
+
+    current = next;
+  }
+}
+#endif // FLOW_MIGRATION
+
 int dchain_impl_allocate_new_index(struct dchain_cell *cells, int *index) {
   struct dchain_cell *fl_head = cells + FREE_LIST_HEAD;
   struct dchain_cell *al_head = cells + ALLOC_LIST_HEAD;
@@ -482,8 +594,30 @@ int dchain_allocate(int index_range, struct DoubleChain **chain_out) {
   }
   (*chain_out)->timestamps = timestamps_alloc;
 
+#ifdef FLOW_MIGRATION
+  (*chain_out)->range = index_range;
+  (*chain_out)->buckets =
+      (uint16_t *)rte_malloc(NULL, sizeof(uint16_t) * index_range, 64);
+  if ((*chain_out)->buckets == NULL) {
+    return 0;
+  }
+  for (int i = 0; i < index_range; i++) {
+    (*chain_out)->buckets[i] = ETH_RSS_RETA_SIZE_512;
+  }
+  MIGRATION_REGISTER(dchains, *chain_out);
+#endif // FLOW_MIGRATION
+
   dchain_impl_init((*chain_out)->cells, index_range);
 
+#ifdef FLOW_MIGRATION
+  // migrated entries keep their index, which is then rarely taken on the
+  // destination core already
+  dchain_impl_rotate_free_list(
+      (*chain_out)->cells, index_range,
+      (int)((uint64_t)index_range * rte_lcore_index(rte_lcore_id()) /
+            rte_lcore_count()));
+#endif // FLOW_MIGRATION
+
   return 1;
 }
 
@@ -493,6 +627,9 @@ int dchain_allocate_new_index(struct DoubleChain *chain, int *index_out,
 
   if (ret) {
     chain->timestamps[*index_out] = time;
+#ifdef FLOW_MIGRATION
+    chain->buckets[*index_out] = RTE_PER_LCORE(flow_bucket);
+#endif
   }
 
   return ret;
@@ -504,6 +641,9 @@ int dchain_rejuvenate_index(struct DoubleChain *chain, int index,
 
   if (ret) {
     chain->timestamps[index] = time;
+#ifdef FLOW_MIGRATION
+    chain->buckets[index] = RTE_PER_LCORE(flow_bucket);
+#endif
   }
 
   return ret;
@@ -565,6 +705,10 @@ int vector_allocate(int elem_size, unsigned capacity,
     init_elem((*vector_out)->data + elem_size * (int)i);
   }
 
+#ifdef FLOW_MIGRATION
+  MIGRATION_REGISTER(vectors, *vector_out);
+#endif
+
   return 1;
 }
 
@@ -607,10 +751,20 @@ int expire_items_single_map_iteratively(struct Vector *vector, struct Map *map,
 #define SKETCH_HASHES 5
 #define SKETCH_SALTS_BANK_SIZE 64
 
+// Count-min sketch laid out as SKETCH_HASHES rows of `capacity` counters,
+// directly indexed by the row hash. Buckets carry the time they were last
+// touched, so expiring only records the cutoff.
+//
+// Each core owns its sketch. When a client's flows are spread over several
+// cores by RSS, building with -DSKETCH_MERGE_STALENESS=<ns> makes sketch_fetch
+// also account for the other cores: every core keeps updating only its local
+// counters, and every SKETCH_MERGE_STALENESS ns a control thread sums all the
+// cores' counters and publishes, for each core, what the others hold. Counters
+// are written with relaxed atomic stores, since the merger reads them while
+// their core keeps counting.
+
 struct internal_data {
   unsigned hashes[SKETCH_HASHES];
-  int present[SKETCH_HASHES];
-  int buckets_indexes[SKETCH_HASHES];
 };
 
 static const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
@@ -628,66 +782,73 @@ static const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
 };
 
 
+struct sketch_bucket {
+  vigor_time_t touched;
+  uint32_t value;
+};
+
 struct Sketch {
-  struct Map *clients;
-  struct Vector *keys;
-  struct Vector *buckets;
-  struct DoubleChain *allocators[SKETCH_HASHES];
+  struct sketch_bucket *buckets;
 
   uint32_t capacity;
   uint16_t threshold;
+  vigor_time_t cutoff;
 
   map_key_hash *kh;
   struct internal_data internal;
-};
 
-struct hash {
-  uint32_t value;
+#ifdef SKETCH_MERGE_STALENESS
+  // Sum of the other cores' counters as of the last merge. The merger fills
+  // the spare array and swaps it in, so readers never see it being written.
+  uint32_t *others;
+  uint32_t *others_spare;
+#endif
 };
 
-struct bucket {
-  uint32_t value;
-};
+#ifdef SKETCH_MERGE_STALENESS
+#define SKETCH_MAX_GROUPS 8
 
-struct sketch_data {
-  unsigned hashes[SKETCH_HASHES];
-  int present[SKETCH_HASHES];
-  int buckets_indexes[SKETCH_HASHES];
+// The n-th sketch allocated by each core (they all run the same nf_init)
+// is the same logical sketch.
+struct sketch_group {
+  struct Sketch *members[RTE_MAX_LCORE];
 };
 
-unsigned find_next_power_of_2_bigger_than(uint32_t d) {
-  assert(d <= 0x80000000);
-  unsigned n = 1;
+static struct sketch_group sketch_groups[SKETCH_MAX_GROUPS];
+RTE_DEFINE_PER_LCORE(unsigned, sketch_allocations);
 
-  while (n < d) {
-    n *= 2;
-  }
+// Swapped out "others" arrays are reclaimed with epochs: a core records the
+// current epoch after every polling round, when it holds no array, and the
+// merger writes an array swapped out at epoch E again only once every core
+// owning a sketch has recorded E or later.
+struct sketch_reader {
+  uint64_t epoch;
+} __rte_cache_aligned;
 
-  return n;
-}
+static struct sketch_reader sketch_readers[RTE_MAX_LCORE];
+static uint64_t sketch_epoch = 1;
 
-bool hash_eq(void *a, void *b) {
-  struct hash *id1 = (struct hash *)a;
-  struct hash *id2 = (struct hash *)b;
+static inline void sketch_quiescent(void) {
+  struct sketch_reader *reader = &sketch_readers[rte_lcore_id()];
+  uint64_t epoch = __atomic_load_n(&sketch_epoch, __ATOMIC_SEQ_CST);
 
-  return (id1->value == id2->value);
+  if (__atomic_load_n(&reader->epoch, __ATOMIC_RELAXED) != epoch) {
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+  }
 }
+#endif
 
-void hash_allocate(void *obj) {
-  struct hash *id = (struct hash *)obj;
-  id->value = 0;
+static inline struct sketch_bucket *sketch_bucket(struct Sketch *sketch,
+                                                  int row) {
+  return &sketch->buckets[sketch->capacity * row +
+                          sketch->internal.hashes[row]];
 }
 
-unsigned hash_hash(void *obj) {
-  struct hash *id = (struct hash *)obj;
-
-  unsigned hash = 0;
-  hash = __builtin_ia32_crc32si(hash, id->value);
-  return hash;
+static inline bool sketch_bucket_live(struct Sketch *sketch,
+                                      struct sketch_bucket *bucket) {
+  return bucket->touched > -1 && bucket->touched >= sketch->cutoff;
 }
 
-void bucket_allocate(void *obj) { (uintptr_t) obj; }
-
 int sketch_allocate(map_key_hash *kh, uint32_t capacity, uint16_t threshold,
                     struct Sketch **sketch_out) {
   assert(SKETCH_HASHES <= SKETCH_SALTS_BANK_SIZE);
@@ -697,151 +858,231 @@ int sketch_allocate(map_key_hash *kh, uint32_t capacity, uint16_t threshold,
     return 0;
   }
 
+  struct sketch_bucket *buckets_alloc = (struct sketch_bucket *)malloc(
+      sizeof(struct sketch_bucket) * capacity * SKETCH_HASHES);
+  if (buckets_alloc == NULL) {
+    free(sketch_alloc);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < capacity * SKETCH_HASHES; i++) {
+    buckets_alloc[i].touched = -1;
+    buckets_alloc[i].value = 0;
+  }
+
   (*sketch_out) = sketch_alloc;
 
+  (*sketch_out)->buckets = buckets_alloc;
   (*sketch_out)->capacity = capacity;
   (*sketch_out)->threshold = threshold;
+  (*sketch_out)->cutoff = 0;
   (*sketch_out)->kh = kh;
 
-  unsigned total_sketch_capacity =
-      find_next_power_of_2_bigger_than(capacity * SKETCH_HASHES);
-
-  (*sketch_out)->clients = NULL;
-  if (map_allocate(hash_eq, hash_hash, total_sketch_capacity,
-                   &((*sketch_out)->clients)) == 0) {
-    return 0;
-  }
-
-  (*sketch_out)->keys = NULL;
-  if (vector_allocate(sizeof(struct hash), total_sketch_capacity, hash_allocate,
-                      &((*sketch_out)->keys)) == 0) {
-    return 0;
+#ifdef SKETCH_MERGE_STALENESS
+  unsigned group_id = RTE_PER_LCORE(sketch_allocations)++;
+  if (group_id >= SKETCH_MAX_GROUPS) {
+    rte_exit(EXIT_FAILURE, "Too many sketches to merge across cores");
   }
 
-  (*sketch_out)->buckets = NULL;
-  if (vector_allocate(sizeof(struct bucket), total_sketch_capacity,
-                      bucket_allocate, &((*sketch_out)->buckets)) == 0) {
+  (*sketch_out)->others =
+      (uint32_t *)calloc(capacity * SKETCH_HASHES, sizeof(uint32_t));
+  (*sketch_out)->others_spare =
+      (uint32_t *)calloc(capacity * SKETCH_HASHES, sizeof(uint32_t));
+  if ((*sketch_out)->others == NULL || (*sketch_out)->others_spare == NULL) {
     return 0;
   }
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    (*sketch_out)->allocators[i] = NULL;
-    if (dchain_allocate(capacity, &((*sketch_out)->allocators[i])) == 0) {
-      return 0;
-    }
-  }
+  // the merger picks the sketch up once it is fully initialized
+  __atomic_store_n(&sketch_groups[group_id].members[rte_lcore_id()],
+                   *sketch_out, __ATOMIC_RELEASE);
+#endif
 
   return 1;
 }
 
+// Mixes the client key hash into 64 bits (MurmurHash3 finalizer), from which
+// every row index is derived: row i uses h1 + i * h2 (Kirsch-Mitzenmacher),
+// mapped onto [0, capacity[ with a multiply-shift instead of a modulo.
+static inline uint64_t sketch_hash64(unsigned key_hash) {
+  uint64_t hash =
+      (((uint64_t)SKETCH_SALTS[1]) << 32 | SKETCH_SALTS[0]) ^ key_hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static inline unsigned sketch_row_index(uint64_t hash, int row,
+                                        uint32_t capacity) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  uint32_t row_hash = h1 + (uint32_t)row * h2;
+  return (unsigned)(((uint64_t)row_hash * capacity) >> 32);
+}
+
 void sketch_compute_hashes(struct Sketch *sketch, void *key) {
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal.buckets_indexes[i] = -1;
-    sketch->internal.present[i] = 0;
-    sketch->internal.hashes[i] = 0;
+  uint64_t hash = sketch_hash64(sketch->kh(key));
 
-    sketch->internal.hashes[i] =
-        __builtin_ia32_crc32si(sketch->internal.hashes[i], SKETCH_SALTS[i]);
-    sketch->internal.hashes[i] =
-        __builtin_ia32_crc32si(sketch->internal.hashes[i], sketch->kh(key));
-    sketch->internal.hashes[i] %= sketch->capacity;
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    sketch->internal.hashes[i] = sketch_row_index(hash, i, sketch->capacity);
   }
 }
 
 void sketch_refresh(struct Sketch *sketch, vigor_time_t now) {
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    map_get(sketch->clients, &sketch->internal.hashes[i],
-            &sketch->internal.buckets_indexes[i]);
-    dchain_rejuvenate_index(sketch->allocators[i],
-                            sketch->internal.buckets_indexes[i], now);
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+
+    if (sketch_bucket_live(sketch, bucket)) {
+      __atomic_store_n(&bucket->touched, now, __ATOMIC_RELAXED);
+    }
   }
 }
 
 int sketch_fetch(struct Sketch *sketch) {
-  int bucket_min_set = false;
-  uint32_t *buckets_values[SKETCH_HASHES];
-  uint32_t bucket_min = 0;
+  uint32_t bucket_min = UINT32_MAX;
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal.present[i] =
-        map_get(sketch->clients, &sketch->internal.hashes[i],
-                &sketch->internal.buckets_indexes[i]);
+#ifdef SKETCH_MERGE_STALENESS
+  uint32_t *others = __atomic_load_n(&sketch->others, __ATOMIC_ACQUIRE);
+#endif
 
-    if (!sketch->internal.present[i]) {
-      continue;
-    }
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
+    uint32_t value = sketch_bucket_live(sketch, bucket) ? bucket->value : 0;
 
-    int offseted = sketch->internal.buckets_indexes[i] + sketch->capacity * i;
-    vector_borrow(sketch->buckets, offseted, (void **)&buckets_values[i]);
+#ifdef SKETCH_MERGE_STALENESS
+    value += others[bucket - sketch->buckets];
+#endif
 
-    if (!bucket_min_set || bucket_min > *buckets_values[i]) {
-      bucket_min = *buckets_values[i];
-      bucket_min_set = true;
+    if (bucket_min > value) {
+      bucket_min = value;
     }
-
-    vector_return(sketch->buckets, offseted, buckets_values[i]);
   }
 
-  return bucket_min_set && bucket_min > sketch->threshold;
+  return bucket_min > sketch->threshold;
 }
 
 int sketch_touch_buckets(struct Sketch *sketch, vigor_time_t now) {
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    int bucket_index = -1;
-    int present =
-        map_get(sketch->clients, &sketch->internal.hashes[i], &bucket_index);
+    struct sketch_bucket *bucket = sketch_bucket(sketch, i);
 
-    if (!present) {
-      int allocated_client =
-          dchain_allocate_new_index(sketch->allocators[i], &bucket_index, now);
+    uint32_t value = sketch_bucket_live(sketch, bucket) ? bucket->value + 1 : 0;
 
-      if (!allocated_client) {
-        // Sketch size limit reached.
-        return false;
-      }
+    __atomic_store_n(&bucket->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->touched, now, __ATOMIC_RELAXED);
+  }
+
+  return true;
+}
+
+#ifdef SKETCH_MERGE_STALENESS
+// Reads every member's live counters exactly once per bucket, so that the
+// published "others" never include a core's own contribution. Members keep
+// counting meanwhile, the merge only needs to be about as fresh as its period.
+// The spare arrays must no longer be read by any core, see sketch_merger_main.
+static void sketch_merge(struct sketch_group *group) {
+  struct Sketch *members[RTE_MAX_LCORE];
+  uint32_t values[RTE_MAX_LCORE];
+  unsigned n_members = 0;
+
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    struct Sketch *member =
+        __atomic_load_n(&group->members[lcore_id], __ATOMIC_ACQUIRE);
+    if (member != NULL) {
+      members[n_members++] = member;
+    }
+  }
 
-      int offseted = bucket_index + sketch->capacity * i;
+  if (n_members == 0) {
+    return;
+  }
 
-      uint32_t *saved_hash = 0;
-      uint32_t *saved_bucket = 0;
+  uint32_t size = members[0]->capacity * SKETCH_HASHES;
+  vigor_time_t cutoffs[RTE_MAX_LCORE];
 
-      vector_borrow(sketch->keys, offseted, (void **)&saved_hash);
-      vector_borrow(sketch->buckets, offseted, (void **)&saved_bucket);
+  for (unsigned m = 0; m < n_members; m++) {
+    cutoffs[m] = __atomic_load_n(&members[m]->cutoff, __ATOMIC_RELAXED);
+  }
 
-      (*saved_hash) = sketch->internal.hashes[i];
-      (*saved_bucket) = 0;
-      map_put(sketch->clients, saved_hash, bucket_index);
+  for (uint32_t b = 0; b < size; b++) {
+    uint32_t total = 0;
 
-      vector_return(sketch->keys, offseted, saved_hash);
-      vector_return(sketch->buckets, offseted, saved_bucket);
-    } else {
-      dchain_rejuvenate_index(sketch->allocators[i], bucket_index, now);
-      uint32_t *bucket;
-      int offseted = bucket_index + sketch->capacity * i;
-      vector_borrow(sketch->buckets, offseted, (void **)&bucket);
-      (*bucket)++;
-      vector_return(sketch->buckets, offseted, bucket);
+    for (unsigned m = 0; m < n_members; m++) {
+      struct sketch_bucket *bucket = &members[m]->buckets[b];
+      vigor_time_t touched =
+          __atomic_load_n(&bucket->touched, __ATOMIC_RELAXED);
+      bool live = touched > -1 && touched >= cutoffs[m];
+      values[m] = live ? __atomic_load_n(&bucket->value, __ATOMIC_RELAXED) : 0;
+      total += values[m];
+    }
+
+    for (unsigned m = 0; m < n_members; m++) {
+      members[m]->others_spare[b] = total - values[m];
     }
   }
 
-  return true;
+  for (unsigned m = 0; m < n_members; m++) {
+    uint32_t *published = members[m]->others;
+    __atomic_store_n(&members[m]->others, members[m]->others_spare,
+                     __ATOMIC_RELEASE);
+    members[m]->others_spare = published;
+  }
 }
 
-void sketch_expire(struct Sketch *sketch, vigor_time_t time) {
-  int offset = 0;
-  int index = -1;
+static void *sketch_merger_main(void *arg) {
+  struct timespec period = {
+    .tv_sec = SKETCH_MERGE_STALENESS / 1000000000l,
+    .tv_nsec = SKETCH_MERGE_STALENESS % 1000000000l,
+  };
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    offset = i * sketch->capacity;
+  // epoch at which the spare arrays were swapped out, none were yet
+  uint64_t retired_epoch = 0;
+
+  while (1) {
+    nanosleep(&period, NULL);
+
+    // cores still reading a spare array drop it by their next polling round
+    unsigned lcore_id;
+    RTE_LCORE_FOREACH(lcore_id) {
+      bool reader = false;
+      for (int group = 0; group < SKETCH_MAX_GROUPS; group++) {
+        reader |= __atomic_load_n(&sketch_groups[group].members[lcore_id],
+                                  __ATOMIC_ACQUIRE) != NULL;
+      }
+
+      while (reader && __atomic_load_n(&sketch_readers[lcore_id].epoch,
+                                       __ATOMIC_SEQ_CST) < retired_epoch) {
+        rte_pause();
+      }
+    }
 
-    while (dchain_expire_one_index(sketch->allocators[i], &index, time)) {
-      void *key;
-      vector_borrow(sketch->keys, index + offset, &key);
-      map_erase(sketch->clients, key, &key);
-      vector_return(sketch->keys, index + offset, key);
+    for (int group = 0; group < SKETCH_MAX_GROUPS; group++) {
+      sketch_merge(&sketch_groups[group]);
     }
+
+    retired_epoch = __atomic_add_fetch(&sketch_epoch, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+// The merge costs a pass over every core's counters, it runs on a control
+// thread instead of on some core's packet path.
+static void sketch_merger_start(void) {
+  pthread_t thread;
+  int retval = rte_ctrl_thread_create(&thread, "sketch-merger", NULL,
+                                      sketch_merger_main, NULL);
+  if (retval != 0) {
+    rte_exit(EXIT_FAILURE, "Cannot start the sketch merger: %d\n", retval);
   }
 }
+#endif
+
+void sketch_expire(struct Sketch *sketch, vigor_time_t time) {
+  __atomic_store_n(&sketch->cutoff, time, __ATOMIC_RELAXED);
+}
 
 /**********************************************
  *
@@ -985,6 +1226,10 @@ unsigned rte_ether_addr_hash(void* obj) {
 #define RSS_HASH_KEY_LENGTH 52
 #define MAX_NUM_DEVICES 32 // this is quite arbitrary...
 
+#if defined(SOFTWARE_RSS) && !defined(SOFTWARE_RSS_DISPATCHERS)
+#define SOFTWARE_RSS_DISPATCHERS 1 // cores dispatching to the workers
+#endif
+
 struct rte_eth_rss_conf rss_conf[MAX_NUM_DEVICES];
 
 struct lcore_conf {
@@ -1053,7 +1298,12 @@ void set_reta(uint16_t device) {
 }
 
 uint32_t spread_data_among_cores(uint32_t capacity) {
+#ifdef SOFTWARE_RSS
+    // only the workers hold state
+    capacity /= rte_lcore_count() - SOFTWARE_RSS_DISPATCHERS;
+#else
     capacity /= rte_lcore_count();
+#endif
 
     // find power of 2
     for (int pow = 0; pow < 32; pow++) {
@@ -1067,171 +1317,1491 @@ uint32_t spread_data_among_cores(uint32_t capacity) {
 	return 0; // silence warning
 }
 
+#ifdef RETA_REBALANCE_PERIOD
 /**********************************************
  *
- *                  NF
+ *                  RETA-BALANCER
  *
  **********************************************/
 
-bool nf_init(void);
-int nf_process(uint16_t device, uint8_t *buffer, uint16_t packet_length,
-               vigor_time_t now);
+// Every core counts the packets it receives per RETA bucket, and a control
+// thread moves hot buckets from overloaded queues to underloaded ones every
+// RETA_REBALANCE_PERIOD ns. A queue is overloaded when it receives more than
+// RETA_REBALANCE_SLACK percent above the mean. The RSS keys make both
+// directions of a flow hash to the same bucket, so a bucket moves on all
+// devices at once, and all devices must start with the same RETA.
+//
+// NF state is per core, so a moved bucket is handed off. By default it is
+// drained: for RETA_HANDOFF_DRAIN ns, its packets are sent back by the new
+// core to the previous one over that core's handoff ring, and keep finding
+// their state there while it ages out. Flows outliving the drain start over on
+// the new core. With FLOW_MIGRATION, the state of the bucket's flows moves to
+// the new core instead (see FLOW-MIGRATION). Either way, a bucket is not moved
+// again while it is being handed off.
+#define RETA_REBALANCE_SLACK 10     // %
+#define RETA_REBALANCE_MAX_MOVES 16 // per round
+#ifndef RETA_HANDOFF_DRAIN
+#define RETA_HANDOFF_DRAIN (10 * 1000000000l) // ns
+#endif
+#define RETA_HANDOFF_RING_SIZE 1024
+
+#ifdef FLOW_MIGRATION
+struct migration_job;
+
+static void migration_init(unsigned lcore_id);
+static inline bool migration_route(struct rte_mbuf *packet, uint16_t bucket,
+                                   unsigned lcore_id, vigor_time_t now);
+static void migration_retire(void);
+static bool migration_plan(uint16_t bucket, unsigned from, unsigned to,
+                           vigor_time_t now);
+static void migration_post(bool retas_updated);
+#endif // FLOW_MIGRATION
+
+struct reta_handoff {
+#ifdef FLOW_MIGRATION
+  struct migration_job *job;
+#else
+  unsigned from; // lcore owning the bucket before it moved
+  vigor_time_t until;
+#endif
+};
 
-#define FLOOD_FRAME ((uint16_t)-1)
+struct reta_balancer {
+  uint16_t size; // of the RETAs, 0 if they cannot be rebalanced
+  uint16_t reta[ETH_RSS_RETA_SIZE_512]; // bucket -> queue, as programmed
+  struct reta_handoff handoffs[ETH_RSS_RETA_SIZE_512];
+  // [queue][bucket] packets received, each queue written by its own core
+  uint32_t *loads;
+  uint32_t *seen; // loads as of the last round
+};
 
-// Unverified support for batching, useful for performance comparisons
-#define VIGOR_BATCH_SIZE 32
+static struct reta_balancer reta_balancer;
+static unsigned queue_lcores[RTE_MAX_LCORE];
+static struct rte_ring *handoff_rings[RTE_MAX_LCORE];
 
-// Do the opposite: we want batching!
-static const uint16_t RX_QUEUE_SIZE = 1024;
-static const uint16_t TX_QUEUE_SIZE = 1024;
+static int reta_balancer_query(uint16_t device, uint16_t *reta) {
+  struct rte_eth_rss_reta_entry64 reta_conf[RETA_CONF_SIZE];
 
-// Buffer count for mempools
-static const unsigned MEMPOOL_BUFFER_COUNT = 2048;
+  memset(reta_conf, 0, sizeof(reta_conf));
+  for (uint16_t bucket = 0; bucket < reta_balancer.size; bucket++) {
+    reta_conf[bucket / RTE_RETA_GROUP_SIZE].mask = UINT64_MAX;
+  }
+
+  int retval =
+      rte_eth_dev_rss_reta_query(device, reta_conf, reta_balancer.size);
+  if (retval != 0) {
+    return retval;
+  }
+
+  for (uint16_t bucket = 0; bucket < reta_balancer.size; bucket++) {
+    reta[bucket] = reta_conf[bucket / RTE_RETA_GROUP_SIZE]
+                       .reta[bucket % RTE_RETA_GROUP_SIZE];
+  }
+
+  return 0;
+}
+
+// @returns 0 if the RETAs cannot be rebalanced
+static uint16_t reta_balancer_sync(void) {
+  uint16_t nb_devices = rte_eth_dev_count_avail();
+  uint16_t reta[ETH_RSS_RETA_SIZE_512];
 
-// Send the given packet to all devices except the packet's own
-void flood(struct rte_mbuf *packet, uint16_t nb_devices, uint16_t queue_id) {
-  rte_mbuf_refcnt_set(packet, nb_devices - 1);
-  int total_sent = 0;
-  uint16_t skip_device = packet->port;
   for (uint16_t device = 0; device < nb_devices; device++) {
-    if (device != skip_device) {
-      total_sent += rte_eth_tx_burst(device, queue_id, &packet, 1);
+    struct rte_eth_dev_info dev_info;
+    rte_eth_dev_info_get(device, &dev_info);
+
+    if (dev_info.reta_size != reta_balancer.size ||
+        reta_balancer_query(device, device == 0 ? reta_balancer.reta : reta) !=
+            0) {
+      return 0;
+    }
+
+    if (device > 0 && memcmp(reta, reta_balancer.reta,
+                             sizeof(uint16_t) * reta_balancer.size) != 0) {
+      return 0;
     }
   }
-  // should not happen, but in case we couldn't transmit, ensure the packet is
-  // freed
-  if (total_sent != nb_devices - 1) {
-    rte_mbuf_refcnt_set(packet, 1);
-    rte_pktmbuf_free(packet);
-  }
+
+  return reta_balancer.size;
 }
 
-// Initializes the given device using the given memory pool
-static int nf_init_device(uint16_t device, struct rte_mempool **mbuf_pools) {
-  int retval;
-  const uint16_t num_queues = rte_lcore_count();
+static void reta_balancer_init(void) {
+  unsigned lcores = rte_lcore_count();
 
-  // device_conf passed to rte_eth_dev_configure cannot be NULL
-  struct rte_eth_conf device_conf = { 0 };
-  // device_conf.rxmode.hw_strip_crc = 1;
-  device_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
-  device_conf.rx_adv_conf.rss_conf = rss_conf[device];
+  struct rte_eth_dev_info dev_info;
+  rte_eth_dev_info_get(0, &dev_info);
 
-  retval = rte_eth_dev_configure(device, num_queues, num_queues, &device_conf);
-  if (retval != 0) {
-    return retval;
+  reta_balancer.size = dev_info.reta_size;
+  if (lcores <= 1 || reta_balancer.size == 0 ||
+      reta_balancer.size > ETH_RSS_RETA_SIZE_512 ||
+      (reta_balancer.size & (reta_balancer.size - 1)) != 0) {
+    reta_balancer.size = 0;
+    return;
   }
 
-  // Allocate and set up TX queues
-  for (int txq = 0; txq < num_queues; txq++) {
-    retval = rte_eth_tx_queue_setup(device, txq, TX_QUEUE_SIZE,
-                                    rte_eth_dev_socket_id(device), NULL);
-    if (retval != 0) {
-      return retval;
-    }
+  reta_balancer.loads = (uint32_t *)rte_zmalloc(
+      NULL, sizeof(uint32_t) * lcores * ETH_RSS_RETA_SIZE_512, 64);
+  reta_balancer.seen = (uint32_t *)rte_zmalloc(
+      NULL, sizeof(uint32_t) * lcores * ETH_RSS_RETA_SIZE_512, 64);
+
+  if (reta_balancer.loads == NULL || reta_balancer.seen == NULL ||
+      reta_balancer_sync() == 0) {
+    printf("RETAs will not be rebalanced\n");
+    reta_balancer.size = 0;
   }
+}
 
-  unsigned lcore_id;
-  int rxq = 0;
-  RTE_LCORE_FOREACH(lcore_id) {
-    // Allocate and set up RX queues
-    lcores_conf[lcore_id].queue_id = rxq;
-    retval = rte_eth_rx_queue_setup(device, rxq, RX_QUEUE_SIZE,
-                                    rte_eth_dev_socket_id(device), NULL,
-                                    mbuf_pools[rxq]);
-    if (retval != 0) {
-      return retval;
-    }
+static inline uint16_t reta_balancer_bucket(struct rte_mbuf *packet) {
+  if (reta_balancer.size == 0 || !(packet->ol_flags & PKT_RX_RSS_HASH)) {
+    return ETH_RSS_RETA_SIZE_512;
+  }
+  return packet->hash.rss & (reta_balancer.size - 1);
+}
 
-    rxq++;
+// @returns true if the packet was taken by the bucket's handoff
+static inline bool reta_balancer_route(struct rte_mbuf *packet,
+                                       unsigned lcore_id, vigor_time_t now) {
+  uint16_t bucket = reta_balancer_bucket(packet);
+  if (bucket == ETH_RSS_RETA_SIZE_512) {
+    return false;
   }
 
-  // Start the device
-  retval = rte_eth_dev_start(device);
-  if (retval != 0) {
-    return retval;
+#ifdef FLOW_MIGRATION
+  return migration_route(packet, bucket, lcore_id, now);
+#else
+  struct reta_handoff *handoff = &reta_balancer.handoffs[bucket];
+  if (__atomic_load_n(&handoff->until, __ATOMIC_ACQUIRE) <= now ||
+      handoff->from == lcore_id) {
+    return false;
   }
 
-  // Enable RX in promiscuous mode, just in case
-  rte_eth_promiscuous_enable(device);
-  if (rte_eth_promiscuous_get(device) != 1) {
-    return retval;
+  if (rte_ring_enqueue(handoff_rings[handoff->from], packet) != 0) {
+    rte_pktmbuf_free(packet);
   }
+  return true;
+#endif // FLOW_MIGRATION
+}
 
-  set_reta(device);
+// Counts a packet received from the NIC, then routes it.
+static inline bool reta_balancer_account(struct rte_mbuf *packet,
+                                         uint16_t queue_id, unsigned lcore_id,
+                                         vigor_time_t now) {
+  uint16_t bucket = reta_balancer_bucket(packet);
+  if (bucket == ETH_RSS_RETA_SIZE_512) {
+    return false;
+  }
 
-  return 0;
+  reta_balancer.loads[queue_id * ETH_RSS_RETA_SIZE_512 + bucket]++;
+  return reta_balancer_route(packet, lcore_id, now);
 }
 
-static void worker_main(void) {
-  const unsigned lcore_id = rte_lcore_id();
-  const uint16_t queue_id = lcores_conf[lcore_id].queue_id;
+static bool reta_balancer_handing_off(uint16_t bucket, vigor_time_t now) {
+#ifdef FLOW_MIGRATION
+  return reta_balancer.handoffs[bucket].job != NULL;
+#else
+  return reta_balancer.handoffs[bucket].until > now;
+#endif // FLOW_MIGRATION
+}
 
-  if (!nf_init()) {
-    rte_exit(EXIT_FAILURE, "Error initializing NF");
-  }
+static void reta_balancer_round(vigor_time_t now) {
+  unsigned queues = rte_lcore_count();
 
-  printf("Core %u forwarding packets.\n", rte_lcore_id());
+#ifdef FLOW_MIGRATION
+  migration_retire();
+#endif // FLOW_MIGRATION
 
-  if (rte_eth_dev_count_avail() != 2) {
-    printf("We assume there will be exactly 2 devices for our simple batching "
-           "implementation.");
-    exit(1);
+  uint64_t bucket_loads[ETH_RSS_RETA_SIZE_512] = { 0 };
+  uint64_t queue_loads[RTE_MAX_LCORE] = { 0 };
+  uint64_t total = 0;
+
+  for (unsigned queue = 0; queue < queues; queue++) {
+    uint32_t *loads = &reta_balancer.loads[queue * ETH_RSS_RETA_SIZE_512];
+    uint32_t *seen = &reta_balancer.seen[queue * ETH_RSS_RETA_SIZE_512];
+    for (uint16_t bucket = 0; bucket < reta_balancer.size; bucket++) {
+      uint32_t load = __atomic_load_n(&loads[bucket], __ATOMIC_RELAXED);
+      bucket_loads[bucket] += (uint32_t)(load - seen[bucket]);
+      seen[bucket] = load;
+    }
   }
 
-  printf("Running with batches, this code is unverified!\n");
+  for (uint16_t bucket = 0; bucket < reta_balancer.size; bucket++) {
+    queue_loads[reta_balancer.reta[bucket]] += bucket_loads[bucket];
+    total += bucket_loads[bucket];
+  }
 
-  while (1) {
-    unsigned VIGOR_DEVICES_COUNT = rte_eth_dev_count_avail();
+  uint64_t mean = total / queues;
 
-    for (uint16_t VIGOR_DEVICE = 0; VIGOR_DEVICE < VIGOR_DEVICES_COUNT;
-         VIGOR_DEVICE++) {
-      struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
-      uint16_t rx_count =
-          rte_eth_rx_burst(VIGOR_DEVICE, queue_id, mbufs, VIGOR_BATCH_SIZE);
+  struct rte_eth_rss_reta_entry64 reta_conf[RETA_CONF_SIZE];
+  memset(reta_conf, 0, sizeof(reta_conf));
+  int moves = 0;
+
+  while (moves < RETA_REBALANCE_MAX_MOVES) {
+    unsigned max_queue = 0;
+    unsigned min_queue = 0;
+    for (unsigned queue = 1; queue < queues; queue++) {
+      if (queue_loads[queue] > queue_loads[max_queue]) {
+        max_queue = queue;
+      }
+      if (queue_loads[queue] < queue_loads[min_queue]) {
+        min_queue = queue;
+      }
+    }
 
-      struct rte_mbuf *mbufs_to_send[VIGOR_BATCH_SIZE];
-      uint16_t tx_count = 0;
+    if (queue_loads[max_queue] * 100 <= mean * (100 + RETA_REBALANCE_SLACK)) {
+      break;
+    }
 
-      for (uint16_t n = 0; n < rx_count; n++) {
-        uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
-        vigor_time_t VIGOR_NOW = current_time();
-        uint16_t dst_device =
-            nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
+    // the bucket bringing both queues closest to each other
+    uint64_t gap = queue_loads[max_queue] - queue_loads[min_queue];
+    int best = -1;
+    uint64_t best_distance = UINT64_MAX;
 
-        if (dst_device == VIGOR_DEVICE) {
-          rte_pktmbuf_free(mbufs[n]);
-        } else if (dst_device == FLOOD_FRAME) {
-          flood(mbufs[n], VIGOR_DEVICES_COUNT, queue_id);
-        } else {
-          mbufs_to_send[tx_count] = mbufs[n];
-          tx_count++;
-        }
+    for (uint16_t bucket = 0; bucket < reta_balancer.size; bucket++) {
+      uint64_t load = bucket_loads[bucket];
+      if (reta_balancer.reta[bucket] != max_queue || load == 0 ||
+          load >= gap || reta_balancer_handing_off(bucket, now)) {
+        continue;
       }
 
-      uint16_t sent_count =
-          rte_eth_tx_burst(1 - VIGOR_DEVICE, queue_id, mbufs_to_send, tx_count);
-      for (uint16_t n = sent_count; n < tx_count; n++) {
-        rte_pktmbuf_free(mbufs[n]); // should not happen, but we're in the
-                                    // unverified case anyway
+      uint64_t distance = load > gap / 2 ? load - gap / 2 : gap / 2 - load;
+      if (distance < best_distance) {
+        best = bucket;
+        best_distance = distance;
       }
     }
+
+    if (best < 0) {
+      break;
+    }
+
+    // the handoff is visible before the first packet reaches the new queue
+#ifdef FLOW_MIGRATION
+    if (!migration_plan(best, queue_lcores[max_queue], queue_lcores[min_queue],
+                        now)) {
+      break;
+    }
+#else
+    struct reta_handoff *handoff = &reta_balancer.handoffs[best];
+    handoff->from = queue_lcores[max_queue];
+    __atomic_store_n(&handoff->until, now + RETA_HANDOFF_DRAIN,
+                     __ATOMIC_RELEASE);
+#endif // FLOW_MIGRATION
+
+    reta_balancer.reta[best] = min_queue;
+    queue_loads[max_queue] -= bucket_loads[best];
+    queue_loads[min_queue] += bucket_loads[best];
+
+    reta_conf[best / RTE_RETA_GROUP_SIZE].mask |=
+        1ull << (best % RTE_RETA_GROUP_SIZE);
+    reta_conf[best / RTE_RETA_GROUP_SIZE].reta[best % RTE_RETA_GROUP_SIZE] =
+        min_queue;
+    moves++;
   }
-}
 
-// Entry point
-int main(int argc, char **argv) {
-  // Initialize the DPDK Environment Abstraction Layer (EAL)
-  int ret = rte_eal_init(argc, argv);
-  if (ret < 0) {
-    rte_exit(EXIT_FAILURE, "Error with EAL initialization, ret=%d\n", ret);
+  if (moves == 0) {
+    return;
   }
-  argc -= ret;
-  argv += ret;
 
-  // Create a memory pool
-  unsigned nb_devices = rte_eth_dev_count_avail();
+  bool updated = true;
+  uint16_t nb_devices = rte_eth_dev_count_avail();
+  for (uint16_t device = 0; device < nb_devices; device++) {
+    if (rte_eth_dev_rss_reta_update(device, reta_conf, reta_balancer.size) !=
+        0) {
+      printf("Device %" PRIu16 ": cannot update RETA\n", device);
+      updated = false;
+    }
+  }
+
+#ifdef FLOW_MIGRATION
+  migration_post(updated);
+#endif // FLOW_MIGRATION
+
+  if (!updated) {
+    // packets keep reaching the previous owners, which process them
+    reta_balancer.size = reta_balancer_sync();
+    if (reta_balancer.size == 0) {
+      printf("RETAs will not be rebalanced anymore\n");
+    }
+    return;
+  }
+
+  printf("Moved %d RETA buckets\n", moves);
+}
+
+static void *reta_balancer_main(void *arg) {
+  struct timespec period = {
+    .tv_sec = RETA_REBALANCE_PERIOD / 1000000000l,
+    .tv_nsec = RETA_REBALANCE_PERIOD % 1000000000l,
+  };
+
+  while (reta_balancer.size > 0) {
+    nanosleep(&period, NULL);
+    reta_balancer_round(current_time());
+  }
+
+  return NULL;
+}
+
+static void reta_balancer_start(void) {
+  char ring_name[20];
+  unsigned lcore_id;
+
+  reta_balancer_init();
+
+  RTE_LCORE_FOREACH(lcore_id) {
+    queue_lcores[lcores_conf[lcore_id].queue_id] = lcore_id;
+
+    sprintf(ring_name, "HANDOFF_%u", lcore_id);
+    handoff_rings[lcore_id] = rte_ring_create(
+        ring_name, RETA_HANDOFF_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+    if (handoff_rings[lcore_id] == NULL) {
+      rte_exit(EXIT_FAILURE, "Cannot create handoff ring: %s\n",
+               rte_strerror(rte_errno));
+    }
+
+#ifdef FLOW_MIGRATION
+    migration_init(lcore_id);
+#endif // FLOW_MIGRATION
+  }
+
+  if (reta_balancer.size == 0) {
+    return;
+  }
+
+  pthread_t thread;
+  int retval = rte_ctrl_thread_create(&thread, "reta-balancer", NULL,
+                                      reta_balancer_main, NULL);
+  if (retval != 0) {
+    rte_exit(EXIT_FAILURE, "Cannot start the RETA balancer: %d\n", retval);
+  }
+}
+#endif // RETA_REBALANCE_PERIOD
+
+#ifdef FLOW_MIGRATION
+/**********************************************
+ *
+ *                  FLOW-MIGRATION
+ *
+ **********************************************/
+
+// With FLOW_MIGRATION, the flows of the RETA buckets moved from core A to core
+// B take their state along. Dchains record the bucket of the packet that last
+// allocated or rejuvenated each index, and a table is a dchain along with the
+// maps and vectors of the same capacity. Once the RETAs point to B:
+//  - B buffers the packets of the moved buckets until their state is in;
+//  - A hands off the packets of the moved buckets it still gets to B, then
+//    scans its tables, packing the entries of those buckets into chunks sent
+//    to B and releasing them;
+//  - B inserts the entries, unless it already holds one of their keys, and
+//    processes the buffered packets once the last chunk is in, or after
+//    MIGRATION_TIMEOUT ns.
+//
+// Migrated entries keep their indexes, since NFs may derive values from them
+// (e.g. NAT ports). B reserves them, once per chunk and table, in a single walk
+// of the dchain's free list. An entry whose index B already uses is dropped and
+// its flow starts over on B, as when B already holds its key. Every core hands
+// out indexes starting from its own part of the range, so this is rare.
+// Migrated entries expire after the entries B allocated before them. Keys
+// stored outside the table's vectors, and tables whose capacity is shared with
+// another dchain, are not migrated.
+#define MIGRATION_MAX_JOBS 64
+#define MIGRATION_MAX_KEYS 8
+#define MIGRATION_CHUNK_SIZE (16 * 1024)
+#define MIGRATION_RING_SIZE 64
+#define MIGRATION_CHUNK_BURST 4
+#define MIGRATION_SCAN_STEP 256 // indexes per loop iteration
+#define MIGRATION_BUFFER_SIZE 1024
+#ifndef MIGRATION_TIMEOUT
+#define MIGRATION_TIMEOUT (100 * 1000000l) // ns
+#endif
+
+enum migration_state {
+  MIGRATION_FREE,
+  MIGRATION_PLANNED,
+  MIGRATION_RUNNING,
+  MIGRATION_RETIRED,
+};
+
+// The buckets moved from one core to another in a round.
+struct migration_job {
+  enum migration_state state; // only seen by the control thread
+  unsigned from;
+  unsigned to;
+  uint64_t buckets[ETH_RSS_RETA_SIZE_512 / 64];
+  vigor_time_t deadline;
+
+  // written by A
+  bool released; // A no longer processes the buckets
+  unsigned table; // scan cursor
+  int index;
+  struct migration_chunk *chunk; // being filled
+
+  // written by B
+  bool done;     // B processes the buckets
+  bool finished; // the last chunk is in
+  unsigned flows;
+} __attribute__((aligned(64)));
+
+struct migration_chunk {
+  struct migration_job *job;
+  uint32_t used;
+  bool last;
+  uint8_t data[MIGRATION_CHUNK_SIZE];
+};
+
+// A table entry, followed by its element in each of the table's vectors.
+struct migration_record {
+  uint32_t size; // rounded up to 8 bytes
+  uint16_t table;
+  uint16_t bucket;
+  int32_t index;
+  vigor_time_t time;
+  uint8_t nb_keys;
+  struct {
+    uint8_t map;
+    uint8_t vector;  // holding the key, in the element of the entry
+    uint16_t offset; // of the key in the element
+  } keys[MIGRATION_MAX_KEYS];
+} __attribute__((aligned(8)));
+
+struct migration_table {
+  struct DoubleChain *dchain;
+  struct Map *maps[MIGRATION_MAX_KEYS];
+  struct Vector *vectors[MIGRATION_MAX_OBJECTS];
+  uint32_t offsets[MIGRATION_MAX_OBJECTS]; // of the elements in a record
+  unsigned nb_maps;
+  unsigned nb_vectors;
+  uint32_t record_size;
+  uint64_t *reserve; // [index / 64] bit set for the indexes B reserves
+  bool reserving;
+};
+
+struct migration_core {
+  bool ready;
+  struct migration_table tables[MIGRATION_MAX_OBJECTS];
+  unsigned nb_tables;
+
+  // A
+  struct migration_job *sources[MIGRATION_MAX_JOBS]; // scanned in order
+  unsigned nb_sources;
+
+  // B
+  struct rte_mbuf *buffered[MIGRATION_BUFFER_SIZE];
+  struct migration_job *buffered_jobs[MIGRATION_BUFFER_SIZE];
+  unsigned nb_buffered;
+};
+
+static struct migration_job migration_jobs[MIGRATION_MAX_JOBS];
+static struct migration_core *migration_cores[RTE_MAX_LCORE];
+static struct rte_ring *migration_requests[RTE_MAX_LCORE]; // jobs, to A
+static struct rte_ring *migration_rings[RTE_MAX_LCORE];    // chunks, to B
+
+static inline bool migration_moves(struct migration_job *job,
+                                   uint16_t bucket) {
+  return bucket < ETH_RSS_RETA_SIZE_512 &&
+         ((job->buckets[bucket / 64] >> (bucket % 64)) & 1);
+}
+
+static void migration_init(unsigned lcore_id) {
+  char ring_name[20];
+
+  migration_cores[lcore_id] = (struct migration_core *)rte_zmalloc(
+      NULL, sizeof(struct migration_core), 64);
+  if (migration_cores[lcore_id] == NULL) {
+    rte_exit(EXIT_FAILURE, "Cannot allocate flow migration state\n");
+  }
+
+  sprintf(ring_name, "MIGRATION_REQ_%u", lcore_id);
+  migration_requests[lcore_id] =
+      rte_ring_create(ring_name, 2 * MIGRATION_MAX_JOBS, rte_socket_id(),
+                      RING_F_SP_ENQ | RING_F_SC_DEQ);
+
+  sprintf(ring_name, "MIGRATION_%u", lcore_id);
+  migration_rings[lcore_id] = rte_ring_create(
+      ring_name, MIGRATION_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+
+  if (migration_requests[lcore_id] == NULL ||
+      migration_rings[lcore_id] == NULL) {
+    rte_exit(EXIT_FAILURE, "Cannot create flow migration ring: %s\n",
+             rte_strerror(rte_errno));
+  }
+}
+
+// Runs on each core once nf_init allocated its objects.
+static void migration_tables_init(struct migration_core *core,
+                                  unsigned lcore_id) {
+  struct migration_objects *objects = &migration_objects[lcore_id];
+
+  for (unsigned d = 0; d < objects->nb_dchains; d++) {
+    struct DoubleChain *dchain = objects->dchains[d];
+    struct migration_table *table = &core->tables[core->nb_tables];
+    bool shared = false;
+
+    for (unsigned other = 0; other < objects->nb_dchains; other++) {
+      shared |= other != d && objects->dchains[other]->range == dchain->range;
+    }
+
+    table->dchain = dchain;
+    table->nb_maps = 0;
+    table->nb_vectors = 0;
+    table->record_size = sizeof(struct migration_record);
+
+    for (unsigned m = 0; m < objects->nb_maps; m++) {
+      if (objects->maps[m]->capacity == (unsigned)dchain->range &&
+          table->nb_maps < MIGRATION_MAX_KEYS) {
+        table->maps[table->nb_maps++] = objects->maps[m];
+      }
+    }
+
+    for (unsigned v = 0; v < objects->nb_vectors; v++) {
+      if (objects->vectors[v]->capacity == (unsigned)dchain->range) {
+        table->offsets[table->nb_vectors] = table->record_size;
+        table->vectors[table->nb_vectors++] = objects->vectors[v];
+        table->record_size += objects->vectors[v]->elem_size;
+      }
+    }
+
+    table->record_size = RTE_ALIGN_CEIL(table->record_size, 8);
+
+    if (shared || table->nb_maps == 0 ||
+        table->record_size > MIGRATION_CHUNK_SIZE) {
+      if (lcore_id == rte_get_master_lcore()) {
+        printf("Flows of dchain %u will not be migrated\n", d);
+      }
+      continue;
+    }
+
+    table->reserve = (uint64_t *)rte_zmalloc(
+        NULL, sizeof(uint64_t) * ((dchain->range + 63) / 64), 64);
+    if (table->reserve == NULL) {
+      rte_exit(EXIT_FAILURE, "Cannot allocate flow migration state\n");
+    }
+    table->reserving = false;
+
+    core->nb_tables++;
+  }
+
+  core->ready = true;
+}
+
+// Packs the entry at index into the job's chunk, then releases it.
+// @returns false if the chunk is full
+static bool migration_take(struct migration_core *core,
+                           struct migration_job *job, int index) {
+  struct migration_table *table = &core->tables[job->table];
+  struct migration_chunk *chunk = job->chunk;
+
+  if (chunk->used + table->record_size > MIGRATION_CHUNK_SIZE) {
+    return false;
+  }
+
+  struct migration_record *record =
+      (struct migration_record *)(chunk->data + chunk->used);
+  record->size = table->record_size;
+  record->table = job->table;
+  record->bucket = table->dchain->buckets[index];
+  record->index = index;
+  record->time = table->dchain->timestamps[index];
+  record->nb_keys = 0;
+
+  for (unsigned v = 0; v < table->nb_vectors; v++) {
+    void *value;
+    vector_borrow(table->vectors[v], index, &value);
+    memcpy((uint8_t *)record + table->offsets[v], value,
+           table->vectors[v]->elem_size);
+    vector_return(table->vectors[v], index, value);
+  }
+
+  for (unsigned m = 0; m < table->nb_maps; m++) {
+    uint8_t *key = (uint8_t *)table->maps[m]->keys_of[index];
+    int value;
+
+    if (key == NULL || !map_get(table->maps[m], key, &value) ||
+        value != index) {
+      continue;
+    }
+
+    for (unsigned v = 0; v < table->nb_vectors; v++) {
+      uint8_t *elem;
+      vector_borrow(table->vectors[v], index, (void **)&elem);
+      if (key >= elem && key < elem + table->vectors[v]->elem_size) {
+        record->keys[record->nb_keys].map = m;
+        record->keys[record->nb_keys].vector = v;
+        record->keys[record->nb_keys].offset = key - elem;
+        record->nb_keys++;
+        break;
+      }
+    }
+  }
+
+  for (unsigned k = 0; k < record->nb_keys; k++) {
+    void *key;
+    vector_borrow(table->vectors[record->keys[k].vector], index, &key);
+    map_erase(table->maps[record->keys[k].map],
+              (uint8_t *)key + record->keys[k].offset, &key);
+  }
+  dchain_free_index(table->dchain, index);
+
+  chunk->used += record->size;
+  return true;
+}
+
+// Marks the index of the record for reservation, unless it cannot be kept.
+static void migration_reserve(struct migration_core *core,
+                              struct migration_record *record) {
+  if (record->table >= core->nb_tables) {
+    return;
+  }
+
+  struct migration_table *table = &core->tables[record->table];
+  int index = record->index;
+
+  if (index < 0 || index >= table->dchain->range ||
+      dchain_is_index_allocated(table->dchain, index)) {
+    return; // B uses the index for another flow
+  }
+
+  for (unsigned k = 0; k < record->nb_keys; k++) {
+    uint8_t *key = (uint8_t *)record +
+                   table->offsets[record->keys[k].vector] +
+                   record->keys[k].offset;
+    int value;
+    if (map_get(table->maps[record->keys[k].map], key, &value)) {
+      return; // the flow started over on this core
+    }
+  }
+
+  table->reserve[index / 64] |= 1ull << (index % 64);
+  table->reserving = true;
+}
+
+static void migration_insert(struct migration_core *core,
+                             struct migration_job *job,
+                             struct migration_record *record) {
+  if (record->table >= core->nb_tables) {
+    return;
+  }
+
+  struct migration_table *table = &core->tables[record->table];
+  int index = record->index;
+
+  if (index < 0 || index >= table->dchain->range ||
+      ((table->reserve[index / 64] >> (index % 64)) & 1) == 0) {
+    return;
+  }
+
+  table->reserve[index / 64] &= ~(1ull << (index % 64));
+  table->dchain->timestamps[index] = record->time;
+  table->dchain->buckets[index] = record->bucket;
+
+  for (unsigned v = 0; v < table->nb_vectors; v++) {
+    void *value;
+    vector_borrow(table->vectors[v], index, &value);
+    memcpy(value, (uint8_t *)record + table->offsets[v],
+           table->vectors[v]->elem_size);
+    vector_return(table->vectors[v], index, value);
+  }
+
+  for (unsigned k = 0; k < record->nb_keys; k++) {
+    void *key;
+    vector_borrow(table->vectors[record->keys[k].vector], index, &key);
+    map_put(table->maps[record->keys[k].map],
+            (uint8_t *)key + record->keys[k].offset, index);
+  }
+
+  job->flows++;
+}
+
+// Inserts the records of a chunk, with the indexes they had on A.
+static void migration_insert_chunk(struct migration_core *core,
+                                   struct migration_chunk *chunk) {
+  for (uint32_t offset = 0; offset < chunk->used;) {
+    struct migration_record *record =
+        (struct migration_record *)(chunk->data + offset);
+    migration_reserve(core, record);
+    offset += record->size;
+  }
+
+  for (unsigned t = 0; t < core->nb_tables; t++) {
+    struct migration_table *table = &core->tables[t];
+    if (table->reserving) {
+      dchain_impl_reserve_indexes(table->dchain->cells, table->reserve);
+      table->reserving = false;
+    }
+  }
+
+  for (uint32_t offset = 0; offset < chunk->used;) {
+    struct migration_record *record =
+        (struct migration_record *)(chunk->data + offset);
+    migration_insert(core, chunk->job, record);
+    offset += record->size;
+  }
+}
+
+// @returns false if the destination ring is full
+static bool migration_push(struct migration_job *job) {
+  if (rte_ring_enqueue(migration_rings[job->to], job->chunk) != 0) {
+    return false;
+  }
+  job->chunk = NULL;
+  return true;
+}
+
+static bool migration_chunk_new(struct migration_job *job) {
+  if (job->chunk == NULL) {
+    job->chunk = (struct migration_chunk *)rte_malloc(
+        NULL, sizeof(struct migration_chunk), 64);
+    if (job->chunk == NULL) {
+      return false;
+    }
+    job->chunk->job = job;
+    job->chunk->used = 0;
+    job->chunk->last = false;
+  }
+  return true;
+}
+
+// Scans up to MIGRATION_SCAN_STEP indexes of the tables on A.
+// @returns true once the last chunk was sent
+static bool migration_scan(struct migration_core *core,
+                           struct migration_job *job) {
+  for (unsigned step = 0;
+       step < MIGRATION_SCAN_STEP && job->table < core->nb_tables; step++) {
+    struct DoubleChain *dchain = core->tables[job->table].dchain;
+
+    if (job->index == dchain->range) {
+      job->table++;
+      job->index = 0;
+      continue;
+    }
+
+    if (!dchain_is_index_allocated(dchain, job->index) ||
+        !migration_moves(job, dchain->buckets[job->index])) {
+      job->index++;
+      continue;
+    }
+
+    if (!migration_chunk_new(job)) {
+      return false;
+    }
+
+    if (migration_take(core, job, job->index)) {
+      job->index++;
+    } else if (!migration_push(job)) {
+      return false;
+    }
+  }
+
+  if (job->table < core->nb_tables || !migration_chunk_new(job)) {
+    return false;
+  }
+
+  job->chunk->last = true;
+  return migration_push(job);
+}
+
+static inline bool migration_route(struct rte_mbuf *packet, uint16_t bucket,
+                                   unsigned lcore_id, vigor_time_t now) {
+  struct migration_job *job = __atomic_load_n(
+      &reta_balancer.handoffs[bucket].job, __ATOMIC_ACQUIRE);
+  if (job == NULL) {
+    return false;
+  }
+
+  if (lcore_id == job->from) {
+    if (!__atomic_load_n(&job->released, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+
+    if (rte_ring_enqueue(handoff_rings[job->to], packet) != 0) {
+      rte_pktmbuf_free(packet);
+    }
+    return true;
+  }
+
+  if (lcore_id != job->to || __atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  struct migration_core *core = migration_cores[lcore_id];
+  if (core->nb_buffered == MIGRATION_BUFFER_SIZE) {
+    rte_pktmbuf_free(packet);
+    return true;
+  }
+
+  core->buffered[core->nb_buffered] = packet;
+  core->buffered_jobs[core->nb_buffered] = job;
+  core->nb_buffered++;
+  return true;
+}
+
+// Runs this core's side of the migrations.
+// @returns the buffered packets that can now be processed
+static unsigned migration_poll(unsigned lcore_id, vigor_time_t now,
+                               struct rte_mbuf **packets, unsigned max) {
+  struct migration_core *core = migration_cores[lcore_id];
+
+  if (!core->ready) {
+    migration_tables_init(core, lcore_id);
+  }
+
+  // A: from now on, the packets of the moved buckets go to B
+  struct migration_job *jobs[MIGRATION_MAX_JOBS];
+  unsigned count = rte_ring_sc_dequeue_burst(
+      migration_requests[lcore_id], (void **)jobs, MIGRATION_MAX_JOBS, NULL);
+
+  for (unsigned n = 0; n < count; n++) {
+    __atomic_store_n(&jobs[n]->released, true, __ATOMIC_RELEASE);
+    core->sources[core->nb_sources++] = jobs[n];
+  }
+
+  if (core->nb_sources > 0 && migration_scan(core, core->sources[0])) {
+    core->nb_sources--;
+    memmove(&core->sources[0], &core->sources[1],
+            sizeof(struct migration_job *) * core->nb_sources);
+  }
+
+  // B: entries coming in
+  struct migration_chunk *chunks[MIGRATION_CHUNK_BURST];
+  count = rte_ring_sc_dequeue_burst(migration_rings[lcore_id], (void **)chunks,
+                                    MIGRATION_CHUNK_BURST, NULL);
+
+  for (unsigned n = 0; n < count; n++) {
+    struct migration_job *job = chunks[n]->job;
+
+    migration_insert_chunk(core, chunks[n]);
+
+    if (chunks[n]->last) {
+      __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+      __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+    }
+
+    rte_free(chunks[n]);
+  }
+
+  // B: packets whose state is in, or waited for too long
+  unsigned released = 0;
+  unsigned kept = 0;
+
+  for (unsigned n = 0; n < core->nb_buffered; n++) {
+    struct migration_job *job = core->buffered_jobs[n];
+
+    bool done = __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+
+    if (!done && now >= job->deadline) {
+      __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+      done = true;
+    }
+
+    if (done && released < max) {
+      packets[released++] = core->buffered[n];
+    } else {
+      core->buffered[kept] = core->buffered[n];
+      core->buffered_jobs[kept] = job;
+      kept++;
+    }
+  }
+
+  core->nb_buffered = kept;
+  return released;
+}
+
+// Control thread: assigns a moved bucket to this round's job for its cores.
+// @returns false if there are too many migrations going on
+static bool migration_plan(uint16_t bucket, unsigned from, unsigned to,
+                           vigor_time_t now) {
+  struct migration_job *job = NULL;
+  struct migration_job *free_job = NULL;
+
+  for (unsigned j = 0; j < MIGRATION_MAX_JOBS && job == NULL; j++) {
+    struct migration_job *candidate = &migration_jobs[j];
+    if (candidate->state == MIGRATION_PLANNED && candidate->from == from &&
+        candidate->to == to) {
+      job = candidate;
+    } else if (candidate->state == MIGRATION_FREE && free_job == NULL) {
+      free_job = candidate;
+    }
+  }
+
+  if (job == NULL) {
+    if (free_job == NULL) {
+      return false;
+    }
+
+    job = free_job;
+    memset(job, 0, sizeof(struct migration_job));
+    job->state = MIGRATION_PLANNED;
+    job->from = from;
+    job->to = to;
+    job->deadline = now + MIGRATION_TIMEOUT;
+  }
+
+  job->buckets[bucket / 64] |= 1ull << (bucket % 64);
+  __atomic_store_n(&reta_balancer.handoffs[bucket].job, job,
+                   __ATOMIC_RELEASE);
+  return true;
+}
+
+// Control thread: starts this round's jobs once the RETAs were updated.
+static void migration_post(bool retas_updated) {
+  for (unsigned j = 0; j < MIGRATION_MAX_JOBS; j++) {
+    struct migration_job *job = &migration_jobs[j];
+    if (job->state != MIGRATION_PLANNED) {
+      continue;
+    }
+
+    job->state = MIGRATION_RUNNING;
+
+    if (retas_updated) {
+      // never full, it holds every job
+      rte_ring_enqueue(migration_requests[job->from], job);
+    } else {
+      // the state stays where it is, and so should the packets
+      __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+      __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// Control thread: detaches the finished jobs from their buckets, and frees
+// them a round later, once no core can still be looking at them.
+static void migration_retire(void) {
+  for (unsigned j = 0; j < MIGRATION_MAX_JOBS; j++) {
+    struct migration_job *job = &migration_jobs[j];
+
+    if (job->state == MIGRATION_RETIRED) {
+      job->state = MIGRATION_FREE;
+      continue;
+    }
+
+    if (job->state != MIGRATION_RUNNING ||
+        !__atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    for (uint16_t bucket = 0; bucket < ETH_RSS_RETA_SIZE_512; bucket++) {
+      if (reta_balancer.handoffs[bucket].job == job) {
+        __atomic_store_n(&reta_balancer.handoffs[bucket].job, NULL,
+                         __ATOMIC_RELEASE);
+      }
+    }
+
+    if (job->flows > 0) {
+      printf("Migrated %u flows from core %u to core %u\n", job->flows,
+             job->from, job->to);
+    }
+
+    job->state = MIGRATION_RETIRED;
+  }
+}
+#endif // FLOW_MIGRATION
+
+#ifdef SOFTWARE_RSS
+/**********************************************
+ *
+ *                  SOFTWARE-RSS
+ *
+ **********************************************/
+
+// For NICs and vdevs that cannot hash the fields chosen for the NF with the
+// keys of rss_conf (e.g. net_pcap, net_ring, most virtual NICs). The first
+// SOFTWARE_RSS_DISPATCHERS cores receive every packet, compute the Toeplitz
+// hash the NIC would have computed, and look its bucket up in a software RETA
+// filled like the hardware one. Packets then reach the worker owning the
+// bucket through a ring per worker and device. With several dispatchers, the
+// NIC spreads packets among them with whatever RSS it supports.
+//
+// The hash is table-driven: the contribution of every value of every input
+// byte is precomputed per device, so hashing the IPv4 addresses and L4 ports
+// takes 12 lookups.
+#define SOFTWARE_RSS_INPUT_SIZE 12 // IPv4 addresses, then L4 ports
+#define SOFTWARE_RSS_RING_SIZE 1024
+
+#ifdef RETA_REBALANCE_PERIOD
+#error "RETA_REBALANCE_PERIOD rebalances the hardware RETAs only"
+#endif
+
+struct software_rss {
+  uint32_t toeplitz[MAX_NUM_DEVICES][SOFTWARE_RSS_INPUT_SIZE][256];
+  uint64_t types[MAX_NUM_DEVICES]; // rss_hf
+  uint16_t reta[MAX_NUM_DEVICES][ETH_RSS_RETA_SIZE_512]; // bucket -> worker
+  uint16_t workers;
+  struct rte_ring *rings[RTE_MAX_LCORE][MAX_NUM_DEVICES]; // [worker][device]
+};
+
+static struct software_rss software_rss;
+
+// The 32 bits of the key starting at bit
+static uint32_t toeplitz_window(const uint8_t *key, unsigned bit) {
+  const uint8_t *bytes = key + bit / 8;
+  uint64_t window = (uint64_t)bytes[0] << 32 | (uint64_t)bytes[1] << 24 |
+                    (uint64_t)bytes[2] << 16 | (uint64_t)bytes[3] << 8 |
+                    (uint64_t)bytes[4];
+  return (uint32_t)(window >> (8 - bit % 8));
+}
+
+// Contribution to the hash of every value of every input byte, for the given
+// key of at least SOFTWARE_RSS_INPUT_SIZE + 4 bytes
+static void toeplitz_table_init(const uint8_t *key,
+                                uint32_t toeplitz[][256]) {
+  for (unsigned byte = 0; byte < SOFTWARE_RSS_INPUT_SIZE; byte++) {
+    for (unsigned value = 0; value < 256; value++) {
+      uint32_t hash = 0;
+      for (unsigned bit = 0; bit < 8; bit++) {
+        if (value & (0x80 >> bit)) {
+          hash ^= toeplitz_window(key, byte * 8 + bit);
+        }
+      }
+      toeplitz[byte][value] = hash;
+    }
+  }
+}
+
+// Hash of the IPv4 addresses (source then destination, network order), then
+// of the L4 ports (same layout) unless ports is NULL
+static inline uint32_t toeplitz_table_hash(const uint32_t (*toeplitz)[256],
+                                           const uint8_t *addresses,
+                                           const uint8_t *ports) {
+  uint32_t hash = 0;
+
+  for (unsigned byte = 0; byte < 8; byte++) {
+    hash ^= toeplitz[byte][addresses[byte]];
+  }
+
+  if (ports != NULL) {
+    for (unsigned byte = 0; byte < 4; byte++) {
+      hash ^= toeplitz[8 + byte][ports[byte]];
+    }
+  }
+
+  return hash;
+}
+
+static void software_rss_init(uint16_t device) {
+  unsigned lcores = rte_lcore_count();
+  const uint8_t *key = rss_conf[device].rss_key;
+
+  if (lcores <= SOFTWARE_RSS_DISPATCHERS) {
+    rte_exit(EXIT_FAILURE, "No cores left for workers after %d dispatchers\n",
+             SOFTWARE_RSS_DISPATCHERS);
+  }
+
+  if (key == NULL ||
+      rss_conf[device].rss_key_len < SOFTWARE_RSS_INPUT_SIZE + 5) {
+    rte_exit(EXIT_FAILURE, "Device %" PRIu16 ": no RSS key to hash with\n",
+             device);
+  }
+
+  toeplitz_table_init(key, software_rss.toeplitz[device]);
+
+  software_rss.types[device] = rss_conf[device].rss_hf;
+  software_rss.workers = lcores - SOFTWARE_RSS_DISPATCHERS;
+
+  // the LUTs balanced for n cores are meant for n workers
+  for (uint16_t bucket = 0; bucket < ETH_RSS_RETA_SIZE_512; bucket++) {
+    uint16_t worker = bucket % software_rss.workers;
+    if (software_rss.workers > 1 && retas_per_device[device].set) {
+      worker =
+          retas_per_device[device].tables[software_rss.workers - 2][bucket];
+    }
+    software_rss.reta[device][bucket] = worker;
+  }
+
+  char ring_name[32];
+  for (uint16_t worker = 0; worker < software_rss.workers; worker++) {
+    sprintf(ring_name, "SOFTWARE_RSS_%" PRIu16 "_%" PRIu16, worker, device);
+    software_rss.rings[worker][device] = rte_ring_create(
+        ring_name, SOFTWARE_RSS_RING_SIZE, rte_socket_id(),
+        RING_F_SC_DEQ | (SOFTWARE_RSS_DISPATCHERS == 1 ? RING_F_SP_ENQ : 0));
+    if (software_rss.rings[worker][device] == NULL) {
+      rte_exit(EXIT_FAILURE, "Cannot create software RSS ring: %s\n",
+               rte_strerror(rte_errno));
+    }
+  }
+}
+
+// The hash the NIC computes for the types of rss_hf, or 0 if the packet is of
+// none of them.
+static inline uint32_t software_rss_hash(uint16_t device,
+                                         struct rte_mbuf *packet) {
+  uint8_t *data = rte_pktmbuf_mtod(packet, uint8_t *);
+  uint64_t types = software_rss.types[device];
+
+  struct rte_ether_hdr *ether_hdr = (struct rte_ether_hdr *)data;
+  size_t l3_offset = sizeof(struct rte_ether_hdr);
+
+  if (packet->data_len < l3_offset + sizeof(struct rte_ipv4_hdr) ||
+      ether_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+    return 0;
+  }
+
+  struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)(data + l3_offset);
+  size_t l4_offset = l3_offset + (ipv4_hdr->version_ihl & 0x0f) * 4;
+  bool fragment =
+      (ipv4_hdr->fragment_offset &
+       rte_cpu_to_be_16(RTE_IPV4_HDR_MF_FLAG | RTE_IPV4_HDR_OFFSET_MASK)) != 0;
+  bool ports =
+      !fragment && packet->data_len >= l4_offset + 4 &&
+      ((ipv4_hdr->next_proto_id == IPPROTO_TCP &&
+        (types & ETH_RSS_NONFRAG_IPV4_TCP)) ||
+       (ipv4_hdr->next_proto_id == IPPROTO_UDP &&
+        (types & ETH_RSS_NONFRAG_IPV4_UDP)));
+
+  if (!ports && !(types & ETH_RSS_IPV4)) {
+    return 0;
+  }
+
+  // the destination address follows the source one
+  return toeplitz_table_hash(software_rss.toeplitz[device],
+                             (const uint8_t *)&ipv4_hdr->src_addr,
+                             ports ? data + l4_offset : NULL);
+}
+
+static inline uint16_t software_rss_rx_burst(uint16_t device,
+                                             uint16_t queue_id,
+                                             struct rte_mbuf **packets,
+                                             uint16_t max) {
+  return rte_ring_sc_dequeue_burst(
+      software_rss.rings[queue_id - SOFTWARE_RSS_DISPATCHERS][device],
+      (void **)packets, max, NULL);
+}
+#endif // SOFTWARE_RSS
+
+/**********************************************
+ *
+ *                  NF
+ *
+ **********************************************/
+
+bool nf_init(void);
+int nf_process(uint16_t device, uint8_t *buffer, uint16_t packet_length,
+               vigor_time_t now);
+
+#define FLOOD_FRAME ((uint16_t)-1)
+
+// Unverified support for batching, useful for performance comparisons
+#define VIGOR_BATCH_SIZE 32
+
+// Do the opposite: we want batching!
+static const uint16_t RX_QUEUE_SIZE = 1024;
+static const uint16_t TX_QUEUE_SIZE = 1024;
+
+// Buffer count for mempools
+static const unsigned MEMPOOL_BUFFER_COUNT = 2048;
+
+// Packets are queued per output device while a burst is processed, and each
+// device is flushed once at the end of the burst. Every queued entry owns one
+// reference to its mbuf, so a flood queues the same mbuf on several devices.
+#define TX_BUFFER_SIZE VIGOR_BATCH_SIZE
+
+struct tx_buffer {
+  uint16_t count;
+  struct rte_mbuf *mbufs[TX_BUFFER_SIZE];
+};
+
+static void tx_buffer_flush(struct tx_buffer *buffer, uint16_t device,
+                            uint16_t queue_id) {
+  if (buffer->count == 0) {
+    return;
+  }
+
+  uint16_t sent_count =
+      rte_eth_tx_burst(device, queue_id, buffer->mbufs, buffer->count);
+  // should not happen, but drop the reference held by every entry the device
+  // did not take; the mbuf itself goes away with its last reference
+  for (uint16_t n = sent_count; n < buffer->count; n++) {
+    rte_pktmbuf_free(buffer->mbufs[n]);
+  }
+  buffer->count = 0;
+}
+
+static inline void tx_buffer_push(struct tx_buffer *buffer, uint16_t device,
+                                  uint16_t queue_id, struct rte_mbuf *packet) {
+  if (buffer->count == TX_BUFFER_SIZE) {
+    tx_buffer_flush(buffer, device, queue_id);
+  }
+  buffer->mbufs[buffer->count++] = packet;
+}
+
+// Queue the given packet on all devices except the packet's own
+void flood(struct rte_mbuf *packet, uint16_t nb_devices,
+           struct tx_buffer *tx_buffers, uint16_t queue_id) {
+  if (nb_devices < 2) {
+    rte_pktmbuf_free(packet);
+    return;
+  }
+
+  // all references are taken before the first one can be transmitted
+  rte_mbuf_refcnt_set(packet, nb_devices - 1);
+  uint16_t skip_device = packet->port;
+  for (uint16_t device = 0; device < nb_devices; device++) {
+    if (device != skip_device) {
+      tx_buffer_push(&tx_buffers[device], device, queue_id, packet);
+    }
+  }
+}
+
+// Initializes the given device using the given memory pool
+static int nf_init_device(uint16_t device, struct rte_mempool **mbuf_pools) {
+  int retval;
+  const uint16_t num_queues = rte_lcore_count();
+
+  // device_conf passed to rte_eth_dev_configure cannot be NULL
+  struct rte_eth_conf device_conf = { 0 };
+  // device_conf.rxmode.hw_strip_crc = 1;
+#ifdef SOFTWARE_RSS
+  // only the dispatchers receive, spread by whatever the device hashes
+  const uint16_t num_rx_queues = SOFTWARE_RSS_DISPATCHERS;
+  if (num_rx_queues > 1) {
+    struct rte_eth_dev_info dev_info;
+    rte_eth_dev_info_get(device, &dev_info);
+
+    device_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+    device_conf.rx_adv_conf.rss_conf.rss_hf =
+        ETH_RSS_IP & dev_info.flow_type_rss_offloads;
+  } else {
+    device_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+  }
+#else
+  const uint16_t num_rx_queues = num_queues;
+  device_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+  device_conf.rx_adv_conf.rss_conf = rss_conf[device];
+#endif // SOFTWARE_RSS
+
+  retval =
+      rte_eth_dev_configure(device, num_rx_queues, num_queues, &device_conf);
+  if (retval != 0) {
+    return retval;
+  }
+
+  // Allocate and set up TX queues
+  for (int txq = 0; txq < num_queues; txq++) {
+    retval = rte_eth_tx_queue_setup(device, txq, TX_QUEUE_SIZE,
+                                    rte_eth_dev_socket_id(device), NULL);
+    if (retval != 0) {
+      return retval;
+    }
+  }
+
+  unsigned lcore_id;
+  int rxq = 0;
+  RTE_LCORE_FOREACH(lcore_id) {
+    // Allocate and set up RX queues
+    lcores_conf[lcore_id].queue_id = rxq;
+    if (rxq < num_rx_queues) {
+      retval = rte_eth_rx_queue_setup(device, rxq, RX_QUEUE_SIZE,
+                                      rte_eth_dev_socket_id(device), NULL,
+                                      mbuf_pools[rxq]);
+      if (retval != 0) {
+        return retval;
+      }
+    }
+
+    rxq++;
+  }
+
+  // Start the device
+  retval = rte_eth_dev_start(device);
+  if (retval != 0) {
+    return retval;
+  }
+
+  // Enable RX in promiscuous mode, just in case
+  rte_eth_promiscuous_enable(device);
+  if (rte_eth_promiscuous_get(device) != 1) {
+    return retval;
+  }
+
+#ifdef SOFTWARE_RSS
+  software_rss_init(device);
+#else
+  set_reta(device);
+#endif // SOFTWARE_RSS
+
+  return 0;
+}
+
+static inline void nf_send(struct rte_mbuf *packet, uint16_t dst_device,
+                           uint16_t nb_devices, struct tx_buffer *tx_buffers,
+                           uint16_t queue_id) {
+  if (dst_device == packet->port) {
+    rte_pktmbuf_free(packet);
+  } else if (dst_device == FLOOD_FRAME) {
+    flood(packet, nb_devices, tx_buffers, queue_id);
+  } else {
+    tx_buffer_push(&tx_buffers[dst_device], dst_device, queue_id, packet);
+  }
+}
+
+#ifdef RETA_REBALANCE_PERIOD
+static inline void nf_handle(struct rte_mbuf *packet, vigor_time_t now,
+                             uint16_t nb_devices, struct tx_buffer *tx_buffers,
+                             uint16_t queue_id) {
+#ifdef FLOW_MIGRATION
+  RTE_PER_LCORE(flow_bucket) = reta_balancer_bucket(packet);
+#endif // FLOW_MIGRATION
+  uint8_t *data = rte_pktmbuf_mtod(packet, uint8_t *);
+  uint16_t dst_device = nf_process(packet->port, data, packet->pkt_len, now);
+  nf_send(packet, dst_device, nb_devices, tx_buffers, queue_id);
+}
+#endif // RETA_REBALANCE_PERIOD
+
+#ifdef SOFTWARE_RSS
+static void dispatcher_main(uint16_t queue_id) {
+  printf("Core %u dispatching packets.\n", rte_lcore_id());
+
+  // [worker] packets of the burst
+  struct rte_mbuf *batches[RTE_MAX_LCORE][VIGOR_BATCH_SIZE];
+  uint16_t counts[RTE_MAX_LCORE] = { 0 };
+
+  while (1) {
+    uint16_t nb_devices = rte_eth_dev_count_avail();
+
+    for (uint16_t device = 0; device < nb_devices; device++) {
+      struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
+      uint16_t rx_count =
+          rte_eth_rx_burst(device, queue_id, mbufs, VIGOR_BATCH_SIZE);
+
+      for (uint16_t n = 0; n < rx_count; n++) {
+        uint32_t hash = software_rss_hash(device, mbufs[n]);
+        mbufs[n]->hash.rss = hash;
+        mbufs[n]->ol_flags |= PKT_RX_RSS_HASH;
+
+        uint16_t worker =
+            software_rss.reta[device][hash & (ETH_RSS_RETA_SIZE_512 - 1)];
+        batches[worker][counts[worker]++] = mbufs[n];
+      }
+
+      for (uint16_t worker = 0; worker < software_rss.workers; worker++) {
+        if (counts[worker] == 0) {
+          continue;
+        }
+
+        unsigned sent = rte_ring_enqueue_burst(
+            software_rss.rings[worker][device], (void **)batches[worker],
+            counts[worker], NULL);
+        for (unsigned n = sent; n < counts[worker]; n++) {
+          rte_pktmbuf_free(batches[worker][n]);
+        }
+        counts[worker] = 0;
+      }
+    }
+  }
+}
+#endif // SOFTWARE_RSS
+
+static void worker_main(void) {
+  const unsigned lcore_id = rte_lcore_id();
+  const uint16_t queue_id = lcores_conf[lcore_id].queue_id;
+
+#ifdef SOFTWARE_RSS
+  if (queue_id < SOFTWARE_RSS_DISPATCHERS) {
+    dispatcher_main(queue_id);
+    return;
+  }
+#endif // SOFTWARE_RSS
+
+#ifdef FLOW_MIGRATION
+  RTE_PER_LCORE(flow_bucket) = ETH_RSS_RETA_SIZE_512;
+#endif // FLOW_MIGRATION
+
+  if (!nf_init()) {
+    rte_exit(EXIT_FAILURE, "Error initializing NF");
+  }
+
+  printf("Core %u forwarding packets.\n", rte_lcore_id());
+
+
+  printf("Running with batches, this code is unverified!\n");
+
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
+  while (1) {
+    unsigned VIGOR_DEVICES_COUNT = rte_eth_dev_count_avail();
+
+    for (uint16_t VIGOR_DEVICE = 0; VIGOR_DEVICE < VIGOR_DEVICES_COUNT;
+         VIGOR_DEVICE++) {
+      struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
+#ifdef SOFTWARE_RSS
+      uint16_t rx_count = software_rss_rx_burst(VIGOR_DEVICE, queue_id, mbufs,
+                                                VIGOR_BATCH_SIZE);
+#else
+      uint16_t rx_count =
+          rte_eth_rx_burst(VIGOR_DEVICE, queue_id, mbufs, VIGOR_BATCH_SIZE);
+#endif // SOFTWARE_RSS
+
+
+      for (uint16_t n = 0; n < rx_count; n++) {
+        uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
+        vigor_time_t VIGOR_NOW = current_time();
+#ifdef RETA_REBALANCE_PERIOD
+        if (reta_balancer_account(mbufs[n], queue_id, lcore_id, VIGOR_NOW)) {
+          continue;
+        }
+#endif // RETA_REBALANCE_PERIOD
+#ifdef FLOW_MIGRATION
+        RTE_PER_LCORE(flow_bucket) = reta_balancer_bucket(mbufs[n]);
+#endif // FLOW_MIGRATION
+        uint16_t dst_device =
+            nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
+        nf_send(mbufs[n], dst_device, VIGOR_DEVICES_COUNT, tx_buffers,
+                queue_id);
+      }
+
+      for (uint16_t device = 0; device < VIGOR_DEVICES_COUNT; device++) {
+        tx_buffer_flush(&tx_buffers[device], device, queue_id);
+      }
+    }
+
+#ifdef RETA_REBALANCE_PERIOD
+    // packets of moved buckets, handed off by the other core owning them
+    struct rte_mbuf *mbufs[VIGOR_BATCH_SIZE];
+    unsigned handoff_count = rte_ring_sc_dequeue_burst(
+        handoff_rings[lcore_id], (void **)mbufs, VIGOR_BATCH_SIZE, NULL);
+
+    for (unsigned n = 0; n < handoff_count; n++) {
+      vigor_time_t VIGOR_NOW = current_time();
+      if (reta_balancer_route(mbufs[n], lcore_id, VIGOR_NOW)) {
+        continue;
+      }
+      nf_handle(mbufs[n], VIGOR_NOW, VIGOR_DEVICES_COUNT, tx_buffers,
+                queue_id);
+    }
+
+#ifdef FLOW_MIGRATION
+    // packets buffered until the state of their flows came in
+    unsigned migrated_count =
+        migration_poll(lcore_id, current_time(), mbufs, VIGOR_BATCH_SIZE);
+
+    for (unsigned n = 0; n < migrated_count; n++) {
+      nf_handle(mbufs[n], current_time(), VIGOR_DEVICES_COUNT, tx_buffers,
+                queue_id);
+    }
+#endif // FLOW_MIGRATION
+
+    for (uint16_t device = 0; device < VIGOR_DEVICES_COUNT; device++) {
+      tx_buffer_flush(&tx_buffers[device], device, queue_id);
+    }
+#endif // RETA_REBALANCE_PERIOD
+
+#ifdef SKETCH_MERGE_STALENESS
+    sketch_quiescent();
+#endif
+  }
+}
+
+// Entry point
+int main(int argc, char **argv) {
+  // Initialize the DPDK Environment Abstraction Layer (EAL)
+  int ret = rte_eal_init(argc, argv);
+  if (ret < 0) {
+    rte_exit(EXIT_FAILURE, "Error with EAL initialization, ret=%d\n", ret);
+  }
+  argc -= ret;
+  argv += ret;
+
+  // Create a memory pool
+  unsigned nb_devices = rte_eth_dev_count_avail();
 
   init_retas();
 
@@ -1272,6 +2842,14 @@ int main(int argc, char **argv) {
     }
   }
 
+#ifdef RETA_REBALANCE_PERIOD
+  reta_balancer_start();
+#endif // RETA_REBALANCE_PERIOD
+
+#ifdef SKETCH_MERGE_STALENESS
+  sketch_merger_start();
+#endif
+
   RTE_LCORE_FOREACH_SLAVE(lcore_id) {
     rte_eal_remote_launch((lcore_function_t *)worker_main, NULL, lcore_id);
   }
@@ -23,6 +23,190 @@
 #include <rte_errno.h>
 #include <rte_lcore.h>
 #include <rte_malloc.h>
+#include <rte_hash_crc.h>
+#include <rte_pause.h>
+
+/**********************************************
+ *
+ *                 TM-SOFTWARE
+ *
+ **********************************************/
+
+// Without RTM (or with -DTM_SOFTWARE, to compare with it), transactions are
+// run in software behind the same HTM_SGL_begin/HTM_SGL_commit interface.
+//
+// Maps and dchains are never written transactionally: writing them aborts
+// the transaction, which is then rerun under the SGL. Rejuvenating a dchain
+// index only touches this lcore's cells, so it is instead deferred until the
+// transaction commits, and dropped if it aborts. Vector elements are
+// borrowed as private copies, and the copies found modified at commit are
+// written back. Every vector has TM_SW_STRIPES version counters used as
+// seqlocks: a copy is taken at an even version, commit locks the stripes it
+// writes (odd version), validates the stripes it only read, writes back and
+// bumps the versions. The SGL waits for running transactions to finish, and
+// transactions do not start while it is held, so nothing a transaction reads
+// outside of vectors changes under it. Packets are written in place, so their
+// headers are logged when the transaction starts and restored if it aborts.
+#if !defined(__RTM__) && !defined(TM_SOFTWARE)
+#define TM_SOFTWARE
+#endif
+
+#ifdef TM_SOFTWARE
+#include <setjmp.h>
+
+// Abort status layout of RTM, so that HTM_SGL_errors keeps its categories
+#ifndef _XBEGIN_STARTED
+#define _XBEGIN_STARTED (~0u)
+#define _XABORT_EXPLICIT (1 << 0)
+#define _XABORT_RETRY (1 << 1)
+#define _XABORT_CONFLICT (1 << 2)
+#define _XABORT_CAPACITY (1 << 3)
+#define _XABORT_DEBUG (1 << 4)
+#define _XABORT_NESTED (1 << 5)
+#define _XABORT_CODE(x) (((x) >> 24) & 0xFF)
+#endif
+
+// Explicit abort asking for the SGL: the transaction wrote a map or a dchain
+#define TM_SW_ABORT_IRREVOCABLE (_XABORT_EXPLICIT | (1 << 24))
+
+#define TM_SW_STRIPES 64
+#define TM_SW_SHADOWS 32
+#define TM_SW_SHADOW_SIZE 128
+#define TM_SW_UNDOS 32
+#define TM_SW_UNDO_SIZE 128 // packet bytes restored on abort, the headers
+#define TM_SW_REJUVENATIONS 32
+
+typedef volatile uint64_t tm_version_t;
+
+struct tm_sw_shadow {
+  char *target;
+  tm_version_t *version;
+  uint64_t seen;
+  int size;
+  bool written;
+  bool locked;
+  char data[TM_SW_SHADOW_SIZE];
+};
+
+struct tm_sw_undo {
+  char *target;
+  int size;
+  char data[TM_SW_UNDO_SIZE];
+};
+
+struct DoubleChainTM;
+
+struct tm_sw_rejuvenation {
+  struct DoubleChainTM *chain;
+  int index;
+  int64_t time;
+};
+
+struct tm_sw_tx {
+  jmp_buf env;
+  unsigned status; // same type as what _xbegin returns
+  bool active;
+  int nb_shadows;
+  struct tm_sw_shadow shadows[TM_SW_SHADOWS];
+  int nb_undos;
+  struct tm_sw_undo undos[TM_SW_UNDOS];
+  int nb_rejuvenations;
+  struct tm_sw_rejuvenation rejuvenations[TM_SW_REJUVENATIONS];
+};
+
+static __thread struct tm_sw_tx tm_sw;
+
+// Set while a transaction runs, the SGL waits for it to clear
+struct tm_sw_busy {
+  volatile int flag;
+} __attribute__((aligned(64)));
+
+static struct tm_sw_busy tm_sw_busy[RTE_MAX_LCORE];
+
+static void tm_sw_abort(unsigned status) __attribute__((noreturn));
+
+#define TM_SW_IRREVOCABLE()                  \
+  if (tm_sw.active) {                        \
+    tm_sw_abort(TM_SW_ABORT_IRREVOCABLE);    \
+  }
+
+#define TM_SW_UNDO_LOG(target, size)         \
+  if (tm_sw.active) {                        \
+    tm_sw_undo_log((char *)(target), size);  \
+  }
+
+static void tm_sw_undo_log(char *target, int size) {
+  if (tm_sw.nb_undos == TM_SW_UNDOS) {
+    tm_sw_abort(_XABORT_CAPACITY);
+  }
+
+  struct tm_sw_undo *undo = &tm_sw.undos[tm_sw.nb_undos++];
+  undo->target = target;
+  undo->size = size < TM_SW_UNDO_SIZE ? size : TM_SW_UNDO_SIZE;
+  memcpy(undo->data, target, undo->size);
+}
+
+static void tm_sw_rejuvenation_defer(struct DoubleChainTM *chain, int index,
+                                     int64_t time) {
+  if (tm_sw.nb_rejuvenations == TM_SW_REJUVENATIONS) {
+    tm_sw_abort(_XABORT_CAPACITY);
+  }
+
+  struct tm_sw_rejuvenation *rejuvenation =
+      &tm_sw.rejuvenations[tm_sw.nb_rejuvenations++];
+  rejuvenation->chain = chain;
+  rejuvenation->index = index;
+  rejuvenation->time = time;
+}
+
+static void *tm_sw_vector_borrow(char *target, int size,
+                                 tm_version_t *version) {
+  // transactions read their own writes
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    if (tm_sw.shadows[i].target == target) {
+      return tm_sw.shadows[i].data;
+    }
+  }
+
+  if (tm_sw.nb_shadows == TM_SW_SHADOWS || size > TM_SW_SHADOW_SIZE) {
+    tm_sw_abort(_XABORT_CAPACITY);
+  }
+
+  struct tm_sw_shadow *shadow = &tm_sw.shadows[tm_sw.nb_shadows];
+
+  uint64_t seen = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+  if (seen & 1) {
+    tm_sw_abort(_XABORT_CONFLICT);
+  }
+
+  memcpy(shadow->data, target, size);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if (*version != seen) {
+    tm_sw_abort(_XABORT_CONFLICT);
+  }
+
+  // a stripe is read at a single version
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    if (tm_sw.shadows[i].version == version && tm_sw.shadows[i].seen != seen) {
+      tm_sw_abort(_XABORT_CONFLICT);
+    }
+  }
+
+  shadow->target = target;
+  shadow->version = version;
+  shadow->seen = seen;
+  shadow->size = size;
+  shadow->written = false;
+  shadow->locked = false;
+  tm_sw.nb_shadows++;
+
+  return shadow->data;
+}
+#else
+#define TM_SW_IRREVOCABLE()
+#define TM_SW_UNDO_LOG(target, size)
+#endif // TM_SOFTWARE
 
 /**********************************************
  *
@@ -268,6 +452,8 @@ int map_get(struct Map *map, void *key, int *value_out) {
 }
 
 void map_put(struct Map *map, void *key, int value) {
+  TM_SW_IRREVOCABLE();
+
   map_key_hash *khash = map->khash;
   unsigned hash = khash(key);
   map_impl_put(map->busybits, map->keyps, map->khs, map->chns, map->vals, key,
@@ -276,6 +462,8 @@ void map_put(struct Map *map, void *key, int value) {
 }
 
 void map_erase(struct Map *map, void *key, void **trash) {
+  TM_SW_IRREVOCABLE();
+
   map_key_hash *khash = map->khash;
   unsigned hash = khash(key);
   map_impl_erase(map->busybits, map->keyps, map->khs, map->chns, key,
@@ -652,6 +840,8 @@ int dchain_tm_allocate(int index_range, DoubleChainTM **chain_out) {
 
 int dchain_tm_allocate_new_index(DoubleChainTM *chain, int *index_out,
                                  vigor_time_t time) {
+  TM_SW_IRREVOCABLE();
+
   int ret = -1;
   unsigned lcore_id;
   RTE_LCORE_FOREACH(lcore_id) {
@@ -671,8 +861,8 @@ int dchain_tm_allocate_new_index(DoubleChainTM *chain, int *index_out,
   return ret;
 }
 
-int dchain_tm_rejuvenate_index(DoubleChainTM *chain, int index,
-                               vigor_time_t time) {
+static int dchain_tm_rejuvenate_index_now(DoubleChainTM *chain, int index,
+                                          vigor_time_t time) {
   unsigned int lcore_id = rte_lcore_id();
   int ret = dchain_tm_impl_rejuvenate_index(chain->cells[lcore_id], index);
   if (ret) {
@@ -683,6 +873,23 @@ int dchain_tm_rejuvenate_index(DoubleChainTM *chain, int index,
   return ret;
 }
 
+int dchain_tm_rejuvenate_index(DoubleChainTM *chain, int index,
+                               vigor_time_t time) {
+#ifdef TM_SOFTWARE
+  if (tm_sw.active) {
+    if (!dchain_tm_impl_is_index_allocated(chain->cells[rte_lcore_id()],
+                                           index)) {
+      return 0;
+    }
+
+    tm_sw_rejuvenation_defer(chain, index, time);
+    return 1;
+  }
+#endif // TM_SOFTWARE
+
+  return dchain_tm_rejuvenate_index_now(chain, index, time);
+}
+
 int dchain_tm_update_timestamp(DoubleChainTM *chain, int index,
                                vigor_time_t time) {
   unsigned int lcore_id = rte_lcore_id();
@@ -723,6 +930,8 @@ int dchain_tm_is_index_allocated(DoubleChainTM *chain, int index) {
 }
 
 int dchain_tm_free_index(DoubleChainTM *chain, int index) {
+  TM_SW_IRREVOCABLE();
+
   int rez = -1;
   unsigned lcore_id;
 
@@ -771,6 +980,9 @@ struct Vector {
   char *data;
   int elem_size;
   unsigned capacity;
+#ifdef TM_SOFTWARE
+  tm_version_t versions[TM_SW_STRIPES];
+#endif
 };
 
 int vector_allocate(int elem_size, unsigned capacity,
@@ -792,6 +1004,11 @@ int vector_allocate(int elem_size, unsigned capacity,
   (*vector_out)->data = data_alloc;
   (*vector_out)->elem_size = elem_size;
   (*vector_out)->capacity = capacity;
+#ifdef TM_SOFTWARE
+  for (int i = 0; i < TM_SW_STRIPES; i++) {
+    (*vector_out)->versions[i] = 0;
+  }
+#endif
 
   for (unsigned i = 0; i < capacity; ++i) {
     init_elem((*vector_out)->data + elem_size * (int)i);
@@ -801,6 +1018,14 @@ int vector_allocate(int elem_size, unsigned capacity,
 }
 
 void vector_borrow(struct Vector *vector, int index, void **val_out) {
+#ifdef TM_SOFTWARE
+  if (tm_sw.active) {
+    *val_out = tm_sw_vector_borrow(vector->data + index * vector->elem_size,
+                                   vector->elem_size,
+                                   &vector->versions[index % TM_SW_STRIPES]);
+    return;
+  }
+#endif
   *val_out = vector->data + index * vector->elem_size;
 }
 
@@ -968,126 +1193,126 @@ const uint32_t SKETCH_SALTS[SKETCH_SALTS_BANK_SIZE] = {
   0xceee91e5, 0x1d4c6b18, 0x2a80e6df, 0x396f4d23,
 };
 
+// Each lcore expires buckets against its own cutoff, so that expiring does
+// not write shared memory on every packet.
 struct internal_data {
   unsigned hashes[SKETCH_HASHES];
-  int present[SKETCH_HASHES];
-  int buckets_indexes[SKETCH_HASHES];
+  vigor_time_t cutoff;
 } __attribute__((aligned(64)));
 
+struct sketch_bucket {
+  vigor_time_t touched;
+  uint32_t value;
+};
+
 struct SketchTM {
-  struct Map *clients;
-  struct Vector *keys;
-  struct Vector *buckets;
-  struct DoubleChainTM *allocators[SKETCH_HASHES];
+  struct sketch_bucket *buckets;
 
   uint32_t capacity;
   uint16_t threshold;
 
   map_key_hash *kh;
   struct internal_data internal[RTE_MAX_LCORE];
+#ifdef TM_SOFTWARE
+  tm_version_t versions[TM_SW_STRIPES];
+#endif
 };
 
-struct hash {
-  uint32_t value;
-};
-
-struct bucket {
-  uint32_t value;
-};
-
-unsigned find_next_power_of_2_bigger_than(uint32_t d) {
-  assert(d <= 0x80000000);
-  unsigned n = 1;
-
-  while (n < d) {
-    n *= 2;
+// Buckets are borrowed like vector elements, so that software transactions
+// touching the sketch stay revocable.
+static inline struct sketch_bucket *sketch_tm_bucket(struct SketchTM *sketch,
+                                                     unsigned lcore_id,
+                                                     int row) {
+  int index = sketch->capacity * row + sketch->internal[lcore_id].hashes[row];
+#ifdef TM_SOFTWARE
+  if (tm_sw.active) {
+    return (struct sketch_bucket *)tm_sw_vector_borrow(
+        (char *)&sketch->buckets[index], sizeof(struct sketch_bucket),
+        &sketch->versions[index % TM_SW_STRIPES]);
   }
-
-  return n;
-}
-
-bool hash_eq(void *a, void *b) {
-  struct hash *id1 = (struct hash *)a;
-  struct hash *id2 = (struct hash *)b;
-
-  return (id1->value == id2->value);
-}
-
-void hash_allocate(void *obj) {
-  struct hash *id = (struct hash *)obj;
-  id->value = 0;
+#endif
+  return &sketch->buckets[index];
 }
 
-unsigned hash_hash(void *obj) {
-  struct hash *id = (struct hash *)obj;
-
-  unsigned hash = 0;
-  hash = __builtin_ia32_crc32si(hash, id->value);
-  return hash;
+static inline bool sketch_tm_bucket_live(struct SketchTM *sketch,
+                                         unsigned lcore_id,
+                                         struct sketch_bucket *bucket) {
+  return bucket->touched > -1 &&
+         bucket->touched >= sketch->internal[lcore_id].cutoff;
 }
 
-void bucket_allocate(void *obj) { (uintptr_t) obj; }
-
 int sketch_tm_allocate(map_key_hash *kh, uint32_t capacity, uint16_t threshold,
                        struct SketchTM **sketch_out) {
   assert(SKETCH_HASHES <= SKETCH_SALTS_BANK_SIZE);
 
   struct SketchTM *sketch_alloc =
-      (struct SketchTM *)rte_malloc(NULL, sizeof(struct SketchTM), 0);
+      (struct SketchTM *)rte_malloc(NULL, sizeof(struct SketchTM), 64);
   if (sketch_alloc == NULL) {
     return 0;
   }
 
+  struct sketch_bucket *buckets_alloc = (struct sketch_bucket *)rte_malloc(
+      NULL, sizeof(struct sketch_bucket) * capacity * SKETCH_HASHES, 64);
+  if (buckets_alloc == NULL) {
+    rte_free(sketch_alloc);
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < capacity * SKETCH_HASHES; i++) {
+    buckets_alloc[i].touched = -1;
+    buckets_alloc[i].value = 0;
+  }
+
   (*sketch_out) = sketch_alloc;
 
+  (*sketch_out)->buckets = buckets_alloc;
   (*sketch_out)->capacity = capacity;
   (*sketch_out)->threshold = threshold;
   (*sketch_out)->kh = kh;
 
-  unsigned total_sketch_capacity =
-      find_next_power_of_2_bigger_than(capacity * SKETCH_HASHES);
-
-  (*sketch_out)->clients = NULL;
-  if (map_allocate(hash_eq, hash_hash, total_sketch_capacity,
-                   &((*sketch_out)->clients)) == 0) {
-    return 0;
+  for (int i = 0; i < RTE_MAX_LCORE; i++) {
+    (*sketch_out)->internal[i].cutoff = 0;
   }
 
-  (*sketch_out)->keys = NULL;
-  if (vector_allocate(sizeof(struct hash), total_sketch_capacity, hash_allocate,
-                      &((*sketch_out)->keys)) == 0) {
-    return 0;
+#ifdef TM_SOFTWARE
+  for (int i = 0; i < TM_SW_STRIPES; i++) {
+    (*sketch_out)->versions[i] = 0;
   }
+#endif
 
-  (*sketch_out)->buckets = NULL;
-  if (vector_allocate(sizeof(struct bucket), total_sketch_capacity,
-                      bucket_allocate, &((*sketch_out)->buckets)) == 0) {
-    return 0;
-  }
+  return 1;
+}
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    (*sketch_out)->allocators[i] = NULL;
-    if (dchain_tm_allocate(capacity, &((*sketch_out)->allocators[i])) == 0) {
-      return 0;
-    }
-  }
+// Mixes the client key hash into 64 bits (MurmurHash3 finalizer), from which
+// every row index is derived: row i uses h1 + i * h2 (Kirsch-Mitzenmacher),
+// mapped onto [0, capacity[ with a multiply-shift instead of a modulo.
+static inline uint64_t sketch_hash64(unsigned key_hash) {
+  uint64_t hash =
+      (((uint64_t)SKETCH_SALTS[1]) << 32 | SKETCH_SALTS[0]) ^ key_hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
 
-  return 1;
+static inline unsigned sketch_row_index(uint64_t hash, int row,
+                                        uint32_t capacity) {
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  uint32_t row_hash = h1 + (uint32_t)row * h2;
+  return (unsigned)(((uint64_t)row_hash * capacity) >> 32);
 }
 
 void sketch_tm_compute_hashes(struct SketchTM *sketch, void *key) {
   unsigned int lcore_id = rte_lcore_id();
 
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal[lcore_id].buckets_indexes[i] = -1;
-    sketch->internal[lcore_id].present[i] = 0;
-    sketch->internal[lcore_id].hashes[i] = 0;
+  uint64_t hash = sketch_hash64(sketch->kh(key));
 
-    sketch->internal[lcore_id].hashes[i] = __builtin_ia32_crc32si(
-        sketch->internal[lcore_id].hashes[i], SKETCH_SALTS[i]);
-    sketch->internal[lcore_id].hashes[i] = __builtin_ia32_crc32si(
-        sketch->internal[lcore_id].hashes[i], sketch->kh(key));
-    sketch->internal[lcore_id].hashes[i] %= sketch->capacity;
+  for (int i = 0; i < SKETCH_HASHES; i++) {
+    sketch->internal[lcore_id].hashes[i] =
+        sketch_row_index(hash, i, sketch->capacity);
   }
 }
 
@@ -1095,103 +1320,52 @@ void sketch_tm_refresh(struct SketchTM *sketch, vigor_time_t now) {
   unsigned int lcore_id = rte_lcore_id();
 
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    map_get(sketch->clients, &sketch->internal[lcore_id].hashes[i],
-            &sketch->internal[lcore_id].buckets_indexes[i]);
-    dchain_tm_rejuvenate_index(sketch->allocators[i],
-                               sketch->internal[lcore_id].buckets_indexes[i],
-                               now);
+    struct sketch_bucket *bucket = sketch_tm_bucket(sketch, lcore_id, i);
+
+    if (sketch_tm_bucket_live(sketch, lcore_id, bucket)) {
+      bucket->touched = now;
+    }
   }
 }
 
 int sketch_tm_fetch(struct SketchTM *sketch) {
   unsigned int lcore_id = rte_lcore_id();
 
-  int bucket_min_set = false;
-  uint32_t *buckets_values[SKETCH_HASHES];
-  uint32_t bucket_min = 0;
+  uint32_t bucket_min = UINT32_MAX;
 
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    sketch->internal[lcore_id].present[i] =
-        map_get(sketch->clients, &sketch->internal[lcore_id].hashes[i],
-                &sketch->internal[lcore_id].buckets_indexes[i]);
-
-    if (!sketch->internal[lcore_id].present[i]) {
-      continue;
-    }
+    struct sketch_bucket *bucket = sketch_tm_bucket(sketch, lcore_id, i);
+    uint32_t value =
+        sketch_tm_bucket_live(sketch, lcore_id, bucket) ? bucket->value : 0;
 
-    int offseted =
-        sketch->internal[lcore_id].buckets_indexes[i] + sketch->capacity * i;
-    vector_borrow(sketch->buckets, offseted, (void **)&buckets_values[i]);
-
-    if (!bucket_min_set || bucket_min > *buckets_values[i]) {
-      bucket_min = *buckets_values[i];
-      bucket_min_set = true;
+    if (bucket_min > value) {
+      bucket_min = value;
     }
-
-    vector_return(sketch->buckets, offseted, buckets_values[i]);
   }
 
-  return bucket_min_set && bucket_min > sketch->threshold;
+  return bucket_min > sketch->threshold;
 }
 
 int sketch_tm_touch_buckets(struct SketchTM *sketch, vigor_time_t now) {
   unsigned int lcore_id = rte_lcore_id();
 
   for (int i = 0; i < SKETCH_HASHES; i++) {
-    int bucket_index = -1;
-    int present = map_get(sketch->clients,
-                          &sketch->internal[lcore_id].hashes[i], &bucket_index);
-
-    if (!present) {
-      int allocated_client = dchain_tm_allocate_new_index(sketch->allocators[i],
-                                                          &bucket_index, now);
-
-      if (!allocated_client) {
-        // Sketch size limit reached.
-        return false;
-      }
+    struct sketch_bucket *bucket = sketch_tm_bucket(sketch, lcore_id, i);
 
-      int offseted = bucket_index + sketch->capacity * i;
-
-      uint32_t *saved_hash = 0;
-      uint32_t *saved_bucket = 0;
-
-      vector_borrow(sketch->keys, offseted, (void **)&saved_hash);
-      vector_borrow(sketch->buckets, offseted, (void **)&saved_bucket);
-
-      (*saved_hash) = sketch->internal[lcore_id].hashes[i];
-      (*saved_bucket) = 0;
-      map_put(sketch->clients, saved_hash, bucket_index);
-
-      vector_return(sketch->keys, offseted, saved_hash);
-      vector_return(sketch->buckets, offseted, saved_bucket);
+    if (sketch_tm_bucket_live(sketch, lcore_id, bucket)) {
+      bucket->value++;
     } else {
-      dchain_tm_rejuvenate_index(sketch->allocators[i], bucket_index, now);
-      uint32_t *bucket;
-      int offseted = bucket_index + sketch->capacity * i;
-      vector_borrow(sketch->buckets, offseted, (void **)&bucket);
-      (*bucket)++;
-      vector_return(sketch->buckets, offseted, bucket);
+      bucket->value = 0;
     }
+
+    bucket->touched = now;
   }
 
   return true;
 }
 
 void sketch_tm_expire(struct SketchTM *sketch, vigor_time_t time) {
-  int offset = 0;
-  int index = -1;
-
-  for (int i = 0; i < SKETCH_HASHES; i++) {
-    offset = i * sketch->capacity;
-
-    while (dchain_tm_expire_one_index(sketch->allocators[i], &index, time)) {
-      void *key;
-      vector_borrow(sketch->keys, index + offset, &key);
-      map_erase(sketch->clients, key, &key);
-      vector_return(sketch->keys, index + offset, key);
-    }
-  }
+  sketch->internal[rte_lcore_id()].cutoff = time;
 }
 
 /**********************************************
@@ -1317,12 +1491,12 @@ unsigned rte_ether_addr_hash(void* obj) {
   uint8_t addr_bytes_5 = id->addr_bytes[5];
 
   unsigned hash = 0;
-  hash = __builtin_ia32_crc32si(hash, addr_bytes_0);
-  hash = __builtin_ia32_crc32si(hash, addr_bytes_1);
-  hash = __builtin_ia32_crc32si(hash, addr_bytes_2);
-  hash = __builtin_ia32_crc32si(hash, addr_bytes_3);
-  hash = __builtin_ia32_crc32si(hash, addr_bytes_4);
-  hash = __builtin_ia32_crc32si(hash, addr_bytes_5);
+  hash = rte_hash_crc_4byte(addr_bytes_0, hash);
+  hash = rte_hash_crc_4byte(addr_bytes_1, hash);
+  hash = rte_hash_crc_4byte(addr_bytes_2, hash);
+  hash = rte_hash_crc_4byte(addr_bytes_3, hash);
+  hash = rte_hash_crc_4byte(addr_bytes_4, hash);
+  hash = rte_hash_crc_4byte(addr_bytes_5, hash);
   return hash;
 }
 
@@ -1374,6 +1548,11 @@ RTE_DEFINE_PER_LCORE(bool, write_state);
 
 //#pragma message ( "USING_TSX" )
 
+#ifdef TM_SOFTWARE
+#define CACHE_LINE_SIZE 64
+#define MEMFENCE __sync_synchronize()
+#define PAUSE() rte_pause()
+#else
 #include <immintrin.h>  // includes avx512 now
 #define _IMMINTRIN_H_INCLUDED
 #include <xtestintrin.h>
@@ -1382,6 +1561,7 @@ RTE_DEFINE_PER_LCORE(bool, write_state);
 // TODO: use __sync_synchronize() instead
 #define MEMFENCE asm volatile("MFENCE" : : : "memory")
 #define PAUSE() _mm_pause()
+#endif // TM_SOFTWARE
 
 typedef enum {
   HTM_SUCCESS = 0,
@@ -1400,11 +1580,30 @@ typedef enum {
 #define HTM_STATUS_TYPE register int
 #define HTM_CODE_SUCCESS _XBEGIN_STARTED
 
+#ifdef TM_SOFTWARE
+static unsigned tm_sw_begin(void);
+static void tm_sw_commit(void);
+
+#define HTM_begin(var)             \
+  ({                               \
+    if (setjmp(tm_sw.env) == 0) {  \
+      var = tm_sw_begin();         \
+    } else {                       \
+      var = tm_sw.status;          \
+    }                              \
+    var;                           \
+  })
+#define HTM_abort() tm_sw_abort(_XABORT_EXPLICIT)
+#define HTM_named_abort(code) tm_sw_abort(_XABORT_EXPLICIT | ((code) << 24))
+#define HTM_test() tm_sw.active
+#define HTM_commit() tm_sw_commit()
+#else
 #define HTM_begin(var) (var = _xbegin())
 #define HTM_abort() _xabort(0)
 #define HTM_named_abort(code) _xabort(code)
 #define HTM_test() _xtest()
 #define HTM_commit() _xend()
+#endif // TM_SOFTWARE
 #define HTM_get_named(status) (status >> 24)
 #define HTM_is_named(status) (status & 1)
 
@@ -1492,9 +1691,16 @@ extern __thread int64_t *volatile HTM_SGL_var_addr;  // points to the prev
 extern __thread HTM_SGL_local_vars_s CL_ALIGN HTM_SGL_vars;
 extern __thread int64_t HTM_SGL_errors[HTM_NB_ERRORS];
 
+// Retry budgets adapted per packet class, see TM-ADAPTIVE
+static void tm_adaptive_thr_init(int tid);
+static int tm_adaptive_begin(void);
+static int tm_adaptive_update(int budget, unsigned status);
+static void tm_adaptive_backoff(int budget, unsigned status);
+static void tm_adaptive_end(int budget);
+
 #define START_TRANSACTION(status) (HTM_begin(status) != HTM_CODE_SUCCESS)
-#define BEFORE_TRANSACTION(tid, budget) /* empty */
-#define AFTER_TRANSACTION(tid, budget)  /* empty */
+#define BEFORE_TRANSACTION(tid, budget) budget = tm_adaptive_begin()
+#define AFTER_TRANSACTION(tid, budget) tm_adaptive_end(budget)
 
 /* DEBUG VERSION
 #define UPDATE_BUDGET(tid, budget, status) \
@@ -1532,7 +1738,7 @@ extern __thread int64_t HTM_SGL_errors[HTM_NB_ERRORS];
 
 #define ENTER_SGL(tid) HTM_enter_fallback()
 #define EXIT_SGL(tid) HTM_exit_fallback()
-#define AFTER_ABORT(tid, budget, status) /* empty */
+#define AFTER_ABORT(tid, budget, status) tm_adaptive_backoff(budget, status)
 
 #define BEFORE_HTM_BEGIN(tid, budget) /* empty */
 #define AFTER_HTM_BEGIN(tid, budget)  /* empty */
@@ -1546,7 +1752,7 @@ extern __thread int64_t HTM_SGL_errors[HTM_NB_ERRORS];
 
 #define BEFORE_CHECK_BUDGET(budget) /* empty */
 // called within HTM_update_budget
-#define HTM_UPDATE_BUDGET(budget, status) (budget - 1)
+#define HTM_UPDATE_BUDGET(budget, status) tm_adaptive_update(budget, status)
 
 #define ENTER_HTM_COND(tid, budget) budget > 0
 #define IN_TRANSACTION(tid, budget, status) HTM_test()
@@ -1555,7 +1761,7 @@ extern __thread int64_t HTM_SGL_errors[HTM_NB_ERRORS];
 // Called within the API
 #define HTM_INIT()      /* empty */
 #define HTM_EXIT()      /* empty */
-#define HTM_THR_INIT()  /* empty */
+#define HTM_THR_INIT()  tm_adaptive_thr_init(tid)
 #define HTM_THR_EXIT()  /* empty */
 #define HTM_INC(status) /* Use this to construct side statistics */
 // #################################
@@ -1770,6 +1976,17 @@ void HTM_enter_fallback() {
 
   // HTM_SGL_var = 1;
   // __sync_synchronize();
+
+#ifdef TM_SOFTWARE
+  // transactions already running finish or abort first, new ones wait
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    while (__atomic_load_n(&tm_sw_busy[lcore_id].flag, __ATOMIC_SEQ_CST)) {
+      PAUSE();
+    }
+  }
+#endif // TM_SOFTWARE
+
   HTM_SGL_errors[HTM_FALLBACK]++;
 }
 
@@ -1825,6 +2042,341 @@ int HTM_get_tid() { return tid; }
 void HTM_set_is_record(int is_rec) { is_record = is_rec; }
 int HTM_get_is_record() { return is_record; }
 
+#ifdef TM_SOFTWARE
+static unsigned tm_sw_begin(void) {
+  unsigned lcore_id = rte_lcore_id();
+
+  while (1) {
+    __atomic_store_n(&tm_sw_busy[lcore_id].flag, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(HTM_SGL_var_addr, __ATOMIC_SEQ_CST) == -1) {
+      break;
+    }
+    __atomic_store_n(&tm_sw_busy[lcore_id].flag, 0, __ATOMIC_RELEASE);
+    HTM_block();
+  }
+
+  tm_sw.active = true;
+  tm_sw.nb_shadows = 0;
+  tm_sw.nb_undos = 0;
+  tm_sw.nb_rejuvenations = 0;
+  return _XBEGIN_STARTED;
+}
+
+static void tm_sw_end(void) {
+  tm_sw.active = false;
+  __atomic_store_n(&tm_sw_busy[rte_lcore_id()].flag, 0, __ATOMIC_RELEASE);
+}
+
+static void tm_sw_abort(unsigned status) {
+  for (int i = tm_sw.nb_undos - 1; i >= 0; i--) {
+    memcpy(tm_sw.undos[i].target, tm_sw.undos[i].data, tm_sw.undos[i].size);
+  }
+
+  tm_sw_end();
+  tm_sw.status = status;
+  HTM_ERROR_INC(status, HTM_SGL_errors);
+  longjmp(tm_sw.env, 1);
+}
+
+static bool tm_sw_stripe_locked(tm_version_t *version) {
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    if (tm_sw.shadows[i].locked && tm_sw.shadows[i].version == version) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void tm_sw_unlock(uint64_t bump) {
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    struct tm_sw_shadow *shadow = &tm_sw.shadows[i];
+    if (shadow->locked) {
+      __atomic_store_n(shadow->version, shadow->seen + bump, __ATOMIC_RELEASE);
+      shadow->locked = false;
+    }
+  }
+}
+
+static void tm_sw_commit(void) {
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    struct tm_sw_shadow *shadow = &tm_sw.shadows[i];
+    shadow->written = memcmp(shadow->data, shadow->target, shadow->size) != 0;
+
+    if (!shadow->written || tm_sw_stripe_locked(shadow->version)) {
+      continue;
+    }
+
+    uint64_t expected = shadow->seen;
+    if (!__atomic_compare_exchange_n(shadow->version, &expected,
+                                     shadow->seen + 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      tm_sw_unlock(0);
+      tm_sw_abort(_XABORT_CONFLICT);
+    }
+    shadow->locked = true;
+  }
+
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    struct tm_sw_shadow *shadow = &tm_sw.shadows[i];
+    if (!tm_sw_stripe_locked(shadow->version) &&
+        __atomic_load_n(shadow->version, __ATOMIC_ACQUIRE) != shadow->seen) {
+      tm_sw_unlock(0);
+      tm_sw_abort(_XABORT_CONFLICT);
+    }
+  }
+
+  for (int i = 0; i < tm_sw.nb_shadows; i++) {
+    struct tm_sw_shadow *shadow = &tm_sw.shadows[i];
+    if (shadow->written) {
+      memcpy(shadow->target, shadow->data, shadow->size);
+    }
+  }
+
+  for (int i = 0; i < tm_sw.nb_rejuvenations; i++) {
+    struct tm_sw_rejuvenation *rejuvenation = &tm_sw.rejuvenations[i];
+    dchain_tm_rejuvenate_index_now(rejuvenation->chain, rejuvenation->index,
+                                   rejuvenation->time);
+  }
+
+  tm_sw_unlock(2);
+  tm_sw_end();
+  HTM_SGL_errors[HTM_SUCCESS]++;
+}
+#endif // TM_SOFTWARE
+
+/**********************************************
+ *
+ *                 TM-ADAPTIVE
+ *
+ **********************************************/
+
+// How many times a transaction is retried depends on why it aborted and on
+// what packets of its class did before. Packets are classified by input
+// device, IPv4 protocol and TCP SYN/FIN/RST flags, and each core keeps, for
+// every class, its own retry budget and abort statistics.
+//
+// Capacity aborts (and software transactions writing maps or dchains) go
+// straight to the SGL, since a retry would abort again. The class then also
+// skips hardware transactions for its next packets, for a window that doubles
+// with every such abort and is reset by a commit.
+//
+// Conflicts back off exponentially, with some jitter, before retrying. A class
+// that commits on its last retry gets one more, and a class that runs out of
+// retries on a conflict gets one less. Classes always keep at least one retry,
+// without which committing on the last retry could never be observed again.
+#define TM_ADAPTIVE_CLASSES 64
+#define TM_ADAPTIVE_MIN_BUDGET 2
+#define TM_ADAPTIVE_MAX_BUDGET 16
+#define TM_ADAPTIVE_MAX_SKIP 1024
+#define TM_ADAPTIVE_BACKOFF_PAUSES 16 // first backoff, doubles on every retry
+#define TM_ADAPTIVE_MAX_BACKOFF_SHIFT 8
+#define TM_ADAPTIVE_REPORT_PERIOD (10 * 1000000000l) // ns
+
+struct tm_class_stats {
+  uint64_t commits;   // in hardware (or software) transactions
+  uint64_t fallbacks; // under the SGL
+  uint64_t conflict_aborts;
+  uint64_t capacity_aborts;
+  uint64_t explicit_aborts;
+  uint64_t other_aborts;
+};
+
+struct tm_class {
+  struct tm_class_stats stats;
+  int budget;    // transactions tried before the SGL
+  int skip;      // packets left to run straight under the SGL
+  int skip_next; // window opened by the next capacity abort
+};
+
+struct tm_adaptive {
+  struct tm_class classes[TM_ADAPTIVE_CLASSES];
+  struct tm_class *current;
+  int aborts;     // by the current packet
+  bool exhausted; // the current packet ran out of retries on a conflict
+  uint32_t seed;
+} CL_ALIGN;
+
+static struct tm_adaptive tm_adaptive[RTE_MAX_LCORE];
+static __thread struct tm_adaptive *tm_adapt;
+
+static void tm_adaptive_thr_init(int tid) {
+  tm_adapt = &tm_adaptive[tid];
+
+  for (int class = 0; class < TM_ADAPTIVE_CLASSES; class++) {
+    tm_adapt->classes[class].budget =
+        RTE_MAX(HTM_SGL_INIT_BUDGET, TM_ADAPTIVE_MIN_BUDGET);
+    tm_adapt->classes[class].skip = 0;
+    tm_adapt->classes[class].skip_next = 1;
+  }
+
+  tm_adapt->current = &tm_adapt->classes[0];
+  tm_adapt->seed = 2654435761u * (tid + 1);
+}
+
+static inline void tm_adaptive_classify(struct rte_mbuf *packet) {
+  uint8_t *data = rte_pktmbuf_mtod(packet, uint8_t *);
+  uint32_t key = packet->port;
+
+  struct rte_ether_hdr *ether_hdr = (struct rte_ether_hdr *)data;
+  size_t l3_offset = sizeof(struct rte_ether_hdr);
+
+  if (packet->pkt_len >= l3_offset + sizeof(struct rte_ipv4_hdr) &&
+      ether_hdr->ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4)) {
+    struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)(data + l3_offset);
+    size_t l4_offset = l3_offset + (ipv4_hdr->version_ihl & 0x0f) * 4;
+
+    key = key << 8 | ipv4_hdr->next_proto_id;
+
+    if (ipv4_hdr->next_proto_id == IPPROTO_TCP &&
+        packet->pkt_len >= l4_offset + sizeof(struct rte_tcp_hdr)) {
+      struct rte_tcp_hdr *tcp_hdr = (struct rte_tcp_hdr *)(data + l4_offset);
+      key = key << 3 |
+            (tcp_hdr->tcp_flags & (RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG |
+                                   RTE_TCP_RST_FLAG));
+    }
+  }
+
+  tm_adapt->current =
+      &tm_adapt->classes[rte_hash_crc_4byte(key, 0) % TM_ADAPTIVE_CLASSES];
+}
+
+static int tm_adaptive_begin(void) {
+  struct tm_class *class = tm_adapt->current;
+
+  tm_adapt->aborts = 0;
+  tm_adapt->exhausted = false;
+
+  if (class->skip > 0) {
+    class->skip--;
+    return 0;
+  }
+
+  return class->budget;
+}
+
+static int tm_adaptive_update(int budget, unsigned status) {
+  struct tm_class *class = tm_adapt->current;
+  bool hopeless = status & _XABORT_CAPACITY;
+
+  tm_adapt->aborts++;
+
+#ifdef TM_SOFTWARE
+  hopeless = hopeless || status == TM_SW_ABORT_IRREVOCABLE;
+#endif // TM_SOFTWARE
+
+  if (status & _XABORT_CAPACITY) {
+    class->stats.capacity_aborts++;
+  } else if (status & _XABORT_CONFLICT) {
+    class->stats.conflict_aborts++;
+  } else if (status & _XABORT_EXPLICIT) {
+    class->stats.explicit_aborts++;
+  } else {
+    class->stats.other_aborts++;
+  }
+
+  if (hopeless) {
+    class->skip = class->skip_next;
+    if (class->skip_next < TM_ADAPTIVE_MAX_SKIP) {
+      class->skip_next *= 2;
+    }
+    return 0;
+  }
+
+  if (budget <= 1 && (status & _XABORT_CONFLICT)) {
+    tm_adapt->exhausted = true;
+  }
+
+  return budget - 1;
+}
+
+static void tm_adaptive_backoff(int budget, unsigned status) {
+  if (budget <= 0 || !(status & _XABORT_CONFLICT)) {
+    return;
+  }
+
+  int shift = tm_adapt->aborts - 1;
+  if (shift > TM_ADAPTIVE_MAX_BACKOFF_SHIFT) {
+    shift = TM_ADAPTIVE_MAX_BACKOFF_SHIFT;
+  }
+
+  // xorshift32, so that cores in conflict do not retry in lockstep
+  uint32_t seed = tm_adapt->seed;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  tm_adapt->seed = seed;
+
+  uint32_t pauses = TM_ADAPTIVE_BACKOFF_PAUSES << shift;
+  pauses = pauses / 2 + seed % (pauses / 2);
+
+  for (uint32_t i = 0; i < pauses; i++) {
+    PAUSE();
+  }
+}
+
+static void tm_adaptive_end(int budget) {
+  struct tm_class *class = tm_adapt->current;
+
+  if (budget > 0) {
+    class->stats.commits++;
+    class->skip_next = 1;
+
+    // committed on its last retry, the next ones may need more
+    if (tm_adapt->aborts > 0 && budget == 1 &&
+        class->budget < TM_ADAPTIVE_MAX_BUDGET) {
+      class->budget++;
+    }
+  } else {
+    class->stats.fallbacks++;
+
+    if (tm_adapt->exhausted && class->budget > TM_ADAPTIVE_MIN_BUDGET) {
+      class->budget--;
+    }
+  }
+}
+
+// Statistics of the given class summed over all cores, for tuning.
+// @returns the mean retry budget of the class over the cores.
+double tm_adaptive_stats(unsigned class, struct tm_class_stats *stats_out) {
+  memset(stats_out, 0, sizeof(struct tm_class_stats));
+  int budgets = 0;
+  int cores = 0;
+
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    struct tm_class *core_class = &tm_adaptive[lcore_id].classes[class];
+    stats_out->commits += core_class->stats.commits;
+    stats_out->fallbacks += core_class->stats.fallbacks;
+    stats_out->conflict_aborts += core_class->stats.conflict_aborts;
+    stats_out->capacity_aborts += core_class->stats.capacity_aborts;
+    stats_out->explicit_aborts += core_class->stats.explicit_aborts;
+    stats_out->other_aborts += core_class->stats.other_aborts;
+    budgets += core_class->budget;
+    cores++;
+  }
+
+  return cores > 0 ? (double)budgets / cores : 0;
+}
+
+static void tm_adaptive_report(void) {
+  printf("TM class   commits fallbacks conflicts  capacity  explicit     other"
+         " budget\n");
+
+  for (unsigned class = 0; class < TM_ADAPTIVE_CLASSES; class++) {
+    struct tm_class_stats stats;
+    double budget = tm_adaptive_stats(class, &stats);
+    if (stats.commits + stats.fallbacks == 0) {
+      continue;
+    }
+
+    printf("%8u %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+           " %9" PRIu64 " %6.1f\n",
+           class, stats.commits, stats.fallbacks, stats.conflict_aborts,
+           stats.capacity_aborts, stats.explicit_aborts, stats.other_aborts,
+           budget);
+  }
+}
+
 #define RETA_CONF_SIZE (ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE)
 
 typedef struct {
@@ -1888,22 +2440,56 @@ static const uint16_t TX_QUEUE_SIZE = 1024;
 // Buffer count for mempools
 static const unsigned MEMPOOL_BUFFER_COUNT = 2048;
 
-// Send the given packet to all devices except the packet's own
-void flood(struct rte_mbuf *packet, uint16_t nb_devices, uint16_t queue_id) {
+// Packets are queued per output device while a burst is processed, and each
+// device is flushed once at the end of the burst. Every queued entry owns one
+// reference to its mbuf, so a flood queues the same mbuf on several devices.
+#define TX_BUFFER_SIZE VIGOR_BATCH_SIZE
+
+struct tx_buffer {
+  uint16_t count;
+  struct rte_mbuf *mbufs[TX_BUFFER_SIZE];
+};
+
+static void tx_buffer_flush(struct tx_buffer *buffer, uint16_t device,
+                            uint16_t queue_id) {
+  if (buffer->count == 0) {
+    return;
+  }
+
+  uint16_t sent_count =
+      rte_eth_tx_burst(device, queue_id, buffer->mbufs, buffer->count);
+  // should not happen, but drop the reference held by every entry the device
+  // did not take; the mbuf itself goes away with its last reference
+  for (uint16_t n = sent_count; n < buffer->count; n++) {
+    rte_pktmbuf_free(buffer->mbufs[n]);
+  }
+  buffer->count = 0;
+}
+
+static inline void tx_buffer_push(struct tx_buffer *buffer, uint16_t device,
+                                  uint16_t queue_id, struct rte_mbuf *packet) {
+  if (buffer->count == TX_BUFFER_SIZE) {
+    tx_buffer_flush(buffer, device, queue_id);
+  }
+  buffer->mbufs[buffer->count++] = packet;
+}
+
+// Queue the given packet on all devices except the packet's own
+void flood(struct rte_mbuf *packet, uint16_t nb_devices,
+           struct tx_buffer *tx_buffers, uint16_t queue_id) {
+  if (nb_devices < 2) {
+    rte_pktmbuf_free(packet);
+    return;
+  }
+
+  // all references are taken before the first one can be transmitted
   rte_mbuf_refcnt_set(packet, nb_devices - 1);
-  int total_sent = 0;
   uint16_t skip_device = packet->port;
   for (uint16_t device = 0; device < nb_devices; device++) {
     if (device != skip_device) {
-      total_sent += rte_eth_tx_burst(device, queue_id, &packet, 1);
+      tx_buffer_push(&tx_buffers[device], device, queue_id, packet);
     }
   }
-  // should not happen, but in case we couldn't transmit, ensure the packet is
-  // freed
-  if (total_sent != nb_devices - 1) {
-    rte_mbuf_refcnt_set(packet, 1);
-    rte_pktmbuf_free(packet);
-  }
 }
 
 // Initializes the given device using the given memory pool
@@ -1963,6 +2549,120 @@ static int nf_init_device(uint16_t device, struct rte_mempool **mbuf_pools) {
   return 0;
 }
 
+static inline void nf_send(struct rte_mbuf *packet, uint16_t dst_device,
+                           uint16_t nb_devices, struct tx_buffer *tx_buffers,
+                           uint16_t queue_id) {
+  if (dst_device == packet->port) {
+    rte_pktmbuf_free(packet);
+  } else if (dst_device == FLOOD_FRAME) {
+    flood(packet, nb_devices, tx_buffers, queue_id);
+  } else {
+    tx_buffer_push(&tx_buffers[dst_device], dst_device, queue_id, packet);
+  }
+}
+
+static inline uint16_t tm_process_one(struct rte_mbuf *packet,
+                                      vigor_time_t now) {
+  uint8_t *data = rte_pktmbuf_mtod(packet, uint8_t *);
+
+  tm_adaptive_classify(packet);
+  HTM_SGL_begin();
+  TM_SW_UNDO_LOG(data, rte_pktmbuf_data_len(packet));
+  uint16_t dst_device = nf_process(packet->port, data, packet->pkt_len, now);
+  HTM_SGL_commit();
+
+  return dst_device;
+}
+
+#ifdef TM_MULTI_PACKET
+// Several packets of a burst share one transaction, paying for a single begin
+// and commit. Every core starts with single-packet transactions and doubles
+// its group size after TM_GROUP_GROWTH transactions commit without aborting,
+// up to TM_GROUP_MAX_SIZE. A group that aborts is not retried: its packets,
+// and the following ones, go back to single-packet transactions, with the
+// usual retry budget and SGL fallback. Packets are only sent once the
+// transaction that processed them has committed.
+#define TM_GROUP_MAX_SIZE 8
+#define TM_GROUP_GROWTH 16
+
+struct tm_group {
+  uint16_t size;
+  uint16_t streak; // commits without aborts since the last resize
+  uint64_t commits;
+  uint64_t aborts;
+  uint64_t packets; // processed by committed groups
+} CL_ALIGN;
+
+static struct tm_group tm_groups[RTE_MAX_LCORE];
+
+static inline void tm_group_clean_commit(struct tm_group *group) {
+  if (++group->streak < TM_GROUP_GROWTH) {
+    return;
+  }
+
+  group->streak = 0;
+  if (group->size < TM_GROUP_MAX_SIZE) {
+    group->size *= 2;
+  }
+}
+
+// @returns false if the transaction aborted, nothing was done then
+static bool tm_group_process(struct tm_group *group, struct rte_mbuf **mbufs,
+                             vigor_time_t *nows, uint16_t *dst_devices,
+                             uint16_t count) {
+  HTM_STATUS_TYPE status;
+
+  CHECK_SGL_NOTX();
+  if (START_TRANSACTION(status)) {
+    group->aborts++;
+    group->size = 1;
+    group->streak = 0;
+    return false;
+  }
+  CHECK_SGL_HTM();
+
+  for (uint16_t n = 0; n < count; n++) {
+    uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
+    TM_SW_UNDO_LOG(data, rte_pktmbuf_data_len(mbufs[n]));
+    dst_devices[n] =
+        nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, nows[n]);
+  }
+
+  HTM_commit();
+
+  group->commits++;
+  group->packets += count;
+  tm_group_clean_commit(group);
+  return true;
+}
+
+// To be called after a single-packet transaction
+static inline void tm_group_single(struct tm_group *group) {
+  if (HTM_SGL_budget > 0 && tm_adapt->aborts == 0) {
+    tm_group_clean_commit(group);
+  } else {
+    group->streak = 0;
+  }
+}
+
+static void tm_group_report(void) {
+  uint64_t commits = 0;
+  uint64_t aborts = 0;
+  uint64_t packets = 0;
+
+  unsigned lcore_id;
+  RTE_LCORE_FOREACH(lcore_id) {
+    commits += tm_groups[lcore_id].commits;
+    aborts += tm_groups[lcore_id].aborts;
+    packets += tm_groups[lcore_id].packets;
+  }
+
+  printf("TM groups: %" PRIu64 " committed (%" PRIu64 " packets), %" PRIu64
+         " aborted\n",
+         commits, packets, aborts);
+}
+#endif // TM_MULTI_PACKET
+
 static void worker_main(void) {
   const unsigned lcore_id = rte_lcore_id();
   const uint16_t queue_id = lcores_conf[lcore_id].queue_id;
@@ -1971,16 +2671,22 @@ static void worker_main(void) {
     rte_exit(EXIT_FAILURE, "Error initializing NF");
   }
 
+  // the SGL is taken by writing the owner's id, which must not be -1
+  HTM_thr_init(lcore_id);
+
+  vigor_time_t last_report = current_time();
+
+#ifdef TM_MULTI_PACKET
+  struct tm_group *group = &tm_groups[lcore_id];
+  group->size = 1;
+#endif // TM_MULTI_PACKET
+
   printf("Core %u forwarding packets.\n", rte_lcore_id());
 
-  if (rte_eth_dev_count_avail() != 2) {
-    printf(
-        "We assume there will be exactly 2 devices for our simple batching "
-        "implementation.");
-    exit(1);
-  }
   printf("Running with batches, this code is unverified!\n");
 
+  struct tx_buffer tx_buffers[RTE_MAX_ETHPORTS] = { 0 };
+
   while (1) {
     unsigned VIGOR_DEVICES_COUNT = rte_eth_dev_count_avail();
     for (uint16_t VIGOR_DEVICE = 0; VIGOR_DEVICE < VIGOR_DEVICES_COUNT;
@@ -1989,33 +2695,52 @@ static void worker_main(void) {
       uint16_t rx_count =
           rte_eth_rx_burst(VIGOR_DEVICE, queue_id, mbufs, VIGOR_BATCH_SIZE);
 
-      struct rte_mbuf *mbufs_to_send[VIGOR_BATCH_SIZE];
-      uint16_t tx_count = 0;
+#ifdef TM_MULTI_PACKET
+      vigor_time_t nows[VIGOR_BATCH_SIZE];
+      uint16_t dst_devices[VIGOR_BATCH_SIZE];
+
       for (uint16_t n = 0; n < rx_count; n++) {
-        uint8_t *data = rte_pktmbuf_mtod(mbufs[n], uint8_t *);
-        vigor_time_t VIGOR_NOW = current_time();
-        HTM_SGL_begin();
-        uint16_t dst_device =
-            nf_process(mbufs[n]->port, data, mbufs[n]->pkt_len, VIGOR_NOW);
-        HTM_SGL_commit();
-
-        if (dst_device == VIGOR_DEVICE) {
-          rte_pktmbuf_free(mbufs[n]);
-        } else if (dst_device == FLOOD_FRAME) {
-          flood(mbufs[n], VIGOR_DEVICES_COUNT, queue_id);
-        } else {  // includes flood when 2 devices, which is equivalent to just
-                  // a
-                  // send
-          mbufs_to_send[tx_count] = mbufs[n];
-          tx_count++;
+        nows[n] = current_time();
+      }
+
+      for (uint16_t n = 0; n < rx_count;) {
+        uint16_t count = RTE_MIN(group->size, rx_count - n);
+        if (count > 1 && tm_group_process(group, &mbufs[n], &nows[n],
+                                          &dst_devices[n], count)) {
+          n += count;
+          continue;
         }
+
+        dst_devices[n] = tm_process_one(mbufs[n], nows[n]);
+        tm_group_single(group);
+        n++;
+      }
+
+      for (uint16_t n = 0; n < rx_count; n++) {
+        nf_send(mbufs[n], dst_devices[n], VIGOR_DEVICES_COUNT, tx_buffers,
+                queue_id);
       }
+#else
+      for (uint16_t n = 0; n < rx_count; n++) {
+        uint16_t dst_device = tm_process_one(mbufs[n], current_time());
+        nf_send(mbufs[n], dst_device, VIGOR_DEVICES_COUNT, tx_buffers,
+                queue_id);
+      }
+#endif // TM_MULTI_PACKET
+
+      for (uint16_t device = 0; device < VIGOR_DEVICES_COUNT; device++) {
+        tx_buffer_flush(&tx_buffers[device], device, queue_id);
+      }
+    }
 
-      uint16_t sent_count =
-          rte_eth_tx_burst(1 - VIGOR_DEVICE, queue_id, mbufs_to_send, tx_count);
-      for (uint16_t n = sent_count; n < tx_count; n++) {
-        rte_pktmbuf_free(mbufs[n]);  // should not happen, but we're in the
-                                     // unverified case anyway
+    if (lcore_id == rte_get_master_lcore()) {
+      vigor_time_t now = current_time();
+      if (now - last_report >= TM_ADAPTIVE_REPORT_PERIOD) {
+        tm_adaptive_report();
+#ifdef TM_MULTI_PACKET
+        tm_group_report();
+#endif // TM_MULTI_PACKET
+        last_report = now;
       }
     }
   }
@@ -4,6 +4,7 @@
 
 #include <algorithm>
 #include <iostream>
+#include <functional>
 
 namespace ParallelSynthesizer {
 
@@ -173,4 +174,29 @@ bool LibvigAccess::content_equal(const LibvigAccess &access1,
   return true;
 }
 
+static void hash_combine(size_t &seed, size_t value) {
+  seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+size_t LibvigAccess::content_hash(const LibvigAccess &access) {
+  size_t seed = 0;
+
+  hash_combine(seed, access.get_src_device());
+  hash_combine(seed, access.is_dst_device_set());
+  if (access.is_dst_device_set()) {
+    hash_combine(seed, access.get_dst_device());
+  }
+  hash_combine(seed, access.get_object());
+  hash_combine(seed, access.get_operation());
+
+  // dependencies are left out, they only ever make equal arguments differ
+  for (const auto &argument : access.get_arguments()) {
+    hash_combine(seed, argument.get_type());
+    hash_combine(seed, std::hash<std::string>()(argument.get_expression()));
+    hash_combine(seed, argument.get_dependencies().get().size());
+  }
+
+  return seed;
+}
+
 }  // namespace ParallelSynthesizer
@@ -185,6 +185,10 @@ public:
   static bool content_equal(const LibvigAccess &access1,
                             const LibvigAccess &access2);
 
+  // Accesses with equal content always hash the same, so this can index
+  // accesses that are then told apart with content_equal.
+  static size_t content_hash(const LibvigAccess &access);
+
   static Operation parse_operation_token(std::string operation) {
     if (operation == Tokens::Operations::WRITE) {
       return Operation::WRITE;
@@ -2,6 +2,7 @@
 #include "lib_access.h"
 #include "constraint.h"
 #include "rss_config_builder.h"
+#include "steering_config.h"
 #include "parser.h"
 
 #include <iostream>
@@ -19,7 +20,8 @@ int main(int argc, char *argv[]) {
   if (argc < 2) {
     Logger::error() << "[ERROR] Missing arguments.";
     Logger::error()
-        << "Please provide an LVA file location, or \"--rand [devices]\".\n";
+        << "Please provide an LVA file location, \"--rand [devices]\", or "
+           "\"--steering [LVA file location]\".\n";
     return 1;
   }
 
@@ -49,6 +51,18 @@ int main(int argc, char *argv[]) {
       Logger::debug() << "\n";
     }
 
+    config.dump();
+  } else if (arg == "--steering") {
+    if (argc < 3) {
+      Logger::error() << "[ERROR] Missing arguments.";
+      Logger::error() << "Please provide an LVA file location to go with the "
+                         "--steering flag.\n";
+      return 1;
+    }
+
+    Parser parser(argv[2]);
+
+    SteeringConfig config(parser.get_accesses());
     config.dump();
   } else {
     Parser parser(arg);
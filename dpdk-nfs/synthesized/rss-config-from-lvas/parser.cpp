@@ -11,14 +11,15 @@
 namespace ParallelSynthesizer {
 
 LibvigAccess &Parser::get_or_push_unique_access(const LibvigAccess &access) {
-  auto it = std::find(accesses.begin(), accesses.end(), access);
+  auto found_it = access_index_by_id.find(access.get_id());
 
-  if (it == accesses.end()) {
+  if (found_it == access_index_by_id.end()) {
+    access_index_by_id.insert({ access.get_id(), accesses.size() });
     accesses.emplace_back(access);
     return accesses.back();
   }
 
-  return *it;
+  return accesses[found_it->second];
 }
 
 bool Parser::consume_token(const std::string &token, std::istringstream &iss,
@@ -8,6 +8,7 @@
 #include <stack>
 #include <deque>
 #include <numeric>
+#include <unordered_map>
 
 namespace ParallelSynthesizer {
 
@@ -314,6 +315,9 @@ private:
   std::vector<LibvigAccess> accesses;
   std::vector<CallPathsConstraint> call_paths_constraints;
 
+  // [id] position in accesses, accesses being equal by id
+  std::unordered_map<unsigned int, size_t> access_index_by_id;
+
 private:
   LibvigAccess &get_or_push_unique_access(const LibvigAccess &access);
 
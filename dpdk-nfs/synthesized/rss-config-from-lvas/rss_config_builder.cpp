@@ -4,6 +4,7 @@
 #include <iostream>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <array>
 #include <thread>
 
@@ -22,11 +23,39 @@ void RSSConfigBuilder::merge_unique_packet_field_dependencies(
   }
 }
 
+size_t RSSConfigBuilder::access_pair_hash(
+    const std::pair<LibvigAccess, LibvigAccess> &pair) {
+  auto first_hash =
+      LibvigAccess::content_hash(pair.first) ^
+      std::hash<std::string>()(pair.first.get_metadata().get_file());
+  auto second_hash =
+      LibvigAccess::content_hash(pair.second) ^
+      std::hash<std::string>()(pair.second.get_metadata().get_file());
+
+  // ordered, (a, b) and (b, a) are different pairs
+  return first_hash ^ (second_hash + 0x9e3779b9 + (first_hash << 6) +
+                       (first_hash >> 2));
+}
+
+// Constraints are later removed by call path, so pairs found on different call
+// paths are kept apart even when their accesses have the same content.
 bool RSSConfigBuilder::is_access_pair_already_stored(
     const std::pair<LibvigAccess, LibvigAccess> &pair) {
-  for (const auto &stored_pair : unique_access_pairs) {
+  auto found_it = unique_access_pairs_by_hash.find(access_pair_hash(pair));
+
+  if (found_it == unique_access_pairs_by_hash.end()) return false;
+
+  for (auto stored_idx : found_it->second) {
+    const auto &stored_pair = unique_access_pairs[stored_idx];
+
     if (!LibvigAccess::content_equal(stored_pair.first, pair.first)) continue;
     if (!LibvigAccess::content_equal(stored_pair.second, pair.second)) continue;
+    if (stored_pair.first.get_metadata().get_file() !=
+            pair.first.get_metadata().get_file() ||
+        stored_pair.second.get_metadata().get_file() !=
+            pair.second.get_metadata().get_file()) {
+      continue;
+    }
 
     return true;
   }
@@ -34,6 +63,26 @@ bool RSSConfigBuilder::is_access_pair_already_stored(
   return false;
 }
 
+// callers check is_access_pair_already_stored first
+void RSSConfigBuilder::store_access_pair(
+    const std::pair<LibvigAccess, LibvigAccess> &pair) {
+  unique_access_pairs_by_hash[access_pair_hash(pair)].push_back(
+      unique_access_pairs.size());
+  unique_access_pairs.push_back(pair);
+}
+
+std::map<unsigned int, std::vector<unsigned int> >
+RSSConfigBuilder::index_accesses_by_object(
+    const std::vector<LibvigAccess> &accesses) {
+  std::map<unsigned int, std::vector<unsigned int> > accesses_by_object;
+
+  for (unsigned int idx = 0; idx < accesses.size(); idx++) {
+    accesses_by_object[accesses[idx].get_object()].push_back(idx);
+  }
+
+  return accesses_by_object;
+}
+
 void RSSConfigBuilder::load_rss_config_options() {
   const auto n_threads = std::thread::hardware_concurrency();
 
@@ -139,16 +188,20 @@ void RSSConfigBuilder::fill_lib_access_constraints(
   R3S::Z3_context ctx = R3S::R3S_cfg_get_z3_context(cfg);
 
   auto size = accesses.size();
+  auto accesses_by_object = index_accesses_by_object(accesses);
 
+  // only accesses to the same object are paired, in the same order as going
+  // through every pair of accesses; pairs equal to a stored one (e.g. the same
+  // lookup repeated on a call path) add nothing new
   for (unsigned int first_idx = 0; first_idx < size; first_idx++) {
-    for (unsigned int second_idx = first_idx + 1; second_idx < size;
-         second_idx++) {
-      const auto &first = accesses[first_idx];
-      const auto &second = accesses[second_idx];
+    const auto &same_object =
+        accesses_by_object.at(accesses[first_idx].get_object());
+    auto second_it =
+        std::upper_bound(same_object.begin(), same_object.end(), first_idx);
+    const auto &first = accesses[first_idx];
 
-      if (first.get_object() != second.get_object()) {
-        continue;
-      }
+    for (; second_it != same_object.end(); second_it++) {
+      const auto &second = accesses[*second_it];
 
       if (first.get_metadata().get_file() == second.get_metadata().get_file()) {
         continue;
@@ -164,6 +217,11 @@ void RSSConfigBuilder::fill_lib_access_constraints(
       auto &second_read_arg =
           second.get_argument(LibvigAccessArgument::Type::READ);
 
+      auto pair = std::make_pair(first, second);
+
+      if (is_access_pair_already_stored(pair)) continue;
+      store_access_pair(pair);
+
       lib_access_constraints.emplace_back(first, second, ctx);
 
       auto first_dependencies = first_read_arg.get_dependencies();
@@ -479,51 +537,43 @@ std::vector<LibvigAccess>
 RSSConfigBuilder::filter_reads_without_writes_on_objects(
     const std::vector<LibvigAccess> &accesses) {
   std::vector<LibvigAccess> trimmed_accesses;
+  auto accesses_by_object = index_accesses_by_object(accesses);
   std::map<unsigned int, bool> access_by_object;
 
-  for (const auto &access : accesses) {
-    const auto &object = access.get_object();
-    auto store_access = access_by_object.find(object);
+  for (const auto &object_accesses : accesses_by_object) {
+    auto found_read = false;
+    auto found_write = false;
 
-    if (store_access != access_by_object.end() && store_access->second) {
-      trimmed_accesses.push_back(access);
-      continue;
-    } else if (store_access != access_by_object.end()) {
-      continue;
-    }
+    for (auto idx : object_accesses.second) {
+      auto operation = accesses[idx].get_operation();
 
-    auto read_op_finder = [&](const LibvigAccess & access)->bool {
-      if (access.get_object() != object) return false;
+      found_read |= operation == LibvigAccess::Operation::READ ||
+                    operation == LibvigAccess::Operation::VERIFY;
 
-      return access.get_operation() == LibvigAccess::Operation::READ ||
-             access.get_operation() == LibvigAccess::Operation::VERIFY;
-    };
+      found_write |= operation == LibvigAccess::Operation::WRITE ||
+                     operation == LibvigAccess::Operation::CREATE ||
+                     operation == LibvigAccess::Operation::UPDATE;
+    }
 
-    auto found_read = std::find_if(accesses.begin(), accesses.end(),
-                                   read_op_finder) != accesses.end();
+    access_by_object.insert({ object_accesses.first,
+                              !found_read || found_write });
+  }
 
-    auto write_op_finder = [&](const LibvigAccess & access)->bool {
-      if (access.get_object() != object) return false;
+  std::set<unsigned int> warned_objects;
 
-      return access.get_operation() == LibvigAccess::Operation::WRITE ||
-             access.get_operation() == LibvigAccess::Operation::CREATE ||
-             access.get_operation() == LibvigAccess::Operation::UPDATE;
-    };
+  for (const auto &access : accesses) {
+    const auto &object = access.get_object();
 
-    auto found_write = std::find_if(accesses.begin(), accesses.end(),
-                                    write_op_finder) != accesses.end();
+    if (access_by_object.at(object)) {
+      trimmed_accesses.push_back(access);
+      continue;
+    }
 
-    if (found_read && !found_write) {
+    if (warned_objects.insert(object).second) {
       Logger::warn() << "Reads with no writes on object ";
       Logger::warn() << object;
       Logger::warn() << "\n";
-
-      access_by_object.insert({object, false});
-      continue;
     }
-
-    access_by_object.insert({object, true});
-    trimmed_accesses.push_back(access);
   }
 
   return trimmed_accesses;
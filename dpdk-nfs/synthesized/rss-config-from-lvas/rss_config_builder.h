@@ -6,6 +6,7 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 
 namespace R3S {
 #include <r3s.h>
@@ -25,6 +26,9 @@ private:
   std::map<std::string, unsigned int> device_per_call_path;
   std::vector<unsigned int> unique_devices;
   std::vector<std::pair<LibvigAccess, LibvigAccess> > unique_access_pairs;
+  // [pair content hash] positions in unique_access_pairs
+  std::unordered_map<size_t, std::vector<unsigned int> >
+  unique_access_pairs_by_hash;
   std::vector<R3S::R3S_pf_t> unique_packet_fields_dependencies;
   std::vector<R3S::R3S_cnstrs_func> solver_constraints_generators;
 
@@ -38,8 +42,14 @@ private:
   void merge_unique_packet_field_dependencies(
       const std::vector<R3S::R3S_pf_t> &packet_fields);
 
+  static size_t
+  access_pair_hash(const std::pair<LibvigAccess, LibvigAccess> &pair);
   bool is_access_pair_already_stored(
       const std::pair<LibvigAccess, LibvigAccess> &pair);
+  void store_access_pair(const std::pair<LibvigAccess, LibvigAccess> &pair);
+
+  static std::map<unsigned int, std::vector<unsigned int> >
+  index_accesses_by_object(const std::vector<LibvigAccess> &accesses);
 
   void fill_unique_devices(const std::vector<LibvigAccess> &accesses);
   std::vector<LibvigAccess> filter_reads_without_writes_on_objects(
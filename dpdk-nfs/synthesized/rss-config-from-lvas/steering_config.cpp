@@ -0,0 +1,273 @@
+#include "logger.h"
+#include "steering_config.h"
+
+#include <algorithm>
+#include <set>
+
+namespace ParallelSynthesizer {
+
+void SteeringConfig::fields_translator_init() {
+  // TCP and UDP ports sit at the same offsets, the steering does not care
+  fields_translator = {
+    { R3S::R3S_PF_IPV4_SRC, "STEERING_IPV4_SRC" },
+    { R3S::R3S_PF_IPV4_DST, "STEERING_IPV4_DST" },
+    { R3S::R3S_PF_TCP_SRC, "STEERING_PORT_SRC" },
+    { R3S::R3S_PF_TCP_DST, "STEERING_PORT_DST" },
+    { R3S::R3S_PF_UDP_SRC, "STEERING_PORT_SRC" },
+    { R3S::R3S_PF_UDP_DST, "STEERING_PORT_DST" }
+  };
+}
+
+std::vector<std::string> SteeringConfig::translate_fields(
+    const std::vector<R3S::R3S_pf_t> &packet_fields) const {
+  std::vector<std::string> fields;
+
+  for (const auto &packet_field : packet_fields) {
+    if (fields_translator.count(packet_field) == 0) {
+      Logger::error() << "Unknown packet field translation: "
+                      << R3S::R3S_pf_to_string(packet_field) << "\n";
+      exit(1);
+    }
+
+    auto field = fields_translator.at(packet_field);
+    if (std::find(fields.begin(), fields.end(), field) == fields.end()) {
+      fields.push_back(field);
+    }
+  }
+
+  return fields;
+}
+
+// Fields of the packet the access looks its entry up by, none when the entry
+// does not depend on the packet
+std::vector<std::string>
+SteeringConfig::get_key(const LibvigAccess &access) const {
+  if (!access.has_argument(LibvigAccessArgument::Type::READ)) {
+    return std::vector<std::string>();
+  }
+
+  const auto &argument = access.get_argument(LibvigAccessArgument::Type::READ);
+  return translate_fields(
+      argument.get_dependencies().get_unique_packet_fields());
+}
+
+// The steering hashes the source and destination of a kind of field in an
+// order independent of the direction when the key holds both, so two keys
+// agree as long as they hold as many fields of each kind.
+bool SteeringConfig::are_keys_symmetric(
+    const std::vector<std::string> &first,
+    const std::vector<std::string> &second) const {
+  auto count_kind = [](const std::vector<std::string> &fields,
+                       const std::string &kind) {
+    return std::count_if(fields.begin(), fields.end(),
+                         [&](const std::string &field) {
+      return field.find(kind) != std::string::npos;
+    });
+  };
+
+  for (const auto &kind : { "IPV4", "PORT" }) {
+    if (count_kind(first, kind) != count_kind(second, kind)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+SteeringConfig::SteeringConfig(const std::vector<LibvigAccess> &accesses) {
+  fields_translator_init();
+
+  // [object] devices writing it
+  std::map<unsigned int, std::set<unsigned int> > writers_per_object;
+
+  for (const auto &access : accesses) {
+    auto operation = access.get_operation();
+
+    if (operation == LibvigAccess::Operation::WRITE ||
+        operation == LibvigAccess::Operation::CREATE ||
+        operation == LibvigAccess::Operation::UPDATE) {
+      writers_per_object[access.get_object()].insert(access.get_src_device());
+    }
+  }
+
+  // [device][object] fields of the key the device looks the object up with
+  std::map<unsigned int, std::map<unsigned int, std::vector<std::string> > >
+  keys_per_device;
+  // [object] devices looking it up by some key
+  std::map<unsigned int, std::set<unsigned int> > devices_per_object;
+  // [object] devices accessing it, with or without a key
+  std::map<unsigned int, std::set<unsigned int> > accessors_per_object;
+  // [object] devices checking its indexes against packet fields
+  std::map<unsigned int, std::set<unsigned int> > verifiers_per_object;
+
+  for (const auto &access : accesses) {
+    auto device = access.get_src_device();
+    auto object = access.get_object();
+
+    steering_per_device[device];
+
+    if (writers_per_object.count(object) == 0) continue;
+
+    steering_per_device[device].stateful = true;
+    accessors_per_object[object].insert(device);
+
+    auto fields = get_key(access);
+
+    if (fields.size() == 0) continue;
+
+    if (access.get_operation() == LibvigAccess::Operation::VERIFY) {
+      verifiers_per_object[object].insert(device);
+    }
+
+    auto &keys = keys_per_device[device];
+    auto found_it = keys.find(object);
+
+    if (found_it == keys.end()) {
+      keys.insert({ object, fields });
+      devices_per_object[object].insert(device);
+    } else if (found_it->second != fields) {
+      Logger::error() << "Device " << device << " looks up object " << object
+                      << " by different keys, its entries would be split "
+                         "among the workers\n";
+      exit(1);
+    }
+  }
+
+  for (auto &device_steering : steering_per_device) {
+    auto device = device_steering.first;
+    auto &steering = device_steering.second;
+
+    if (keys_per_device.count(device) == 0) continue;
+
+    const auto &keys = keys_per_device.at(device);
+
+    // steer by the object shared with the most devices, so that their
+    // packets agree on the worker owning it; ties go to the first object
+    for (const auto &key : keys) {
+      auto object = key.first;
+
+      if (steering.object.first &&
+          devices_per_object.at(object).size() <=
+              devices_per_object.at(steering.object.second).size()) {
+        continue;
+      }
+
+      steering.object = std::make_pair(true, object);
+      steering.fields = key.second;
+    }
+
+    Logger::debug() << "Device " << device << " steered by object "
+                    << steering.object.second << "\n";
+
+    for (const auto &key : keys) {
+      if (key.second == steering.fields) continue;
+
+      Logger::error() << "Device " << device << " steers by object "
+                      << steering.object.second << ", object " << key.first
+                      << " is keyed differently and would be split among the "
+                         "workers\n";
+      exit(1);
+    }
+  }
+
+  // every device looking up an object must send the packets hitting the same
+  // entry to the same worker, whichever direction they flow in
+  for (const auto &object_devices : devices_per_object) {
+    auto object = object_devices.first;
+    const auto &devices = object_devices.second;
+    auto first_device = *devices.begin();
+
+    for (auto device : devices) {
+      if (are_keys_symmetric(
+              steering_per_device.at(first_device).fields,
+              steering_per_device.at(device).fields)) {
+        continue;
+      }
+
+      Logger::error() << "Devices " << first_device << " and " << device
+                      << " look up object " << object
+                      << " by keys not mapping a flow and its reply to the "
+                         "same worker\n";
+      exit(1);
+    }
+  }
+
+  // devices looking up a common object agree on the worker of their entries
+  auto share_key = [&](unsigned int first, unsigned int second) {
+    for (const auto &object_devices : devices_per_object) {
+      const auto &devices = object_devices.second;
+
+      if (devices.count(first) && devices.count(second)) {
+        return true;
+      }
+    }
+
+    return false;
+  };
+
+  // any other device reaches what the writer stores on whichever worker its
+  // own packets are steered to, so every worker has to hold it
+  for (const auto &object_writers : writers_per_object) {
+    auto object = object_writers.first;
+
+    for (auto writer : object_writers.second) {
+      auto &steering = steering_per_device.at(writer);
+
+      for (auto device : accessors_per_object.at(object)) {
+        if (device == writer || share_key(writer, device)) continue;
+
+        if (!steering.broadcast) {
+          Logger::debug() << "Device " << writer << " broadcast, device "
+                          << device << " reaches object " << object
+                          << " without a key shared with it\n";
+        }
+
+        steering.broadcast = true;
+      }
+    }
+  }
+
+  // each worker allocates the indexes of its copy on its own, they can not
+  // stand for packet fields on another device
+  for (const auto &object_verifiers : verifiers_per_object) {
+    auto object = object_verifiers.first;
+
+    for (auto writer : writers_per_object.at(object)) {
+      if (!steering_per_device.at(writer).broadcast) continue;
+
+      for (auto device : object_verifiers.second) {
+        if (device == writer) continue;
+
+        Logger::error() << "Device " << device << " interprets indexes of "
+                        << "object " << object << " as packet fields, but "
+                        << "every worker allocates its own for the packets "
+                        << "of device " << writer << "\n";
+        exit(1);
+      }
+    }
+  }
+}
+
+void SteeringConfig::dump() const {
+  for (const auto &device_steering : steering_per_device) {
+    const auto &steering = device_steering.second;
+
+    Logger::log() << device_steering.first;
+
+    if (!steering.stateful) {
+      Logger::log() << " stateless\n";
+      continue;
+    }
+
+    // stateful devices with no key send everything to a single worker, which
+    // is also the one forwarding the packets of broadcast devices
+    Logger::log() << (steering.broadcast ? " broadcast" : " stateful");
+
+    for (const auto &field : steering.fields) {
+      Logger::log() << " " << field;
+    }
+
+    Logger::log() << "\n";
+  }
+}
+}
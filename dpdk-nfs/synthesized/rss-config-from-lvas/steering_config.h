@@ -0,0 +1,54 @@
+#pragma once
+
+#include "lib_access.h"
+
+#include <vector>
+#include <map>
+
+namespace R3S {
+#include <r3s.h>
+}
+
+namespace ParallelSynthesizer {
+
+/*
+ * Software steering for the pipeline target, used when no RSS key satisfies
+ * the constraints. For every device, picks the written object whose key the
+ * device's packets should be steered by, and the packet fields making up that
+ * key, so that all the packets touching the same entry reach the same worker.
+ * Configurations that would split an object among the workers, either because
+ * it is keyed differently from the steering key or because two devices map a
+ * flow and its reply to different workers, are rejected.
+ *
+ * A device writing state that another device reaches without a key the two
+ * share is broadcast instead: every worker keeps its own copy of that state,
+ * updated by a copy of each of the device's packets.
+ */
+class SteeringConfig {
+private:
+  struct DeviceSteering {
+    bool stateful;
+    bool broadcast;
+    std::pair<bool, unsigned int> object;
+    std::vector<std::string> fields;
+
+    DeviceSteering() : stateful(false), broadcast(false), object(false, 0) {}
+  };
+
+  std::map<unsigned int, DeviceSteering> steering_per_device;
+  std::map<R3S::R3S_pf_t, std::string> fields_translator;
+
+private:
+  void fields_translator_init();
+  std::vector<std::string>
+  translate_fields(const std::vector<R3S::R3S_pf_t> &packet_fields) const;
+  std::vector<std::string> get_key(const LibvigAccess &access) const;
+  bool are_keys_symmetric(const std::vector<std::string> &first,
+                          const std::vector<std::string> &second) const;
+
+public:
+  SteeringConfig(const std::vector<LibvigAccess> &accesses);
+
+  void dump() const;
+};
+}
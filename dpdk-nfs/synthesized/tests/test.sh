@@ -0,0 +1,53 @@
+#!/bin/bash
+
+set -euo pipefail
+
+SCRIPT_DIR=$(cd $(dirname ${BASH_SOURCE[0]}) && pwd)
+
+BUILD_DIR=$(mktemp -d)
+function cleanup {
+  rm -rf "$BUILD_DIR"
+}
+trap cleanup EXIT
+
+# Same DPDK flags as the NFs, see Makefile.dpdk
+DPDK_CFLAGS=$(pkg-config --cflags libdpdk)
+DPDK_LDFLAGS=$(pkg-config --static --libs libdpdk)
+
+cc -std=gnu11 -O2 -DSOFTWARE_RSS $DPDK_CFLAGS \
+   -o "$BUILD_DIR/software-rss-test" "$SCRIPT_DIR/software-rss-test.c" \
+   $DPDK_LDFLAGS
+"$BUILD_DIR/software-rss-test"
+
+# Steering configs found in LVAs modelled on the call paths of the firewall,
+# the load balancer and the NAT
+make -C "$SCRIPT_DIR/.." maestro > /dev/null
+RSS_CONFIG_FROM_LVAS="$SCRIPT_DIR/../build/maestro/rss-config-from-lvas"
+
+function steering {
+  "$RSS_CONFIG_FROM_LVAS" --steering "$SCRIPT_DIR/lvas/$1.lva" \
+    > "$BUILD_DIR/$1.conf" 2> /dev/null
+}
+
+# both directions of a flow reach the worker holding it
+steering fw
+diff - "$BUILD_DIR/fw.conf" <<END
+0 stateful STEERING_IPV4_SRC STEERING_IPV4_DST STEERING_PORT_SRC STEERING_PORT_DST
+1 stateful STEERING_IPV4_DST STEERING_IPV4_SRC STEERING_PORT_DST STEERING_PORT_SRC
+END
+
+# flows pick among the backends the heartbeats register without their key,
+# so every worker keeps a copy of the backends
+steering lb
+diff - "$BUILD_DIR/lb.conf" <<END
+0 stateful STEERING_IPV4_SRC STEERING_IPV4_DST STEERING_PORT_SRC STEERING_PORT_DST
+1 broadcast STEERING_IPV4_SRC
+END
+
+# external ports are allocated indexes, the copies would not agree on them
+if steering nat; then
+  echo "Got a steering config for the NAT, whose state can not be partitioned"
+  exit 1
+fi
+
+echo "Done."
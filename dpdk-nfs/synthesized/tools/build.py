@@ -21,6 +21,7 @@ subprocess.call([ "mkdir", "-p", SYNTHESIZED_APP ], stdout=subprocess.DEVNULL, s
 BOILERPLATE_CHOICE_BMV2				= "bmv2_ss_grpc_controller"
 BOILERPLATE_CHOICE_CALL_PATH_HITTER = "call_path_hitter"
 BOILERPLATE_CHOICE_LOCKS 			= "locks"
+BOILERPLATE_CHOICE_PIPELINE			= "pipeline"
 BOILERPLATE_CHOICE_SQ 				= "sequential"
 BOILERPLATE_CHOICE_SN 				= "shared-nothing"
 BOILERPLATE_CHOICE_TM 				= "tm"
@@ -29,6 +30,7 @@ BOILERPLATE_TO_MAKEFILE = {
   BOILERPLATE_CHOICE_BMV2: 				f"{MAKEFILES_DIR}/Makefile.bmv2_controller",
   BOILERPLATE_CHOICE_CALL_PATH_HITTER:	f"{MAKEFILES_DIR}/Makefile.cph",
   BOILERPLATE_CHOICE_LOCKS:				f"{MAKEFILES_DIR}/Makefile.maestro",
+  BOILERPLATE_CHOICE_PIPELINE:			f"{MAKEFILES_DIR}/Makefile.maestro",
   BOILERPLATE_CHOICE_SQ:				f"{MAKEFILES_DIR}/Makefile.maestro",
   BOILERPLATE_CHOICE_SN:				f"{MAKEFILES_DIR}/Makefile.maestro",
   BOILERPLATE_CHOICE_TM:				f"{MAKEFILES_DIR}/Makefile.maestro",
@@ -38,6 +40,7 @@ BOILERPLATE_CHOICES = [
 	BOILERPLATE_CHOICE_BMV2,
 	BOILERPLATE_CHOICE_CALL_PATH_HITTER,
 	BOILERPLATE_CHOICE_LOCKS,
+	BOILERPLATE_CHOICE_PIPELINE,
 	BOILERPLATE_CHOICE_SQ,
 	BOILERPLATE_CHOICE_SN,
 	BOILERPLATE_CHOICE_TM,
@@ -38,6 +38,7 @@ CHOICE_SHARED_NOTHING = "sn"
 CHOICE_LOCKS          = "locks"
 CHOICE_TM             = "tm"
 CHOICE_CPH            = "cph"
+CHOICE_PIPELINE       = "pipe"
 
 CHOICE_TO_BOILERPLATE = {
 	CHOICE_SEQUENTIAL: build.BOILERPLATE_CHOICE_SQ,
@@ -45,6 +46,7 @@ CHOICE_TO_BOILERPLATE = {
 	CHOICE_LOCKS: build.BOILERPLATE_CHOICE_LOCKS,
 	CHOICE_TM: build.BOILERPLATE_CHOICE_TM,
 	CHOICE_CPH: build.BOILERPLATE_CHOICE_CALL_PATH_HITTER,
+	CHOICE_PIPELINE: build.BOILERPLATE_CHOICE_PIPELINE,
 }
 
 SYNTHESIZED       = f"{BUILD_SYNTHESIZED_DIR}/nf_process.gen.c"
@@ -52,6 +54,7 @@ SYNTHESIZED_XML   = f"{BUILD_SYNTHESIZED_DIR}/nf_process.gen.xml"
 LVA               = f"{BUILD_DIR}/report.lva"
 LVA_DEBUG         = f"{BUILD_DIR}/report.txt"
 RSS_CONF          = f"{BUILD_DIR}/rss_conf.txt"
+STEERING_CONF     = f"{BUILD_DIR}/steering_conf.txt"
 RSS_KEY_LEN       = 52
 
 COMPATIBLE_OPTS = [ "ETH_RSS_NONFRAG_IPV4_TCP", "ETH_RSS_NONFRAG_IPV4_UDP" ]
@@ -96,6 +99,15 @@ def rss_conf_from_lvas():
 
 	return code == 0
 
+def steering_conf_from_lvas():
+	rss_conf_from_lva = f"{BUILD_DIR}/rss-config-from-lvas"
+
+	steering_conf = open(STEERING_CONF, mode='w')
+	code = subprocess.call([ rss_conf_from_lva, "--steering", LVA ], stdout=steering_conf)
+	steering_conf.close()
+
+	return code == 0
+
 def rss_conf_random(devices):
 	rss_conf_from_lva = f"{BUILD_DIR}/rss-config-from-lvas"
 	
@@ -121,7 +133,7 @@ def synthesize_rss_conf(target):
 	code = ""
 	keys = []
 
-	if target == CHOICE_SEQUENTIAL or target == CHOICE_CPH:
+	if target == CHOICE_SEQUENTIAL or target == CHOICE_CPH or target == CHOICE_PIPELINE:
 		return (code, keys)
 
 	f = open(RSS_CONF, 'r')
@@ -161,9 +173,45 @@ def synthesize_rss_conf(target):
 	code += f"\n}};"
 	return (code, keys)
 
+def synthesize_steering_conf(target):
+	code = ""
+
+	if target != CHOICE_PIPELINE:
+		return code
+
+	f = open(STEERING_CONF, 'r')
+	steering_conf = f.read()
+	f.close()
+
+	steering_conf = steering_conf.split('\n')
+	steering_conf = list(filter(len, steering_conf))
+
+	assert(steering_conf)
+
+	code += f"struct steering_conf steering_conf[MAX_NUM_DEVICES] = {{\n"
+	for iconf, conf in enumerate(steering_conf):
+		tokens = conf.split(' ')
+		device = int(tokens[0])
+		fields = tokens[2:]
+
+		code += f"  [{device}] = {{\n"
+		code += f"    .stateful = {'true' if tokens[1] != 'stateless' else 'false'},\n"
+		code += f"    .broadcast = {'true' if tokens[1] == 'broadcast' else 'false'},\n"
+		code += f"    .n_fields = {len(fields)},\n"
+		code += f"    .fields = {{ {', '.join(fields)} }}\n"
+		code += f"  }}"
+		if iconf != len(steering_conf) - 1: code += ",\n"
+
+	code += f"\n}};"
+	return code
+
 def synthesize_nf(nf, call_paths, target):
 	assert(call_paths)
 
+	# pipeline workers partition the state like shared-nothing cores do
+	if target == CHOICE_PIPELINE:
+		target = CHOICE_SHARED_NOTHING
+
 	bdd_to_c      = f"{KLEE_DIR}/Release/bin/bdd-to-c"
 	bdd_to_c_args	= f"-out={SYNTHESIZED} -xml={SYNTHESIZED_XML} -target={target} {' '.join(call_paths)}"
 
@@ -190,7 +238,7 @@ def stitch_synthesized_nf(synthesized_content, target):
 def synthesize_balance_lut(keys, pcap, target):
 	code = ""
 
-	if target == CHOICE_SEQUENTIAL or target == CHOICE_CPH:
+	if target == CHOICE_SEQUENTIAL or target == CHOICE_CPH or target == CHOICE_PIPELINE:
 		return code
 
 	code += "void init_retas() {\n"                                \
@@ -247,7 +295,7 @@ if __name__ == "__main__":
 	parser.add_argument('nf', type=str, help='path to the NF')
 	parser.add_argument('--target', 													  \
 		help='implementation model target', 											\
-		choices=[ CHOICE_SEQUENTIAL, CHOICE_SHARED_NOTHING, CHOICE_LOCKS, CHOICE_TM, CHOICE_CPH ],	\
+		choices=[ CHOICE_SEQUENTIAL, CHOICE_SHARED_NOTHING, CHOICE_LOCKS, CHOICE_TM, CHOICE_CPH, CHOICE_PIPELINE ],	\
 		default=CHOICE_SHARED_NOTHING)
 	parser.add_argument('--randomize', type=str, help='randomize RSS keys')
 	parser.add_argument('--balance', type=str, help='pcap used to balance LUT')
@@ -273,13 +321,22 @@ if __name__ == "__main__":
 		analyze_call_paths(args.nf, call_paths)
 		t_analyze_call_paths = perf_counter()
 
-		print("[*] Finding RSS configuration")
-		if not args.randomize and args.target == CHOICE_SHARED_NOTHING:
+		if args.target == CHOICE_PIPELINE:
+			print("[*] Finding steering configuration")
+			success = steering_conf_from_lvas()
+			if not success:
+				print("Unable to synthesize a parallel implementation using a pipeline model.")
+				print("Its state can not be partitioned by steering the packets, see the errors above.")
+				exit(1)
+		elif not args.randomize and args.target == CHOICE_SHARED_NOTHING:
+			print("[*] Finding RSS configuration")
 			success = rss_conf_from_lvas()
 			if not success:
 				print("Unable to synthesize a parallel implementation using a shared nothing model.")
+				print(f"Try the pipeline model instead (--target {CHOICE_PIPELINE}).")
 				exit(1)
 		else:
+			print("[*] Finding RSS configuration")
 			success = rss_conf_random(2) # TODO devices
 			assert(success)
 
@@ -291,6 +348,9 @@ if __name__ == "__main__":
 	rss_conf_code, keys = synthesize_rss_conf(args.target)
 	synthesized_content.append(rss_conf_code)
 
+	steering_conf_code = synthesize_steering_conf(args.target)
+	synthesized_content.append(steering_conf_code)
+
 	synthesized_nf = synthesize_nf(args.nf, call_paths, args.target)
 	synthesized_content.append(synthesized_nf)
 